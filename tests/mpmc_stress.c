@@ -0,0 +1,80 @@
+/* Multi-consumer stress test for MPMCQueue: a prefilled ring must hand out
+ * every item before any consumer is told it is empty.
+ * Build and run with `make test` */
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+#include "utils.h"
+
+#define CAPACITY	1024
+#define NCONSUMERS	8
+#define NROUNDS		2000
+
+struct consumer {
+	MPMCQueue q;
+	pthread_barrier_t *start;
+	size_t popped;
+	size_t batch;
+};
+
+static void *consume(void *arg)
+{
+	struct consumer *c = (struct consumer*) arg;
+	void *data[4];
+	size_t n;
+
+	c->popped = 0;
+	pthread_barrier_wait(c->start);
+	if(c->batch == 1) {
+		while(mpmc_try_pop(c->q, data) == 0)
+			c->popped++;
+	} else {
+		while((n = mpmc_pop_batch(c->q, data, c->batch)) != 0)
+			c->popped += n;
+	}
+	return NULL;
+}
+
+int main(void)
+{
+	MPMCQueue q = new_mpmc_queue(CAPACITY);
+	struct consumer consumers[NCONSUMERS];
+	pthread_t threads[NCONSUMERS];
+	pthread_barrier_t start;
+	size_t round, i, total;
+
+	if(q == (MPMCQueue) NULL) {
+		perror("new_mpmc_queue");
+		return EXIT_FAILURE;
+	}
+	pthread_barrier_init(&start, NULL, NCONSUMERS);
+	for(round = 0; round < NROUNDS; round++) {
+		for(i = 0; i < CAPACITY; i++)
+			if(mpmc_try_push(q, (void*) (i + 1)) != 0) {
+				fprintf(stderr, "round %lu: ring full after %lu of %d items\n",
+						(unsigned long) round, (unsigned long) i, CAPACITY);
+				return EXIT_FAILURE;
+			}
+		for(i = 0; i < NCONSUMERS; i++) {
+			consumers[i].q = q;
+			consumers[i].start = &start;
+			consumers[i].batch = round % 2 == 0 ? 1 : i % 4 + 1;
+			pthread_create(&threads[i], NULL, &consume, &consumers[i]);
+		}
+		total = 0;
+		for(i = 0; i < NCONSUMERS; i++) {
+			pthread_join(threads[i], NULL);
+			total += consumers[i].popped;
+		}
+		if(total != CAPACITY) {
+			fprintf(stderr, "round %lu: consumers saw an empty ring after %lu of %d items\n",
+					(unsigned long) round, (unsigned long) total, CAPACITY);
+			return EXIT_FAILURE;
+		}
+	}
+	pthread_barrier_destroy(&start);
+	delete_mpmc_queue(q, NULL);
+	printf("mpmc_stress: ok\n");
+	return EXIT_SUCCESS;
+}
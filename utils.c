@@ -230,6 +230,43 @@ void *xrealloc(void *ptr, size_t size)
 	return ptr;
 }
 
+#ifdef __unix__
+void *xmemalign(size_t alignment, size_t size)
+{
+	void *ptr = (void*) NULL;
+	int count = 0, ret;
+
+	do {
+		ret = posix_memalign(&ptr, alignment, size);
+		if(likely(ret == 0))
+			break;
+		switch(ret) {
+			case ENOMEM:
+				log_message(LOG_ERROR, "Error allocating memory: %s", strerror(ret));
+				if(count++ < MAX_RETRIES_ALLOC) {
+					log_message(LOG_ERROR, "Retrying in 100ms");
+					usleep(100);
+				} else {
+					log_message(LOG_FATAL, "Giving up after %d tries", MAX_RETRIES_ALLOC);
+					exit(EXIT_FAILURE);
+				}
+				break;
+			default:
+				log_message(LOG_FATAL, "Error allocating memory: %s", strerror(ret));
+				exit(EXIT_FAILURE);
+		}
+	} while(BOOL_TRUE);
+
+#ifdef MANAGE_MEM
+	if(ptr < heap_bottom)
+		heap_bottom = ptr;
+	if(ptr > heap_top)
+		heap_top = ptr;
+#endif /* #ifdef MANAGE_MEM */
+	return ptr;
+}
+#endif /* #ifdef __unix__ */
+
 FILE *xfopen(const char *path, const char *mode)
 {
 	FILE *f = (FILE*) NULL;
@@ -1088,70 +1125,362 @@ byte *read_file(const char *path, ssize_t *n)
 
 
 
+#if defined(ENABLE_DATASTRUCTS) || defined(ENABLE_THREADING)
+/* spread entropy of h over all its bits (murmur3 finalizer) */
+static uint64_t __hash_mix(uint64_t h)
+{
+	h ^= h >> 33;
+	h *= UINT64_C(0xff51afd7ed558ccd);
+	h ^= h >> 33;
+	h *= UINT64_C(0xc4ceb9fe1a85ec53);
+	h ^= h >> 33;
+	return h;
+}
+#endif /* #if defined(ENABLE_DATASTRUCTS) || defined(ENABLE_THREADING) */
+
 /* -------------------- DATA STRUCTURES -------------------- */
 #ifdef ENABLE_DATASTRUCTS
 
-/* ----- Double-linked list ----- */
-DLinkedList new_dlinkedlist(void)
+/* ----- Dynamic array ----- */
+#define ARRAY_MIN_CAPACITY	8
+
+/* bytes needed for the header and nmemb elements, 0 on overflow */
+static size_t __array_bytes(size_t elem_size, size_t nmemb)
 {
-#ifdef INTERNAL_ERROR_HANDLING
-	DLinkedList dl = (DLinkedList) xmalloc(sizeof(__datastruct__));
+	if(unlikely(elem_size != 0 && nmemb > (SIZE_MAX - __SIZEOF_ARRAY_STRUCT) / elem_size))
+		return 0;
+	return __SIZEOF_ARRAY_STRUCT + nmemb * elem_size;
+}
+
+#ifdef __linux__
+/* arrays of at least ARRAY_MREMAP_THRESHOLD bytes are mmap()ed. Whether an
+ * array is mapped is always decided from its capacity, so it need not be stored */
+# define __array_is_mapped(bytes)	((bytes) >= ARRAY_MREMAP_THRESHOLD)
 #else
-	DLinkedList dl = (DLinkedList) malloc(sizeof(__datastruct__));
-	if(likely(dl != (DLinkedList) NULL))
-#endif /* #ifdef INTERNAL_ERROR_HANDLING */
-		dl->in = dl->out = (__datastruct_elem__*) NULL;
-	return dl;
+# define __array_is_mapped(bytes)	0
+#endif /* #ifdef __linux__ */
+
+#ifdef __linux__
+static size_t __array_page_align(size_t bytes)
+{
+	static size_t pagesize = 0;
+
+	if(pagesize == 0)
+		pagesize = (size_t) sysconf(_SC_PAGESIZE);
+	return (bytes + pagesize - 1) & ~(pagesize - 1);
 }
+#endif /* #ifdef __linux__ */
 
-void delete_dlinkedlist(DLinkedList dl, void (*__del__)(void*))
+/* move header and elements of old_hdr (old_bytes, possibly NULL) to a block of
+ * new_bytes bytes, using malloc or mmap according to their sizes.
+ * Return NULL if out of memory */
+static struct __array_data__ *__array_realloc(struct __array_data__ *old_hdr, size_t old_bytes, size_t new_bytes)
 {
-	__datastruct_elem__ *e = dl->in, *next;;
-	if(__del__ != (void(*)(void*)) NULL) {
-		while(e != (__datastruct_elem__*) NULL) {
-			__del__(e->data);
-			next = e->next;
-			free(e);
-			e = next;
-		}
-		e = dl->out;
-		while(e != (__datastruct_elem__*) NULL) {
-			__del__(e->data);
-			next = e->next;
-			free(e);
-			e = next;
+	struct __array_data__ *hdr;
+#ifdef __linux__
+	void *mem;
+
+	if(__array_is_mapped(new_bytes)) {
+		if(old_hdr != (struct __array_data__*) NULL && __array_is_mapped(old_bytes)) {
+			mem = mremap(old_hdr, old_bytes, new_bytes, MREMAP_MAYMOVE);
+			return mem == MAP_FAILED ? (struct __array_data__*) NULL : (struct __array_data__*) mem;
 		}
-	} else {
-		while(e != (__datastruct_elem__*) NULL) {
-			next = e->next;
-			free(e);
-			e = next;
+		mem = mmap(NULL, new_bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if(mem == MAP_FAILED)
+			return (struct __array_data__*) NULL;
+		hdr = (struct __array_data__*) mem;
+		if(old_hdr != (struct __array_data__*) NULL) {
+			memcpy(hdr, old_hdr, old_bytes < new_bytes ? old_bytes : new_bytes);
+			free(old_hdr);
 		}
-		e = dl->out;
-		while(e != (__datastruct_elem__*) NULL) {
-			next = e->next;
-			free(e);
-			e = next;
+		return hdr;
+	}
+	if(old_hdr != (struct __array_data__*) NULL && __array_is_mapped(old_bytes)) {
+		/* shrinking back under the threshold */
+		hdr = (struct __array_data__*) malloc(new_bytes);
+		if(hdr != (struct __array_data__*) NULL) {
+			memcpy(hdr, old_hdr, new_bytes);
+			munmap(old_hdr, old_bytes);
 		}
+		return hdr;
 	}
+#else
+	(void) old_bytes;
+#endif /* #ifdef __linux__ */
+	hdr = (struct __array_data__*) realloc(old_hdr, new_bytes);
+	return hdr;
 }
 
-void *dll_add(DLinkedList dl, void *data)
+/* set capacity of a to exactly nmemb elements, or a bit more if memory is mapped */
+static void *__array_set_capacity(void *a, size_t elem_size, size_t nmemb)
+{
+	struct __array_data__ *hdr = (struct __array_data__*) NULL;
+	size_t old_bytes = 0, new_bytes = __array_bytes(elem_size, nmemb);
+
+	if(unlikely(new_bytes == 0)) {
+		errno = ENOMEM;
+		return a;
+	}
+#ifdef __linux__
+	/* mapped memory comes in pages anyway: use all of it */
+	if(__array_is_mapped(new_bytes)) {
+		new_bytes = __array_page_align(new_bytes);
+		/* capacity must still map back to the same number of pages */
+		if(elem_size != 0 && __array_page_align(__array_bytes(elem_size,
+					(new_bytes - __SIZEOF_ARRAY_STRUCT) / elem_size)) == new_bytes)
+			nmemb = (new_bytes - __SIZEOF_ARRAY_STRUCT) / elem_size;
+	}
+#endif /* #ifdef __linux__ */
+	if(a != NULL) {
+		hdr = __array_header(a);
+		old_bytes = __array_bytes(elem_size, hdr->size);
+#ifdef __linux__
+		if(__array_is_mapped(old_bytes))
+			old_bytes = __array_page_align(old_bytes);
+#endif /* #ifdef __linux__ */
+	}
+	hdr = __array_realloc(hdr, old_bytes, new_bytes);
+	if(unlikely(hdr == (struct __array_data__*) NULL)) {
+#ifdef INTERNAL_ERROR_HANDLING
+		log_message(LOG_FATAL, "Error allocating memory: %s", strerror(errno));
+		exit(EXIT_FAILURE);
+#else
+		errno = ENOMEM;
+		return a;
+#endif /* #ifdef INTERNAL_ERROR_HANDLING */
+	}
+	if(a == NULL)
+		hdr->nmemb = 0;
+	hdr->size = nmemb;
+	return hdr->data;
+}
+
+void *__array_grow(void *a, size_t elem_size, size_t min_nmemb)
+{
+	size_t capacity = a == NULL ? ARRAY_MIN_CAPACITY : __array_header(a)->size << 1;
+
+	if(capacity < min_nmemb)
+		capacity = min_nmemb;
+	return __array_set_capacity(a, elem_size, capacity);
+}
+
+void *__array_resize(void *a, size_t elem_size, size_t nmemb)
+{
+	if(nmemb == 0) {
+		__array_free(a, elem_size);
+		return NULL;
+	}
+	if(a != NULL && nmemb < __array_header(a)->nmemb)
+		nmemb = __array_header(a)->nmemb;
+	return __array_set_capacity(a, elem_size, nmemb);
+}
+
+void __array_free(void *a, size_t elem_size)
+{
+	size_t bytes;
+
+	if(a == NULL)
+		return;
+	bytes = __array_bytes(elem_size, __array_header(a)->size);
+#ifdef __linux__
+	if(__array_is_mapped(bytes)) {
+		munmap(__array_header(a), __array_page_align(bytes));
+		return;
+	}
+#else
+	(void) bytes;
+#endif /* #ifdef __linux__ */
+	free(__array_header(a));
+}
+#undef __array_is_mapped
+#undef ARRAY_MIN_CAPACITY
+
+/* ----- Node slab ----- */
+/* Nodes of DLinkedList and Queue are carved out of chunks owned by the container
+ * and recycled through a free list, so that adding and removing elements seldom
+ * calls malloc and deleting the container releases a handful of chunks instead
+ * of every node. Chunks double in size up to SLAB_CHUNK_MAX_NMEMB nodes */
+#define SLAB_CHUNK_START_NMEMB	16
+#define SLAB_CHUNK_MAX_NMEMB	1024
+
+typedef struct __datastruct_chunk__ {
+	struct __datastruct_chunk__ *next;
+	__datastruct_elem__ elems[1];
+} __datastruct_chunk__;
+
+struct __datastruct_slab__ {
+	__datastruct_elem__ *free;
+	/* last node of free, meaningless while free is NULL */
+	__datastruct_elem__ *free_tail;
+	__datastruct_chunk__ *chunks;
+	/* number of nodes handed out from / total number of nodes in chunks */
+	size_t used, chunk_nmemb;
+};
+
+/* containers allocate their slab right after their header. Views returned by
+ * dll_tail and dll_copy_interator only point to the slab of their list */
+#define __owns_slab(ds)	((ds)->slab == (struct __datastruct_slab__*) ((ds) + 1))
+
+static __datastruct__ *__new_datastruct(void)
 {
 #ifdef INTERNAL_ERROR_HANDLING
-	__datastruct_elem__ *e = (__datastruct_elem__*) xmalloc(sizeof(__datastruct_elem__));
+	__datastruct__ *ds = (__datastruct__*) xmalloc(sizeof(__datastruct__)
+			+ sizeof(struct __datastruct_slab__));
 #else
-	__datastruct_elem__ *e = (__datastruct_elem__*) malloc(sizeof(__datastruct_elem__));
+	__datastruct__ *ds = (__datastruct__*) malloc(sizeof(__datastruct__)
+			+ sizeof(struct __datastruct_slab__));
+	if(likely(ds != (__datastruct__*) NULL)) {
+#endif /* #ifdef INTERNAL_ERROR_HANDLING */
+		ds->in = ds->out = ds->last = (__datastruct_elem__*) NULL;
+		ds->slab = (struct __datastruct_slab__*) (ds + 1);
+		memset(ds->slab, 0, sizeof(struct __datastruct_slab__));
+#ifndef INTERNAL_ERROR_HANDLING
+	}
+#endif /* #ifndef INTERNAL_ERROR_HANDLING */
+	return ds;
+}
+
+static __datastruct_elem__ *__slab_alloc(struct __datastruct_slab__ *slab)
+{
+	__datastruct_elem__ *e = slab->free;
+	__datastruct_chunk__ *chunk;
+	size_t nmemb;
+
 	if(likely(e != (__datastruct_elem__*) NULL)) {
+		slab->free = e->next;
+		return e;
+	}
+	if(slab->chunks == (__datastruct_chunk__*) NULL || slab->used == slab->chunk_nmemb) {
+		nmemb = slab->chunks == (__datastruct_chunk__*) NULL ? SLAB_CHUNK_START_NMEMB
+			: slab->chunk_nmemb << (slab->chunk_nmemb < SLAB_CHUNK_MAX_NMEMB);
+#ifdef INTERNAL_ERROR_HANDLING
+		chunk = (__datastruct_chunk__*) xmalloc(sizeof(__datastruct_chunk__)
+				+ (nmemb - 1) * sizeof(__datastruct_elem__));
+#else
+		chunk = (__datastruct_chunk__*) malloc(sizeof(__datastruct_chunk__)
+				+ (nmemb - 1) * sizeof(__datastruct_elem__));
+		if(unlikely(chunk == (__datastruct_chunk__*) NULL))
+			return (__datastruct_elem__*) NULL;
 #endif /* #ifdef INTERNAL_ERROR_HANDLING */
-		e->data = data;
-		e->next = dl->out;
-		dl->out = e;
-		return data;
+		chunk->next = slab->chunks;
+		slab->chunks = chunk;
+		slab->chunk_nmemb = nmemb;
+		slab->used = 0;
+	}
+	return &slab->chunks->elems[slab->used++];
+}
+
+static void __slab_free(struct __datastruct_slab__ *slab, __datastruct_elem__ *e)
+{
+	if(slab->free == (__datastruct_elem__*) NULL)
+		slab->free_tail = e;
+	e->next = slab->free;
+	slab->free = e;
+}
+
+/* put nmemb nodes on the free list of slab, so that as many allocations cannot
+ * fail. Return 0 on success, -1 if out of memory */
+static int __slab_reserve(struct __datastruct_slab__ *slab, size_t nmemb)
+{
+	__datastruct_elem__ *taken = (__datastruct_elem__*) NULL, *e;
+	int ret = 0;
+
+	/* hold on to them until done, or they would be handed out again */
+	for(; nmemb > 0; nmemb--) {
+		e = __slab_alloc(slab);
 #ifndef INTERNAL_ERROR_HANDLING
-	} else
+		if(unlikely(e == (__datastruct_elem__*) NULL)) {
+			ret = -1;
+			break;
+		}
+#endif /* #ifndef INTERNAL_ERROR_HANDLING */
+		e->next = taken;
+		taken = e;
+	}
+	while(taken != (__datastruct_elem__*) NULL) {
+		e = taken;
+		taken = taken->next;
+		__slab_free(slab, e);
+	}
+	return ret;
+}
+
+/* give every node of slab back to the system at once */
+static void __slab_release(struct __datastruct_slab__ *slab)
+{
+	__datastruct_chunk__ *chunk = slab->chunks, *next;
+
+	while(chunk != (__datastruct_chunk__*) NULL) {
+		next = chunk->next;
+		free(chunk);
+		chunk = next;
+	}
+	memset(slab, 0, sizeof(struct __datastruct_slab__));
+}
+
+/* make slab responsible for the chunks of other, leaving other empty. Runs in
+ * O(number of chunks in other), i.e. O(log(number of nodes)) */
+static void __slab_adopt(struct __datastruct_slab__ *slab, struct __datastruct_slab__ *other)
+{
+	__datastruct_chunk__ *last;
+
+	if(other->chunks == (__datastruct_chunk__*) NULL)
+		return;
+	if(slab->chunks == (__datastruct_chunk__*) NULL) {
+		*slab = *other;
+	} else {
+		/* keep our first chunk first, nodes are still being handed out from it */
+		for(last = other->chunks; last->next != (__datastruct_chunk__*) NULL; last = last->next)
+			;
+		last->next = slab->chunks->next;
+		slab->chunks->next = other->chunks;
+		if(slab->free == (__datastruct_elem__*) NULL) {
+			slab->free = other->free;
+			slab->free_tail = other->free_tail;
+		} else if(other->free != (__datastruct_elem__*) NULL) {
+			slab->free_tail->next = other->free;
+			slab->free_tail = other->free_tail;
+		}
+	}
+	memset(other, 0, sizeof(struct __datastruct_slab__));
+}
+
+/* ----- Double-linked list ----- */
+DLinkedList new_dlinkedlist(void)
+{
+	return (DLinkedList) __new_datastruct();
+}
+
+void delete_dlinkedlist(DLinkedList dl, void (*__del__)(void*))
+{
+	__datastruct_elem__ *e;
+
+	if(__owns_slab(dl)) {
+		if(__del__ != (void(*)(void*)) NULL) {
+			for(e = dl->in; e != (__datastruct_elem__*) NULL; e = e->next)
+				__del__(e->data);
+			for(e = dl->out; e != (__datastruct_elem__*) NULL; e = e->next)
+				__del__(e->data);
+		}
+		__slab_release(dl->slab);
+	}
+	free(dl);
+}
+
+void *dll_add(DLinkedList dl, void *data)
+{
+	__datastruct_elem__ *e = __slab_alloc(dl->slab);
+
+#ifndef INTERNAL_ERROR_HANDLING
+	if(unlikely(e == (__datastruct_elem__*) NULL))
 		return (void*) NULL;
 #endif /* #ifndef INTERNAL_ERROR_HANDLING */
+	e->data = data;
+	e->next = dl->out;
+	if(dl->out == (__datastruct_elem__*) NULL)
+		dl->last = e;
+	dl->out = e;
+	return data;
 }
 
 void *dll_remove(DLinkedList dl)
@@ -1160,17 +1489,22 @@ void *dll_remove(DLinkedList dl)
 	__datastruct_elem__ *e = dl->out;
 
 	if(e != (__datastruct_elem__*) NULL) {
+		data = e->data;
 		dl->out = e->next;
-		free(e);
+		if(dl->out == (__datastruct_elem__*) NULL)
+			dl->last = (__datastruct_elem__*) NULL;
+		__slab_free(dl->slab, e);
 	}
 	return data;
 }
 
 void dll_rewind(DLinkedList dl)
 {
-	__datastruct_elem__ *e = dl->in;
+	__datastruct_elem__ *e;
 
-	while(e != (__datastruct_elem__*) NULL) {
+	if(dl->out == (__datastruct_elem__*) NULL)
+		dl->last = dl->in;
+	while((e = dl->in) != (__datastruct_elem__*) NULL) {
 		dl->in = e->next;
 		e->next = dl->out;
 		dl->out = e;
@@ -1185,6 +1519,8 @@ void *dll_iterate(DLinkedList dl)
 	if(e != (__datastruct_elem__*) NULL) {
 		data = e->data;
 		dl->out = e->next;
+		if(dl->out == (__datastruct_elem__*) NULL)
+			dl->last = (__datastruct_elem__*) NULL;
 		e->next = dl->in;
 		dl->in = e;
 	}
@@ -1199,6 +1535,8 @@ void *dll_rev_iterate(DLinkedList dl)
 	if(dl->out != (__datastruct_elem__*) NULL)
 		data = dl->out->data;
 	if(e != (__datastruct_elem__*) NULL) {
+		if(dl->out == (__datastruct_elem__*) NULL)
+			dl->last = e;
 		dl->in = e->next;
 		e->next = dl->out;
 		dl->out = e;
@@ -1219,9 +1557,10 @@ DLinkedList dll_tail(DLinkedList dl)
 	DLinkedList tl = (DLinkedList) malloc(sizeof(__datastruct__));
 	if(likely(tl != (DLinkedList) NULL)) {
 #endif /* #ifdef INTERNAL_ERROR_HANDLING */
-		tl->in = dl->out;
-		if(tl->in != (__datastruct_elem__*) NULL)
-			tl->out = tl->in->next;
+		tl->in = (__datastruct_elem__*) NULL;
+		tl->out = dl->out != (__datastruct_elem__*) NULL ? dl->out->next : (__datastruct_elem__*) NULL;
+		tl->last = tl->out != (__datastruct_elem__*) NULL ? dl->last : (__datastruct_elem__*) NULL;
+		tl->slab = dl->slab;
 #ifndef INTERNAL_ERROR_HANDLING
 	}
 #endif /* #ifndef INTERNAL_ERROR_HANDLING */
@@ -1238,60 +1577,108 @@ DLinkedList dll_copy_interator(DLinkedList dl)
 #endif /* #ifdef INTERNAL_ERROR_HANDLING */
 		new_dl->in = dl->in;
 		new_dl->out = dl->out;
+		new_dl->last = dl->last;
+		new_dl->slab = dl->slab;
 #ifndef INTERNAL_ERROR_HANDLING
 	}
 #endif /* #ifndef INTERNAL_ERROR_HANDLING */
 	return new_dl;
 }
-#if 0
-/* TODO: finish implementing */
-DLinkedList clone_dll(DLinkedList dl, void *(*__clonefunc__)(void*))
+
+/* copy chain src to *head, taking nodes from slab. Elements for which
+ * __filterfunc__ returns false are skipped, and data is passed through
+ * __clonefunc__ unless either is NULL. *last is set to the last node copied.
+ * Returns 0 on success, -1 on failure */
+static int __dll_copy_chain(struct __datastruct_slab__ *slab, const __datastruct_elem__ *src,
+		__datastruct_elem__ **head, __datastruct_elem__ **last,
+		void *(*__clonefunc__)(void*), BOOL_TYPE (*__filterfunc__)(void*))
 {
-	failwith("function not yet implemented");
-	__datastruct_elem__ *e, *e_copy;
-#ifdef INTERNAL_ERROR_HANDLING
-	DLinkedList new_dl = (DLinkedList) xmalloc(sizeof(__datastruct__));
-#else
-	DLinkedList new_dl = (DLinkedList) malloc(sizeof(__datastruct__));
-	if(likely(new_dl != (DLinkedList) NULL)) {
-#endif /* #ifdef INTERNAL_ERROR_HANDLING */
-		e = dl->in;
-		while(e != (__datastruct_elem__*) NULL) {
-#ifdef INTERNAL_ERROR_HANDLING
-			e_copy = (__datastruct_elem__*) xmalloc(sizeof(__datastruct_elem__));
-#else
-			e_copy = (__datastruct_elem__*) malloc(sizeof(__datastruct_elem__));
-			if(likely(e_copy != (__datastruct_elem__*) NULL)) {
-#endif /* #ifdef INTERNAL_ERROR_HANDLING */
-				e_copy->data = __clonefunc__(e->data);
-				e->next = dl->out;
-				dl->out = e;
-				return data;
+	__datastruct_elem__ **link = head, *e;
+
+	*last = (__datastruct_elem__*) NULL;
+	for(; src != (const __datastruct_elem__*) NULL; src = src->next) {
+		if(__filterfunc__ != (BOOL_TYPE(*)(void*)) NULL && ! __filterfunc__(src->data))
+			continue;
+		e = __slab_alloc(slab);
 #ifndef INTERNAL_ERROR_HANDLING
-			} else
-				return (void*) NULL;
-#endif /* #ifndef INTERNAL_ERROR_HANDLING */
+		if(unlikely(e == (__datastruct_elem__*) NULL)) {
+			*link = (__datastruct_elem__*) NULL;
+			return -1;
 		}
+#endif /* #ifndef INTERNAL_ERROR_HANDLING */
+		e->data = __clonefunc__ != (void*(*)(void*)) NULL ? __clonefunc__(src->data) : src->data;
+		*link = e;
+		link = &e->next;
+		*last = e;
+	}
+	*link = (__datastruct_elem__*) NULL;
+	return 0;
+}
+
+/* copy both chains of dl in a single pass each, so that the copy also keeps
+ * the iterator position of dl */
+static DLinkedList __dll_copy(DLinkedList dl, void *(*__clonefunc__)(void*),
+		BOOL_TYPE (*__filterfunc__)(void*))
+{
+	DLinkedList new_dl = new_dlinkedlist();
+	const __datastruct_elem__ *e;
+	__datastruct_elem__ *unused;
+	size_t nmemb = 0;
+
 #ifndef INTERNAL_ERROR_HANDLING
+	if(unlikely(new_dl == (DLinkedList) NULL))
+		return (DLinkedList) NULL;
+#endif /* #ifndef INTERNAL_ERROR_HANDLING */
+	if(__clonefunc__ != (void*(*)(void*)) NULL) {
+		/* we could not free the clones made before running out of nodes */
+		for(e = dl->in; e != (const __datastruct_elem__*) NULL; e = e->next)
+			nmemb++;
+		for(e = dl->out; e != (const __datastruct_elem__*) NULL; e = e->next)
+			nmemb++;
+		if(unlikely(__slab_reserve(new_dl->slab, nmemb) != 0)) {
+			delete_dlinkedlist(new_dl, (void(*)(void*)) NULL);
+			return (DLinkedList) NULL;
+		}
+	}
+	if(unlikely(__dll_copy_chain(new_dl->slab, dl->in, &new_dl->in, &unused,
+					__clonefunc__, __filterfunc__) != 0
+				|| __dll_copy_chain(new_dl->slab, dl->out, &new_dl->out, &new_dl->last,
+					__clonefunc__, __filterfunc__) != 0)) {
+		delete_dlinkedlist(new_dl, (void(*)(void*)) NULL);
+		return (DLinkedList) NULL;
 	}
 	return new_dl;
-#endif /* #ifndef INTERNAL_ERROR_HANDLING */
 }
 
-/* TODO: implement*/
-DLinkedList dll_join(DLinkedList dl1, DLinkedList dl2)
+DLinkedList dll_clone(DLinkedList dl, void *(*__clonefunc__)(void*))
 {
-	__datastruct_elem__ *e1, *e2;
-	failwith("function not yet implemented");
+	return __dll_copy(dl, __clonefunc__, (BOOL_TYPE(*)(void*)) NULL);
 }
 
-/* TODO: implement*/
 DLinkedList dll_filter(DLinkedList dl, BOOL_TYPE (*__filterfunc__)(void*))
 {
-	failwith("function not yet implemented");
+	return __dll_copy(dl, (void*(*)(void*)) NULL, __filterfunc__);
+}
 
+DLinkedList dll_join(DLinkedList dl1, DLinkedList dl2)
+{
+	if(unlikely( ! __owns_slab(dl2) || dl1->slab == dl2->slab)) {
+		errno = EINVAL;
+		return (DLinkedList) NULL;
+	}
+	/* only the part of dl2 in front of its iterator can be spliced as is */
+	dll_rewind(dl2);
+	if(dl2->out != (__datastruct_elem__*) NULL) {
+		if(dl1->out == (__datastruct_elem__*) NULL)
+			dl1->out = dl2->out;
+		else
+			dl1->last->next = dl2->out;
+		dl1->last = dl2->last;
+		dl2->out = dl2->last = (__datastruct_elem__*) NULL;
+	}
+	__slab_adopt(dl1->slab, dl2->slab);
+	return dl1;
 }
-#endif /* #if 0 */
 
 void *dll_map(DLinkedList dl, void *(*__mapfunc__)(void *data, void *arg), void *arg)
 {
@@ -1304,574 +1691,7472 @@ void *dll_map(DLinkedList dl, void *(*__mapfunc__)(void *data, void *arg), void
 	return arg;
 }
 
-#if 0
-/* TODO: implement*/
-void dll_sort(DLinkedList dl, int (*__cmp__)(void *d1, void *d2))
+/* detach the run of non-decreasing elements starting at list. *rest is set to
+ * the first node following the run */
+static __datastruct_elem__ *__dll_run(__datastruct_elem__ *list,
+		int (*__cmp__)(void*, void*), __datastruct_elem__ **rest)
 {
-	failwith("function not yet implemented");
+	__datastruct_elem__ *e = list;
+
+	while(e->next != (__datastruct_elem__*) NULL && __cmp__(e->next->data, e->data) >= 0)
+		e = e->next;
+	*rest = e->next;
+	e->next = (__datastruct_elem__*) NULL;
+	return list;
 }
-#endif /* #if 0 */
 
-/* ----- Stack ----- */
-void delete_stack(Stack s, void (*__del__)(void*))
+/* stable merge of runs a and b. *last is set to the last node of the result */
+static __datastruct_elem__ *__dll_merge(__datastruct_elem__ *a, __datastruct_elem__ *b,
+		int (*__cmp__)(void*, void*), __datastruct_elem__ **last)
 {
-	Stack temp;
-
-	if(__del__ != (void(*)(void*)) NULL)
-		while(s != (Stack) NULL) {
-			__del__(s->data);
-			temp = s;
-			s = s->next;
-			free(temp);
+	__datastruct_elem__ head, *tail = &head;
+
+	while(a != (__datastruct_elem__*) NULL && b != (__datastruct_elem__*) NULL) {
+		if(__cmp__(b->data, a->data) < 0) {
+			tail->next = b;
+			b = b->next;
+		} else {
+			tail->next = a;
+			a = a->next;
 		}
-	else
-		while(s != (Stack) NULL) {
-			temp = s;
-			s = s->next;
-			free(temp);
+		tail = tail->next;
+	}
+	tail->next = a != (__datastruct_elem__*) NULL ? a : b;
+	while(tail->next != (__datastruct_elem__*) NULL)
+		tail = tail->next;
+	*last = tail;
+	return head.next;
+}
+
+/* Bottom-up natural merge sort: every pass merges pairs of adjacent runs of
+ * already sorted elements by relinking nodes, until a single run is left.
+ * Takes O(n log r) time for r initial runs and O(1) extra memory */
+void dll_sort(DLinkedList dl, int (*__cmp__)(void *d1, void *d2))
+{
+	__datastruct_elem__ *rest, *a, *b, head, *tail;
+	size_t runs;
+
+	dll_rewind(dl);
+	if(dl->out == (__datastruct_elem__*) NULL)
+		return;
+	do {
+		runs = 0;
+		tail = &head;
+		rest = dl->out;
+		while(rest != (__datastruct_elem__*) NULL) {
+			a = __dll_run(rest, __cmp__, &rest);
+			runs++;
+			if(rest == (__datastruct_elem__*) NULL) {
+				tail->next = a;
+				for(tail = a; tail->next != (__datastruct_elem__*) NULL; tail = tail->next)
+					;
+				break;
+			}
+			b = __dll_run(rest, __cmp__, &rest);
+			runs++;
+			a = __dll_merge(a, b, __cmp__, &b);
+			tail->next = a;
+			tail = b;
 		}
+		dl->out = head.next;
+	} while(runs > 2);
+	dl->last = tail;
+}
 
+/* ----- Stack ----- */
+#ifdef ARRAY_STACK_QUEUE
+void delete_stack(Stack s, void (*__del__)(void*))
+{
+	stack_clear(s, __del__);
+	array_free(s);
 }
 
 #undef stack_push
 void *stack_push(Stack *s, void *data)
 {
-#ifdef INTERNAL_ERROR_HANDLING
-	__datastruct_elem__ *new = (__datastruct_elem__*) xmalloc(sizeof(__datastruct_elem__));
-#else
-	__datastruct_elem__ *new = (__datastruct_elem__*) malloc(sizeof(__datastruct_elem__));
-	if(likely(new != NULL)) {
-#endif	/* #ifdef INTERNAL_ERROR_HANDLING */
-		new->data = data;
-		new->next = *s;
-		*s = new;
-#ifndef INTERNAL_ERROR_HANDLING
-	}
-#endif /* #ifdef INTERNAL_ERROR_HANDLING */
+	if(unlikely(array_push(*s, data) != 0))
+		return NULL;
 	return data;
 }
 
 #undef stack_pop
 void *stack_pop(Stack *s)
 {
-	void *ret = (void*) NULL;
-	Stack new;
-
-	if(likely(*s != (Stack) NULL)) {
-		ret = (*s)->data;
-		new = (*s)->next;
-		free(*s);
-		*s = new;
-	}
-	return ret;
+	return likely(array_len(*s) != 0) ? array_pop(*s) : (void*) NULL;
 }
 
 void *stack_peek(Stack s)
 {
-	return unlikely(s == (Stack) NULL) ? (void*) NULL : s->data;
+	return likely(array_len(s) != 0) ? array_last(s) : (void*) NULL;
 }
 
-/* ----- Queue ----- */
-Queue new_queue(void)
+#undef stack_reserve
+int stack_reserve(Stack *s, size_t nmemb)
 {
-#ifdef INTERNAL_ERROR_HANDLING
-	Queue q = (Queue) xmalloc(sizeof(__datastruct__));
-#else
-	Queue q = (Queue) malloc(sizeof(__datastruct__));
-	if(likely(q != (Queue) NULL)) {
-#endif	/* #ifdef INTERNAL_ERROR_HANDLING */
-		q->in = (__datastruct_elem__*) NULL;
-		q->out = (__datastruct_elem__*) NULL;
-#ifndef INTERNAL_ERROR_HANDLING
-	}
-#endif /* #ifdef INTERNAL_ERROR_HANDLING */
-	return q;
+	return array_reserve(*s, nmemb);
 }
 
-void delete_queue(Queue q, void (*__del__)(void*))
+#undef stack_clear
+void stack_clear(Stack *s, void (*__del__)(void*))
 {
-	__datastruct_elem__ *temp, *iterator;
+	size_t i;
 
-	iterator = q->in;
 	if(__del__ != (void(*)(void*)) NULL)
-		while(iterator != (__datastruct_elem__*) NULL) {
-			__del__(iterator->data);
-			temp = iterator;
-			iterator = iterator->next;
-			free(temp);
-		}
-	else
-		while(iterator != (__datastruct_elem__*) NULL) {
-			temp = iterator;
-			iterator = iterator->next;
-			free(temp);
-		}
-	free(q);
+		for(i = array_len(*s); i > 0; i--)
+			__del__((*s)[i - 1]);
+	array_clear(*s);
 }
+#else
+/* A Stack is a bare node pointer with no header to hang a slab from, so its
+ * nodes come from a small per-thread cache instead: popped nodes are kept for
+ * the next push rather than freed */
+#define STACK_NODE_CACHE_NMEMB	64
 
-void queue_push(Queue q, void *data)
+static __thread __datastruct_elem__ *__stack_cache__ = (__datastruct_elem__*) NULL;
+static __thread unsigned __stack_cache_nmemb__ = 0;
+
+#ifdef ENABLE_THREADING
+static __thread BOOL_TYPE __stack_cache_registered__ = BOOL_FALSE;
+static pthread_key_t __stack_cache_key__;
+static pthread_once_t __stack_cache_once__ = PTHREAD_ONCE_INIT;
+static int __stack_cache_key_error__ = 0;
+
+/* runs at thread exit */
+static void __stack_cache_destroy(void *unused)
 {
-#ifdef INTERNAL_ERROR_HANDLING
-	__datastruct_elem__ *new = (__datastruct_elem__*) xmalloc(sizeof(__datastruct_elem__));
-#else
-	__datastruct_elem__ *new = (__datastruct_elem__*) malloc(sizeof(__datastruct_elem__));
+	__datastruct_elem__ *next;
 
-	if(likely(new != (__datastruct_elem__*) NULL)) {
-#endif	/* #ifdef INTERNAL_ERROR_HANDLING */
-		new->data = data;
-		new->next = (__datastruct_elem__*) NULL;
-		if(q->in != (__datastruct_elem__*) NULL)
-			q->in->next = new;
-		q->in = new;
-		if(q->out == (__datastruct_elem__*) NULL)
-			q->out = q->in;
-#ifndef INTERNAL_ERROR_HANDLING
+	(void) unused;
+	while(__stack_cache__ != (__datastruct_elem__*) NULL) {
+		next = __stack_cache__->next;
+		free(__stack_cache__);
+		__stack_cache__ = next;
 	}
-#endif /* #ifndef INTERNAL_ERROR_HANDLING */
+	__stack_cache_nmemb__ = 0;
 }
 
-void *queue_pop(Queue q)
+static void __stack_cache_key_init(void)
 {
-	void *ret = (void*) NULL;
-	__datastruct_elem__ *temp;
-
-	if(q->out != (__datastruct_elem__*) NULL)
-		ret = q->out->data;
-	temp = q->out;
-	q->out = temp->next;
-	if(q->out == (__datastruct_elem__*) NULL)
-		q->in = (__datastruct_elem__*) NULL;
-	free(temp);
-
-	return ret;
+	if(unlikely((__stack_cache_key_error__ = pthread_key_create(&__stack_cache_key__, &__stack_cache_destroy)) != 0))
+		log_message(LOG_WARNING, "Stack nodes will not be cached");
 }
+#endif /* #ifdef ENABLE_THREADING */
 
-void *queue_peek(Queue q)
+static void __stack_free_node(__datastruct_elem__ *e)
 {
-	return likely(q->out != (__datastruct_elem__*) NULL) ? q->out->data : (void*) NULL;
+	if(__stack_cache_nmemb__ == STACK_NODE_CACHE_NMEMB) {
+		free(e);
+		return;
+	}
+#ifdef ENABLE_THREADING
+	if(unlikely( ! __stack_cache_registered__)) {
+		pthread_once(&__stack_cache_once__, &__stack_cache_key_init);
+		/* without a key, the cache would leak at thread exit */
+		if(unlikely(__stack_cache_key_error__ != 0)) {
+			free(e);
+			return;
+		}
+		/* key destructors only run for non-NULL values */
+		pthread_setspecific(__stack_cache_key__, (void*) &__stack_cache__);
+		__stack_cache_registered__ = BOOL_TRUE;
+	}
+#endif /* #ifdef ENABLE_THREADING */
+	e->next = __stack_cache__;
+	__stack_cache__ = e;
+	__stack_cache_nmemb__++;
 }
 
-/* ----- Bitset ----- */
-Bitset new_bitset(size_t size)
+void delete_stack(Stack s, void (*__del__)(void*))
 {
-	size_t mem = (size >> 3) + (size % 8 != 0);
-	Bitset b;
-#ifdef INTERNAL_ERROR_HANDLING
-	b = (Bitset) xmalloc(sizeof(__bitset_struct__) + mem);
-#else
-	b = (Bitset) malloc(sizeof(__bitset_struct__) + mem);
-	if(likely(b != (Bitset) NULL))
-#endif /* #ifdef INTERNAL_ERROR_HANDLING */
-		memset(b->data, 0, mem);
-	b->size = size;
-	return b;
+	Stack temp;
+
+	while(s != (Stack) NULL) {
+		if(__del__ != (void(*)(void*)) NULL)
+			__del__(s->data);
+		temp = s;
+		s = s->next;
+		__stack_free_node(temp);
+	}
 }
 
-Bitset clone_bitset(Bitset set)
+#undef stack_push
+void *stack_push(Stack *s, void *data)
 {
-	Bitset set_clone;
-	size_t mem = (set->size >> 3) + (set->size % 8 != 0);
+	__datastruct_elem__ *new = __stack_cache__;
 
+	if(likely(new != (__datastruct_elem__*) NULL)) {
+		__stack_cache__ = new->next;
+		__stack_cache_nmemb__--;
+	} else {
 #ifdef INTERNAL_ERROR_HANDLING
-	set_clone = (Bitset) xmalloc(sizeof(__bitset_struct__) + mem);
+		new = (__datastruct_elem__*) xmalloc(sizeof(__datastruct_elem__));
 #else
-	set_clone = (Bitset) malloc(sizeof(__bitset_struct__) + mem);
-	if(likely(set_clone != (Bitset) NULL)) {
-#endif /* #ifdef INTERNAL_ERROR_HANDLING */
-		memcpy(set_clone->data, set->data, mem);
-		set_clone->size = set->size;
-#ifndef INTERNAL_ERROR_HANDLING
+		new = (__datastruct_elem__*) malloc(sizeof(__datastruct_elem__));
+		if(unlikely(new == (__datastruct_elem__*) NULL))
+			return data;
+#endif	/* #ifdef INTERNAL_ERROR_HANDLING */
 	}
-#endif /* #ifndef INTERNAL_ERROR_HANDLING */
-
-	return set_clone;
+	new->data = data;
+	new->next = *s;
+	*s = new;
+	return data;
 }
 
-int getbit(const Bitset set, int pos)
+#undef stack_pop
+void *stack_pop(Stack *s)
 {
-	return (set->data[pos >> 3] >> (pos % 8)) & 1;
+	void *ret = (void*) NULL;
+	Stack new;
+
+	if(likely(*s != (Stack) NULL)) {
+		ret = (*s)->data;
+		new = (*s)->next;
+		__stack_free_node(*s);
+		*s = new;
+	}
+	return ret;
 }
 
-void setbit(Bitset set, int pos)
+void *stack_peek(Stack s)
 {
-	set->data[pos >> 3] |= (1 << (pos % 8));
+	return unlikely(s == (Stack) NULL) ? (void*) NULL : s->data;
 }
 
-void unsetbit(Bitset set, int pos)
+#undef stack_reserve
+int stack_reserve(Stack *s, size_t nmemb)
 {
-	set->data[pos >> 3] &= ~(1 << (pos % 8));
+	(void) s;
+	(void) nmemb;
+	return 0;
 }
 
-int togglebit(Bitset set, int pos)
+#undef stack_clear
+void stack_clear(Stack *s, void (*__del__)(void*))
 {
-	set->data[pos >> 3] ^= 1 << pos % 8;
-
-	return (set->data[pos >> 3] >> (pos % 8)) & 1;
+	delete_stack(*s, __del__);
+	*s = (Stack) NULL;
 }
-#endif /* #ifdef ENABLE_Bitset */
+#endif /* #ifdef ARRAY_STACK_QUEUE */
 
+/* ----- Queue ----- */
+#ifdef ARRAY_STACK_QUEUE
+#define QUEUE_START_SIZE	16
 
-/* -------------------- Filesystem functions -------------------- */
-#ifdef ENABLE_FILESYSTEM
-int is_dir(const char *path)
+Queue new_queue(void)
 {
-	struct stat buf;
+	Queue q;
 
-	if(lstat(path, &buf) != 0) {
-		log_message(LOG_ERROR, "Error statting file: %s", strerror(errno));
-		return -1;
-	} else
-		return S_ISDIR(buf.st_mode);
+#ifdef INTERNAL_ERROR_HANDLING
+	q = (Queue) xmalloc(sizeof(struct __array_queue__));
+#else
+	q = (Queue) malloc(sizeof(struct __array_queue__));
+	if(unlikely(q == (Queue) NULL))
+		return (Queue) NULL;
+#endif /* #ifdef INTERNAL_ERROR_HANDLING */
+	q->data = (void**) NULL;
+	q->size = q->head = q->nmemb = 0;
+	return q;
 }
 
-#ifdef	_WIN32
-#define FILE_SEPARATOR	'\\'
-#else
-#define FILE_SEPARATOR	'/'
-#endif /* #ifdef _WIN32 */
+void delete_queue(Queue q, void (*__del__)(void*))
+{
+	queue_clear(q, __del__);
+	free(q->data);
+	free(q);
+}
 
-#undef make_path
-char *make_path(const char *path, ...)
+/* move elements to a new ring of at least nmemb elements, starting at index 0.
+ * Return 0 on success, -1 if out of memory (q is left untouched) */
+static int __queue_grow(Queue q, size_t nmemb)
 {
-	char *new_path = (char*) NULL, *ptr = (char*) NULL;
-	va_list ap;
-	size_t len = strlen(path) + 1;
+	void **data;
+	size_t size = q->size == 0 ? QUEUE_START_SIZE : q->size, first;
 
-	va_start(ap, path);
-	while((ptr = va_arg(ap, char*)) != (char*) NULL)
-		len += strlen(ptr) + 1;
-	va_end(ap);
+	while(size < nmemb)
+		size <<= 1;
 #ifdef INTERNAL_ERROR_HANDLING
-	ptr = new_path = (char*) xmalloc(len * sizeof(char));
+	data = (void**) xmalloc(size * sizeof(void*));
 #else
-	ptr = new_path = (char*) malloc(len * sizeof(char));
-	if(new_path != (char*) NULL) {
+	data = (void**) malloc(size * sizeof(void*));
+	if(unlikely(data == (void**) NULL))
+		return -1;
 #endif /* #ifdef INTERNAL_ERROR_HANDLING */
-		va_start(ap, path);
-		ptr = stpcpy(new_path, path);
-		while((path = va_arg(ap, char*)) != (char*) NULL) {
-			*ptr++ = FILE_SEPARATOR;
-			ptr = stpcpy(ptr, path);
-		}
-		va_end(ap);
-#ifndef INTERNAL_ERROR_HANDLING
+	if(q->nmemb != 0) {
+		first = q->size - q->head < q->nmemb ? q->size - q->head : q->nmemb;
+		memcpy(data, &q->data[q->head], first * sizeof(void*));
+		memcpy(&data[first], q->data, (q->nmemb - first) * sizeof(void*));
 	}
-#endif /* #ifndef INTERNAL_ERROR_HANDLING */
-	return new_path;
+	free(q->data);
+	q->data = data;
+	q->size = size;
+	q->head = 0;
+	return 0;
 }
-#undef FILE_SEPARATOR
-#ifdef C99
-# define make_path(...)	make_path(__VA_ARGS__, (char*) NULL)
-#endif /* #ifdef C99 */
 
-void *dirwalk(const char *path, BOOL_TYPE recurse, void *(*func)(char*, void*), void *arg)
+void queue_push(Queue q, void *data)
 {
-	DIR *dir;
-	struct dirent *entry;
-	char *new_path;
+	if(unlikely(q->nmemb == q->size) && __queue_grow(q, q->nmemb + 1) != 0)
+		return;
+	q->data[(q->head + q->nmemb++) & (q->size - 1)] = data;
+}
 
-	dir = opendir(path);
-	if(dir != (DIR*) NULL) {
-        while((entry = readdir(dir)) != (struct dirent*) NULL)
-            if(strcmp(entry->d_name, ".") != 0 && strcmp(entry->d_name, "..") != 0) {
-#ifdef C99
-                new_path = make_path(path, entry->d_name);
-#else
-                new_path = make_path(path, entry->d_name, NULL);
-#endif /* #ifdef C99 */
-#ifndef INTERNAL_ERROR_HANDLING
-                if(unlikely(new_path == (char*) NULL)) {
-                    closedir(dir);
-                    return (void*) NULL;
-                }
-#endif /* #ifndef INTERNAL_ERROR_HANDLING */
-#ifdef _DIRENT_HAVE_D_TYPE
-                if(entry->d_type == DT_DIR)
-#else
-                    if(is_dir(new_path))
-#endif /* #ifdef _WIN32 */
-                    {
-                        if(recurse)
-                            dirwalk(new_path, recurse, func, arg);
-                    } else
-                        arg = func(new_path, arg);
-                free(new_path);
-            }
-		closedir(dir);
-	} else
-		arg = (void*) NULL;
-	return arg;
+void *queue_pop(Queue q)
+{
+	void *ret;
+
+	if(unlikely(q->nmemb == 0))
+		return NULL;
+	ret = q->data[q->head];
+	q->head = (q->head + 1) & (q->size - 1);
+	q->nmemb--;
+	return ret;
 }
-#endif /* #ifdef ENABLE_FILESYSTEM */
 
+void *queue_peek(Queue q)
+{
+	return likely(q->nmemb != 0) ? q->data[q->head] : (void*) NULL;
+}
 
-/* -------------------- Networking functions -------------------- */
-#ifdef ENABLE_NETWORKING
+int queue_reserve(Queue q, size_t nmemb)
+{
+	return nmemb <= q->size ? 0 : __queue_grow(q, nmemb);
+}
 
-int connect_to(const char *server_name, unsigned port)
+void queue_clear(Queue q, void (*__del__)(void*))
 {
-	struct addrinfo *adresses = (struct addrinfo*) NULL, *iterator = (struct addrinfo*) NULL;
-	char ip_addr[INET6_ADDRSTRLEN] = { 0 }, port_buff[11] = { 0 };
-	int sockfd;
+	size_t i;
 
-	sockfd = socket(AF_INET, SOCK_STREAM, 0);
-	snprintf(port_buff, 11, "%u", port);
-	if(sockfd == -1) {
-		log_message(LOG_ERROR, "Error creating socket: %s", strerror(errno));
-		sockfd = CONNECT_ERROR;
-	} else if(getaddrinfo(server_name, port_buff, (const struct addrinfo*) NULL, &adresses) != 0) {
-		/* DNS resolution. getaddrinfo creates a linked list (pointed to by adresses),
-		 * 1 element == 1 IP Address. Function IPv6 compatible. */
-		log_message(LOG_ERROR, "Unable to resolve '%s' to a valid IP address", server_name);
-		sockfd = CONNECT_ERROR;
-	} else {
-		log_message(LOG_INFO, "DNS lookup succesful");
-		iterator = adresses;
-		/* Iterate over linked list until we connect successfully or we run out of addresses. */
-		while(connect(sockfd, iterator->ai_addr, (socklen_t) sizeof *iterator->ai_addr) != 0) {
-			iterator = iterator->ai_next;
-			if(unlikely(iterator == (struct addrinfo*) NULL)) {
-				sockfd = CONNECT_ERROR;
-				break;
-			}
-		}
-		if(likely(iterator != (struct addrinfo*) NULL))
-			log_message(LOG_INFO, "Connection established with %s (%s:%d)", server_name,
-					inet_ntop(iterator->ai_family,
-						&((struct sockaddr_in*) iterator->ai_addr)->sin_addr,
-						ip_addr, sizeof ip_addr),
-					ntohs(((struct sockaddr_in*) iterator->ai_addr)->sin_port));
-		freeaddrinfo(adresses);
-	}
-	return sockfd;
+	if(__del__ != (void(*)(void*)) NULL)
+		for(i = 0; i < q->nmemb; i++)
+			__del__(q->data[(q->head + i) & (q->size - 1)]);
+	q->head = q->nmemb = 0;
+}
+#undef QUEUE_START_SIZE
+#else
+Queue new_queue(void)
+{
+	return (Queue) __new_datastruct();
 }
 
-int create_server(unsigned port)
+void delete_queue(Queue q, void (*__del__)(void*))
 {
-	int sockfd;
-	unsigned queue = 1;
-	struct sockaddr_in config;
+	__datastruct_elem__ *iterator;
 
-	memset(&config, 0, sizeof config);
-	config.sin_family = PF_INET;
-	config.sin_addr.s_addr = htonl(INADDR_ANY);
-	config.sin_port = htons(port);
+	if(__del__ != (void(*)(void*)) NULL)
+		for(iterator = q->out; iterator != (__datastruct_elem__*) NULL; iterator = iterator->next)
+			__del__(iterator->data);
+	__slab_release(q->slab);
+	free(q);
+}
 
-	sockfd = socket(AF_INET, SOCK_STREAM, 0);
-	if(sockfd == -1) {
-		log_message(LOG_ERROR, "Error creating socket: %s", strerror(errno));
-		sockfd = CONNECT_ERROR;
-	} else {
-		if(setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &queue, sizeof queue) != 0)
-			log_message(LOG_ERROR, "Error setting socket option SO_REUSEADDR: %s", strerror(errno));
-		/* print error message but keep on going. Failing here will not prevent program from
-		 * working correctly */
-		queue = SOMAXCONN;
-		if(bind(sockfd, (struct sockaddr*) &config, sizeof config) != 0 || listen(sockfd, queue) != 0) {
-			shutdown(sockfd, SHUT_RDWR);
-			log_message(LOG_ERROR, "Error binding server %d: %s", port, strerror(errno));
-			sockfd = CONNECT_ERROR;
-		} else
-			log_message(LOG_INFO, "Server initialized on port %u", port);
-	}
-	return sockfd;
+void queue_push(Queue q, void *data)
+{
+	__datastruct_elem__ *new = __slab_alloc(q->slab);
+
+#ifndef INTERNAL_ERROR_HANDLING
+	if(unlikely(new == (__datastruct_elem__*) NULL))
+		return;
+#endif /* #ifndef INTERNAL_ERROR_HANDLING */
+	new->data = data;
+	new->next = (__datastruct_elem__*) NULL;
+	if(q->in != (__datastruct_elem__*) NULL)
+		q->in->next = new;
+	q->in = new;
+	if(q->out == (__datastruct_elem__*) NULL)
+		q->out = q->in;
 }
 
-int get_single_client(int server_socket)
+void *queue_pop(Queue q)
 {
-	struct sockaddr_in client_config;
-	int client_fd;
-	char buffer[INET6_ADDRSTRLEN];
-	socklen_t size = sizeof client_config;
+	void *ret = (void*) NULL;
+	__datastruct_elem__ *temp = q->out;
 
-	client_fd = accept(server_socket, (struct sockaddr*) &client_config, &size);
-	if(client_fd != -1)
-		log_message(LOG_INFO, "Connection established to %s:%u",
-				inet_ntop(AF_INET, &client_config.sin_addr, buffer, INET6_ADDRSTRLEN),
-				ntohs(client_config.sin_port));
-	else {
-		client_fd = CONNECT_ERROR;
-		log_message(LOG_ERROR, "Error establishing connection: %s", strerror(errno));
+	if(likely(temp != (__datastruct_elem__*) NULL)) {
+		ret = temp->data;
+		q->out = temp->next;
+		if(q->out == (__datastruct_elem__*) NULL)
+			q->in = (__datastruct_elem__*) NULL;
+		__slab_free(q->slab, temp);
 	}
-
-	return client_fd;
+	return ret;
+}
+
+void *queue_peek(Queue q)
+{
+	return likely(q->out != (__datastruct_elem__*) NULL) ? q->out->data : (void*) NULL;
+}
+
+int queue_reserve(Queue q, size_t nmemb)
+{
+	__datastruct_elem__ *e, *nodes = (__datastruct_elem__*) NULL;
+	size_t i;
+
+	/* fill the slab's free list */
+	for(i = 0; i < nmemb; i++) {
+		e = __slab_alloc(q->slab);
+#ifndef INTERNAL_ERROR_HANDLING
+		if(unlikely(e == (__datastruct_elem__*) NULL))
+			break;
+#endif /* #ifndef INTERNAL_ERROR_HANDLING */
+		e->next = nodes;
+		nodes = e;
+	}
+	while(nodes != (__datastruct_elem__*) NULL) {
+		e = nodes->next;
+		__slab_free(q->slab, nodes);
+		nodes = e;
+	}
+	return i == nmemb ? 0 : -1;
+}
+
+void queue_clear(Queue q, void (*__del__)(void*))
+{
+	__datastruct_elem__ *e;
+
+	while((e = q->out) != (__datastruct_elem__*) NULL) {
+		if(__del__ != (void(*)(void*)) NULL)
+			__del__(e->data);
+		q->out = e->next;
+		__slab_free(q->slab, e);
+	}
+	q->in = (__datastruct_elem__*) NULL;
+}
+#endif /* #ifdef ARRAY_STACK_QUEUE */
+
+/* ----- Deque ----- */
+#define DEQUE_MAP_START_SIZE	8
+#define __deque_slot(d, g)	((d)->map[(g) / DEQUE_BLOCK_NMEMB][(g) % DEQUE_BLOCK_NMEMB])
+
+Deque new_deque(void)
+{
+#ifdef INTERNAL_ERROR_HANDLING
+	Deque d = (Deque) xmalloc(sizeof(struct __deque__));
+	d->map = (void***) xcalloc(DEQUE_MAP_START_SIZE, sizeof(void**));
+#else
+	Deque d = (Deque) malloc(sizeof(struct __deque__));
+	if(unlikely(d == (Deque) NULL))
+		return (Deque) NULL;
+	d->map = (void***) calloc(DEQUE_MAP_START_SIZE, sizeof(void**));
+	if(unlikely(d->map == (void***) NULL)) {
+		free(d);
+		return (Deque) NULL;
+	}
+#endif /* #ifdef INTERNAL_ERROR_HANDLING */
+	d->map_size = DEQUE_MAP_START_SIZE;
+	d->start = (DEQUE_MAP_START_SIZE >> 1) * DEQUE_BLOCK_NMEMB;
+	d->nmemb = 0;
+	d->spare = (void**) NULL;
+	return d;
+}
+
+void delete_deque(Deque d, void (*__del__)(void*))
+{
+	size_t i;
+
+	if(__del__ != (void(*)(void*)) NULL)
+		for(i = 0; i < d->nmemb; i++)
+			__del__(__deque_slot(d, d->start + i));
+	for(i = 0; i < d->map_size; i++)
+		free(d->map[i]);
+	free(d->spare);
+	free(d->map);
+	free(d);
+}
+
+/* recenter used blocks in the map, doubling its size if less than half of it
+ * would be free. Returns 0 on success, -1 on failure */
+static int __deque_grow_map(Deque d)
+{
+	size_t first = d->start / DEQUE_BLOCK_NMEMB, nblocks = 0, new_size = d->map_size, new_first;
+	void ***new_map;
+
+	if(d->nmemb != 0)
+		nblocks = (d->start + d->nmemb - 1) / DEQUE_BLOCK_NMEMB - first + 1;
+	while((nblocks << 1) + 2 > new_size)
+		new_size <<= 1;
+#ifdef INTERNAL_ERROR_HANDLING
+	new_map = (void***) xcalloc(new_size, sizeof(void**));
+#else
+	new_map = (void***) calloc(new_size, sizeof(void**));
+	if(unlikely(new_map == (void***) NULL))
+		return -1;
+#endif /* #ifdef INTERNAL_ERROR_HANDLING */
+	new_first = (new_size - nblocks) >> 1;
+	memcpy(new_map + new_first, d->map + first, nblocks * sizeof(void**));
+	free(d->map);
+	d->map = new_map;
+	d->map_size = new_size;
+	d->start = new_first * DEQUE_BLOCK_NMEMB + d->start % DEQUE_BLOCK_NMEMB;
+	return 0;
+}
+
+/* make sure block holding global position g is allocated */
+static int __deque_get_block(Deque d, size_t g)
+{
+	void ***block = &d->map[g / DEQUE_BLOCK_NMEMB];
+
+	if(likely(*block != (void**) NULL))
+		return 0;
+	if(d->spare != (void**) NULL) {
+		*block = d->spare;
+		d->spare = (void**) NULL;
+		return 0;
+	}
+#ifdef INTERNAL_ERROR_HANDLING
+	*block = (void**) xmalloc(DEQUE_BLOCK_NMEMB * sizeof(void*));
+#else
+	*block = (void**) malloc(DEQUE_BLOCK_NMEMB * sizeof(void*));
+	if(unlikely(*block == (void**) NULL))
+		return -1;
+#endif /* #ifdef INTERNAL_ERROR_HANDLING */
+	return 0;
+}
+
+/* block holding global position g is no longer used */
+static void __deque_release_block(Deque d, size_t g)
+{
+	void ***block = &d->map[g / DEQUE_BLOCK_NMEMB];
+
+	if(d->spare == (void**) NULL)
+		d->spare = *block;
+	else
+		free(*block);
+	*block = (void**) NULL;
+}
+
+void *deque_push_back(Deque d, void *data)
+{
+	if(unlikely(d->start + d->nmemb == d->map_size * DEQUE_BLOCK_NMEMB)
+			&& unlikely(__deque_grow_map(d) != 0))
+		return (void*) NULL;
+	if(unlikely(__deque_get_block(d, d->start + d->nmemb) != 0))
+		return (void*) NULL;
+	__deque_slot(d, d->start + d->nmemb) = data;
+	d->nmemb++;
+	return data;
+}
+
+void *deque_push_front(Deque d, void *data)
+{
+	if(unlikely(d->start == 0) && unlikely(__deque_grow_map(d) != 0))
+		return (void*) NULL;
+	if(unlikely(__deque_get_block(d, d->start - 1) != 0))
+		return (void*) NULL;
+	d->start--;
+	d->nmemb++;
+	__deque_slot(d, d->start) = data;
+	return data;
+}
+
+void *deque_pop_back(Deque d)
+{
+	void *data = (void*) NULL;
+	size_t g;
+
+	if(likely(d->nmemb != 0)) {
+		g = d->start + --d->nmemb;
+		data = __deque_slot(d, g);
+		if(g % DEQUE_BLOCK_NMEMB == 0 || d->nmemb == 0)
+			__deque_release_block(d, g);
+	}
+	return data;
+}
+
+void *deque_pop_front(Deque d)
+{
+	void *data = (void*) NULL;
+	size_t g;
+
+	if(likely(d->nmemb != 0)) {
+		g = d->start++;
+		d->nmemb--;
+		data = __deque_slot(d, g);
+		if(g % DEQUE_BLOCK_NMEMB == DEQUE_BLOCK_NMEMB - 1 || d->nmemb == 0)
+			__deque_release_block(d, g);
+	}
+	return data;
+}
+
+void *deque_peek_back(Deque d)
+{
+	return likely(d->nmemb != 0) ? __deque_slot(d, d->start + d->nmemb - 1) : (void*) NULL;
+}
+
+void *deque_peek_front(Deque d)
+{
+	return likely(d->nmemb != 0) ? __deque_slot(d, d->start) : (void*) NULL;
+}
+
+void *deque_at(Deque d, size_t i)
+{
+	return likely(i < d->nmemb) ? __deque_slot(d, d->start + i) : (void*) NULL;
+}
+
+void deque_rewind(Deque d, DequeCursor *c)
+{
+	c->d = d;
+	c->pos = 0;
+}
+
+void deque_rewind_end(Deque d, DequeCursor *c)
+{
+	c->d = d;
+	c->pos = d->nmemb;
+}
+
+void *deque_iterate(DequeCursor *c)
+{
+	void *data = (void*) NULL;
+
+	if(c->pos < c->d->nmemb) {
+		data = __deque_slot(c->d, c->d->start + c->pos);
+		c->pos++;
+	}
+	return data;
+}
+
+void *deque_rev_iterate(DequeCursor *c)
+{
+	void *data = (void*) NULL;
+
+	if(c->pos != 0) {
+		c->pos--;
+		data = __deque_slot(c->d, c->d->start + c->pos);
+	}
+	return data;
+}
+
+void *deque_map(Deque d, void *(*__mapfunc__)(void *data, void *arg), void *arg)
+{
+	size_t g = d->start, end = d->start + d->nmemb, block_end;
+	void **block;
+
+	/* walk one block at a time rather than recomputing each slot address */
+	while(g < end) {
+		block = d->map[g / DEQUE_BLOCK_NMEMB];
+		block_end = (g / DEQUE_BLOCK_NMEMB + 1) * DEQUE_BLOCK_NMEMB;
+		if(block_end > end)
+			block_end = end;
+		for(; g < block_end; g++)
+			arg = __mapfunc__(block[g % DEQUE_BLOCK_NMEMB], arg);
+	}
+	return arg;
+}
+#undef __deque_slot
+#undef DEQUE_MAP_START_SIZE
+
+/* ----- Intrusive lists ----- */
+void ilist_init(IList *l)
+{
+	l->head.next = l->head.prev = &l->head;
+}
+
+/* link node between prev and next, which are adjacent */
+static void __ilist_link(IListNode *prev, IListNode *next, IListNode *node)
+{
+	node->prev = prev;
+	node->next = next;
+	prev->next = node;
+	next->prev = node;
+}
+
+void ilist_push_front(IList *l, IListNode *node)
+{
+	__ilist_link(&l->head, l->head.next, node);
+}
+
+void ilist_push_back(IList *l, IListNode *node)
+{
+	__ilist_link(l->head.prev, &l->head, node);
+}
+
+void ilist_insert_after(IListNode *pos, IListNode *node)
+{
+	__ilist_link(pos, pos->next, node);
+}
+
+void ilist_insert_before(IListNode *pos, IListNode *node)
+{
+	__ilist_link(pos->prev, pos, node);
+}
+
+void ilist_remove(IListNode *node)
+{
+	node->prev->next = node->next;
+	node->next->prev = node->prev;
+	node->next = node->prev = (IListNode*) NULL;
+}
+
+IListNode *ilist_pop_front(IList *l)
+{
+	IListNode *node = ilist_front(l);
+
+	if(node != (IListNode*) NULL)
+		ilist_remove(node);
+	return node;
+}
+
+IListNode *ilist_pop_back(IList *l)
+{
+	IListNode *node = ilist_back(l);
+
+	if(node != (IListNode*) NULL)
+		ilist_remove(node);
+	return node;
+}
+
+void ilist_move_front(IList *l, IListNode *node)
+{
+	node->prev->next = node->next;
+	node->next->prev = node->prev;
+	__ilist_link(&l->head, l->head.next, node);
+}
+
+void ilist_move_back(IList *l, IListNode *node)
+{
+	node->prev->next = node->next;
+	node->next->prev = node->prev;
+	__ilist_link(l->head.prev, &l->head, node);
+}
+
+void ilist_splice(IList *dst, IList *src)
+{
+	if(ilist_empty(src))
+		return;
+	src->head.next->prev = dst->head.prev;
+	dst->head.prev->next = src->head.next;
+	src->head.prev->next = &dst->head;
+	dst->head.prev = src->head.prev;
+	ilist_init(src);
+}
+
+size_t ilist_size(const IList *l)
+{
+	const IListNode *n;
+	size_t size = 0;
+
+	for(n = l->head.next; n != &l->head; n = n->next)
+		size++;
+	return size;
+}
+
+#undef istack_push
+void istack_push(IStack *s, ISListNode *node)
+{
+	node->next = *s;
+	*s = node;
+}
+
+#undef istack_pop
+ISListNode *istack_pop(IStack *s)
+{
+	ISListNode *node = *s;
+
+	if(node != (ISListNode*) NULL)
+		*s = node->next;
+	return node;
+}
+
+void iqueue_init(IQueue *q)
+{
+	q->head = q->tail = (ISListNode*) NULL;
+}
+
+void iqueue_push(IQueue *q, ISListNode *node)
+{
+	node->next = (ISListNode*) NULL;
+	if(q->head == (ISListNode*) NULL)
+		q->head = node;
+	else
+		q->tail->next = node;
+	q->tail = node;
+}
+
+ISListNode *iqueue_pop(IQueue *q)
+{
+	ISListNode *node = q->head;
+
+	if(node != (ISListNode*) NULL) {
+		q->head = node->next;
+		if(q->head == (ISListNode*) NULL)
+			q->tail = (ISListNode*) NULL;
+	}
+	return node;
+}
+
+/* ----- Bitset ----- */
+#define BITSET_WORD_BITS	64
+#define __bitset_nwords(size)	(((size) + BITSET_WORD_BITS - 1) / BITSET_WORD_BITS)
+#define __bitset_memsize(nwords)	\
+	(offsetof(__bitset_struct__, data) + ((nwords) == 0 ? 1 : (nwords)) * sizeof(uint64_t))
+#define __bitset_word(pos)	((pos) / BITSET_WORD_BITS)
+#define __bitset_mask(pos)	((uint64_t) 1 << ((pos) % BITSET_WORD_BITS))
+
+static size_t __popcount64(uint64_t w)
+{
+#ifdef __LP64__
+	return (size_t) __builtin_popcountl(w);
+#else
+	return (size_t) (__builtin_popcount((unsigned) w) + __builtin_popcount((unsigned) (w >> 32)));
+#endif /* #ifdef __LP64__ */
+}
+
+/* index of lowest bit set. w must not be 0 */
+static size_t __ctz64(uint64_t w)
+{
+#ifdef __LP64__
+	return (size_t) __builtin_ctzl(w);
+#else
+	return (uint32_t) w != 0 ? (size_t) __builtin_ctz((unsigned) w)
+		: 32 + (size_t) __builtin_ctz((unsigned) (w >> 32));
+#endif /* #ifdef __LP64__ */
+}
+
+Bitset new_bitset(size_t size)
+{
+	size_t nwords = __bitset_nwords(size);
+	Bitset b;
+#ifdef INTERNAL_ERROR_HANDLING
+	b = (Bitset) xmemalign(CACHE_LINE_SIZE, __bitset_memsize(nwords));
+#else
+	if(unlikely(posix_memalign((void**) &b, CACHE_LINE_SIZE, __bitset_memsize(nwords)) != 0)) {
+		errno = ENOMEM;
+		return (Bitset) NULL;
+	}
+#endif /* #ifdef INTERNAL_ERROR_HANDLING */
+	memset(b->data, 0, nwords * sizeof(uint64_t));
+	b->size = size;
+	b->nwords = nwords;
+	return b;
+}
+
+Bitset clone_bitset(Bitset set)
+{
+	Bitset set_clone;
+	size_t mem = __bitset_memsize(set->nwords);
+
+#ifdef INTERNAL_ERROR_HANDLING
+	set_clone = (Bitset) xmemalign(CACHE_LINE_SIZE, mem);
+#else
+	if(unlikely(posix_memalign((void**) &set_clone, CACHE_LINE_SIZE, mem) != 0)) {
+		errno = ENOMEM;
+		return (Bitset) NULL;
+	}
+#endif /* #ifdef INTERNAL_ERROR_HANDLING */
+	memcpy(set_clone, set, mem);
+
+	return set_clone;
+}
+
+int getbit(const Bitset set, size_t pos)
+{
+	if(unlikely(pos >= set->size)) {
+		errno = ERANGE;
+		return -1;
+	}
+	return (set->data[__bitset_word(pos)] & __bitset_mask(pos)) != 0;
+}
+
+int setbit(Bitset set, size_t pos)
+{
+	if(unlikely(pos >= set->size)) {
+		errno = ERANGE;
+		return -1;
+	}
+	set->data[__bitset_word(pos)] |= __bitset_mask(pos);
+	return 0;
+}
+
+int unsetbit(Bitset set, size_t pos)
+{
+	if(unlikely(pos >= set->size)) {
+		errno = ERANGE;
+		return -1;
+	}
+	set->data[__bitset_word(pos)] &= ~__bitset_mask(pos);
+	return 0;
+}
+
+int togglebit(Bitset set, size_t pos)
+{
+	if(unlikely(pos >= set->size)) {
+		errno = ERANGE;
+		return -1;
+	}
+	set->data[__bitset_word(pos)] ^= __bitset_mask(pos);
+
+	return (set->data[__bitset_word(pos)] & __bitset_mask(pos)) != 0;
+}
+
+/* set (value != 0) or unset all bits in [from, to) */
+static int __bitset_fill_range(Bitset set, size_t from, size_t to, int value)
+{
+	size_t first, last, i;
+	uint64_t first_mask, last_mask;
+
+	if(unlikely(from > to || to > set->size)) {
+		errno = ERANGE;
+		return -1;
+	}
+	if(from == to)
+		return 0;
+	first = __bitset_word(from);
+	last = __bitset_word(to - 1);
+	first_mask = ~(__bitset_mask(from) - 1);
+	last_mask = to % BITSET_WORD_BITS == 0 ? ~(uint64_t) 0 : __bitset_mask(to) - 1;
+	if(first == last)
+		first_mask &= last_mask;
+	if(value)
+		set->data[first] |= first_mask;
+	else
+		set->data[first] &= ~first_mask;
+	if(first == last)
+		return 0;
+	for(i = first + 1; i < last; i++)
+		set->data[i] = value ? ~(uint64_t) 0 : 0;
+	if(value)
+		set->data[last] |= last_mask;
+	else
+		set->data[last] &= ~last_mask;
+	return 0;
+}
+
+int bitset_set_range(Bitset set, size_t from, size_t to)
+{
+	return __bitset_fill_range(set, from, to, 1);
+}
+
+int bitset_clear_range(Bitset set, size_t from, size_t to)
+{
+	return __bitset_fill_range(set, from, to, 0);
+}
+
+void bitset_clear(Bitset set)
+{
+	memset(set->data, 0, set->nwords * sizeof(uint64_t));
+}
+
+size_t bitset_count(const Bitset set)
+{
+	size_t i, count = 0;
+
+	for(i = 0; i < set->nwords; i++)
+		count += __popcount64(set->data[i]);
+	return count;
+}
+
+/* first bit at or after pos in set, or in its complement if invert is ~0 */
+static size_t __bitset_find_next(const Bitset set, size_t pos, uint64_t invert)
+{
+	size_t i;
+	uint64_t w;
+
+	if(pos >= set->size)
+		return BITSET_NPOS;
+	i = __bitset_word(pos);
+	w = (set->data[i] ^ invert) & ~(__bitset_mask(pos) - 1);
+	while(w == 0) {
+		if(++i == set->nwords)
+			return BITSET_NPOS;
+		w = set->data[i] ^ invert;
+	}
+	pos = i * BITSET_WORD_BITS + __ctz64(w);
+	/* inverted tail bits are 1 */
+	return pos < set->size ? pos : BITSET_NPOS;
+}
+
+size_t bitset_find_next_set(const Bitset set, size_t pos)
+{
+	return __bitset_find_next(set, pos, 0);
+}
+
+size_t bitset_find_next_clear(const Bitset set, size_t pos)
+{
+	return __bitset_find_next(set, pos, ~(uint64_t) 0);
+}
+
+typedef enum { BITSET_AND, BITSET_OR, BITSET_XOR, BITSET_ANDNOT } __bitset_op__;
+
+static int __bitset_apply(Bitset dst, const Bitset src, __bitset_op__ op)
+{
+	size_t i = 0;
+#ifdef __AVX2__
+	__m256i a, b;
+#endif /* #ifdef __AVX2__ */
+
+	if(unlikely(dst->size != src->size)) {
+		errno = EINVAL;
+		return -1;
+	}
+#ifdef __AVX2__
+	/* data is aligned on CACHE_LINE_SIZE so aligned loads are safe */
+	for(; i + 4 <= dst->nwords; i += 4) {
+		a = _mm256_load_si256((const __m256i*) &dst->data[i]);
+		b = _mm256_load_si256((const __m256i*) &src->data[i]);
+		switch(op) {
+			case BITSET_AND:
+				a = _mm256_and_si256(a, b);
+				break;
+			case BITSET_OR:
+				a = _mm256_or_si256(a, b);
+				break;
+			case BITSET_XOR:
+				a = _mm256_xor_si256(a, b);
+				break;
+			case BITSET_ANDNOT:
+				/* _mm256_andnot_si256 computes ~first & second */
+				a = _mm256_andnot_si256(b, a);
+				break;
+		}
+		_mm256_store_si256((__m256i*) &dst->data[i], a);
+	}
+#endif /* #ifdef __AVX2__ */
+	for(; i < dst->nwords; i++) {
+		switch(op) {
+			case BITSET_AND:
+				dst->data[i] &= src->data[i];
+				break;
+			case BITSET_OR:
+				dst->data[i] |= src->data[i];
+				break;
+			case BITSET_XOR:
+				dst->data[i] ^= src->data[i];
+				break;
+			case BITSET_ANDNOT:
+				dst->data[i] &= ~src->data[i];
+				break;
+		}
+	}
+	return 0;
+}
+
+int bitset_and(Bitset dst, const Bitset src)
+{
+	return __bitset_apply(dst, src, BITSET_AND);
+}
+
+int bitset_or(Bitset dst, const Bitset src)
+{
+	return __bitset_apply(dst, src, BITSET_OR);
+}
+
+int bitset_xor(Bitset dst, const Bitset src)
+{
+	return __bitset_apply(dst, src, BITSET_XOR);
+}
+
+int bitset_andnot(Bitset dst, const Bitset src)
+{
+	return __bitset_apply(dst, src, BITSET_ANDNOT);
+}
+#undef __bitset_mask
+#undef __bitset_word
+#undef __bitset_memsize
+#undef __bitset_nwords
+
+/* ----- Compressed bitmap ----- */
+#define ROARING_ARRAY_MAX	4096
+#define ROARING_BITMAP_WORDS	1024
+
+enum { ROARING_ARRAY, ROARING_BITMAP, ROARING_RUN };
+
+/* values start to start + length */
+struct __roaring_run__ {
+	uint16_t start, length;
+};
+
+struct __roaring_container__ {
+	uint16_t key;
+	unsigned char type;
+	uint32_t card;
+	/* dynamic arrays, except bitmap which always has ROARING_BITMAP_WORDS words */
+	union {
+		uint16_t *array;
+		uint64_t *bitmap;
+		struct __roaring_run__ *runs;
+	} u;
+};
+
+struct __roaring_bitmap__ {
+	/* sorted by key */
+	struct __roaring_container__ *containers;
+};
+
+static void __rc_free(struct __roaring_container__ *c)
+{
+	switch(c->type) {
+		case ROARING_ARRAY:
+			array_free(c->u.array);
+			break;
+		case ROARING_BITMAP:
+			free(c->u.bitmap);
+			break;
+		case ROARING_RUN:
+			array_free(c->u.runs);
+			break;
+	}
+}
+
+static uint64_t *__rc_new_words(void)
+{
+	uint64_t *words;
+
+#ifdef INTERNAL_ERROR_HANDLING
+	words = (uint64_t*) xmemalign(CACHE_LINE_SIZE, ROARING_BITMAP_WORDS * sizeof(uint64_t));
+#else
+	if(unlikely(posix_memalign((void**) &words, CACHE_LINE_SIZE, ROARING_BITMAP_WORDS * sizeof(uint64_t)) != 0))
+		return (uint64_t*) NULL;
+#endif /* #ifdef INTERNAL_ERROR_HANDLING */
+	return words;
+}
+
+/* write the values of c as a bitmap into words */
+static void __rc_to_words(const struct __roaring_container__ *c, uint64_t *words)
+{
+	size_t i;
+	uint32_t v, end;
+
+	switch(c->type) {
+		case ROARING_ARRAY:
+			memset(words, 0, ROARING_BITMAP_WORDS * sizeof(uint64_t));
+			for(i = 0; i < array_len(c->u.array); i++)
+				words[c->u.array[i] >> 6] |= (uint64_t) 1 << (c->u.array[i] & 63);
+			break;
+		case ROARING_BITMAP:
+			memcpy(words, c->u.bitmap, ROARING_BITMAP_WORDS * sizeof(uint64_t));
+			break;
+		case ROARING_RUN:
+			memset(words, 0, ROARING_BITMAP_WORDS * sizeof(uint64_t));
+			for(i = 0; i < array_len(c->u.runs); i++) {
+				end = (uint32_t) c->u.runs[i].start + c->u.runs[i].length;
+				for(v = c->u.runs[i].start; v <= end; v++)
+					words[v >> 6] |= (uint64_t) 1 << (v & 63);
+			}
+			break;
+	}
+}
+
+/* set c (already freed) to the best of array or bitmap holding the card values
+ * set in words. Return -1 if out of memory */
+static int __rc_from_words(struct __roaring_container__ *c, const uint64_t *words, uint32_t card)
+{
+	size_t i;
+	uint64_t w;
+
+	c->card = card;
+	if(card > ROARING_ARRAY_MAX) {
+		c->type = ROARING_BITMAP;
+		c->u.bitmap = __rc_new_words();
+		if(unlikely(c->u.bitmap == (uint64_t*) NULL))
+			return -1;
+		memcpy(c->u.bitmap, words, ROARING_BITMAP_WORDS * sizeof(uint64_t));
+		return 0;
+	}
+	c->type = ROARING_ARRAY;
+	c->u.array = (uint16_t*) NULL;
+	if(array_reserve(c->u.array, card) != 0)
+		return -1;
+	for(i = 0; i < ROARING_BITMAP_WORDS; i++)
+		for(w = words[i]; w != 0; w &= w - 1)
+			(void) array_push(c->u.array, (uint16_t) ((i << 6) + __ctz64(w)));
+	return 0;
+}
+
+static uint32_t __rc_words_card(const uint64_t *words)
+{
+	size_t i;
+	uint32_t card = 0;
+
+	for(i = 0; i < ROARING_BITMAP_WORDS; i++)
+		card += (uint32_t) __popcount64(words[i]);
+	return card;
+}
+
+/* turn a run container into an array or bitmap before modifying it */
+static int __rc_unrun(struct __roaring_container__ *c)
+{
+	uint64_t words[ROARING_BITMAP_WORDS];
+	struct __roaring_container__ tmp;
+
+	__rc_to_words(c, words);
+	if(__rc_from_words(&tmp, words, c->card) != 0) {
+		__rc_free(&tmp);
+		return -1;
+	}
+	tmp.key = c->key;
+	__rc_free(c);
+	*c = tmp;
+	return 0;
+}
+
+static int __rc_clone(struct __roaring_container__ *dst, const struct __roaring_container__ *src)
+{
+	*dst = *src;
+	switch(src->type) {
+		case ROARING_ARRAY:
+			dst->u.array = (uint16_t*) NULL;
+			if(array_reserve(dst->u.array, array_len(src->u.array)) != 0)
+				return -1;
+			memcpy(dst->u.array, src->u.array, array_len(src->u.array) * sizeof(uint16_t));
+			__array_header(dst->u.array)->nmemb = array_len(src->u.array);
+			break;
+		case ROARING_BITMAP:
+			dst->u.bitmap = __rc_new_words();
+			if(unlikely(dst->u.bitmap == (uint64_t*) NULL))
+				return -1;
+			memcpy(dst->u.bitmap, src->u.bitmap, ROARING_BITMAP_WORDS * sizeof(uint64_t));
+			break;
+		case ROARING_RUN:
+			dst->u.runs = (struct __roaring_run__*) NULL;
+			if(array_reserve(dst->u.runs, array_len(src->u.runs)) != 0)
+				return -1;
+			memcpy(dst->u.runs, src->u.runs, array_len(src->u.runs) * sizeof(struct __roaring_run__));
+			__array_header(dst->u.runs)->nmemb = array_len(src->u.runs);
+			break;
+	}
+	return 0;
+}
+
+/* index of first element of array >= v */
+static size_t __rc_array_lower_bound(const uint16_t *array, uint16_t v)
+{
+	size_t lo = 0, hi = array_len(array), mid;
+
+	while(lo < hi) {
+		mid = (lo + hi) >> 1;
+		if(array[mid] < v)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+/* index of first run starting after v */
+static size_t __rc_run_upper_bound(const struct __roaring_run__ *runs, uint16_t v)
+{
+	size_t lo = 0, hi = array_len(runs), mid;
+
+	while(lo < hi) {
+		mid = (lo + hi) >> 1;
+		if(runs[mid].start <= v)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+static BOOL_TYPE __rc_contains(const struct __roaring_container__ *c, uint16_t v)
+{
+	size_t i;
+
+	switch(c->type) {
+		case ROARING_ARRAY:
+			i = __rc_array_lower_bound(c->u.array, v);
+			return i < array_len(c->u.array) && c->u.array[i] == v;
+		case ROARING_BITMAP:
+			return (c->u.bitmap[v >> 6] >> (v & 63)) & 1;
+		default:
+			i = __rc_run_upper_bound(c->u.runs, v);
+			return i > 0 && v <= (uint32_t) c->u.runs[i - 1].start + c->u.runs[i - 1].length;
+	}
+}
+
+/* number of values <= v in c */
+static uint32_t __rc_rank(const struct __roaring_container__ *c, uint16_t v)
+{
+	size_t i, n;
+	uint32_t rank = 0;
+
+	switch(c->type) {
+		case ROARING_ARRAY:
+			i = __rc_array_lower_bound(c->u.array, v);
+			return (uint32_t) i + (i < array_len(c->u.array) && c->u.array[i] == v);
+		case ROARING_BITMAP:
+			for(i = 0; i < (size_t) (v >> 6); i++)
+				rank += (uint32_t) __popcount64(c->u.bitmap[i]);
+			/* shifting by 64 is undefined */
+			return rank + (uint32_t) __popcount64(c->u.bitmap[i]
+					& ((((uint64_t) 1 << (v & 63)) << 1) - 1));
+		default:
+			n = __rc_run_upper_bound(c->u.runs, v);
+			for(i = 0; i < n; i++)
+				rank += (uint32_t) c->u.runs[i].length + 1;
+			if(n > 0 && v < (uint32_t) c->u.runs[n - 1].start + c->u.runs[n - 1].length)
+				rank -= (uint32_t) c->u.runs[n - 1].start + c->u.runs[n - 1].length - v;
+			return rank;
+	}
+}
+
+/* i-th smallest value of c, i < c->card */
+static uint16_t __rc_select(const struct __roaring_container__ *c, uint32_t i)
+{
+	size_t j;
+	uint64_t w;
+	uint32_t n;
+
+	switch(c->type) {
+		case ROARING_ARRAY:
+			return c->u.array[i];
+		case ROARING_BITMAP:
+			for(j = 0; ; j++) {
+				n = (uint32_t) __popcount64(c->u.bitmap[j]);
+				if(i < n)
+					break;
+				i -= n;
+			}
+			for(w = c->u.bitmap[j]; i > 0; i--)
+				w &= w - 1;
+			return (uint16_t) ((j << 6) + __ctz64(w));
+		default:
+			for(j = 0; i > c->u.runs[j].length; j++)
+				i -= (uint32_t) c->u.runs[j].length + 1;
+			return (uint16_t) (c->u.runs[j].start + i);
+	}
+}
+
+RoaringBitmap new_roaring_bitmap(void)
+{
+	RoaringBitmap r;
+
+#ifdef INTERNAL_ERROR_HANDLING
+	r = (RoaringBitmap) xmalloc(sizeof(struct __roaring_bitmap__));
+#else
+	r = (RoaringBitmap) malloc(sizeof(struct __roaring_bitmap__));
+	if(unlikely(r == (RoaringBitmap) NULL))
+		return (RoaringBitmap) NULL;
+#endif /* #ifdef INTERNAL_ERROR_HANDLING */
+	r->containers = (struct __roaring_container__*) NULL;
+	return r;
+}
+
+void delete_roaring_bitmap(RoaringBitmap r)
+{
+	size_t i;
+
+	for(i = 0; i < array_len(r->containers); i++)
+		__rc_free(&r->containers[i]);
+	array_free(r->containers);
+	free(r);
+}
+
+RoaringBitmap roaring_clone(const RoaringBitmap r)
+{
+	RoaringBitmap clone = new_roaring_bitmap();
+	struct __roaring_container__ c;
+	size_t i;
+
+#ifndef INTERNAL_ERROR_HANDLING
+	if(unlikely(clone == (RoaringBitmap) NULL))
+		return (RoaringBitmap) NULL;
+#endif /* #ifndef INTERNAL_ERROR_HANDLING */
+	if(array_reserve(clone->containers, array_len(r->containers)) != 0)
+		goto error;
+	for(i = 0; i < array_len(r->containers); i++) {
+		if(__rc_clone(&c, &r->containers[i]) != 0) {
+			__rc_free(&c);
+			goto error;
+		}
+		(void) array_push(clone->containers, c);
+	}
+	return clone;
+error:
+	delete_roaring_bitmap(clone);
+	return (RoaringBitmap) NULL;
+}
+
+/* index of container with key, or where to insert it if *found is false */
+static size_t __roaring_find(const RoaringBitmap r, uint16_t key, BOOL_TYPE *found)
+{
+	size_t lo = 0, hi = array_len(r->containers), mid;
+
+	while(lo < hi) {
+		mid = (lo + hi) >> 1;
+		if(r->containers[mid].key < key)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	*found = lo < array_len(r->containers) && r->containers[lo].key == key;
+	return lo;
+}
+
+int roaring_add(RoaringBitmap r, uint32_t x)
+{
+	uint16_t key = (uint16_t) (x >> 16), v = (uint16_t) x;
+	struct __roaring_container__ *c, nc;
+	uint64_t words[ROARING_BITMAP_WORDS];
+	BOOL_TYPE found;
+	size_t i = __roaring_find(r, key, &found);
+
+	if( ! found) {
+		nc.key = key;
+		nc.type = ROARING_ARRAY;
+		nc.card = 0;
+		nc.u.array = (uint16_t*) NULL;
+		if(array_insert(r->containers, i, nc) != 0)
+			return -1;
+	}
+	c = &r->containers[i];
+	if(c->type == ROARING_RUN) {
+		if(__rc_contains(c, v))
+			return 0;
+		if(__rc_unrun(c) != 0)
+			return -1;
+	}
+	if(c->type == ROARING_BITMAP) {
+		if((c->u.bitmap[v >> 6] >> (v & 63)) & 1)
+			return 0;
+		c->u.bitmap[v >> 6] |= (uint64_t) 1 << (v & 63);
+		c->card++;
+		return 1;
+	}
+	i = __rc_array_lower_bound(c->u.array, v);
+	if(i < array_len(c->u.array) && c->u.array[i] == v)
+		return 0;
+	if(c->card == ROARING_ARRAY_MAX) {
+		__rc_to_words(c, words);
+		words[v >> 6] |= (uint64_t) 1 << (v & 63);
+		nc.key = key;
+		if(__rc_from_words(&nc, words, c->card + 1) != 0) {
+			__rc_free(&nc);
+			return -1;
+		}
+		__rc_free(c);
+		*c = nc;
+		return 1;
+	}
+	if(array_insert(c->u.array, i, v) != 0) {
+		if(c->card == 0)
+			array_erase(r->containers, (size_t) (c - r->containers));
+		return -1;
+	}
+	c->card++;
+	return 1;
+}
+
+int roaring_remove(RoaringBitmap r, uint32_t x)
+{
+	uint16_t key = (uint16_t) (x >> 16), v = (uint16_t) x;
+	struct __roaring_container__ *c, nc;
+	BOOL_TYPE found;
+	size_t i = __roaring_find(r, key, &found);
+
+	if( ! found)
+		return 0;
+	c = &r->containers[i];
+	if( ! __rc_contains(c, v))
+		return 0;
+	if(c->card == 1) {
+		__rc_free(c);
+		array_erase(r->containers, i);
+		return 1;
+	}
+	if(c->type == ROARING_RUN && __rc_unrun(c) != 0)
+		return -1;
+	if(c->type == ROARING_ARRAY) {
+		array_erase(c->u.array, __rc_array_lower_bound(c->u.array, v));
+		c->card--;
+		return 1;
+	}
+	c->u.bitmap[v >> 6] &= ~((uint64_t) 1 << (v & 63));
+	if(--c->card == ROARING_ARRAY_MAX) {
+		nc.key = key;
+		if(__rc_from_words(&nc, c->u.bitmap, c->card) != 0) {
+			/* leaving a bitmap is fine */
+			__rc_free(&nc);
+			return 1;
+		}
+		__rc_free(c);
+		*c = nc;
+	}
+	return 1;
+}
+
+BOOL_TYPE roaring_contains(const RoaringBitmap r, uint32_t x)
+{
+	BOOL_TYPE found;
+	size_t i = __roaring_find(r, (uint16_t) (x >> 16), &found);
+
+	return found && __rc_contains(&r->containers[i], (uint16_t) x);
+}
+
+uint64_t roaring_cardinality(const RoaringBitmap r)
+{
+	uint64_t card = 0;
+	size_t i;
+
+	for(i = 0; i < array_len(r->containers); i++)
+		card += r->containers[i].card;
+	return card;
+}
+
+uint64_t roaring_rank(const RoaringBitmap r, uint32_t x)
+{
+	uint16_t key = (uint16_t) (x >> 16);
+	uint64_t rank = 0;
+	size_t i;
+
+	for(i = 0; i < array_len(r->containers) && r->containers[i].key < key; i++)
+		rank += r->containers[i].card;
+	if(i < array_len(r->containers) && r->containers[i].key == key)
+		rank += __rc_rank(&r->containers[i], (uint16_t) x);
+	return rank;
+}
+
+int roaring_select(const RoaringBitmap r, uint64_t i, uint32_t *x)
+{
+	size_t j;
+
+	for(j = 0; j < array_len(r->containers); j++) {
+		if(i < r->containers[j].card) {
+			*x = ((uint32_t) r->containers[j].key << 16) | __rc_select(&r->containers[j], (uint32_t) i);
+			return 0;
+		}
+		i -= r->containers[j].card;
+	}
+	return -1;
+}
+
+void roaring_rewind(RoaringBitmap r, RoaringCursor *c)
+{
+	c->r = r;
+	c->container = 0;
+	c->index = c->next = 0;
+}
+
+BOOL_TYPE roaring_iterate(RoaringCursor *c, uint32_t *x)
+{
+	struct __roaring_container__ *rc;
+	uint64_t w;
+	uint32_t v;
+
+	for(; c->container < array_len(c->r->containers); c->container++, c->index = c->next = 0) {
+		rc = &c->r->containers[c->container];
+		switch(rc->type) {
+			case ROARING_ARRAY:
+				if(c->index < rc->card) {
+					v = rc->u.array[c->index++];
+					goto found;
+				}
+				break;
+			case ROARING_BITMAP:
+				/* next is the next value to look at */
+				while(c->next < 65536) {
+					w = rc->u.bitmap[c->next >> 6] & (~(uint64_t) 0 << (c->next & 63));
+					if(w != 0) {
+						v = (c->next & ~(uint32_t) 63) + (uint32_t) __ctz64(w);
+						c->next = v + 1;
+						goto found;
+					}
+					c->next = (c->next & ~(uint32_t) 63) + 64;
+				}
+				break;
+			case ROARING_RUN:
+				/* index is the current run, next the offset within it */
+				if(c->index < array_len(rc->u.runs)) {
+					v = rc->u.runs[c->index].start + c->next;
+					if(c->next++ == rc->u.runs[c->index].length) {
+						c->index++;
+						c->next = 0;
+					}
+					goto found;
+				}
+				break;
+		}
+	}
+	return BOOL_FALSE;
+found:
+	*x = ((uint32_t) rc->key << 16) | v;
+	return BOOL_TRUE;
+}
+
+typedef enum { ROARING_AND, ROARING_OR, ROARING_XOR, ROARING_ANDNOT } __roaring_op__;
+
+/* merge 2 array containers into result. Return -1 if out of memory */
+static int __rc_array_op(const uint16_t *a, const uint16_t *b, __roaring_op__ op, uint16_t **result)
+{
+	size_t i = 0, j = 0, na = array_len(a), nb = array_len(b);
+
+	*result = (uint16_t*) NULL;
+	if(array_reserve(*result, op == ROARING_AND ? (na < nb ? na : nb) : op == ROARING_ANDNOT ? na : na + nb) != 0)
+		return -1;
+	while(i < na && j < nb) {
+		if(a[i] < b[j]) {
+			if(op != ROARING_AND)
+				(void) array_push(*result, a[i]);
+			i++;
+		} else if(a[i] > b[j]) {
+			if(op == ROARING_OR || op == ROARING_XOR)
+				(void) array_push(*result, b[j]);
+			j++;
+		} else {
+			if(op == ROARING_AND || op == ROARING_OR)
+				(void) array_push(*result, a[i]);
+			i++;
+			j++;
+		}
+	}
+	if(op != ROARING_AND)
+		for(; i < na; i++)
+			(void) array_push(*result, a[i]);
+	if(op == ROARING_OR || op == ROARING_XOR)
+		for(; j < nb; j++)
+			(void) array_push(*result, b[j]);
+	return 0;
+}
+
+/* result = a OP b for containers with the same key. result->card is 0 if empty */
+static int __rc_op(const struct __roaring_container__ *a, const struct __roaring_container__ *b,
+		__roaring_op__ op, struct __roaring_container__ *result)
+{
+	uint64_t wa[ROARING_BITMAP_WORDS], wb[ROARING_BITMAP_WORDS];
+	uint16_t *array;
+	size_t i;
+
+	result->key = a->key;
+	result->type = ROARING_ARRAY;
+	result->u.array = (uint16_t*) NULL;
+	if(a->type == ROARING_ARRAY && b->type == ROARING_ARRAY) {
+		if(__rc_array_op(a->u.array, b->u.array, op, &array) != 0) {
+			array_free(array);
+			return -1;
+		}
+		if(array_len(array) <= ROARING_ARRAY_MAX) {
+			result->u.array = array;
+			result->card = (uint32_t) array_len(array);
+			return 0;
+		}
+		/* union too big for an array */
+		memset(wa, 0, sizeof(wa));
+		for(i = 0; i < array_len(array); i++)
+			wa[array[i] >> 6] |= (uint64_t) 1 << (array[i] & 63);
+		array_free(array);
+		return __rc_from_words(result, wa, __rc_words_card(wa));
+	}
+	if(a->type == ROARING_ARRAY && b->type == ROARING_BITMAP && (op == ROARING_AND || op == ROARING_ANDNOT)) {
+		/* filter a's values */
+		if(array_reserve(result->u.array, array_len(a->u.array)) != 0)
+			return -1;
+		for(i = 0; i < array_len(a->u.array); i++)
+			if((int) ((b->u.bitmap[a->u.array[i] >> 6] >> (a->u.array[i] & 63)) & 1) == (op == ROARING_AND))
+				(void) array_push(result->u.array, a->u.array[i]);
+		result->card = (uint32_t) array_len(result->u.array);
+		return 0;
+	}
+	__rc_to_words(a, wa);
+	__rc_to_words(b, wb);
+	for(i = 0; i < ROARING_BITMAP_WORDS; i++)
+		switch(op) {
+			case ROARING_AND:
+				wa[i] &= wb[i];
+				break;
+			case ROARING_OR:
+				wa[i] |= wb[i];
+				break;
+			case ROARING_XOR:
+				wa[i] ^= wb[i];
+				break;
+			case ROARING_ANDNOT:
+				wa[i] &= ~wb[i];
+				break;
+		}
+	return __rc_from_words(result, wa, __rc_words_card(wa));
+}
+
+static RoaringBitmap __roaring_op(const RoaringBitmap a, const RoaringBitmap b, __roaring_op__ op)
+{
+	RoaringBitmap result = new_roaring_bitmap();
+	size_t i = 0, j = 0, na = array_len(a->containers), nb = array_len(b->containers);
+	struct __roaring_container__ c;
+	int ret;
+
+#ifndef INTERNAL_ERROR_HANDLING
+	if(unlikely(result == (RoaringBitmap) NULL))
+		return (RoaringBitmap) NULL;
+#endif /* #ifndef INTERNAL_ERROR_HANDLING */
+	while(i < na || j < nb) {
+		if(j == nb || (i < na && a->containers[i].key < b->containers[j].key)) {
+			/* only in a */
+			if(op == ROARING_AND) {
+				i++;
+				continue;
+			}
+			ret = __rc_clone(&c, &a->containers[i++]);
+		} else if(i == na || b->containers[j].key < a->containers[i].key) {
+			if(op == ROARING_AND || op == ROARING_ANDNOT) {
+				j++;
+				continue;
+			}
+			ret = __rc_clone(&c, &b->containers[j++]);
+		} else {
+			ret = __rc_op(&a->containers[i++], &b->containers[j++], op, &c);
+		}
+		if(ret != 0 || (c.card != 0 && array_push(result->containers, c) != 0)) {
+			__rc_free(&c);
+			delete_roaring_bitmap(result);
+			return (RoaringBitmap) NULL;
+		}
+		if(c.card == 0)
+			__rc_free(&c);
+	}
+	return result;
+}
+
+RoaringBitmap roaring_and(const RoaringBitmap a, const RoaringBitmap b)
+{
+	return __roaring_op(a, b, ROARING_AND);
+}
+
+RoaringBitmap roaring_or(const RoaringBitmap a, const RoaringBitmap b)
+{
+	return __roaring_op(a, b, ROARING_OR);
+}
+
+RoaringBitmap roaring_xor(const RoaringBitmap a, const RoaringBitmap b)
+{
+	return __roaring_op(a, b, ROARING_XOR);
+}
+
+RoaringBitmap roaring_andnot(const RoaringBitmap a, const RoaringBitmap b)
+{
+	return __roaring_op(a, b, ROARING_ANDNOT);
+}
+
+/* replace c with a run container if that takes less memory */
+static int __rc_run_optimize(struct __roaring_container__ *c, const uint64_t *words)
+{
+	size_t i, nruns = 0, size;
+	uint64_t w, prev = 0, starts, ends;
+	struct __roaring_run__ run, *runs = (struct __roaring_run__*) NULL;
+
+	for(i = 0; i < ROARING_BITMAP_WORDS; prev = words[i++])
+		nruns += __popcount64(words[i] & ~((words[i] << 1) | (prev >> 63)));
+	size = c->type == ROARING_ARRAY ? c->card * sizeof(uint16_t) : ROARING_BITMAP_WORDS * sizeof(uint64_t);
+	if(nruns * sizeof(struct __roaring_run__) >= size)
+		return 0;
+	if(array_reserve(runs, nruns) != 0)
+		return -1;
+	/* a run starts at bits set whose predecessor is not, and ends at bits set
+	 * whose successor is not */
+	for(i = 0, prev = 0; i < ROARING_BITMAP_WORDS; prev = words[i++]) {
+		w = words[i];
+		starts = w & ~((w << 1) | (prev >> 63));
+		ends = w & ~((w >> 1) | (i + 1 < ROARING_BITMAP_WORDS ? words[i + 1] << 63 : 0));
+		while(starts != 0 || ends != 0) {
+			if(starts != 0 && (ends == 0 || __ctz64(starts) <= __ctz64(ends))) {
+				run.start = (uint16_t) ((i << 6) + __ctz64(starts));
+				starts &= starts - 1;
+			} else {
+				run.length = (uint16_t) ((i << 6) + __ctz64(ends) - run.start);
+				ends &= ends - 1;
+				(void) array_push(runs, run);
+			}
+		}
+	}
+	__rc_free(c);
+	c->type = ROARING_RUN;
+	c->u.runs = runs;
+	return 0;
+}
+
+int roaring_run_optimize(RoaringBitmap r)
+{
+	uint64_t words[ROARING_BITMAP_WORDS];
+	size_t i;
+
+	for(i = 0; i < array_len(r->containers); i++) {
+		if(r->containers[i].type == ROARING_RUN)
+			continue;
+		__rc_to_words(&r->containers[i], words);
+		if(__rc_run_optimize(&r->containers[i], words) != 0)
+			return -1;
+	}
+	return 0;
+}
+
+RoaringBitmap roaring_from_bitset(const Bitset b)
+{
+	RoaringBitmap r;
+	uint64_t words[ROARING_BITMAP_WORDS];
+	struct __roaring_container__ c;
+	size_t chunk, n;
+	uint32_t card;
+
+#if SIZE_MAX > UINT32_MAX
+	/* with a 32 bit size_t, all positions fit */
+	if(b->size > (size_t) UINT32_MAX + 1 && bitset_find_next_set(b, (size_t) UINT32_MAX + 1) != BITSET_NPOS) {
+		errno = EINVAL;
+		return (RoaringBitmap) NULL;
+	}
+#endif /* #if SIZE_MAX > UINT32_MAX */
+	r = new_roaring_bitmap();
+#ifndef INTERNAL_ERROR_HANDLING
+	if(unlikely(r == (RoaringBitmap) NULL))
+		return (RoaringBitmap) NULL;
+#endif /* #ifndef INTERNAL_ERROR_HANDLING */
+	for(chunk = 0; chunk * ROARING_BITMAP_WORDS < b->nwords && chunk < 65536; chunk++) {
+		n = b->nwords - chunk * ROARING_BITMAP_WORDS;
+		if(n > ROARING_BITMAP_WORDS)
+			n = ROARING_BITMAP_WORDS;
+		memset(words, 0, sizeof(words));
+		memcpy(words, &b->data[chunk * ROARING_BITMAP_WORDS], n * sizeof(uint64_t));
+		card = __rc_words_card(words);
+		if(card == 0)
+			continue;
+		c.key = (uint16_t) chunk;
+		if(__rc_from_words(&c, words, card) != 0 || __rc_run_optimize(&c, words) != 0
+				|| array_push(r->containers, c) != 0) {
+			__rc_free(&c);
+			delete_roaring_bitmap(r);
+			return (RoaringBitmap) NULL;
+		}
+	}
+	return r;
+}
+
+Bitset roaring_to_bitset(const RoaringBitmap r)
+{
+	uint64_t words[ROARING_BITMAP_WORDS];
+	size_t i, n, nc = array_len(r->containers), offset;
+	uint32_t max = 0;
+	Bitset b;
+
+	if(nc > 0)
+		max = ((uint32_t) r->containers[nc - 1].key << 16)
+			| __rc_select(&r->containers[nc - 1], r->containers[nc - 1].card - 1);
+	b = new_bitset(nc > 0 ? (size_t) max + 1 : 0);
+#ifndef INTERNAL_ERROR_HANDLING
+	if(unlikely(b == (Bitset) NULL))
+		return (Bitset) NULL;
+#endif /* #ifndef INTERNAL_ERROR_HANDLING */
+	for(i = 0; i < nc; i++) {
+		__rc_to_words(&r->containers[i], words);
+		offset = (size_t) r->containers[i].key * ROARING_BITMAP_WORDS;
+		/* words past the highest value are 0 */
+		n = b->nwords - offset < ROARING_BITMAP_WORDS ? b->nwords - offset : ROARING_BITMAP_WORDS;
+		memcpy(&b->data[offset], words, n * sizeof(uint64_t));
+	}
+	return b;
+}
+#undef ROARING_BITMAP_WORDS
+#undef ROARING_ARRAY_MAX
+
+/* ----- HashMap ----- */
+#define HASHMAP_GROUP_SIZE	16
+#define HASHMAP_MIN_CAPACITY	HASHMAP_GROUP_SIZE
+#define HASHMAP_CTRL_EMPTY	((byte) 0x80)
+#define HASHMAP_NPOS		((size_t) -1)
+
+struct __hashmap__ {
+	/* capacity + HASHMAP_GROUP_SIZE control bytes. The first group is
+	 * mirrored at the end so probes never need to wrap around */
+	byte *ctrl;
+	byte *slots;
+	size_t capacity, nmemb, growth_left;
+	/* 0 for pointers */
+	size_t key_size, value_size;
+	size_t value_offset, slot_size;
+	size_t (*hash)(const void *key);
+	int (*eq)(const void *k1, const void *k2);
+};
+
+size_t hash_bytes(const void *data, size_t len)
+{
+	const byte *p = (const byte*) data;
+	uint64_t h = UINT64_C(0x9e3779b97f4a7c15) ^ ((uint64_t) len * UINT64_C(0xc2b2ae3d27d4eb4f));
+	uint64_t w;
+
+	for(; len >= 8; len -= 8, p += 8) {
+		memcpy(&w, p, 8);
+		w *= UINT64_C(0x87c37b91114253d5);
+		w = (w << 31) | (w >> 33);
+		h ^= w * UINT64_C(0x4cf5ad432745937f);
+		h = ((h << 27) | (h >> 37)) * 5 + 0x52dce729;
+	}
+	if(len > 0) {
+		w = 0;
+		memcpy(&w, p, len);
+		h ^= w * UINT64_C(0x87c37b91114253d5);
+	}
+	return (size_t) __hash_mix(h);
+}
+
+size_t hash_string(const void *str)
+{
+	return hash_bytes(str, strlen((const char*) str));
+}
+
+int string_equal(const void *s1, const void *s2)
+{
+	return strcmp((const char*) s1, (const char*) s2) == 0;
+}
+
+/* where key or value passed by the user is stored in a slot */
+#define __hm_slot(m, i)	((m)->slots + (i) * (m)->slot_size)
+/* key or value as handed out to the user and callbacks */
+#define __hm_key(m, slot)	((m)->key_size == 0 ? *(void**) (slot) : (void*) (slot))
+#define __hm_value(m, slot)	((m)->value_size == 0 ? *(void**) ((slot) + (m)->value_offset) \
+					: (void*) ((slot) + (m)->value_offset))
+
+static size_t __hm_hash(const HashMap m, const void *key)
+{
+	if(m->hash != (size_t(*)(const void*)) NULL)
+		return m->hash(key);
+	if(m->key_size == 0)
+		return (size_t) (uintptr_t) key;
+	return hash_bytes(key, m->key_size);
+}
+
+static int __hm_eq(const HashMap m, const void *k1, const void *k2)
+{
+	if(m->eq != (int(*)(const void*, const void*)) NULL)
+		return m->eq(k1, k2);
+	if(m->key_size == 0)
+		return k1 == k2;
+	return memcmp(k1, k2, m->key_size) == 0;
+}
+
+/* bitmasks of control bytes in the group starting at ctrl which are equal to
+ * h2, resp. empty */
+static unsigned __hm_group_match(const byte *ctrl, byte h2)
+{
+#ifdef __SSE2__
+	__m128i g = _mm_loadu_si128((const __m128i*) ctrl);
+	return (unsigned) _mm_movemask_epi8(_mm_cmpeq_epi8(g, _mm_set1_epi8((char) h2)));
+#else
+	unsigned i, mask = 0;
+
+	for(i = 0; i < HASHMAP_GROUP_SIZE; i++)
+		mask |= (unsigned) (ctrl[i] == h2) << i;
+	return mask;
+#endif /* #ifdef __SSE2__ */
+}
+
+static unsigned __hm_group_empty(const byte *ctrl)
+{
+#ifdef __SSE2__
+	return (unsigned) _mm_movemask_epi8(_mm_loadu_si128((const __m128i*) ctrl));
+#else
+	unsigned i, mask = 0;
+
+	for(i = 0; i < HASHMAP_GROUP_SIZE; i++)
+		mask |= (unsigned) (ctrl[i] >> 7) << i;
+	return mask;
+#endif /* #ifdef __SSE2__ */
+}
+
+static void __hm_set_ctrl(HashMap m, size_t i, byte c)
+{
+	m->ctrl[i] = c;
+	if(i < HASHMAP_GROUP_SIZE)
+		m->ctrl[m->capacity + i] = c;
+}
+
+/* home slot is given by the low bits of the mixed hash, control byte by the
+ * top 7 bits */
+#define __hm_home(m, h)	((size_t) (h) & ((m)->capacity - 1))
+#define __hm_h2(h)	((byte) ((h) >> 57))
+
+static size_t __hm_find(const HashMap m, const void *key, uint64_t h)
+{
+	size_t mask = m->capacity - 1, pos = __hm_home(m, h), i;
+	unsigned match;
+	byte *slot;
+
+	do {
+		match = __hm_group_match(m->ctrl + pos, __hm_h2(h));
+		while(match != 0) {
+			i = (pos + (size_t) __builtin_ctz(match)) & mask;
+			slot = __hm_slot(m, i);
+			if(__hm_eq(m, key, __hm_key(m, slot)))
+				return i;
+			match &= match - 1;
+		}
+		if(__hm_group_empty(m->ctrl + pos) != 0)
+			return HASHMAP_NPOS;
+		pos = (pos + HASHMAP_GROUP_SIZE) & mask;
+	} while(BOOL_TRUE);
+}
+
+/* first empty slot at or after home slot of h */
+static size_t __hm_find_empty(const HashMap m, uint64_t h)
+{
+	size_t mask = m->capacity - 1, pos = __hm_home(m, h);
+	unsigned empty;
+
+	while((empty = __hm_group_empty(m->ctrl + pos)) == 0)
+		pos = (pos + HASHMAP_GROUP_SIZE) & mask;
+	return (pos + (size_t) __builtin_ctz(empty)) & mask;
+}
+
+/* allocate ctrl and slots for capacity elements, all empty */
+static int __hm_alloc(HashMap m, size_t capacity)
+{
+	size_t slots_size = capacity * m->slot_size;
+	byte *mem;
+
+#ifdef INTERNAL_ERROR_HANDLING
+	mem = (byte*) xmalloc(slots_size + capacity + HASHMAP_GROUP_SIZE);
+#else
+	mem = (byte*) malloc(slots_size + capacity + HASHMAP_GROUP_SIZE);
+	if(unlikely(mem == (byte*) NULL))
+		return -1;
+#endif /* #ifdef INTERNAL_ERROR_HANDLING */
+	m->slots = mem;
+	m->ctrl = mem + slots_size;
+	memset(m->ctrl, HASHMAP_CTRL_EMPTY, capacity + HASHMAP_GROUP_SIZE);
+	m->capacity = capacity;
+	/* keep load factor under 7/8 */
+	m->growth_left = capacity - capacity / 8 - m->nmemb;
+	return 0;
+}
+
+static int __hm_rehash(HashMap m, size_t capacity)
+{
+	byte *old_ctrl = m->ctrl, *old_slots = m->slots, *slot;
+	size_t old_capacity = m->capacity, i, j;
+	uint64_t h;
+
+	if(__hm_alloc(m, capacity) != 0)
+		return -1;
+	for(i = 0; i < old_capacity; i++) {
+		if(old_ctrl[i] & HASHMAP_CTRL_EMPTY)
+			continue;
+		slot = old_slots + i * m->slot_size;
+		h = __hash_mix(__hm_hash(m, __hm_key(m, slot)));
+		j = __hm_find_empty(m, h);
+		__hm_set_ctrl(m, j, __hm_h2(h));
+		memcpy(__hm_slot(m, j), slot, m->slot_size);
+	}
+	free(old_slots);
+	return 0;
+}
+
+HashMap new_hashmap(size_t key_size, size_t value_size,
+		size_t (*hash)(const void *key), int (*eq)(const void *k1, const void *k2))
+{
+	HashMap m;
+	size_t align = sizeof(void*);
+
+#ifdef INTERNAL_ERROR_HANDLING
+	m = (HashMap) xmalloc(sizeof(struct __hashmap__));
+#else
+	m = (HashMap) malloc(sizeof(struct __hashmap__));
+	if(unlikely(m == (HashMap) NULL))
+		return (HashMap) NULL;
+#endif /* #ifdef INTERNAL_ERROR_HANDLING */
+	m->key_size = key_size;
+	m->value_size = value_size;
+	m->hash = hash;
+	m->eq = eq;
+	if(key_size == 0)
+		key_size = sizeof(void*);
+	if(value_size == 0)
+		value_size = sizeof(void*);
+	if(align < sizeof(uint64_t))
+		align = sizeof(uint64_t);
+	m->value_offset = (key_size + align - 1) / align * align;
+	m->slot_size = (m->value_offset + value_size + align - 1) / align * align;
+	m->nmemb = 0;
+	if(__hm_alloc(m, HASHMAP_MIN_CAPACITY) != 0) {
+		free(m);
+		return (HashMap) NULL;
+	}
+	return m;
+}
+
+void delete_hashmap(HashMap m, void (*__del_key__)(void*), void (*__del_value__)(void*))
+{
+	size_t i;
+	byte *slot;
+
+	if(__del_key__ != (void(*)(void*)) NULL || __del_value__ != (void(*)(void*)) NULL)
+		for(i = 0; i < m->capacity; i++) {
+			if(m->ctrl[i] & HASHMAP_CTRL_EMPTY)
+				continue;
+			slot = __hm_slot(m, i);
+			if(__del_key__ != (void(*)(void*)) NULL)
+				__del_key__(__hm_key(m, slot));
+			if(__del_value__ != (void(*)(void*)) NULL)
+				__del_value__(__hm_value(m, slot));
+		}
+	free(m->slots);
+	free(m);
+}
+
+/* NULL is a valid pointer key, hence store_key */
+static void __hm_store(HashMap m, byte *slot, BOOL_TYPE store_key, const void *key, const void *value)
+{
+	if(store_key) {
+		if(m->key_size == 0)
+			*(const void**) slot = key;
+		else
+			memcpy(slot, key, m->key_size);
+	}
+	if(m->value_size == 0)
+		*(const void**) (slot + m->value_offset) = value;
+	else if(value != (const void*) NULL)
+		memcpy(slot + m->value_offset, value, m->value_size);
+	else
+		memset(slot + m->value_offset, 0, m->value_size);
+}
+
+int hashmap_put(HashMap m, const void *key, const void *value)
+{
+	uint64_t h = __hash_mix(__hm_hash(m, key));
+	size_t i = __hm_find(m, key, h);
+
+	if(i != HASHMAP_NPOS) {
+		__hm_store(m, __hm_slot(m, i), BOOL_FALSE, (const void*) NULL, value);
+		return 1;
+	}
+	if(unlikely(m->growth_left == 0) && __hm_rehash(m, m->capacity << 1) != 0)
+		return -1;
+	i = __hm_find_empty(m, h);
+	__hm_set_ctrl(m, i, __hm_h2(h));
+	__hm_store(m, __hm_slot(m, i), BOOL_TRUE, key, value);
+	m->nmemb++;
+	m->growth_left--;
+	return 0;
+}
+
+void *hashmap_get(const HashMap m, const void *key)
+{
+	size_t i = __hm_find(m, key, __hash_mix(__hm_hash(m, key)));
+
+	if(i == HASHMAP_NPOS)
+		return NULL;
+	return __hm_value(m, __hm_slot(m, i));
+}
+
+BOOL_TYPE hashmap_contains(const HashMap m, const void *key)
+{
+	return __hm_find(m, key, __hash_mix(__hm_hash(m, key))) != HASHMAP_NPOS;
+}
+
+int hashmap_remove(HashMap m, const void *key, void (*__del_key__)(void*), void (*__del_value__)(void*))
+{
+	size_t mask = m->capacity - 1, i, j, home;
+	byte *slot;
+
+	i = __hm_find(m, key, __hash_mix(__hm_hash(m, key)));
+	if(i == HASHMAP_NPOS)
+		return -1;
+	slot = __hm_slot(m, i);
+	if(__del_key__ != (void(*)(void*)) NULL)
+		__del_key__(__hm_key(m, slot));
+	if(__del_value__ != (void(*)(void*)) NULL)
+		__del_value__(__hm_value(m, slot));
+
+	/* backward shift: move each following entry of the cluster into the hole
+	 * as long as the hole is not before the entry's home slot */
+	for(j = (i + 1) & mask; ! (m->ctrl[j] & HASHMAP_CTRL_EMPTY); j = (j + 1) & mask) {
+		slot = __hm_slot(m, j);
+		home = __hm_home(m, __hash_mix(__hm_hash(m, __hm_key(m, slot))));
+		if(((j - home) & mask) >= ((j - i) & mask)) {
+			__hm_set_ctrl(m, i, m->ctrl[j]);
+			memcpy(__hm_slot(m, i), slot, m->slot_size);
+			i = j;
+		}
+	}
+	__hm_set_ctrl(m, i, HASHMAP_CTRL_EMPTY);
+	m->nmemb--;
+	m->growth_left++;
+	return 0;
+}
+
+int hashmap_reserve(HashMap m, size_t nmemb)
+{
+	size_t capacity = m->capacity;
+
+	while(nmemb > capacity - capacity / 8)
+		capacity <<= 1;
+	if(capacity == m->capacity)
+		return 0;
+	return __hm_rehash(m, capacity);
+}
+
+size_t hashmap_size(const HashMap m)
+{
+	return m->nmemb;
+}
+
+BOOL_TYPE hashmap_iterate(const HashMap m, size_t *pos, void **key, void **value)
+{
+	byte *slot;
+
+	while(*pos < m->capacity && (m->ctrl[*pos] & HASHMAP_CTRL_EMPTY))
+		(*pos)++;
+	if(*pos >= m->capacity)
+		return BOOL_FALSE;
+	slot = __hm_slot(m, *pos);
+	if(key != (void**) NULL)
+		*key = __hm_key(m, slot);
+	if(value != (void**) NULL)
+		*value = __hm_value(m, slot);
+	(*pos)++;
+	return BOOL_TRUE;
+}
+#undef __hm_h2
+#undef __hm_home
+#undef __hm_value
+#undef __hm_key
+#undef __hm_slot
+#undef HASHMAP_NPOS
+#undef HASHMAP_CTRL_EMPTY
+#undef HASHMAP_MIN_CAPACITY
+#undef HASHMAP_GROUP_SIZE
+
+/* ----- B+tree ----- */
+/* sized so that both node types fit in 256 bytes */
+#define BTREE_INNER_KEYS	15
+#define BTREE_LEAF_KEYS		14
+#define BTREE_INNER_MIN		(BTREE_INNER_KEYS / 2)
+#define BTREE_LEAF_MIN		(BTREE_LEAF_KEYS / 2)
+#define BTREE_MAX_HEIGHT	32
+
+struct __btree_node__ {
+	unsigned short nkeys, is_leaf;
+};
+
+/* children[i] holds keys < keys[i], children[i + 1] keys >= keys[i] */
+struct __btree_inner__ {
+	struct __btree_node__ hdr;
+	uint64_t keys[BTREE_INNER_KEYS];
+	struct __btree_node__ *children[BTREE_INNER_KEYS + 1];
+};
+
+struct __btree_leaf__ {
+	struct __btree_node__ hdr;
+	uint64_t keys[BTREE_LEAF_KEYS];
+	void *values[BTREE_LEAF_KEYS];
+	struct __btree_leaf__ *prev, *next;
+};
+
+struct __btree__ {
+	struct __btree_node__ *root;
+	struct __btree_leaf__ *first, *last;
+	size_t nmemb;
+};
+
+#define __btree_inner(node)	((struct __btree_inner__*) (node))
+#define __btree_leaf(node)	((struct __btree_leaf__*) (node))
+
+/* NULL if out of memory */
+static struct __btree_node__ *__btree_new_node(BOOL_TYPE is_leaf)
+{
+	struct __btree_node__ *node;
+	size_t size = is_leaf ? sizeof(struct __btree_leaf__) : sizeof(struct __btree_inner__);
+
+#ifdef INTERNAL_ERROR_HANDLING
+	node = (struct __btree_node__*) xmemalign(CACHE_LINE_SIZE, size);
+#else
+	if(unlikely(posix_memalign((void**) &node, CACHE_LINE_SIZE, size) != 0))
+		return (struct __btree_node__*) NULL;
+#endif /* #ifdef INTERNAL_ERROR_HANDLING */
+	node->nkeys = 0;
+	node->is_leaf = (unsigned short) is_leaf;
+	if(is_leaf)
+		__btree_leaf(node)->prev = __btree_leaf(node)->next = (struct __btree_leaf__*) NULL;
+	return node;
+}
+
+BTree new_btree(void)
+{
+	BTree t;
+
+#ifdef INTERNAL_ERROR_HANDLING
+	t = (BTree) xmalloc(sizeof(struct __btree__));
+#else
+	t = (BTree) malloc(sizeof(struct __btree__));
+	if(unlikely(t == (BTree) NULL))
+		return (BTree) NULL;
+#endif /* #ifdef INTERNAL_ERROR_HANDLING */
+	t->root = __btree_new_node(BOOL_TRUE);
+#ifndef INTERNAL_ERROR_HANDLING
+	if(unlikely(t->root == (struct __btree_node__*) NULL)) {
+		free(t);
+		return (BTree) NULL;
+	}
+#endif /* #ifndef INTERNAL_ERROR_HANDLING */
+	t->first = t->last = __btree_leaf(t->root);
+	t->nmemb = 0;
+	return t;
+}
+
+static void __btree_free_node(struct __btree_node__ *node, void (*__del__)(void*))
+{
+	unsigned i;
+
+	if(node->is_leaf) {
+		if(__del__ != (void(*)(void*)) NULL)
+			for(i = 0; i < node->nkeys; i++)
+				__del__(__btree_leaf(node)->values[i]);
+	} else {
+		for(i = 0; i <= node->nkeys; i++)
+			__btree_free_node(__btree_inner(node)->children[i], __del__);
+	}
+	free(node);
+}
+
+void delete_btree(BTree t, void (*__del__)(void*))
+{
+	__btree_free_node(t->root, __del__);
+	free(t);
+}
+
+/* index of child of inner node to follow for key */
+static unsigned __btree_child_index(const struct __btree_inner__ *node, uint64_t key)
+{
+	unsigned i = 0;
+
+	while(i < node->hdr.nkeys && key >= node->keys[i])
+		i++;
+	return i;
+}
+
+/* index of first key of leaf >= key (upper == false) or > key (upper == true) */
+static unsigned __btree_leaf_index(const struct __btree_leaf__ *leaf, uint64_t key, BOOL_TYPE upper)
+{
+	unsigned i = 0;
+
+	if(upper)
+		while(i < leaf->hdr.nkeys && leaf->keys[i] <= key)
+			i++;
+	else
+		while(i < leaf->hdr.nkeys && leaf->keys[i] < key)
+			i++;
+	return i;
+}
+
+static struct __btree_leaf__ *__btree_find_leaf(const BTree t, uint64_t key)
+{
+	struct __btree_node__ *node = t->root;
+
+	while( ! node->is_leaf)
+		node = __btree_inner(node)->children[__btree_child_index(__btree_inner(node), key)];
+	return __btree_leaf(node);
+}
+
+void *btree_get(const BTree t, uint64_t key)
+{
+	struct __btree_leaf__ *leaf = __btree_find_leaf(t, key);
+	unsigned i = __btree_leaf_index(leaf, key, BOOL_FALSE);
+
+	return i < leaf->hdr.nkeys && leaf->keys[i] == key ? leaf->values[i] : NULL;
+}
+
+BOOL_TYPE btree_contains(const BTree t, uint64_t key)
+{
+	struct __btree_leaf__ *leaf = __btree_find_leaf(t, key);
+	unsigned i = __btree_leaf_index(leaf, key, BOOL_FALSE);
+
+	return i < leaf->hdr.nkeys && leaf->keys[i] == key;
+}
+
+size_t btree_size(const BTree t)
+{
+	return t->nmemb;
+}
+
+/* nodes allocated before inserting, so that an insertion either fully
+ * succeeds or changes nothing */
+struct __btree_spare__ {
+	struct __btree_node__ *nodes[BTREE_MAX_HEIGHT + 1];
+	int n;
+};
+
+/* insert key (known to be absent) under node. If node had to be split, set
+ * *split_node to its new right sibling and *split_key to the smallest key in it */
+static void __btree_insert_rec(BTree t, struct __btree_node__ *node, uint64_t key, void *value,
+		struct __btree_spare__ *spare, uint64_t *split_key, struct __btree_node__ **split_node)
+{
+	uint64_t keys[BTREE_INNER_KEYS + 1], child_split_key;
+	void *values[BTREE_LEAF_KEYS + 1];
+	struct __btree_node__ *children[BTREE_INNER_KEYS + 2], *child_split = (struct __btree_node__*) NULL;
+	struct __btree_leaf__ *leaf, *right;
+	struct __btree_inner__ *inner, *iright;
+	unsigned i, n, left_n;
+
+	*split_node = (struct __btree_node__*) NULL;
+	if(node->is_leaf) {
+		leaf = __btree_leaf(node);
+		i = __btree_leaf_index(leaf, key, BOOL_FALSE);
+		n = leaf->hdr.nkeys;
+		if(n < BTREE_LEAF_KEYS) {
+			memmove(&leaf->keys[i + 1], &leaf->keys[i], (n - i) * sizeof(uint64_t));
+			memmove(&leaf->values[i + 1], &leaf->values[i], (n - i) * sizeof(void*));
+			leaf->keys[i] = key;
+			leaf->values[i] = value;
+			leaf->hdr.nkeys++;
+			return;
+		}
+		/* split full leaf in 2 halves */
+		memcpy(keys, leaf->keys, i * sizeof(uint64_t));
+		memcpy(values, leaf->values, i * sizeof(void*));
+		keys[i] = key;
+		values[i] = value;
+		memcpy(&keys[i + 1], &leaf->keys[i], (n - i) * sizeof(uint64_t));
+		memcpy(&values[i + 1], &leaf->values[i], (n - i) * sizeof(void*));
+		right = __btree_leaf(spare->nodes[--spare->n]);
+		left_n = (n + 1) / 2;
+		memcpy(leaf->keys, keys, left_n * sizeof(uint64_t));
+		memcpy(leaf->values, values, left_n * sizeof(void*));
+		memcpy(right->keys, &keys[left_n], (n + 1 - left_n) * sizeof(uint64_t));
+		memcpy(right->values, &values[left_n], (n + 1 - left_n) * sizeof(void*));
+		leaf->hdr.nkeys = (unsigned short) left_n;
+		right->hdr.nkeys = (unsigned short) (n + 1 - left_n);
+		right->prev = leaf;
+		right->next = leaf->next;
+		if(leaf->next != (struct __btree_leaf__*) NULL)
+			leaf->next->prev = right;
+		else
+			t->last = right;
+		leaf->next = right;
+		*split_key = right->keys[0];
+		*split_node = &right->hdr;
+		return;
+	}
+
+	inner = __btree_inner(node);
+	i = __btree_child_index(inner, key);
+	__btree_insert_rec(t, inner->children[i], key, value, spare, &child_split_key, &child_split);
+	if(child_split == (struct __btree_node__*) NULL)
+		return;
+	n = inner->hdr.nkeys;
+	if(n < BTREE_INNER_KEYS) {
+		memmove(&inner->keys[i + 1], &inner->keys[i], (n - i) * sizeof(uint64_t));
+		memmove(&inner->children[i + 2], &inner->children[i + 1], (n - i) * sizeof(struct __btree_node__*));
+		inner->keys[i] = child_split_key;
+		inner->children[i + 1] = child_split;
+		inner->hdr.nkeys++;
+		return;
+	}
+	/* split full inner node: the middle key moves up */
+	memcpy(keys, inner->keys, i * sizeof(uint64_t));
+	keys[i] = child_split_key;
+	memcpy(&keys[i + 1], &inner->keys[i], (n - i) * sizeof(uint64_t));
+	memcpy(children, inner->children, (i + 1) * sizeof(struct __btree_node__*));
+	children[i + 1] = child_split;
+	memcpy(&children[i + 2], &inner->children[i + 1], (n - i) * sizeof(struct __btree_node__*));
+	iright = __btree_inner(spare->nodes[--spare->n]);
+	iright->hdr.is_leaf = 0;
+	left_n = (n + 1) / 2;
+	memcpy(inner->keys, keys, left_n * sizeof(uint64_t));
+	memcpy(inner->children, children, (left_n + 1) * sizeof(struct __btree_node__*));
+	inner->hdr.nkeys = (unsigned short) left_n;
+	*split_key = keys[left_n];
+	memcpy(iright->keys, &keys[left_n + 1], (n - left_n) * sizeof(uint64_t));
+	memcpy(iright->children, &children[left_n + 1], (n - left_n + 1) * sizeof(struct __btree_node__*));
+	iright->hdr.nkeys = (unsigned short) (n - left_n);
+	*split_node = &iright->hdr;
+}
+
+int btree_insert(BTree t, uint64_t key, void *value)
+{
+	struct __btree_node__ *node = t->root, *path[BTREE_MAX_HEIGHT], *split_node, *root;
+	struct __btree_spare__ spare;
+	struct __btree_leaf__ *leaf;
+	uint64_t split_key;
+	int depth = 0, i, needed;
+	unsigned pos;
+
+	while( ! node->is_leaf) {
+		path[depth++] = node;
+		node = __btree_inner(node)->children[__btree_child_index(__btree_inner(node), key)];
+	}
+	leaf = __btree_leaf(node);
+	pos = __btree_leaf_index(leaf, key, BOOL_FALSE);
+	if(pos < leaf->hdr.nkeys && leaf->keys[pos] == key) {
+		leaf->values[pos] = value;
+		return 1;
+	}
+	/* one new node per full node on the way up from the leaf, plus a new
+	 * root if they are all full */
+	needed = leaf->hdr.nkeys == BTREE_LEAF_KEYS;
+	for(i = depth - 1; needed == depth - i && i >= 0; i--)
+		needed += path[i]->nkeys == BTREE_INNER_KEYS;
+	if(needed == depth + 1)
+		needed++;
+	for(spare.n = 0; spare.n < needed; spare.n++) {
+		/* leaves are the first to split and take the last spare node */
+		spare.nodes[spare.n] = __btree_new_node(spare.n == needed - 1);
+		if(unlikely(spare.nodes[spare.n] == (struct __btree_node__*) NULL)) {
+			while(spare.n-- > 0)
+				free(spare.nodes[spare.n]);
+			return -1;
+		}
+	}
+	__btree_insert_rec(t, t->root, key, value, &spare, &split_key, &split_node);
+	if(split_node != (struct __btree_node__*) NULL) {
+		root = spare.nodes[--spare.n];
+		root->is_leaf = 0;
+		root->nkeys = 1;
+		__btree_inner(root)->keys[0] = split_key;
+		__btree_inner(root)->children[0] = t->root;
+		__btree_inner(root)->children[1] = split_node;
+		t->root = root;
+	}
+	t->nmemb++;
+	return 0;
+}
+
+/* fix child i of inner node p, which has too few keys, by borrowing from or
+ * merging with a sibling */
+static void __btree_rebalance(BTree t, struct __btree_inner__ *p, unsigned i)
+{
+	struct __btree_node__ *child = p->children[i], *left, *right;
+	struct __btree_leaf__ *lc, *ll, *lr;
+	struct __btree_inner__ *ic, *il, *ir;
+	unsigned min = child->is_leaf ? BTREE_LEAF_MIN : BTREE_INNER_MIN, n;
+
+	left = i > 0 ? p->children[i - 1] : (struct __btree_node__*) NULL;
+	right = i < p->hdr.nkeys ? p->children[i + 1] : (struct __btree_node__*) NULL;
+	if(child->is_leaf) {
+		lc = __btree_leaf(child);
+		if(left != (struct __btree_node__*) NULL && left->nkeys > min) {
+			ll = __btree_leaf(left);
+			memmove(&lc->keys[1], lc->keys, lc->hdr.nkeys * sizeof(uint64_t));
+			memmove(&lc->values[1], lc->values, lc->hdr.nkeys * sizeof(void*));
+			n = --ll->hdr.nkeys;
+			lc->keys[0] = ll->keys[n];
+			lc->values[0] = ll->values[n];
+			lc->hdr.nkeys++;
+			p->keys[i - 1] = lc->keys[0];
+			return;
+		}
+		if(right != (struct __btree_node__*) NULL && right->nkeys > min) {
+			lr = __btree_leaf(right);
+			lc->keys[lc->hdr.nkeys] = lr->keys[0];
+			lc->values[lc->hdr.nkeys++] = lr->values[0];
+			n = --lr->hdr.nkeys;
+			memmove(lr->keys, &lr->keys[1], n * sizeof(uint64_t));
+			memmove(lr->values, &lr->values[1], n * sizeof(void*));
+			p->keys[i] = lr->keys[0];
+			return;
+		}
+		/* merge child into left, or right into child */
+		if(left != (struct __btree_node__*) NULL) {
+			ll = __btree_leaf(left);
+			lr = lc;
+			i--;
+		} else {
+			ll = lc;
+			lr = __btree_leaf(right);
+		}
+		memcpy(&ll->keys[ll->hdr.nkeys], lr->keys, lr->hdr.nkeys * sizeof(uint64_t));
+		memcpy(&ll->values[ll->hdr.nkeys], lr->values, lr->hdr.nkeys * sizeof(void*));
+		ll->hdr.nkeys += lr->hdr.nkeys;
+		ll->next = lr->next;
+		if(lr->next != (struct __btree_leaf__*) NULL)
+			lr->next->prev = ll;
+		else
+			t->last = ll;
+		free(lr);
+	} else {
+		ic = __btree_inner(child);
+		if(left != (struct __btree_node__*) NULL && left->nkeys > min) {
+			il = __btree_inner(left);
+			memmove(&ic->keys[1], ic->keys, ic->hdr.nkeys * sizeof(uint64_t));
+			memmove(&ic->children[1], ic->children, (ic->hdr.nkeys + 1) * sizeof(struct __btree_node__*));
+			ic->keys[0] = p->keys[i - 1];
+			ic->children[0] = il->children[il->hdr.nkeys];
+			ic->hdr.nkeys++;
+			p->keys[i - 1] = il->keys[--il->hdr.nkeys];
+			return;
+		}
+		if(right != (struct __btree_node__*) NULL && right->nkeys > min) {
+			ir = __btree_inner(right);
+			ic->keys[ic->hdr.nkeys] = p->keys[i];
+			ic->children[++ic->hdr.nkeys] = ir->children[0];
+			p->keys[i] = ir->keys[0];
+			n = --ir->hdr.nkeys;
+			memmove(ir->keys, &ir->keys[1], n * sizeof(uint64_t));
+			memmove(ir->children, &ir->children[1], (n + 1) * sizeof(struct __btree_node__*));
+			return;
+		}
+		if(left != (struct __btree_node__*) NULL) {
+			il = __btree_inner(left);
+			ir = ic;
+			i--;
+		} else {
+			il = ic;
+			ir = __btree_inner(right);
+		}
+		/* separator comes down between both halves */
+		il->keys[il->hdr.nkeys] = p->keys[i];
+		memcpy(&il->keys[il->hdr.nkeys + 1], ir->keys, ir->hdr.nkeys * sizeof(uint64_t));
+		memcpy(&il->children[il->hdr.nkeys + 1], ir->children, (ir->hdr.nkeys + 1) * sizeof(struct __btree_node__*));
+		il->hdr.nkeys += ir->hdr.nkeys + 1;
+		free(ir);
+	}
+	/* drop separator i and child i + 1 from p */
+	n = --p->hdr.nkeys;
+	memmove(&p->keys[i], &p->keys[i + 1], (n - i) * sizeof(uint64_t));
+	memmove(&p->children[i + 1], &p->children[i + 2], (n - i) * sizeof(struct __btree_node__*));
+}
+
+static int __btree_remove_rec(BTree t, struct __btree_node__ *node, uint64_t key, void (*__del__)(void*))
+{
+	struct __btree_leaf__ *leaf;
+	unsigned i, n;
+
+	if(node->is_leaf) {
+		leaf = __btree_leaf(node);
+		i = __btree_leaf_index(leaf, key, BOOL_FALSE);
+		if(i >= leaf->hdr.nkeys || leaf->keys[i] != key)
+			return -1;
+		if(__del__ != (void(*)(void*)) NULL)
+			__del__(leaf->values[i]);
+		n = --leaf->hdr.nkeys;
+		memmove(&leaf->keys[i], &leaf->keys[i + 1], (n - i) * sizeof(uint64_t));
+		memmove(&leaf->values[i], &leaf->values[i + 1], (n - i) * sizeof(void*));
+		return 0;
+	}
+	i = __btree_child_index(__btree_inner(node), key);
+	if(__btree_remove_rec(t, __btree_inner(node)->children[i], key, __del__) != 0)
+		return -1;
+	if(__btree_inner(node)->children[i]->nkeys < (__btree_inner(node)->children[i]->is_leaf
+				? BTREE_LEAF_MIN : BTREE_INNER_MIN))
+		__btree_rebalance(t, __btree_inner(node), i);
+	return 0;
+}
+
+int btree_remove(BTree t, uint64_t key, void (*__del__)(void*))
+{
+	struct __btree_node__ *root = t->root;
+
+	if(__btree_remove_rec(t, root, key, __del__) != 0)
+		return -1;
+	/* root lost its last separator: tree shrinks by one level */
+	if( ! root->is_leaf && root->nkeys == 0) {
+		t->root = __btree_inner(root)->children[0];
+		free(root);
+	}
+	t->nmemb--;
+	return 0;
+}
+
+BTree new_btree_from_sorted(const uint64_t *keys, void **values, size_t nmemb)
+{
+	BTree t;
+	struct __btree_node__ **level = (struct __btree_node__**) NULL, **up = (struct __btree_node__**) NULL;
+	struct __btree_node__ **all = (struct __btree_node__**) NULL, *node;
+	uint64_t *mins = (uint64_t*) NULL, *up_mins = (uint64_t*) NULL;
+	struct __btree_leaf__ *prev = (struct __btree_leaf__*) NULL;
+	size_t i, j, k, nnodes, per_node, extra, done, total;
+
+	for(i = 1; i < nmemb; i++)
+		if(keys[i - 1] >= keys[i]) {
+			errno = EINVAL;
+			return (BTree) NULL;
+		}
+	t = new_btree();
+#ifndef INTERNAL_ERROR_HANDLING
+	if(unlikely(t == (BTree) NULL))
+		return (BTree) NULL;
+#endif /* #ifndef INTERNAL_ERROR_HANDLING */
+	if(nmemb == 0)
+		return t;
+
+	/* every node of the tree is recorded in all, to release them if an
+	 * allocation fails half-way */
+	nnodes = (nmemb + BTREE_LEAF_KEYS - 1) / BTREE_LEAF_KEYS;
+	for(total = 0, k = nnodes; k > 1; k = (k + BTREE_INNER_KEYS) / (BTREE_INNER_KEYS + 1))
+		total += k;
+	if(array_reserve(all, total + 1) != 0 || array_reserve(level, nnodes) != 0
+			|| array_reserve(mins, nnodes) != 0)
+		goto error;
+
+	/* spread elements evenly over as few leaves as possible, so that each
+	 * holds at least the minimum */
+	per_node = nmemb / nnodes;
+	extra = nmemb % nnodes;
+	for(i = 0, done = 0; i < nnodes; i++, done += k) {
+		k = per_node + (i < extra);
+		node = __btree_new_node(BOOL_TRUE);
+		if(unlikely(node == (struct __btree_node__*) NULL))
+			goto error;
+		(void) array_push(all, node);
+		memcpy(__btree_leaf(node)->keys, &keys[done], k * sizeof(uint64_t));
+		memcpy(__btree_leaf(node)->values, &values[done], k * sizeof(void*));
+		node->nkeys = (unsigned short) k;
+		__btree_leaf(node)->prev = prev;
+		if(prev != (struct __btree_leaf__*) NULL)
+			prev->next = __btree_leaf(node);
+		prev = __btree_leaf(node);
+		(void) array_push(level, node);
+		(void) array_push(mins, keys[done]);
+	}
+
+	/* then build each level of inner nodes the same way */
+	while(array_len(level) > 1) {
+		nnodes = (array_len(level) + BTREE_INNER_KEYS) / (BTREE_INNER_KEYS + 1);
+		if(array_reserve(up, nnodes) != 0 || array_reserve(up_mins, nnodes) != 0)
+			goto error;
+		per_node = array_len(level) / nnodes;
+		extra = array_len(level) % nnodes;
+		for(i = 0, done = 0; i < nnodes; i++, done += k) {
+			k = per_node + (i < extra);
+			node = __btree_new_node(BOOL_FALSE);
+			if(unlikely(node == (struct __btree_node__*) NULL))
+				goto error;
+			(void) array_push(all, node);
+			for(j = 0; j < k; j++) {
+				__btree_inner(node)->children[j] = level[done + j];
+				if(j > 0)
+					__btree_inner(node)->keys[j - 1] = mins[done + j];
+			}
+			node->nkeys = (unsigned short) (k - 1);
+			(void) array_push(up, node);
+			(void) array_push(up_mins, mins[done]);
+		}
+		array_free(level);
+		array_free(mins);
+		level = up;
+		mins = up_mins;
+		up = (struct __btree_node__**) NULL;
+		up_mins = (uint64_t*) NULL;
+	}
+	free(t->root);
+	t->root = level[0];
+	t->first = __btree_leaf(all[0]);
+	t->last = prev;
+	t->nmemb = nmemb;
+	array_free(all);
+	array_free(level);
+	array_free(mins);
+	return t;
+
+error:
+	for(i = 0; i < array_len(all); i++)
+		free(all[i]);
+	array_free(all);
+	array_free(level);
+	array_free(mins);
+	array_free(up);
+	array_free(up_mins);
+	delete_btree(t, NULL);
+	return (BTree) NULL;
+}
+
+static void __btree_bound(const BTree t, uint64_t key, BTreeCursor *c, BOOL_TYPE upper)
+{
+	struct __btree_leaf__ *leaf = __btree_find_leaf(t, key);
+
+	c->leaf = leaf;
+	c->pos = __btree_leaf_index(leaf, key, upper);
+}
+
+void btree_lower_bound(const BTree t, uint64_t key, BTreeCursor *c)
+{
+	__btree_bound(t, key, c, BOOL_FALSE);
+}
+
+void btree_upper_bound(const BTree t, uint64_t key, BTreeCursor *c)
+{
+	__btree_bound(t, key, c, BOOL_TRUE);
+}
+
+void btree_rewind(const BTree t, BTreeCursor *c)
+{
+	c->leaf = t->first;
+	c->pos = 0;
+}
+
+void btree_rewind_end(const BTree t, BTreeCursor *c)
+{
+	c->leaf = t->last;
+	c->pos = t->last->hdr.nkeys;
+}
+
+BOOL_TYPE btree_iterate(BTreeCursor *c, uint64_t *key, void **value)
+{
+	struct __btree_leaf__ *leaf = (struct __btree_leaf__*) c->leaf;
+
+	/* a cursor may sit at the end of a leaf: move on to the next one */
+	while(c->pos >= leaf->hdr.nkeys) {
+		if(leaf->next == (struct __btree_leaf__*) NULL)
+			return BOOL_FALSE;
+		c->leaf = leaf = leaf->next;
+		c->pos = 0;
+	}
+	if(key != (uint64_t*) NULL)
+		*key = leaf->keys[c->pos];
+	if(value != (void**) NULL)
+		*value = leaf->values[c->pos];
+	c->pos++;
+	return BOOL_TRUE;
+}
+
+BOOL_TYPE btree_rev_iterate(BTreeCursor *c, uint64_t *key, void **value)
+{
+	struct __btree_leaf__ *leaf = (struct __btree_leaf__*) c->leaf;
+
+	while(c->pos == 0) {
+		if(leaf->prev == (struct __btree_leaf__*) NULL)
+			return BOOL_FALSE;
+		c->leaf = leaf = leaf->prev;
+		c->pos = leaf->hdr.nkeys;
+	}
+	c->pos--;
+	if(key != (uint64_t*) NULL)
+		*key = leaf->keys[c->pos];
+	if(value != (void**) NULL)
+		*value = leaf->values[c->pos];
+	return BOOL_TRUE;
+}
+
+#undef __btree_leaf
+#undef __btree_inner
+#undef BTREE_MAX_HEIGHT
+#undef BTREE_LEAF_MIN
+#undef BTREE_INNER_MIN
+#undef BTREE_LEAF_KEYS
+#undef BTREE_INNER_KEYS
+
+/* ----- Heap ----- */
+#define HEAP_ARITY	4
+
+struct __heap_node__ {
+	void *data;
+	/* index in heap array, or next free handle once removed */
+	size_t pos;
+};
+
+struct __heap__ {
+	/* handles in heap order */
+	HeapHandle *heap;
+	struct __heap_node__ *nodes;
+	HeapHandle free_handle;
+	int (*__cmp__)(const void*, const void*);
+};
+
+static void __heap_sift_up(Heap h, size_t i)
+{
+	HeapHandle handle = h->heap[i];
+	void *data = h->nodes[handle].data;
+	size_t parent;
+
+	while(i > 0) {
+		parent = (i - 1) / HEAP_ARITY;
+		if(h->__cmp__(data, h->nodes[h->heap[parent]].data) >= 0)
+			break;
+		h->heap[i] = h->heap[parent];
+		h->nodes[h->heap[i]].pos = i;
+		i = parent;
+	}
+	h->heap[i] = handle;
+	h->nodes[handle].pos = i;
+}
+
+static void __heap_sift_down(Heap h, size_t i)
+{
+	HeapHandle handle = h->heap[i];
+	void *data = h->nodes[handle].data, *best_data;
+	size_t n = array_len(h->heap), child, best, last;
+
+	while((child = i * HEAP_ARITY + 1) < n) {
+		last = child + HEAP_ARITY < n ? child + HEAP_ARITY : n;
+		best = child;
+		best_data = h->nodes[h->heap[best]].data;
+		for(child++; child < last; child++)
+			if(h->__cmp__(h->nodes[h->heap[child]].data, best_data) < 0) {
+				best = child;
+				best_data = h->nodes[h->heap[best]].data;
+			}
+		if(h->__cmp__(best_data, data) >= 0)
+			break;
+		h->heap[i] = h->heap[best];
+		h->nodes[h->heap[i]].pos = i;
+		i = best;
+	}
+	h->heap[i] = handle;
+	h->nodes[handle].pos = i;
+}
+
+Heap new_heap(int (*__cmp__)(const void*, const void*))
+{
+	Heap h;
+
+#ifdef INTERNAL_ERROR_HANDLING
+	h = (Heap) xmalloc(sizeof(struct __heap__));
+#else
+	h = (Heap) malloc(sizeof(struct __heap__));
+	if(unlikely(h == (Heap) NULL))
+		return (Heap) NULL;
+#endif /* #ifdef INTERNAL_ERROR_HANDLING */
+	h->heap = (HeapHandle*) NULL;
+	h->nodes = (struct __heap_node__*) NULL;
+	h->free_handle = HEAP_NO_HANDLE;
+	h->__cmp__ = __cmp__;
+	return h;
+}
+
+Heap new_heap_from_array(void **data, size_t nmemb, int (*__cmp__)(const void*, const void*))
+{
+	Heap h = new_heap(__cmp__);
+	size_t i;
+
+#ifndef INTERNAL_ERROR_HANDLING
+	if(unlikely(h == (Heap) NULL))
+		return (Heap) NULL;
+#endif /* #ifndef INTERNAL_ERROR_HANDLING */
+	if(nmemb == 0)
+		return h;
+	if(array_reserve(h->heap, nmemb) != 0 || array_reserve(h->nodes, nmemb) != 0) {
+		delete_heap(h, NULL);
+		return (Heap) NULL;
+	}
+	for(i = 0; i < nmemb; i++) {
+		h->nodes[i].data = data[i];
+		h->nodes[i].pos = i;
+		h->heap[i] = i;
+	}
+	__array_header(h->heap)->nmemb = __array_header(h->nodes)->nmemb = nmemb;
+	for(i = (nmemb + HEAP_ARITY - 2) / HEAP_ARITY; i > 0; i--)
+		__heap_sift_down(h, i - 1);
+	return h;
+}
+
+void delete_heap(Heap h, void (*__del__)(void*))
+{
+	size_t i;
+
+	if(__del__ != (void(*)(void*)) NULL)
+		for(i = 0; i < array_len(h->heap); i++)
+			__del__(h->nodes[h->heap[i]].data);
+	array_free(h->heap);
+	array_free(h->nodes);
+	free(h);
+}
+
+HeapHandle heap_push(Heap h, void *data)
+{
+	HeapHandle handle;
+	struct __heap_node__ node;
+
+	/* grows geometrically, and before taking a handle so that failing leaves
+	 * the free list alone */
+	if(__array_make_room(h->heap, 1) != 0)
+		return HEAP_NO_HANDLE;
+	if(h->free_handle != HEAP_NO_HANDLE) {
+		handle = h->free_handle;
+		h->free_handle = h->nodes[handle].pos;
+	} else {
+		handle = array_len(h->nodes);
+		node.data = data;
+		if(array_push(h->nodes, node) != 0)
+			return HEAP_NO_HANDLE;
+	}
+	h->nodes[handle].data = data;
+	array_push(h->heap, handle);
+	__heap_sift_up(h, array_len(h->heap) - 1);
+	return handle;
+}
+
+void *heap_remove(Heap h, HeapHandle handle)
+{
+	size_t pos = h->nodes[handle].pos;
+	void *data = h->nodes[handle].data;
+	HeapHandle last = array_pop(h->heap);
+
+	if(last != handle) {
+		/* fill the hole with the last element and move it where it belongs */
+		h->heap[pos] = last;
+		h->nodes[last].pos = pos;
+		__heap_sift_up(h, pos);
+		__heap_sift_down(h, h->nodes[last].pos);
+	}
+	h->nodes[handle].data = NULL;
+	h->nodes[handle].pos = h->free_handle;
+	h->free_handle = handle;
+	return data;
+}
+
+void *heap_pop(Heap h)
+{
+	if(array_len(h->heap) == 0)
+		return NULL;
+	return heap_remove(h, h->heap[0]);
+}
+
+void *heap_peek(const Heap h)
+{
+	if(array_len(h->heap) == 0)
+		return NULL;
+	return h->nodes[h->heap[0]].data;
+}
+
+size_t heap_size(const Heap h)
+{
+	return array_len(h->heap);
+}
+
+void *heap_get(const Heap h, HeapHandle handle)
+{
+	return h->nodes[handle].data;
+}
+
+void heap_update(Heap h, HeapHandle handle)
+{
+	__heap_sift_up(h, h->nodes[handle].pos);
+	__heap_sift_down(h, h->nodes[handle].pos);
+}
+
+void heap_replace(Heap h, HeapHandle handle, void *data)
+{
+	h->nodes[handle].data = data;
+	heap_update(h, handle);
+}
+#undef HEAP_ARITY
+
+/* ----- Bloom filter ----- */
+#define BLOOM_MAX_HASHES	32
+/* slots of an element fall within one BLOOM_BLOCK_BITS storage bits when blocked */
+#define BLOOM_BLOCK_BITS	(CACHE_LINE_SIZE * 8)
+#define BLOOM_HEADER_SIZE	16
+#define BLOOM_LN2		0.69314718055994530942
+
+struct __bloom_filter__ {
+	Bitset bits;
+	size_t nslots;
+	unsigned nhashes;
+	/* bits per slot: 1, or 4 for counting filters */
+	unsigned width;
+	int flags;
+};
+
+/* natural logarithm of x > 0, so we need not link with libm */
+static double __bloom_ln(double x)
+{
+	double y, y2, term, sum = 0.0;
+	int e = 0, i;
+
+	for(; x > 2.0; e++)
+		x /= 2.0;
+	for(; x < 1.0; e--)
+		x *= 2.0;
+	/* ln(x) = 2 atanh((x - 1) / (x + 1)), |y| <= 1/3 */
+	y = (x - 1.0) / (x + 1.0);
+	y2 = y * y;
+	for(i = 1, term = y; i < 40; i += 2, term *= y2)
+		sum += term / i;
+	return 2.0 * sum + e * BLOOM_LN2;
+}
+
+static BloomFilter __new_bloom_filter(size_t nslots, unsigned nhashes, int flags)
+{
+	BloomFilter b;
+
+#ifdef INTERNAL_ERROR_HANDLING
+	b = (BloomFilter) xmalloc(sizeof(struct __bloom_filter__));
+#else
+	b = (BloomFilter) malloc(sizeof(struct __bloom_filter__));
+	if(unlikely(b == (BloomFilter) NULL))
+		return (BloomFilter) NULL;
+#endif /* #ifdef INTERNAL_ERROR_HANDLING */
+	b->width = flags & BLOOM_COUNTING ? 4 : 1;
+	b->nslots = nslots;
+	b->nhashes = nhashes;
+	b->flags = flags;
+	b->bits = new_bitset(nslots * b->width);
+#ifndef INTERNAL_ERROR_HANDLING
+	if(unlikely(b->bits == (Bitset) NULL)) {
+		free(b);
+		return (BloomFilter) NULL;
+	}
+#endif /* #ifndef INTERNAL_ERROR_HANDLING */
+	return b;
+}
+
+BloomFilter new_bloom_filter(size_t nmemb, double fp_rate, int flags)
+{
+	double slots;
+	size_t nslots, block_slots;
+	unsigned nhashes;
+
+	if(nmemb == 0 || ! (fp_rate > 0.0 && fp_rate < 1.0)) {
+		errno = EINVAL;
+		return (BloomFilter) NULL;
+	}
+	/* m = -n ln(p) / ln(2)^2, k = m / n ln(2) */
+	slots = -(double) nmemb * __bloom_ln(fp_rate) / (BLOOM_LN2 * BLOOM_LN2);
+	if(slots >= (double) (SIZE_MAX / 8 - BLOOM_BLOCK_BITS)) {
+		errno = EINVAL;
+		return (BloomFilter) NULL;
+	}
+	nslots = (size_t) slots + 1;
+	nhashes = (unsigned) (slots / (double) nmemb * BLOOM_LN2 + 0.5);
+	if(nhashes == 0)
+		nhashes = 1;
+	else if(nhashes > BLOOM_MAX_HASHES)
+		nhashes = BLOOM_MAX_HASHES;
+	if(flags & BLOOM_BLOCKED) {
+		block_slots = BLOOM_BLOCK_BITS / (flags & BLOOM_COUNTING ? 4 : 1);
+		nslots = (nslots + block_slots - 1) / block_slots * block_slots;
+	}
+	return __new_bloom_filter(nslots, nhashes, flags);
+}
+
+void delete_bloom_filter(BloomFilter b)
+{
+	free_bitset(b->bits);
+	free(b);
+}
+
+/* fill slots with the nhashes slots of data */
+static void __bloom_slots(const BloomFilter b, const void *data, size_t len, size_t *slots)
+{
+	uint64_t h1 = (uint64_t) hash_bytes(data, len), h2, block_slots;
+	unsigned i;
+
+	h2 = __hash_mix(h1 ^ UINT64_C(0x9e3779b97f4a7c15)) | 1;
+	if(b->flags & BLOOM_BLOCKED) {
+		/* blocks hold a power of 2 of slots, and an odd step visits them all */
+		block_slots = BLOOM_BLOCK_BITS / b->width;
+		h1 = h1 % (b->nslots / block_slots) * block_slots;
+		for(i = 0; i < b->nhashes; i++)
+			slots[i] = (size_t) (h1 + ((h2 >> 16) + i * h2) % block_slots);
+	} else {
+		/* double hashing: h1 + i * h2 */
+		for(i = 0; i < b->nhashes; i++)
+			slots[i] = (size_t) ((h1 + i * h2) % b->nslots);
+	}
+}
+
+#define __bloom_counter_shift(slot)	(((slot) % 16) * 4)
+#define __bloom_counter(b, slot)	\
+	((unsigned) ((b)->bits->data[(slot) / 16] >> __bloom_counter_shift(slot)) & 0xf)
+
+void bloom_add(BloomFilter b, const void *data, size_t len)
+{
+	size_t slots[BLOOM_MAX_HASHES];
+	unsigned i;
+
+	__bloom_slots(b, data, len, slots);
+	for(i = 0; i < b->nhashes; i++)
+		if(b->width == 1)
+			b->bits->data[slots[i] / 64] |= (uint64_t) 1 << (slots[i] % 64);
+		else if(__bloom_counter(b, slots[i]) != 0xf)
+			b->bits->data[slots[i] / 16] += (uint64_t) 1 << __bloom_counter_shift(slots[i]);
+}
+
+BOOL_TYPE bloom_contains(const BloomFilter b, const void *data, size_t len)
+{
+	size_t slots[BLOOM_MAX_HASHES];
+	unsigned i;
+
+	__bloom_slots(b, data, len, slots);
+	for(i = 0; i < b->nhashes; i++)
+		if(b->width == 1 ? ! ((b->bits->data[slots[i] / 64] >> (slots[i] % 64)) & 1)
+				: __bloom_counter(b, slots[i]) == 0)
+			return BOOL_FALSE;
+	return BOOL_TRUE;
+}
+
+int bloom_remove(BloomFilter b, const void *data, size_t len)
+{
+	size_t slots[BLOOM_MAX_HASHES];
+	unsigned i;
+
+	if( ! (b->flags & BLOOM_COUNTING)) {
+		errno = EINVAL;
+		return -1;
+	}
+	__bloom_slots(b, data, len, slots);
+	for(i = 0; i < b->nhashes; i++)
+		if(__bloom_counter(b, slots[i]) == 0) {
+			errno = ENOENT;
+			return -1;
+		}
+	for(i = 0; i < b->nhashes; i++)
+		/* saturated counters lost track of how many elements they count */
+		if(__bloom_counter(b, slots[i]) != 0xf)
+			b->bits->data[slots[i] / 16] -= (uint64_t) 1 << __bloom_counter_shift(slots[i]);
+	return 0;
+}
+
+void bloom_clear(BloomFilter b)
+{
+	bitset_clear(b->bits);
+}
+
+int bloom_union(BloomFilter dst, const BloomFilter src)
+{
+	size_t slot;
+	unsigned sum;
+
+	if(dst->nslots != src->nslots || dst->nhashes != src->nhashes || dst->flags != src->flags) {
+		errno = EINVAL;
+		return -1;
+	}
+	if(dst->width == 1)
+		return bitset_or(dst->bits, src->bits);
+	for(slot = 0; slot < dst->nslots; slot++) {
+		sum = __bloom_counter(dst, slot) + __bloom_counter(src, slot);
+		if(sum > 0xf)
+			sum = 0xf;
+		dst->bits->data[slot / 16] &= ~((uint64_t) 0xf << __bloom_counter_shift(slot));
+		dst->bits->data[slot / 16] |= (uint64_t) sum << __bloom_counter_shift(slot);
+	}
+	return 0;
+}
+#undef __bloom_counter
+#undef __bloom_counter_shift
+
+/* layout: "BLMF", version, flags, nhashes (16 bits), nslots (64 bits), then
+ * the Bitset words, all little-endian */
+size_t bloom_serialized_size(const BloomFilter b)
+{
+	return BLOOM_HEADER_SIZE + b->bits->nwords * 8;
+}
+
+static void __bloom_put_le(byte *p, uint64_t v, int nbytes)
+{
+	int i;
+
+	for(i = 0; i < nbytes; i++, v >>= 8)
+		p[i] = (byte) (v & 0xff);
+}
+
+static uint64_t __bloom_get_le(const byte *p, int nbytes)
+{
+	uint64_t v = 0;
+
+	while(nbytes-- > 0)
+		v = (v << 8) | p[nbytes];
+	return v;
+}
+
+void bloom_serialize(const BloomFilter b, void *buf)
+{
+	byte *p = (byte*) buf;
+	size_t i;
+
+	memcpy(p, "BLMF", 4);
+	p[4] = 1;
+	p[5] = (byte) b->flags;
+	__bloom_put_le(p + 6, b->nhashes, 2);
+	__bloom_put_le(p + 8, b->nslots, 8);
+	for(i = 0, p += BLOOM_HEADER_SIZE; i < b->bits->nwords; i++, p += 8)
+		__bloom_put_le(p, b->bits->data[i], 8);
+}
+
+BloomFilter new_bloom_filter_from_buffer(const void *buf, size_t len)
+{
+	const byte *p = (const byte*) buf;
+	uint64_t nslots;
+	unsigned nhashes;
+	int flags;
+	BloomFilter b;
+	size_t i;
+
+	if(len < BLOOM_HEADER_SIZE || memcmp(p, "BLMF", 4) != 0 || p[4] != 1)
+		goto invalid;
+	flags = p[5];
+	nhashes = (unsigned) __bloom_get_le(p + 6, 2);
+	nslots = __bloom_get_le(p + 8, 8);
+	if((flags & ~(BLOOM_COUNTING | BLOOM_BLOCKED)) != 0 || nhashes == 0 || nhashes > BLOOM_MAX_HASHES
+			|| nslots == 0 || nslots > SIZE_MAX / 8
+			|| ((flags & BLOOM_BLOCKED) && nslots % (BLOOM_BLOCK_BITS / (flags & BLOOM_COUNTING ? 4 : 1)) != 0)
+			|| (len - BLOOM_HEADER_SIZE) / 8 != (nslots * (flags & BLOOM_COUNTING ? 4 : 1) + 63) / 64)
+		goto invalid;
+	b = __new_bloom_filter((size_t) nslots, nhashes, flags);
+#ifndef INTERNAL_ERROR_HANDLING
+	if(unlikely(b == (BloomFilter) NULL))
+		return (BloomFilter) NULL;
+#endif /* #ifndef INTERNAL_ERROR_HANDLING */
+	for(i = 0, p += BLOOM_HEADER_SIZE; i < b->bits->nwords; i++, p += 8)
+		b->bits->data[i] = __bloom_get_le(p, 8);
+	/* keep Bitset tail clear whatever the buffer says */
+	if(b->bits->size % 64 != 0)
+		b->bits->data[b->bits->nwords - 1] &= ((uint64_t) 1 << (b->bits->size % 64)) - 1;
+	return b;
+invalid:
+	errno = EINVAL;
+	return (BloomFilter) NULL;
+}
+#undef BLOOM_LN2
+#undef BLOOM_HEADER_SIZE
+#undef BLOOM_BLOCK_BITS
+#undef BLOOM_MAX_HASHES
+
+/* ----- Cache ----- */
+/* what the HashMap of a Cache stores as key. Lookups pass one on the stack */
+struct __cache_key__ {
+	const void *data;
+	size_t len, hash;
+};
+
+struct __cache_entry__ {
+	struct __cache_key__ key;
+	IListNode link;
+	void *value;
+	size_t charge;
+	uint64_t expires;	/* in ms on the monotonic clock, 0 if never */
+	int referenced;	/* CACHE_CLOCK only */
+	byte keydata[1];
+};
+
+struct __cache__ {
+	HashMap map;
+	/* most recently used first for CACHE_LRU, in insertion order around the
+	 * clock hand for CACHE_CLOCK */
+	IList entries;
+	IListNode *hand;
+	size_t capacity, usage;
+	int policy;
+	CacheStats stats;
+	void (*__del__)(void*);
+};
+
+#define __cache_entry(node)	container_of(node, struct __cache_entry__, link)
+
+static size_t __cache_key_hash(const void *key)
+{
+	return ((const struct __cache_key__*) key)->hash;
+}
+
+static int __cache_key_equal(const void *k1, const void *k2)
+{
+	const struct __cache_key__ *a = (const struct __cache_key__*) k1, *b = (const struct __cache_key__*) k2;
+
+	return a->hash == b->hash && a->len == b->len && memcmp(a->data, b->data, a->len) == 0;
+}
+
+static uint64_t __cache_now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000 + (uint64_t) ts.tv_nsec / 1000000;
+}
+
+Cache new_cache(size_t capacity, int policy, void (*__del__)(void*))
+{
+	Cache c;
+
+#ifdef INTERNAL_ERROR_HANDLING
+	c = (Cache) xmalloc(sizeof(struct __cache__));
+	c->map = new_hashmap(0, 0, &__cache_key_hash, &__cache_key_equal);
+#else
+	c = (Cache) malloc(sizeof(struct __cache__));
+	if(unlikely(c == (Cache) NULL))
+		return (Cache) NULL;
+	c->map = new_hashmap(0, 0, &__cache_key_hash, &__cache_key_equal);
+	if(unlikely(c->map == (HashMap) NULL)) {
+		free(c);
+		return (Cache) NULL;
+	}
+#endif /* #ifdef INTERNAL_ERROR_HANDLING */
+	ilist_init(&c->entries);
+	c->hand = &c->entries.head;
+	c->capacity = capacity;
+	c->usage = 0;
+	c->policy = policy;
+	memset(&c->stats, 0, sizeof(CacheStats));
+	c->__del__ = __del__;
+	return c;
+}
+
+static void __cache_free_entry(Cache c, struct __cache_entry__ *e)
+{
+	if(c->__del__ != (void(*)(void*)) NULL)
+		c->__del__(e->value);
+	free(e);
+}
+
+void delete_cache(Cache c)
+{
+	IListNode *n, *tmp;
+
+	ilist_foreach_safe(&c->entries, n, tmp)
+		__cache_free_entry(c, __cache_entry(n));
+	delete_hashmap(c->map, NULL, NULL);
+	free(c);
+}
+
+/* take e out of the eviction order */
+static void __cache_detach(Cache c, struct __cache_entry__ *e)
+{
+	if(c->hand == &e->link)
+		c->hand = e->link.next;
+	ilist_remove(&e->link);
+	c->usage -= e->charge;
+}
+
+static void __cache_attach(Cache c, struct __cache_entry__ *e)
+{
+	/* new entries go right behind the clock hand, so they are the last ones
+	 * it considers */
+	if(c->policy == CACHE_LRU)
+		ilist_push_front(&c->entries, &e->link);
+	else
+		ilist_insert_before(c->hand, &e->link);
+	c->usage += e->charge;
+}
+
+static void __cache_unlink(Cache c, struct __cache_entry__ *e)
+{
+	(void) hashmap_remove(c->map, &e->key, NULL, NULL);
+	__cache_detach(c, e);
+	__cache_free_entry(c, e);
+}
+
+static void __cache_evict(Cache c)
+{
+	struct __cache_entry__ *e;
+
+	if(c->policy == CACHE_LRU) {
+		e = __cache_entry(ilist_back(&c->entries));
+	} else {
+		for(;;) {
+			if(c->hand == &c->entries.head)
+				c->hand = c->hand->next;
+			e = __cache_entry(c->hand);
+			if( ! e->referenced)
+				break;
+			e->referenced = 0;
+			c->hand = c->hand->next;
+		}
+	}
+	c->stats.evictions++;
+	__cache_unlink(c, e);
+}
+
+static struct __cache_entry__ *__cache_find(Cache c, const void *key, size_t keylen, size_t hash)
+{
+	struct __cache_key__ k;
+
+	k.data = key;
+	k.len = keylen;
+	k.hash = hash;
+	return (struct __cache_entry__*) hashmap_get(c->map, &k);
+}
+
+static int __cache_put(Cache c, const void *key, size_t keylen, size_t hash,
+		void *value, size_t size, unsigned long ttl_ms)
+{
+	struct __cache_entry__ *e;
+	size_t charge = offsetof(struct __cache_entry__, keydata) + keylen + size;
+	int replaced;
+
+	if(charge > c->capacity || charge < size) {
+		errno = E2BIG;
+		return -1;
+	}
+	e = __cache_find(c, key, keylen, hash);
+	replaced = e != (struct __cache_entry__*) NULL;
+	if(replaced) {
+		/* replace in place, which cannot fail. Out of the eviction order,
+		 * e cannot be evicted to make room for itself */
+		__cache_detach(c, e);
+		while(c->usage + charge > c->capacity)
+			__cache_evict(c);
+		if(e->value != value && c->__del__ != (void(*)(void*)) NULL)
+			c->__del__(e->value);
+	} else {
+#ifdef INTERNAL_ERROR_HANDLING
+		e = (struct __cache_entry__*) xmalloc(offsetof(struct __cache_entry__, keydata) + keylen);
+#else
+		e = (struct __cache_entry__*) malloc(offsetof(struct __cache_entry__, keydata) + keylen);
+		if(unlikely(e == (struct __cache_entry__*) NULL))
+			return -1;
+#endif /* #ifdef INTERNAL_ERROR_HANDLING */
+		memcpy(e->keydata, key, keylen);
+		e->key.data = e->keydata;
+		e->key.len = keylen;
+		e->key.hash = hash;
+		/* store before evicting anything, so that failing leaves c alone */
+		if(unlikely(hashmap_put(c->map, &e->key, e) < 0)) {
+			free(e);
+			errno = ENOMEM;
+			return -1;
+		}
+		while(c->usage + charge > c->capacity)
+			__cache_evict(c);
+	}
+	e->value = value;
+	e->charge = charge;
+	e->expires = ttl_ms == 0 ? 0 : __cache_now_ms() + ttl_ms;
+	e->referenced = 0;
+	__cache_attach(c, e);
+	return replaced;
+}
+
+static void *__cache_get(Cache c, const void *key, size_t keylen, size_t hash)
+{
+	struct __cache_entry__ *e = __cache_find(c, key, keylen, hash);
+
+	if(e == (struct __cache_entry__*) NULL) {
+		c->stats.misses++;
+		return NULL;
+	}
+	if(e->expires != 0 && __cache_now_ms() >= e->expires) {
+		c->stats.expirations++;
+		c->stats.misses++;
+		__cache_unlink(c, e);
+		return NULL;
+	}
+	c->stats.hits++;
+	if(c->policy == CACHE_LRU)
+		ilist_move_front(&c->entries, &e->link);
+	else
+		e->referenced = 1;
+	return e->value;
+}
+
+static int __cache_remove(Cache c, const void *key, size_t keylen, size_t hash)
+{
+	struct __cache_entry__ *e = __cache_find(c, key, keylen, hash);
+
+	if(e == (struct __cache_entry__*) NULL)
+		return -1;
+	__cache_unlink(c, e);
+	return 0;
+}
+
+int cache_put(Cache c, const void *key, size_t keylen, void *value, size_t size, unsigned long ttl_ms)
+{
+	return __cache_put(c, key, keylen, hash_bytes(key, keylen), value, size, ttl_ms);
+}
+
+void *cache_get(Cache c, const void *key, size_t keylen)
+{
+	return __cache_get(c, key, keylen, hash_bytes(key, keylen));
+}
+
+int cache_remove(Cache c, const void *key, size_t keylen)
+{
+	return __cache_remove(c, key, keylen, hash_bytes(key, keylen));
+}
+
+size_t cache_size(const Cache c)
+{
+	return hashmap_size(c->map);
+}
+
+size_t cache_usage(const Cache c)
+{
+	return c->usage;
+}
+
+void cache_stats(const Cache c, CacheStats *stats)
+{
+	memcpy(stats, &c->stats, sizeof(CacheStats));
+}
+#undef __cache_entry
+#endif /* #ifdef ENABLE_Bitset */
+
+
+/* -------------------- Filesystem functions -------------------- */
+#ifdef ENABLE_FILESYSTEM
+int is_dir(const char *path)
+{
+	struct stat buf;
+
+	if(lstat(path, &buf) != 0) {
+		log_message(LOG_ERROR, "Error statting file: %s", strerror(errno));
+		return -1;
+	} else
+		return S_ISDIR(buf.st_mode);
+}
+
+#ifdef	_WIN32
+#define FILE_SEPARATOR	'\\'
+#else
+#define FILE_SEPARATOR	'/'
+#endif /* #ifdef _WIN32 */
+
+#undef make_path
+char *make_path(const char *path, ...)
+{
+	char *new_path = (char*) NULL, *ptr = (char*) NULL;
+	va_list ap;
+	size_t len = strlen(path) + 1;
+
+	va_start(ap, path);
+	while((ptr = va_arg(ap, char*)) != (char*) NULL)
+		len += strlen(ptr) + 1;
+	va_end(ap);
+#ifdef INTERNAL_ERROR_HANDLING
+	ptr = new_path = (char*) xmalloc(len * sizeof(char));
+#else
+	ptr = new_path = (char*) malloc(len * sizeof(char));
+	if(new_path != (char*) NULL) {
+#endif /* #ifdef INTERNAL_ERROR_HANDLING */
+		va_start(ap, path);
+		ptr = stpcpy(new_path, path);
+		while((path = va_arg(ap, char*)) != (char*) NULL) {
+			*ptr++ = FILE_SEPARATOR;
+			ptr = stpcpy(ptr, path);
+		}
+		va_end(ap);
+#ifndef INTERNAL_ERROR_HANDLING
+	}
+#endif /* #ifndef INTERNAL_ERROR_HANDLING */
+	return new_path;
+}
+#undef FILE_SEPARATOR
+#ifdef C99
+# define make_path(...)	make_path(__VA_ARGS__, (char*) NULL)
+#endif /* #ifdef C99 */
+
+#ifdef __unix__
+#define __dirwalk_skip(name)	((name)[0] == '.' && ((name)[1] == '\0' || ((name)[1] == '.' && (name)[2] == '\0')))
+
+#if defined(__linux__) || defined(_DIRENT_HAVE_D_TYPE)
+/* DirEntryType of a d_type, -1 if unknown */
+static int __dir_type(unsigned char d_type)
+{
+	switch(d_type) {
+		case DT_REG:
+			return DIRWALK_FILE;
+		case DT_DIR:
+			return DIRWALK_DIR;
+		case DT_LNK:
+			return DIRWALK_SYMLINK;
+		case DT_UNKNOWN:
+			return -1;
+		default:
+			return DIRWALK_OTHER;
+	}
+}
+#endif /* #if defined(__linux__) || defined(_DIRENT_HAVE_D_TYPE) */
+
+#ifdef __linux__
+/* what getdents64 fills the buffer with */
+struct __dirent64__ {
+	uint64_t d_ino;
+	int64_t d_off;
+	unsigned short d_reclen;
+	unsigned char d_type;
+	char d_name[1];
+};
+
+int dir_reader_init(DirReader *r, int fd, void *buf, size_t size)
+{
+	r->fd = fd;
+	r->buf = (char*) buf;
+	r->size = size;
+	r->pos = r->len = 0;
+	return 0;
+}
+
+void dir_reader_close(DirReader *r)
+{
+	close(r->fd);
+}
+
+int dir_read(DirReader *r, DirRecord *rec)
+{
+	struct __dirent64__ *d;
+	long n;
+
+	for(;;) {
+		if(r->pos >= r->len) {
+			n = syscall(SYS_getdents64, r->fd, r->buf, r->size);
+			if(n <= 0)
+				return n == 0 ? 0 : -1;
+			r->len = (size_t) n;
+			r->pos = 0;
+		}
+		d = (struct __dirent64__*) &r->buf[r->pos];
+		r->pos += d->d_reclen;
+		if( ! __dirwalk_skip(d->d_name)) {
+			rec->name = d->d_name;
+			rec->ino = d->d_ino;
+			rec->type = __dir_type(d->d_type);
+			return 1;
+		}
+	}
+}
+#else
+int dir_reader_init(DirReader *r, int fd, void *buf, size_t size)
+{
+	(void) buf;
+	(void) size;
+	r->fd = fd;
+	if((r->dir = fdopendir(fd)) == (DIR*) NULL) {
+		close(fd);
+		return -1;
+	}
+	return 0;
+}
+
+void dir_reader_close(DirReader *r)
+{
+	closedir(r->dir);
+}
+
+int dir_read(DirReader *r, DirRecord *rec)
+{
+	struct dirent *entry;
+
+	errno = 0;
+	while((entry = readdir(r->dir)) != (struct dirent*) NULL) {
+		if(__dirwalk_skip(entry->d_name))
+			continue;
+		rec->name = entry->d_name;
+		rec->ino = (uint64_t) entry->d_ino;
+#ifdef _DIRENT_HAVE_D_TYPE
+		rec->type = __dir_type(entry->d_type);
+#else
+		rec->type = -1;
+#endif /* #ifdef _DIRENT_HAVE_D_TYPE */
+		return 1;
+	}
+	return errno == 0 ? 0 : -1;
+}
+#endif /* #ifdef __linux__ */
+
+struct __dirwalk__ {
+	char *path;
+	size_t size;
+	char **bufs;	/* a DirReader buffer per depth level */
+	unsigned nbufs;
+	int flags;
+	int (*func)(const DirEntry*, void*);
+	void *arg;
+};
+
+/* readdir() has its own buffers */
+#ifdef __linux__
+# define DIRWALK_BUFSIZE	DIR_READER_BUFSIZE
+#else
+# define DIRWALK_BUFSIZE	1
+#endif /* #ifdef __linux__ */
+
+static void __dirwalk_init(struct __dirwalk__ *w, int flags, int (*func)(const DirEntry*, void*), void *arg)
+{
+	w->path = (char*) NULL;
+	w->size = 0;
+	w->bufs = (char**) NULL;
+	w->nbufs = 0;
+	w->flags = flags;
+	w->func = func;
+	w->arg = arg;
+}
+
+static void __dirwalk_free(struct __dirwalk__ *w)
+{
+	unsigned i;
+
+	for(i = 0; i < w->nbufs; i++)
+		free(w->bufs[i]);
+	free(w->bufs);
+	free(w->path);
+}
+
+/* make room for a path of len characters. Return 0 on success, -1 if out of
+ * memory */
+static int __dirwalk_reserve(struct __dirwalk__ *w, size_t len)
+{
+	char *path;
+	size_t size = w->size == 0 ? PATH_MAX : w->size;
+
+	if(likely(len < w->size))
+		return 0;
+	while(size <= len)
+		size <<= 1;
+#ifdef INTERNAL_ERROR_HANDLING
+	path = (char*) xrealloc(w->path, size);
+#else
+	path = (char*) realloc(w->path, size);
+	if(unlikely(path == (char*) NULL)) {
+		errno = ENOMEM;
+		return -1;
+	}
+#endif /* #ifdef INTERNAL_ERROR_HANDLING */
+	w->path = path;
+	w->size = size;
+	return 0;
+}
+
+/* DirReader buffer for directories at depth, NULL if out of memory */
+static char *__dirwalk_buffer(struct __dirwalk__ *w, unsigned depth)
+{
+	char **bufs;
+
+	if(likely(depth < w->nbufs))
+		return w->bufs[depth];
+#ifdef INTERNAL_ERROR_HANDLING
+	bufs = (char**) xrealloc(w->bufs, (depth + 1) * sizeof(char*));
+	w->bufs = bufs;
+	bufs[depth] = (char*) xmalloc(DIRWALK_BUFSIZE);
+#else
+	bufs = (char**) realloc(w->bufs, (depth + 1) * sizeof(char*));
+	if(unlikely(bufs == (char**) NULL))
+		return (char*) NULL;
+	w->bufs = bufs;
+	if(unlikely((bufs[depth] = (char*) malloc(DIRWALK_BUFSIZE)) == (char*) NULL))
+		return (char*) NULL;
+#endif /* #ifdef INTERNAL_ERROR_HANDLING */
+	/* depths are reached in order */
+	w->nbufs = depth + 1;
+	return bufs[depth];
+}
+
+static DirEntryType __dirwalk_type(mode_t mode)
+{
+	if(S_ISREG(mode))
+		return DIRWALK_FILE;
+	if(S_ISDIR(mode))
+		return DIRWALK_DIR;
+	if(S_ISLNK(mode))
+		return DIRWALK_SYMLINK;
+	return DIRWALK_OTHER;
+}
+
+/* fill in e->type and e->st from dtype, only stat'ing e->name if it is unknown
+ * or flags ask for it. Return -1 if the entry vanished since it was read */
+static int __dirwalk_classify(DirEntry *e, int dtype, int flags, struct stat *st)
+{
+	e->st = (const struct stat*) NULL;
+	if(dtype >= 0 && ! (flags & DIRWALK_STAT)) {
+		e->type = (DirEntryType) dtype;
+		return 0;
+	}
+	if(fstatat(e->dirfd, e->name, st, AT_SYMLINK_NOFOLLOW) != 0)
+		return -1;
+	e->type = __dirwalk_type(st->st_mode);
+	if(flags & DIRWALK_STAT)
+		e->st = st;
+	return 0;
+}
+
+/* walk through directory fd, whose path is the first len characters of
+ * w->path. fd is closed when done */
+static int __dirwalk_dir(struct __dirwalk__ *w, int fd, size_t len, unsigned depth)
+{
+	char *buf = __dirwalk_buffer(w, depth);
+	DirReader r;
+	DirRecord rec;
+	struct stat st;
+	DirEntry e;
+	size_t base, namelen;
+	int ret = 0, subfd;
+
+	if(unlikely(buf == (char*) NULL)) {
+		close(fd);
+		errno = ENOMEM;
+		return -1;
+	}
+	if(dir_reader_init(&r, fd, buf, DIRWALK_BUFSIZE) != 0)
+		return depth == 0 ? -1 : 0;
+	/* path + '/', unless path is "/" */
+	base = len + (w->path[len - 1] != '/');
+	w->path[len] = '/';
+	e.dirfd = fd;
+	e.depth = depth;
+	while(dir_read(&r, &rec) == 1) {
+		namelen = strlen(rec.name);
+		if(unlikely(__dirwalk_reserve(w, base + namelen) != 0)) {
+			ret = -1;
+			break;
+		}
+		memcpy(&w->path[base], rec.name, namelen + 1);
+		e.path = w->path;
+		e.name = &w->path[base];
+		e.pathlen = base + namelen;
+		e.ino = rec.ino;
+		if(__dirwalk_classify(&e, rec.type, w->flags, &st) != 0)
+			continue;
+
+		if(e.type != DIRWALK_DIR || (w->flags & DIRWALK_DIRS)) {
+			ret = w->func(&e, w->arg);
+			if(ret == DIRWALK_PRUNE) {
+				ret = 0;
+				continue;
+			}
+			if(ret != 0)
+				break;
+		}
+		if(e.type == DIRWALK_DIR && (w->flags & DIRWALK_RECURSE)) {
+			subfd = openat(fd, &w->path[base], O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+			if(subfd < 0)
+				continue;
+			ret = __dirwalk_dir(w, subfd, base + namelen, depth + 1);
+			if(ret != 0)
+				break;
+			/* w->path may have moved */
+			w->path[len] = '/';
+		}
+	}
+	dir_reader_close(&r);
+	w->path[len] = '\0';
+	return ret;
+}
+
+/* strip trailing '/' from path, which __dirwalk_dir adds back. Return the new
+ * length of path, 0 if it is empty */
+static size_t __dirwalk_pathlen(const char *path)
+{
+	size_t len = strlen(path);
+
+	while(len > 1 && path[len - 1] == '/')
+		len--;
+	return len;
+}
+
+int dirwalk_at(int dirfd, const char *path, int flags, int (*func)(const DirEntry *entry, void *arg), void *arg)
+{
+	struct __dirwalk__ w;
+	size_t len = __dirwalk_pathlen(path);
+	int fd, ret;
+
+	if(unlikely(len == 0)) {
+		errno = ENOENT;
+		return -1;
+	}
+	__dirwalk_init(&w, flags, func, arg);
+	if(unlikely(__dirwalk_reserve(&w, len) != 0))
+		return -1;
+	memcpy(w.path, path, len);
+	w.path[len] = '\0';
+	fd = openat(dirfd, w.path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if(fd < 0) {
+		__dirwalk_free(&w);
+		return -1;
+	}
+	ret = __dirwalk_dir(&w, fd, len, 0);
+	__dirwalk_free(&w);
+	return ret;
+}
+
+struct __dirwalk_compat__ {
+	void *(*func)(char*, void*);
+	void *arg;
+};
+
+static int __dirwalk_compat(const DirEntry *entry, void *arg)
+{
+	struct __dirwalk_compat__ *c = (struct __dirwalk_compat__*) arg;
+
+	c->arg = c->func((char*) entry->path, c->arg);
+	return 0;
+}
+
+void *dirwalk(const char *path, BOOL_TYPE recurse, void *(*func)(char*, void*), void *arg)
+{
+	struct __dirwalk_compat__ c;
+
+	c.func = func;
+	c.arg = arg;
+	if(dirwalk_at(AT_FDCWD, path, recurse ? DIRWALK_RECURSE : 0, &__dirwalk_compat, &c) != 0)
+		return (void*) NULL;
+	return c.arg;
+}
+
+#if defined(__linux__) && defined(ENABLE_DATASTRUCTS)
+#define DIR_INDEX_MASK	(IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_MODIFY | IN_CLOSE_WRITE \
+			| IN_ATTRIB | IN_DELETE_SELF | IN_DONT_FOLLOW | IN_EXCL_UNLINK | IN_ONLYDIR)
+#define DIR_INDEX_DIRWALK	(DIRWALK_RECURSE | DIRWALK_DIRS | DIRWALK_STAT)
+
+/* followed by the path */
+struct __dir_index_entry__ {
+	DirIndexEntry e;
+	IListNode sibling;	/* in its parent's children */
+	IList children;		/* so that removing a directory only looks at what it holds */
+	int wd;			/* directories only, -1 otherwise */
+	unsigned gen;		/* of the last walk which saw the entry */
+};
+
+struct __dir_index__ {
+	HashMap entries;	/* path -> struct __dir_index_entry__* */
+	HashMap watches;	/* watch descriptor -> directory path */
+	char *root;
+	size_t rootlen;
+	int fd;
+	int rootwd;
+	unsigned gen;
+	IList top;		/* entries right under root */
+	char *path;		/* scratch buffer for event paths */
+	size_t pathsize;
+	char *parent;		/* scratch buffer for parent lookups */
+	size_t parentsize;
+	int nchanges;
+	BOOL_TYPE failed;	/* an entry could not be added during the last walk */
+	void (*func)(DirIndexChange, const DirIndexEntry*, void*);
+	void *arg;
+};
+
+/* make room for a string of len characters in *buf. Return 0 on success, -1 if
+ * out of memory */
+static int __dir_index_reserve(char **buf, size_t *size, size_t len)
+{
+	if(likely(len < *size))
+		return 0;
+	*size = len + 1 > PATH_MAX ? len + 1 : PATH_MAX;
+#ifdef INTERNAL_ERROR_HANDLING
+	*buf = (char*) xrealloc(*buf, *size);
+#else
+	free(*buf);
+	if(unlikely((*buf = (char*) malloc(*size)) == (char*) NULL)) {
+		*size = 0;
+		errno = ENOMEM;
+		return -1;
+	}
+#endif /* #ifdef INTERNAL_ERROR_HANDLING */
+	return 0;
+}
+
+static void __dir_index_report(DirIndex ix, DirIndexChange change, const DirIndexEntry *e)
+{
+	ix->nchanges++;
+	if(ix->func != NULL)
+		ix->func(change, e, ix->arg);
+}
+
+/* Return 0 on success, -1 on error */
+static int __dir_index_watch(DirIndex ix, const char *path, int *wd)
+{
+	char *copy;
+
+	if((*wd = inotify_add_watch(ix->fd, path, DIR_INDEX_MASK)) < 0)
+		/* gone already, or unreadable: indexed without its contents */
+		return errno == ENOENT || errno == ENOTDIR || errno == EACCES ? 0 : -1;
+	if(hashmap_contains(ix->watches, wd)) {
+		/* same inode as another directory, it cannot be watched twice */
+		*wd = -1;
+		return 0;
+	}
+#ifdef INTERNAL_ERROR_HANDLING
+	copy = xstrdup(path);
+#else
+	if(unlikely((copy = strdup(path)) == (char*) NULL))
+		goto error;
+#endif /* #ifdef INTERNAL_ERROR_HANDLING */
+	if(unlikely(hashmap_put(ix->watches, wd, copy) < 0)) {
+		free(copy);
+		goto error;
+	}
+	return 0;
+error:
+	inotify_rm_watch(ix->fd, *wd);
+	*wd = -1;
+	errno = ENOMEM;
+	return -1;
+}
+
+static void __dir_index_unwatch(DirIndex ix, int wd)
+{
+	if(hashmap_remove(ix->watches, &wd, NULL, &free) == 0)
+		inotify_rm_watch(ix->fd, wd);
+}
+
+/* remove entry and everything under it, deepest first like rm -r does */
+static void __dir_index_drop(DirIndex ix, struct __dir_index_entry__ *entry)
+{
+	while( ! ilist_empty(&entry->children))
+		__dir_index_drop(ix, container_of(ilist_front(&entry->children), struct __dir_index_entry__, sibling));
+	__dir_index_report(ix, DIR_INDEX_REMOVED, &entry->e);
+	if(entry->wd >= 0)
+		__dir_index_unwatch(ix, entry->wd);
+	ilist_remove(&entry->sibling);
+	hashmap_remove(ix->entries, entry->e.path, NULL, NULL);
+	free(entry);
+}
+
+static void __dir_index_remove(DirIndex ix, const char *path)
+{
+	struct __dir_index_entry__ *entry = (struct __dir_index_entry__*) hashmap_get(ix->entries, path);
+
+	if(entry != (struct __dir_index_entry__*) NULL)
+		__dir_index_drop(ix, entry);
+}
+
+/* remove what the last walk didn't see under children */
+static void __dir_index_sweep(DirIndex ix, IList *children)
+{
+	struct __dir_index_entry__ *entry;
+	IListNode *n, *tmp;
+
+	ilist_foreach_safe(children, n, tmp) {
+		entry = container_of(n, struct __dir_index_entry__, sibling);
+		if(entry->gen != ix->gen)
+			__dir_index_drop(ix, entry);
+		else
+			__dir_index_sweep(ix, &entry->children);
+	}
+}
+
+/* list of entries in the same directory as path, NULL if that directory is
+ * not indexed. Return 0 on success, -1 if out of memory */
+static int __dir_index_siblings(DirIndex ix, const char *path, size_t len, IList **siblings)
+{
+	struct __dir_index_entry__ *parent;
+
+	while(len > 0 && path[len - 1] != '/')
+		len--;
+	/* drop the '/', unless the parent is "/" */
+	if(len > 1)
+		len--;
+	if(len <= ix->rootlen) {
+		*siblings = &ix->top;
+		return 0;
+	}
+	if(unlikely(__dir_index_reserve(&ix->parent, &ix->parentsize, len) != 0))
+		return -1;
+	memcpy(ix->parent, path, len);
+	ix->parent[len] = '\0';
+	parent = (struct __dir_index_entry__*) hashmap_get(ix->entries, ix->parent);
+	*siblings = parent == (struct __dir_index_entry__*) NULL ? (IList*) NULL : &parent->children;
+	return 0;
+}
+
+/* add or update path from st, watching it if it is a directory.
+ * Return 0 on success, -1 on error */
+static int __dir_index_set(DirIndex ix, const char *path, size_t len, const struct stat *st)
+{
+	struct __dir_index_entry__ *entry = (struct __dir_index_entry__*) hashmap_get(ix->entries, path);
+	DirEntryType type = __dirwalk_type(st->st_mode);
+	IList *siblings;
+	BOOL_TYPE modified;
+
+	if(entry != (struct __dir_index_entry__*) NULL) {
+		entry->gen = ix->gen;
+		if(entry->e.type != type) {
+			/* replaced by something else: start over */
+			__dir_index_drop(ix, entry);
+		} else {
+			modified = entry->e.ino != (uint64_t) st->st_ino
+				|| (type != DIRWALK_DIR && (entry->e.size != (uint64_t) st->st_size
+							|| entry->e.mtime.tv_sec != st->st_mtim.tv_sec
+							|| entry->e.mtime.tv_nsec != st->st_mtim.tv_nsec));
+			entry->e.ino = (uint64_t) st->st_ino;
+			entry->e.size = (uint64_t) st->st_size;
+			entry->e.mtime = st->st_mtim;
+			if(modified)
+				__dir_index_report(ix, DIR_INDEX_MODIFIED, &entry->e);
+			return 0;
+		}
+	}
+	if(unlikely(__dir_index_siblings(ix, path, len, &siblings) != 0))
+		return -1;
+#ifdef INTERNAL_ERROR_HANDLING
+	entry = (struct __dir_index_entry__*) xmalloc(sizeof(struct __dir_index_entry__) + len + 1);
+#else
+	entry = (struct __dir_index_entry__*) malloc(sizeof(struct __dir_index_entry__) + len + 1);
+	if(unlikely(entry == (struct __dir_index_entry__*) NULL))
+		return -1;
+#endif /* #ifdef INTERNAL_ERROR_HANDLING */
+	memcpy(entry + 1, path, len + 1);
+	entry->e.path = (const char*) (entry + 1);
+	entry->e.ino = (uint64_t) st->st_ino;
+	entry->e.size = (uint64_t) st->st_size;
+	entry->e.mtime = st->st_mtim;
+	entry->e.type = type;
+	ilist_init(&entry->children);
+	entry->wd = -1;
+	entry->gen = ix->gen;
+	if(type == DIRWALK_DIR && __dir_index_watch(ix, path, &entry->wd) != 0) {
+		free(entry);
+		return -1;
+	}
+	if(unlikely(hashmap_put(ix->entries, entry->e.path, entry) < 0)) {
+		if(entry->wd >= 0)
+			__dir_index_unwatch(ix, entry->wd);
+		free(entry);
+		errno = ENOMEM;
+		return -1;
+	}
+	/* a lone node unlinks fine */
+	entry->sibling.next = entry->sibling.prev = &entry->sibling;
+	if(siblings != (IList*) NULL)
+		ilist_push_back(siblings, &entry->sibling);
+	__dir_index_report(ix, DIR_INDEX_ADDED, &entry->e);
+	return 0;
+}
+
+static int __dir_index_walk(const DirEntry *entry, void *arg)
+{
+	DirIndex ix = (DirIndex) arg;
+
+	/* entries are stat'ed relative to their directory, which might be gone
+	 * by the time they are added: the events will tell */
+	if(unlikely(__dir_index_set(ix, entry->path, entry->pathlen, entry->st) != 0)) {
+		ix->failed = BOOL_TRUE;
+		return -1;
+	}
+	return 0;
+}
+
+/* walk through path again, and drop what is not there anymore */
+static int __dir_index_rescan(DirIndex ix, const char *path, size_t len)
+{
+	struct __dir_index_entry__ *entry;
+	IList *children = &ix->top;
+	struct stat st;
+
+	ix->gen++;
+	if(len != ix->rootlen) {
+		if(lstat(path, &st) != 0) {
+			__dir_index_remove(ix, path);
+			return 0;
+		}
+		if(__dir_index_set(ix, path, len, &st) != 0)
+			return -1;
+		if( ! S_ISDIR(st.st_mode))
+			return 0;
+		entry = (struct __dir_index_entry__*) hashmap_get(ix->entries, path);
+		children = &entry->children;
+	}
+	ix->failed = BOOL_FALSE;
+	if(dirwalk_at(AT_FDCWD, path, DIR_INDEX_DIRWALK, &__dir_index_walk, ix) != 0) {
+		if(ix->failed || errno == ENOMEM)
+			return -1;
+		/* cannot be opened: skip its contents like dirwalk_at does for
+		 * subdirectories, and keep what was known of them. Unless the
+		 * directory was just removed */
+		if(errno != ENOENT && errno != ENOTDIR)
+			return 0;
+	}
+	__dir_index_sweep(ix, children);
+	return 0;
+}
+
+DirIndex new_dir_index(const char *path)
+{
+	DirIndex ix;
+	size_t len = __dirwalk_pathlen(path);
+
+	if(unlikely(len == 0)) {
+		errno = ENOENT;
+		return (DirIndex) NULL;
+	}
+#ifdef INTERNAL_ERROR_HANDLING
+	ix = (DirIndex) xmalloc(sizeof(struct __dir_index__));
+	ix->root = (char*) xmalloc(len + 1);
+	ix->entries = new_hashmap(0, 0, &hash_string, &string_equal);
+	ix->watches = new_hashmap(sizeof(int), 0, NULL, NULL);
+#else
+	ix = (DirIndex) malloc(sizeof(struct __dir_index__));
+	if(unlikely(ix == (DirIndex) NULL))
+		return (DirIndex) NULL;
+	ix->root = (char*) malloc(len + 1);
+	ix->entries = new_hashmap(0, 0, &hash_string, &string_equal);
+	ix->watches = new_hashmap(sizeof(int), 0, NULL, NULL);
+	if(unlikely(ix->root == (char*) NULL || ix->entries == (HashMap) NULL || ix->watches == (HashMap) NULL)) {
+		free(ix->root);
+		if(ix->entries != (HashMap) NULL)
+			delete_hashmap(ix->entries, NULL, NULL);
+		if(ix->watches != (HashMap) NULL)
+			delete_hashmap(ix->watches, NULL, NULL);
+		free(ix);
+		errno = ENOMEM;
+		return (DirIndex) NULL;
+	}
+#endif /* #ifdef INTERNAL_ERROR_HANDLING */
+	memcpy(ix->root, path, len);
+	ix->root[len] = '\0';
+	ix->rootlen = len;
+	ix->gen = 0;
+	ilist_init(&ix->top);
+	ix->path = (char*) NULL;
+	ix->pathsize = 0;
+	ix->parent = (char*) NULL;
+	ix->parentsize = 0;
+	ix->nchanges = 0;
+	ix->failed = BOOL_FALSE;
+	ix->func = NULL;
+	ix->arg = NULL;
+	if((ix->fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) < 0)
+		goto error;
+	/* watch before walking, so that nothing slips through */
+	if(__dir_index_watch(ix, ix->root, &ix->rootwd) != 0)
+		goto error;
+	/* errno set by inotify_add_watch */
+	if(ix->rootwd < 0)
+		goto error;
+	if(dirwalk_at(AT_FDCWD, ix->root, DIR_INDEX_DIRWALK, &__dir_index_walk, ix) != 0)
+		goto error;
+	return ix;
+error:
+	delete_dir_index(ix);
+	return (DirIndex) NULL;
+}
+
+void delete_dir_index(DirIndex ix)
+{
+	int err = errno;
+
+	delete_hashmap(ix->entries, NULL, &free);
+	delete_hashmap(ix->watches, NULL, &free);
+	/* removes all watches */
+	if(ix->fd >= 0)
+		close(ix->fd);
+	free(ix->path);
+	free(ix->parent);
+	free(ix->root);
+	free(ix);
+	errno = err;
+}
+
+int dir_index_fd(const DirIndex ix)
+{
+	return ix->fd;
+}
+
+/* apply ev. Return 0 on success, -1 on error */
+static int __dir_index_event(DirIndex ix, const struct inotify_event *ev)
+{
+	struct __dir_index_entry__ *entry;
+	const char *dir;
+	struct stat st;
+	size_t len, dirlen, namelen;
+
+	if(ev->mask & IN_Q_OVERFLOW)
+		return __dir_index_rescan(ix, ix->root, ix->rootlen);
+	if((dir = (const char*) hashmap_get(ix->watches, &ev->wd)) == (const char*) NULL)
+		return 0;
+	if(ev->mask & IN_IGNORED) {
+		/* directory removed, the watch is gone already */
+		hashmap_remove(ix->watches, &ev->wd, NULL, &free);
+		return 0;
+	}
+	/* events about dir itself, which its parent reports as well */
+	if(ev->len == 0)
+		return 0;
+
+	/* dir + '/' + name, unless dir is "/" */
+	dirlen = strlen(dir);
+	namelen = strlen(ev->name);
+	len = dirlen + (dir[dirlen - 1] != '/') + namelen;
+	if(unlikely(__dir_index_reserve(&ix->path, &ix->pathsize, len) != 0))
+		return -1;
+	memcpy(ix->path, dir, dirlen);
+	ix->path[dirlen] = '/';
+	memcpy(&ix->path[len - namelen], ev->name, namelen + 1);
+
+	if(ev->mask & (IN_DELETE | IN_MOVED_FROM)) {
+		__dir_index_remove(ix, ix->path);
+		return 0;
+	}
+	if(ev->mask & (IN_CREATE | IN_MOVED_TO)) {
+		/* directories may have been filled before being watched */
+		if(ev->mask & IN_ISDIR)
+			return __dir_index_rescan(ix, ix->path, len);
+	} else if((entry = (struct __dir_index_entry__*) hashmap_get(ix->entries, ix->path)) == (struct __dir_index_entry__*) NULL
+			|| entry->e.type == DIRWALK_DIR) {
+		/* contents of directories are tracked by their own watch */
+		return 0;
+	}
+	/* a later event will tell if it is gone */
+	if(lstat(ix->path, &st) != 0)
+		return 0;
+	return __dir_index_set(ix, ix->path, len, &st);
+}
+
+int dir_index_update(DirIndex ix, void (*func)(DirIndexChange change, const DirIndexEntry *entry, void *arg), void *arg)
+{
+	char buf[16384] __attribute__ ((aligned (__alignof__ (struct inotify_event))));
+	const struct inotify_event *ev;
+	ssize_t n, pos;
+
+	ix->func = func;
+	ix->arg = arg;
+	ix->nchanges = 0;
+	while((n = read(ix->fd, buf, sizeof(buf))) > 0) {
+		for(pos = 0; pos < n; pos += (ssize_t) (sizeof(struct inotify_event) + ev->len)) {
+			ev = (const struct inotify_event*) &buf[pos];
+			if(__dir_index_event(ix, ev) != 0)
+				return -1;
+		}
+	}
+	if(n < 0 && errno != EAGAIN && errno != EINTR)
+		return -1;
+	return ix->nchanges;
+}
+
+const DirIndexEntry *dir_index_get(const DirIndex ix, const char *path)
+{
+	return (const DirIndexEntry*) hashmap_get(ix->entries, path);
+}
+
+size_t dir_index_size(const DirIndex ix)
+{
+	return hashmap_size(ix->entries);
+}
+
+BOOL_TYPE dir_index_iterate(const DirIndex ix, size_t *pos, const DirIndexEntry **entry)
+{
+	void *value;
+
+	if( ! hashmap_iterate(ix->entries, pos, NULL, &value))
+		return BOOL_FALSE;
+	*entry = (const DirIndexEntry*) value;
+	return BOOL_TRUE;
+}
+
+#undef DIR_INDEX_DIRWALK
+#undef DIR_INDEX_MASK
+#endif /* #if defined(__linux__) && defined(ENABLE_DATASTRUCTS) */
+
+#ifndef ENABLE_THREADING
+#undef DIRWALK_BUFSIZE
+#endif /* #ifndef ENABLE_THREADING */
+#undef __dirwalk_skip
+#else
+void *dirwalk(const char *path, BOOL_TYPE recurse, void *(*func)(char*, void*), void *arg)
+{
+	DIR *dir;
+	struct dirent *entry;
+	char *new_path;
+
+	dir = opendir(path);
+	if(dir != (DIR*) NULL) {
+        while((entry = readdir(dir)) != (struct dirent*) NULL)
+            if(strcmp(entry->d_name, ".") != 0 && strcmp(entry->d_name, "..") != 0) {
+#ifdef C99
+                new_path = make_path(path, entry->d_name);
+#else
+                new_path = make_path(path, entry->d_name, NULL);
+#endif /* #ifdef C99 */
+#ifndef INTERNAL_ERROR_HANDLING
+                if(unlikely(new_path == (char*) NULL)) {
+                    closedir(dir);
+                    return (void*) NULL;
+                }
+#endif /* #ifndef INTERNAL_ERROR_HANDLING */
+#ifdef _DIRENT_HAVE_D_TYPE
+                if(entry->d_type == DT_DIR)
+#else
+                    if(is_dir(new_path))
+#endif /* #ifdef _WIN32 */
+                    {
+                        if(recurse)
+                            dirwalk(new_path, recurse, func, arg);
+                    } else
+                        arg = func(new_path, arg);
+                free(new_path);
+            }
+		closedir(dir);
+	} else
+		arg = (void*) NULL;
+	return arg;
+}
+#endif /* #ifdef __unix__ */
+#endif /* #ifdef ENABLE_FILESYSTEM */
+
+
+/* -------------------- Networking functions -------------------- */
+#ifdef ENABLE_NETWORKING
+
+int connect_to(const char *server_name, unsigned port)
+{
+	struct addrinfo *adresses = (struct addrinfo*) NULL, *iterator = (struct addrinfo*) NULL;
+	char ip_addr[INET6_ADDRSTRLEN] = { 0 }, port_buff[11] = { 0 };
+	int sockfd;
+
+	sockfd = socket(AF_INET, SOCK_STREAM, 0);
+	snprintf(port_buff, 11, "%u", port);
+	if(sockfd == -1) {
+		log_message(LOG_ERROR, "Error creating socket: %s", strerror(errno));
+		sockfd = CONNECT_ERROR;
+	} else if(getaddrinfo(server_name, port_buff, (const struct addrinfo*) NULL, &adresses) != 0) {
+		/* DNS resolution. getaddrinfo creates a linked list (pointed to by adresses),
+		 * 1 element == 1 IP Address. Function IPv6 compatible. */
+		log_message(LOG_ERROR, "Unable to resolve '%s' to a valid IP address", server_name);
+		sockfd = CONNECT_ERROR;
+	} else {
+		log_message(LOG_INFO, "DNS lookup succesful");
+		iterator = adresses;
+		/* Iterate over linked list until we connect successfully or we run out of addresses. */
+		while(connect(sockfd, iterator->ai_addr, (socklen_t) sizeof *iterator->ai_addr) != 0) {
+			iterator = iterator->ai_next;
+			if(unlikely(iterator == (struct addrinfo*) NULL)) {
+				sockfd = CONNECT_ERROR;
+				break;
+			}
+		}
+		if(likely(iterator != (struct addrinfo*) NULL))
+			log_message(LOG_INFO, "Connection established with %s (%s:%d)", server_name,
+					inet_ntop(iterator->ai_family,
+						&((struct sockaddr_in*) iterator->ai_addr)->sin_addr,
+						ip_addr, sizeof ip_addr),
+					ntohs(((struct sockaddr_in*) iterator->ai_addr)->sin_port));
+		freeaddrinfo(adresses);
+	}
+	return sockfd;
+}
+
+int create_server(unsigned port)
+{
+	int sockfd;
+	unsigned queue = 1;
+	struct sockaddr_in config;
+
+	memset(&config, 0, sizeof config);
+	config.sin_family = PF_INET;
+	config.sin_addr.s_addr = htonl(INADDR_ANY);
+	config.sin_port = htons(port);
+
+	sockfd = socket(AF_INET, SOCK_STREAM, 0);
+	if(sockfd == -1) {
+		log_message(LOG_ERROR, "Error creating socket: %s", strerror(errno));
+		sockfd = CONNECT_ERROR;
+	} else {
+		if(setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &queue, sizeof queue) != 0)
+			log_message(LOG_ERROR, "Error setting socket option SO_REUSEADDR: %s", strerror(errno));
+		/* print error message but keep on going. Failing here will not prevent program from
+		 * working correctly */
+		queue = SOMAXCONN;
+		if(bind(sockfd, (struct sockaddr*) &config, sizeof config) != 0 || listen(sockfd, queue) != 0) {
+			shutdown(sockfd, SHUT_RDWR);
+			log_message(LOG_ERROR, "Error binding server %d: %s", port, strerror(errno));
+			sockfd = CONNECT_ERROR;
+		} else
+			log_message(LOG_INFO, "Server initialized on port %u", port);
+	}
+	return sockfd;
+}
+
+int get_single_client(int server_socket)
+{
+	struct sockaddr_in client_config;
+	int client_fd;
+	char buffer[INET6_ADDRSTRLEN];
+	socklen_t size = sizeof client_config;
+
+	client_fd = accept(server_socket, (struct sockaddr*) &client_config, &size);
+	if(client_fd != -1)
+		log_message(LOG_INFO, "Connection established to %s:%u",
+				inet_ntop(AF_INET, &client_config.sin_addr, buffer, INET6_ADDRSTRLEN),
+				ntohs(client_config.sin_port));
+	else {
+		client_fd = CONNECT_ERROR;
+		log_message(LOG_ERROR, "Error establishing connection: %s", strerror(errno));
+	}
+
+	return client_fd;
 }
 
 #endif /* ifdef ENABLE_NETWORKING */
 
 
-/* -------------------- Terminal manipulation functions and color printing -------------------- */
-#if defined(ENABLE_TERMIOS_MANIPULATION) && defined(__unix__)
+/* -------------------- Terminal manipulation functions and color printing -------------------- */
+#if defined(ENABLE_TERMIOS_MANIPULATION) && defined(__unix__)
+
+typedef struct {
+	Color c;
+	Color bgc;
+	Style s;
+} ColorEnv;
+
+static ColorEnv __color_session__;
+
+void set_style(Color c, Color bgc, Style s)
+{
+	printf("\x1B[%d;%dm", c + 30, s);
+	__color_session__.c = c;
+	__color_session__.s = s;
+	printf("\x1B[%dm", bgc + 40);
+	__color_session__.bgc = bgc;
+}
+
+void stylish_fprintf(FILE *stream, Color c, Color bgc, Style s, const char *fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	fprintf(stream, "\x1B[%d;%dm", c + 30, s);
+	fprintf(stream, "\x1B[%dm", bgc + 40);
+	vprintf(fmt, ap);
+	va_end(ap);
+	fprintf(stream, "\x1B[%dm", __color_session__.bgc);
+	fprintf(stream, "\x1B[%d;%dm", __color_session__.c + 30, __color_session__.s);
+	fflush(stream);
+}
+
+int turn_echoing_off(void)
+{
+	struct termios term;
+
+	if(tcgetattr(STDIN_FILENO, &term) != 0) {
+#ifdef INTERNAL_ERROR_HANDLING
+		log_message(LOG_FATAL, "Error manipulating terminal: %s", strerror(errno));
+		exit(EXIT_FAILURE);
+#else
+		return -1;
+#endif /* #ifdef INTERNAL_ERROR_HANDLING */
+	}
+	term.c_lflag &= ~ECHO;
+	if(tcsetattr(STDIN_FILENO, TCSAFLUSH, &term) != 0) {
+#ifdef INTERNAL_ERROR_HANDLING
+		log_message(LOG_FATAL, "Error manipulating terminal: %s", strerror(errno));
+		exit(EXIT_FAILURE);
+#else
+		return -1;
+#endif /* #ifdef INTERNAL_ERROR_HANDLING */
+	}
+	return 0;
+}
+
+int turn_echoing_on(void)
+{
+	struct termios term;
+
+	if(tcgetattr(STDIN_FILENO, &term) != 0) {
+#ifdef INTERNAL_ERROR_HANDLING
+		log_message(LOG_FATAL, "Error manipulating terminal: %s", strerror(errno));
+		exit(EXIT_FAILURE);
+#else
+		return -1;
+#endif /* #ifdef INTERNAL_ERROR_HANDLING */
+	}
+	term.c_lflag |= ECHO;
+	if(tcsetattr(STDIN_FILENO, TCSAFLUSH, &term) != 0) {
+#ifdef INTERNAL_ERROR_HANDLING
+		log_message(LOG_FATAL, "Error manipulating terminal: %s", strerror(errno));
+		exit(EXIT_FAILURE);
+#else
+		return -1;
+#endif /* #ifdef INTERNAL_ERROR_HANDLING */
+	}
+	return 0;
+}
+
+int instant_getchar(void)
+{
+	struct termios term;
+
+	if(tcgetattr(STDIN_FILENO, &term) != 0) {
+#ifdef INTERNAL_ERROR_HANDLING
+		log_message(LOG_FATAL, "Error manipulating terminal: %s", strerror(errno));
+		exit(EXIT_FAILURE);
+#else
+		return -1;
+#endif /* #ifdef INTERNAL_ERROR_HANDLING */
+	}
+	term.c_lflag &= ~ICANON;
+	term.c_cc[VMIN] = 1;
+	term.c_cc[VTIME] = 0;
+
+	if(tcsetattr(STDIN_FILENO, TCSAFLUSH, &term) != 0) {
+#ifdef INTERNAL_ERROR_HANDLING
+		log_message(LOG_FATAL, "Error manipulating terminal: %s", strerror(errno));
+		exit(EXIT_FAILURE);
+#else
+		return -1;
+#endif /* #ifdef INTERNAL_ERROR_HANDLING */
+	}
+	return 0;
+}
+
+int normal_getchar(void)
+{
+	struct termios term;
+
+	if(tcgetattr(STDIN_FILENO, &term) != 0) {
+#ifdef INTERNAL_ERROR_HANDLING
+		log_message(LOG_FATAL, "Error manipulating terminal: %s", strerror(errno));
+		exit(EXIT_FAILURE);
+#else
+		return -1;
+#endif /* #ifdef INTERNAL_ERROR_HANDLING */
+	}
+	term.c_lflag |= ICANON;
+	if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &term) != 0) {
+#ifdef INTERNAL_ERROR_HANDLING
+		log_message(LOG_FATAL, "Error manipulating terminal: %s", strerror(errno));
+		exit(EXIT_FAILURE);
+#else
+		return -1;
+#endif /* #ifdef INTERNAL_ERROR_HANDLING */
+	}
+	return 0;
+}
+
+#endif /* #if defined(ENABLE_TERMIOS_MANIPULATION) && defined(__unix__) */
+
+
+/* -------------------- Threading -------------------- */
+#ifdef ENABLE_THREADING
+
+pthread_t launch_thread(void *(*start_routine)(void*), void *arg, const pthread_attr_t *attr)
+{
+	pthread_t th;
+	if(pthread_create(&th, attr, start_routine, arg) != 0) {
+		log_message(LOG_ERROR, "Error creating thread: %s", strerror(errno));
+		th = 0;
+	}
+	return th;
+}
+
+#ifdef ENABLE_ERROR_HANDLING
+
+pthread_t xlaunch_thread(void *(*start_routine)(void*), void *arg, const pthread_attr_t *attr)
+{
+	pthread_t th = launch_thread(start_routine, arg, attr);
+	if(th == 0) {
+		log_message(LOG_FATAL, "Thread not created: %s", strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+	return th;
+}
+
+void *xpthread_join(pthread_t thread)
+{
+	void *retval;
+
+	if(pthread_join(thread, &retval) != 0) {
+		log_message(LOG_FATAL, "Error joining threads: %s", strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+	return retval;
+}
+#endif /* #ifdef ENABLE_ERROR_HANDLING */
+
+/* sleep as long as *addr == val. May return spuriously */
+static void __futex_wait(uint32_t *addr, uint32_t val)
+{
+#ifdef __linux__
+	syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, val, (struct timespec*) NULL, (uint32_t*) NULL, 0);
+#else
+	if(__atomic_load_n(addr, __ATOMIC_ACQUIRE) == val)
+		sched_yield();
+#endif /* #ifdef __linux__ */
+}
+
+static void __futex_wake(uint32_t *addr, int nwaiters)
+{
+#ifdef __linux__
+	syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, nwaiters, (struct timespec*) NULL, (uint32_t*) NULL, 0);
+#else
+	(void) addr;
+	(void) nwaiters;
+#endif /* #ifdef __linux__ */
+}
+
+/* ----- Bounded MPMC queue ----- */
+#define MPMC_SPIN_COUNT	128
+
+struct __mpmc_slot__ {
+	size_t seq;
+	void *data;
+};
+
+struct __mpmc_queue__ {
+	struct __mpmc_slot__ *slots;
+	size_t mask;
+	/* event counters bumped when elements are pushed/popped while threads are
+	 * waiting for them, and number of threads waiting */
+	uint32_t push_events, pop_events, push_waiters, pop_waiters;
+	size_t head __attribute__ ((aligned (CACHE_LINE_SIZE)));
+	size_t tail __attribute__ ((aligned (CACHE_LINE_SIZE)));
+};
+
+MPMCQueue new_mpmc_queue(size_t capacity)
+{
+	MPMCQueue q;
+	size_t i, size = 2;
+
+	while(size < capacity)
+		size <<= 1;
+#ifdef INTERNAL_ERROR_HANDLING
+	q = (MPMCQueue) xmemalign(CACHE_LINE_SIZE, sizeof(struct __mpmc_queue__));
+	q->slots = (struct __mpmc_slot__*) xmemalign(CACHE_LINE_SIZE, size * sizeof(struct __mpmc_slot__));
+#else
+	if(unlikely(posix_memalign((void**) &q, CACHE_LINE_SIZE, sizeof(struct __mpmc_queue__)) != 0))
+		return (MPMCQueue) NULL;
+	if(unlikely(posix_memalign((void**) &q->slots, CACHE_LINE_SIZE,
+					size * sizeof(struct __mpmc_slot__)) != 0)) {
+		free(q);
+		errno = ENOMEM;
+		return (MPMCQueue) NULL;
+	}
+#endif /* #ifdef INTERNAL_ERROR_HANDLING */
+	for(i = 0; i < size; i++)
+		q->slots[i].seq = i;
+	q->mask = size - 1;
+	q->head = q->tail = 0;
+	q->push_events = q->pop_events = q->push_waiters = q->pop_waiters = 0;
+	return q;
+}
+
+void delete_mpmc_queue(MPMCQueue q, void (*__del__)(void*))
+{
+	void *data;
+
+	if(__del__ != (void(*)(void*)) NULL)
+		while(mpmc_try_pop(q, &data) == 0)
+			__del__(data);
+	free(q->slots);
+	free(q);
+}
+
+/* tell up to nwaiters threads sleeping on events that something changed */
+static void __mpmc_notify(uint32_t *events, uint32_t *waiters, size_t nwaiters)
+{
+	/* orders our release of the slot before reading waiters, pairing with the
+	 * increment of waiters in mpmc_push/mpmc_pop */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if(unlikely(__atomic_load_n(waiters, __ATOMIC_RELAXED) != 0)) {
+		__atomic_add_fetch(events, 1, __ATOMIC_SEQ_CST);
+		__futex_wake(events, nwaiters > INT_MAX ? INT_MAX : (int) nwaiters);
+	}
+}
+
+/* claim up to nmemb consecutive slots at *pos whose sequence number is
+ * *pos + i + offset. Returns number of slots claimed */
+static size_t __mpmc_claim(MPMCQueue q, size_t *counter, size_t *pos, size_t nmemb, size_t offset)
+{
+	size_t n, seq;
+	intptr_t diff = 0;
+
+	*pos = __atomic_load_n(counter, __ATOMIC_RELAXED);
+	for(;;) {
+		for(n = 0; n < nmemb; n++) {
+			seq = __atomic_load_n(&q->slots[(*pos + n) & q->mask].seq, __ATOMIC_ACQUIRE);
+			diff = (intptr_t) seq - (intptr_t) (*pos + n + offset);
+			if(diff != 0)
+				break;
+		}
+		if(n != 0) {
+			/* a failed exchange reloads *pos */
+			if(__atomic_compare_exchange_n(counter, pos, *pos + n, BOOL_TRUE,
+						__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				return n;
+		} else if(diff < 0) {
+			/* slot is still in use from the previous lap: ring is full/empty */
+			return 0;
+		} else {
+			/* another thread claimed it already */
+			*pos = __atomic_load_n(counter, __ATOMIC_RELAXED);
+		}
+	}
+}
+
+size_t mpmc_push_batch(MPMCQueue q, void **data, size_t nmemb)
+{
+	size_t pos, i, n;
+	struct __mpmc_slot__ *slot;
+
+	if(unlikely(nmemb == 0))
+		return 0;
+	n = __mpmc_claim(q, &q->head, &pos, nmemb, 0);
+	for(i = 0; i < n; i++) {
+		slot = &q->slots[(pos + i) & q->mask];
+		slot->data = data[i];
+		__atomic_store_n(&slot->seq, pos + i + 1, __ATOMIC_RELEASE);
+	}
+	if(n != 0)
+		__mpmc_notify(&q->push_events, &q->pop_waiters, n);
+	return n;
+}
+
+size_t mpmc_pop_batch(MPMCQueue q, void **data, size_t nmemb)
+{
+	size_t pos, i, n;
+	struct __mpmc_slot__ *slot;
+
+	if(unlikely(nmemb == 0))
+		return 0;
+	n = __mpmc_claim(q, &q->tail, &pos, nmemb, 1);
+	for(i = 0; i < n; i++) {
+		slot = &q->slots[(pos + i) & q->mask];
+		data[i] = slot->data;
+		__atomic_store_n(&slot->seq, pos + i + q->mask + 1, __ATOMIC_RELEASE);
+	}
+	if(n != 0)
+		__mpmc_notify(&q->pop_events, &q->push_waiters, n);
+	return n;
+}
+
+int mpmc_try_push(MPMCQueue q, void *data)
+{
+	return mpmc_push_batch(q, &data, 1) == 1 ? 0 : -1;
+}
+
+int mpmc_try_pop(MPMCQueue q, void **data)
+{
+	return mpmc_pop_batch(q, data, 1) == 1 ? 0 : -1;
+}
+
+void mpmc_push(MPMCQueue q, void *data)
+{
+	unsigned spins = 0;
+	uint32_t ev;
+
+	while(mpmc_try_push(q, data) != 0) {
+		if(spins++ < MPMC_SPIN_COUNT) {
+			cpu_relax();
+			continue;
+		}
+		/* register as waiting before the last attempt, so that a pop
+		 * happening in between sees us and bumps pop_events */
+		ev = __atomic_load_n(&q->pop_events, __ATOMIC_ACQUIRE);
+		__atomic_add_fetch(&q->push_waiters, 1, __ATOMIC_SEQ_CST);
+		if(mpmc_try_push(q, data) == 0) {
+			__atomic_sub_fetch(&q->push_waiters, 1, __ATOMIC_RELAXED);
+			break;
+		}
+		__futex_wait(&q->pop_events, ev);
+		__atomic_sub_fetch(&q->push_waiters, 1, __ATOMIC_RELAXED);
+	}
+}
+
+void *mpmc_pop(MPMCQueue q)
+{
+	unsigned spins = 0;
+	uint32_t ev;
+	void *data;
+
+	while(mpmc_try_pop(q, &data) != 0) {
+		if(spins++ < MPMC_SPIN_COUNT) {
+			cpu_relax();
+			continue;
+		}
+		ev = __atomic_load_n(&q->push_events, __ATOMIC_ACQUIRE);
+		__atomic_add_fetch(&q->pop_waiters, 1, __ATOMIC_SEQ_CST);
+		if(mpmc_try_pop(q, &data) == 0) {
+			__atomic_sub_fetch(&q->pop_waiters, 1, __ATOMIC_RELAXED);
+			break;
+		}
+		__futex_wait(&q->push_events, ev);
+		__atomic_sub_fetch(&q->pop_waiters, 1, __ATOMIC_RELAXED);
+	}
+	return data;
+}
+#undef MPMC_SPIN_COUNT
+
+/* ----- SPSC ring buffer ----- */
+#define SPSC_SPIN_COUNT	128
+
+struct __spsc_ring__ {
+	void **slots;
+	size_t mask;
+	int flags;
+	/* event counters and flags for the side sleeping in spsc_wait_*() */
+	uint32_t commit_events, release_events, producer_waiting, consumer_waiting;
+	/* written by producer. cached_tail is the consumer's index as last seen */
+	size_t head __attribute__ ((aligned (CACHE_LINE_SIZE)));
+	size_t cached_tail;
+	/* written by consumer */
+	size_t tail __attribute__ ((aligned (CACHE_LINE_SIZE)));
+	size_t cached_head;
+};
+
+SPSCRing new_spsc_ring(size_t capacity, int flags)
+{
+	SPSCRing r;
+	size_t size = 2;
+
+	while(size < capacity)
+		size <<= 1;
+#ifdef INTERNAL_ERROR_HANDLING
+	r = (SPSCRing) xmemalign(CACHE_LINE_SIZE, sizeof(struct __spsc_ring__));
+	r->slots = (void**) xmalloc(size * sizeof(void*));
+#else
+	if(unlikely(posix_memalign((void**) &r, CACHE_LINE_SIZE, sizeof(struct __spsc_ring__)) != 0))
+		return (SPSCRing) NULL;
+	r->slots = (void**) malloc(size * sizeof(void*));
+	if(unlikely(r->slots == (void**) NULL)) {
+		free(r);
+		return (SPSCRing) NULL;
+	}
+#endif /* #ifdef INTERNAL_ERROR_HANDLING */
+	r->mask = size - 1;
+	r->flags = flags;
+	r->commit_events = r->release_events = r->producer_waiting = r->consumer_waiting = 0;
+	r->head = r->cached_tail = r->tail = r->cached_head = 0;
+	return r;
+}
+
+void delete_spsc_ring(SPSCRing r, void (*__del__)(void*))
+{
+	size_t i;
+
+	if(__del__ != (void(*)(void*)) NULL)
+		for(i = r->tail; i != r->head; i++)
+			__del__(r->slots[i & r->mask]);
+	free(r->slots);
+	free(r);
+}
+
+/* wake up the other side if it sleeps waiting for events */
+static void __spsc_notify(SPSCRing r, uint32_t *events, uint32_t *waiting)
+{
+	if(r->flags & SPSC_BLOCKING) {
+		/* pairs with the store to waiting in __spsc_wait() */
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		if(unlikely(__atomic_load_n(waiting, __ATOMIC_RELAXED))) {
+			__atomic_add_fetch(events, 1, __ATOMIC_SEQ_CST);
+			__futex_wake(events, 1);
+		}
+	}
+}
+
+size_t spsc_reserve(SPSCRing r, void ***slots, size_t nmemb)
+{
+	size_t size = r->mask + 1, avail, run;
+
+	avail = size - (r->head - r->cached_tail);
+	if(avail < nmemb) {
+		r->cached_tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+		avail = size - (r->head - r->cached_tail);
+	}
+	run = size - (r->head & r->mask);
+	if(avail > run)
+		avail = run;
+	*slots = &r->slots[r->head & r->mask];
+	return avail < nmemb ? avail : nmemb;
+}
+
+void spsc_commit(SPSCRing r, size_t n)
+{
+	__atomic_store_n(&r->head, r->head + n, __ATOMIC_RELEASE);
+	__spsc_notify(r, &r->commit_events, &r->consumer_waiting);
+}
+
+size_t spsc_peek(SPSCRing r, void ***slots, size_t nmemb)
+{
+	size_t avail, run;
+
+	avail = r->cached_head - r->tail;
+	if(avail < nmemb) {
+		r->cached_head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+		avail = r->cached_head - r->tail;
+	}
+	run = r->mask + 1 - (r->tail & r->mask);
+	if(avail > run)
+		avail = run;
+	*slots = &r->slots[r->tail & r->mask];
+	return avail < nmemb ? avail : nmemb;
+}
+
+void spsc_release(SPSCRing r, size_t n)
+{
+	__atomic_store_n(&r->tail, r->tail + n, __ATOMIC_RELEASE);
+	__spsc_notify(r, &r->release_events, &r->producer_waiting);
+}
+
+int spsc_try_push(SPSCRing r, void *data)
+{
+	void **slot;
+
+	if(spsc_reserve(r, &slot, 1) == 0)
+		return -1;
+	*slot = data;
+	spsc_commit(r, 1);
+	return 0;
+}
+
+int spsc_try_pop(SPSCRing r, void **data)
+{
+	void **slot;
+
+	if(spsc_peek(r, &slot, 1) == 0)
+		return -1;
+	*data = *slot;
+	spsc_release(r, 1);
+	return 0;
+}
+
+/* wait until ready(r) */
+static void __spsc_wait(SPSCRing r, int (*ready)(SPSCRing), uint32_t *events, uint32_t *waiting)
+{
+	unsigned spins = 0;
+	uint32_t ev;
+
+	while( ! ready(r)) {
+		if(spins++ < SPSC_SPIN_COUNT) {
+			cpu_relax();
+		} else if( ! (r->flags & SPSC_BLOCKING)) {
+			sched_yield();
+		} else {
+			/* announce we are going to sleep before checking one last
+			 * time, so that the other side cannot miss us */
+			ev = __atomic_load_n(events, __ATOMIC_ACQUIRE);
+			__atomic_store_n(waiting, 1, __ATOMIC_SEQ_CST);
+			if( ! ready(r))
+				__futex_wait(events, ev);
+			__atomic_store_n(waiting, 0, __ATOMIC_RELAXED);
+		}
+	}
+}
+
+static int __spsc_writable(SPSCRing r)
+{
+	void **slot;
+
+	return spsc_reserve(r, &slot, 1) != 0;
+}
+
+static int __spsc_readable(SPSCRing r)
+{
+	void **slot;
+
+	return spsc_peek(r, &slot, 1) != 0;
+}
+
+void spsc_wait_writable(SPSCRing r)
+{
+	__spsc_wait(r, &__spsc_writable, &r->release_events, &r->producer_waiting);
+}
+
+void spsc_wait_readable(SPSCRing r)
+{
+	__spsc_wait(r, &__spsc_readable, &r->commit_events, &r->consumer_waiting);
+}
+
+void spsc_push(SPSCRing r, void *data)
+{
+	while(spsc_try_push(r, data) != 0)
+		spsc_wait_writable(r);
+}
+
+void *spsc_pop(SPSCRing r)
+{
+	void *data;
+
+	while(spsc_try_pop(r, &data) != 0)
+		spsc_wait_readable(r);
+	return data;
+}
+#undef SPSC_SPIN_COUNT
+
+/* ----- Epoch-based reclamation ----- */
+/* retirements between attempts to advance the global epoch */
+#define EBR_ADVANCE_INTERVAL	64
+
+/* per thread state. Records are never freed before the EBR, threads exiting
+ * leave theirs to be reused by the next thread registering */
+struct __ebr_record__ {
+	/* (epoch << 1) | 1 while pinned, 0 otherwise */
+	size_t state __attribute__ ((aligned (CACHE_LINE_SIZE)));
+	unsigned nest;
+	size_t nretired;
+	/* retired entries, by epoch modulo 3 */
+	struct {
+		EBREntry *head;
+		size_t epoch;
+	} limbo[3];
+	int in_use;
+	struct __ebr_record__ *next;
+	EBR ebr;
+};
+
+struct __ebr__ {
+	size_t epoch __attribute__ ((aligned (CACHE_LINE_SIZE)));
+	struct __ebr_record__ *records;
+	/* tells this EBR from a later one allocated at the same address */
+	uint64_t id;
+	EBR next_live;
+};
+
+/* The records of the calling thread, in an open addressing table keyed by EBR.
+ * A single pthread key serves all EBRs, so their number is not bounded by
+ * PTHREAD_KEYS_MAX */
+struct __ebr_slot__ {
+	EBR ebr;
+	uint64_t id;
+	struct __ebr_record__ *record;
+	BOOL_TYPE live;
+};
+
+static __thread struct __ebr_slot__ *__ebr_slots__ = (struct __ebr_slot__*) NULL;
+static __thread size_t __ebr_nslots__ = 0;
+static __thread size_t __ebr_slots_size__ = 0;
+
+static pthread_key_t __ebr_key__;
+static pthread_once_t __ebr_once__ = PTHREAD_ONCE_INIT;
+static int __ebr_key_error__ = 0;
+
+/* EBRs not deleted yet, so that exiting threads only touch records which
+ * still exist */
+static pthread_mutex_t __ebr_lock__ = PTHREAD_MUTEX_INITIALIZER;
+static EBR __ebr_live__ = (EBR) NULL;
+static uint64_t __ebr_next_id__ = 0;
+
+/* EBRs are cache line aligned, the low bits carry nothing */
+#define EBR_SLOT_HASH(e)	((size_t) ((uintptr_t) (e) / CACHE_LINE_SIZE))
+
+/* flag the slots of the calling thread whose EBR was not deleted. Call with
+ * __ebr_lock__ held */
+static void __ebr_mark_live(void)
+{
+	EBR e;
+	size_t i, mask = __ebr_slots_size__ - 1;
+
+	for(i = 0; i < __ebr_slots_size__; i++)
+		__ebr_slots__[i].live = BOOL_FALSE;
+	if(__ebr_slots_size__ == 0)
+		return;
+	for(e = __ebr_live__; e != (EBR) NULL; e = e->next_live)
+		for(i = EBR_SLOT_HASH(e) & mask; __ebr_slots__[i].ebr != (EBR) NULL; i = (i + 1) & mask)
+			if(__ebr_slots__[i].ebr == e && __ebr_slots__[i].id == e->id) {
+				__ebr_slots__[i].live = BOOL_TRUE;
+				break;
+			}
+}
+
+/* runs at thread exit */
+static void __ebr_thread_exit(void *unused)
+{
+	size_t i;
+
+	(void) unused;
+	pthread_mutex_lock(&__ebr_lock__);
+	__ebr_mark_live();
+	for(i = 0; i < __ebr_slots_size__; i++)
+		if(__ebr_slots__[i].live)
+			__atomic_store_n(&__ebr_slots__[i].record->in_use, 0, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&__ebr_lock__);
+	free(__ebr_slots__);
+	__ebr_slots__ = (struct __ebr_slot__*) NULL;
+	__ebr_nslots__ = __ebr_slots_size__ = 0;
+}
+
+static void __ebr_key_init(void)
+{
+	__ebr_key_error__ = pthread_key_create(&__ebr_key__, &__ebr_thread_exit);
+}
+
+EBR new_ebr(void)
+{
+	EBR e;
+
+#ifdef INTERNAL_ERROR_HANDLING
+	e = (EBR) xmemalign(CACHE_LINE_SIZE, sizeof(struct __ebr__));
+#else
+	if(unlikely(posix_memalign((void**) &e, CACHE_LINE_SIZE, sizeof(struct __ebr__)) != 0)) {
+		errno = ENOMEM;
+		return (EBR) NULL;
+	}
+#endif /* #ifdef INTERNAL_ERROR_HANDLING */
+	pthread_once(&__ebr_once__, &__ebr_key_init);
+	if(unlikely(__ebr_key_error__ != 0)) {
+		free(e);
+		errno = __ebr_key_error__;
+		return (EBR) NULL;
+	}
+	e->epoch = 0;
+	e->records = (struct __ebr_record__*) NULL;
+	pthread_mutex_lock(&__ebr_lock__);
+	e->id = __ebr_next_id__++;
+	e->next_live = __ebr_live__;
+	__ebr_live__ = e;
+	pthread_mutex_unlock(&__ebr_lock__);
+	return e;
+}
+
+static void __ebr_free_list(EBREntry *entry)
+{
+	EBREntry *next;
+
+	while(entry != (EBREntry*) NULL) {
+		next = entry->next;
+		entry->__free__(entry->ptr, entry->arg);
+		entry = next;
+	}
+}
+
+void delete_ebr(EBR e)
+{
+	struct __ebr_record__ *r, *next;
+	EBR *prev;
+	int i;
+
+	pthread_mutex_lock(&__ebr_lock__);
+	for(prev = &__ebr_live__; *prev != e; prev = &(*prev)->next_live)
+		;
+	*prev = e->next_live;
+	pthread_mutex_unlock(&__ebr_lock__);
+	for(r = e->records; r != (struct __ebr_record__*) NULL; r = next) {
+		next = r->next;
+		for(i = 0; i < 3; i++)
+			__ebr_free_list(r->limbo[i].head);
+		free(r);
+	}
+	free(e);
+}
+
+/* record of calling thread for e, NULL if it has none yet */
+static struct __ebr_record__ *__ebr_find(EBR e)
+{
+	size_t i, mask = __ebr_slots_size__ - 1;
+
+	if(unlikely(__ebr_slots_size__ == 0))
+		return (struct __ebr_record__*) NULL;
+	for(i = EBR_SLOT_HASH(e) & mask; __ebr_slots__[i].ebr != (EBR) NULL; i = (i + 1) & mask)
+		if(__ebr_slots__[i].ebr == e && __ebr_slots__[i].id == e->id)
+			return __ebr_slots__[i].record;
+	return (struct __ebr_record__*) NULL;
+}
+
+static void __ebr_slot_insert(struct __ebr_slot__ *slots, size_t size, const struct __ebr_slot__ *slot)
+{
+	size_t i, mask = size - 1;
+
+	for(i = EBR_SLOT_HASH(slot->ebr) & mask; slots[i].ebr != (EBR) NULL; i = (i + 1) & mask)
+		;
+	slots[i] = *slot;
+}
+
+/* make room for one more slot, keeping the table at most half full. Slots of
+ * deleted EBRs are dropped when it is rebuilt. Return 0 on success, -1 if out
+ * of memory */
+static int __ebr_slot_reserve(void)
+{
+	struct __ebr_slot__ *slots;
+	size_t i, n = 0, size = __ebr_slots_size__ == 0 ? 8 : __ebr_slots_size__;
+
+	if((__ebr_nslots__ + 1) * 2 <= __ebr_slots_size__)
+		return 0;
+	pthread_mutex_lock(&__ebr_lock__);
+	__ebr_mark_live();
+	for(i = 0; i < __ebr_slots_size__; i++)
+		if(__ebr_slots__[i].live)
+			n++;
+	pthread_mutex_unlock(&__ebr_lock__);
+	while((n + 1) * 2 > size)
+		size *= 2;
+#ifdef INTERNAL_ERROR_HANDLING
+	slots = (struct __ebr_slot__*) xcalloc(size, sizeof(struct __ebr_slot__));
+#else
+	slots = (struct __ebr_slot__*) calloc(size, sizeof(struct __ebr_slot__));
+	if(unlikely(slots == (struct __ebr_slot__*) NULL))
+		return -1;
+#endif /* #ifdef INTERNAL_ERROR_HANDLING */
+	for(i = 0; i < __ebr_slots_size__; i++)
+		if(__ebr_slots__[i].live)
+			__ebr_slot_insert(slots, size, &__ebr_slots__[i]);
+	if(__ebr_slots__ == (struct __ebr_slot__*) NULL)
+		pthread_setspecific(__ebr_key__, slots);
+	free(__ebr_slots__);
+	__ebr_slots__ = slots;
+	__ebr_slots_size__ = size;
+	__ebr_nslots__ = n;
+	return 0;
+}
+
+/* record of calling thread, registering it if needed. Return NULL if out of memory */
+static struct __ebr_record__ *__ebr_record(EBR e)
+{
+	struct __ebr_record__ *r = __ebr_find(e);
+	struct __ebr_slot__ slot;
+	int unused = 0;
+
+	if(likely(r != (struct __ebr_record__*) NULL))
+		return r;
+	if(unlikely(__ebr_slot_reserve() != 0))
+		return (struct __ebr_record__*) NULL;
+	for(r = __atomic_load_n(&e->records, __ATOMIC_ACQUIRE); r != (struct __ebr_record__*) NULL; r = r->next)
+		if(__atomic_load_n(&r->in_use, __ATOMIC_RELAXED) == 0
+				&& __atomic_compare_exchange_n(&r->in_use, &unused, 1, BOOL_FALSE,
+					__ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+			break;
+		else
+			unused = 0;
+	if(r == (struct __ebr_record__*) NULL) {
+#ifdef INTERNAL_ERROR_HANDLING
+		r = (struct __ebr_record__*) xmemalign(CACHE_LINE_SIZE, sizeof(struct __ebr_record__));
+#else
+		if(unlikely(posix_memalign((void**) &r, CACHE_LINE_SIZE, sizeof(struct __ebr_record__)) != 0))
+			return (struct __ebr_record__*) NULL;
+#endif /* #ifdef INTERNAL_ERROR_HANDLING */
+		memset(r, 0, sizeof(struct __ebr_record__));
+		r->in_use = 1;
+		r->ebr = e;
+		r->next = __atomic_load_n(&e->records, __ATOMIC_RELAXED);
+		while( ! __atomic_compare_exchange_n(&e->records, &r->next, r, BOOL_TRUE,
+					__ATOMIC_RELEASE, __ATOMIC_RELAXED))
+			;
+	}
+	slot.ebr = e;
+	slot.id = e->id;
+	slot.record = r;
+	slot.live = BOOL_TRUE;
+	__ebr_slot_insert(__ebr_slots__, __ebr_slots_size__, &slot);
+	__ebr_nslots__++;
+	return r;
+}
+
+void ebr_pin(EBR e)
+{
+	struct __ebr_record__ *r = __ebr_record(e);
+
+	/* cannot fail for a thread which already retired or pinned before. Without
+	 * a record, spin until memory frees up: reading unprotected is not an option */
+	while(unlikely(r == (struct __ebr_record__*) NULL)) {
+		sched_yield();
+		r = __ebr_record(e);
+	}
+	if(r->nest++ == 0) {
+		__atomic_store_n(&r->state, (__atomic_load_n(&e->epoch, __ATOMIC_SEQ_CST) << 1) | 1, __ATOMIC_RELAXED);
+		/* make our state visible before reading any shared node */
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	}
+}
+
+void ebr_unpin(EBR e)
+{
+	struct __ebr_record__ *r = __ebr_find(e);
+
+	if(--r->nest == 0)
+		__atomic_store_n(&r->state, 0, __ATOMIC_RELEASE);
+}
+
+/* move global epoch forward if every pinned thread has seen the current one */
+static void __ebr_try_advance(EBR e)
+{
+	size_t epoch = __atomic_load_n(&e->epoch, __ATOMIC_SEQ_CST), state;
+	struct __ebr_record__ *r;
+
+	for(r = __atomic_load_n(&e->records, __ATOMIC_ACQUIRE); r != (struct __ebr_record__*) NULL; r = r->next) {
+		state = __atomic_load_n(&r->state, __ATOMIC_SEQ_CST);
+		if((state & 1) && (state >> 1) != epoch)
+			return;
+	}
+	__atomic_compare_exchange_n(&e->epoch, &epoch, epoch + 1, BOOL_FALSE,
+			__ATOMIC_SEQ_CST, __ATOMIC_RELAXED);
+}
+
+void ebr_retire(EBR e, EBREntry *entry, void *ptr, void (*__free__)(void *ptr, void *arg), void *arg)
+{
+	struct __ebr_record__ *r = __ebr_record(e);
+	size_t epoch;
+	int i;
+
+	entry->ptr = ptr;
+	entry->arg = arg;
+	entry->__free__ = __free__;
+	if(unlikely(r == (struct __ebr_record__*) NULL)) {
+		/* nowhere to keep entry. Wait until everyone moved 2 epochs past
+		 * the current one, at which point nobody can see entry anymore */
+		epoch = __atomic_load_n(&e->epoch, __ATOMIC_SEQ_CST);
+		while(__atomic_load_n(&e->epoch, __ATOMIC_SEQ_CST) < epoch + 2) {
+			__ebr_try_advance(e);
+			sched_yield();
+		}
+		__free__(ptr, arg);
+		return;
+	}
+	if(++r->nretired % EBR_ADVANCE_INTERVAL == 0)
+		__ebr_try_advance(e);
+	epoch = __atomic_load_n(&e->epoch, __ATOMIC_SEQ_CST);
+	/* entries retired 2 epochs ago or more are unreachable */
+	for(i = 0; i < 3; i++)
+		if(r->limbo[i].head != (EBREntry*) NULL && r->limbo[i].epoch + 2 <= epoch) {
+			__ebr_free_list(r->limbo[i].head);
+			r->limbo[i].head = (EBREntry*) NULL;
+		}
+	i = (int) (epoch % 3);
+	r->limbo[i].epoch = epoch;
+	entry->next = r->limbo[i].head;
+	r->limbo[i].head = entry;
+}
+#undef EBR_ADVANCE_INTERVAL
+#undef EBR_SLOT_HASH
+
+/* ----- Concurrent hash map ----- */
+/* number of stripe locks. Tables never have fewer buckets, so a bucket and the
+ * 2 buckets it is split into when resizing are always covered by the same lock */
+#define CHM_NLOCKS		64
+#define CHM_MIGRATE_STEP	16
+
+struct __chm_entry__ {
+	EBREntry retire;
+	size_t hash;
+	void *key, *value;
+	struct __chm_entry__ *next;
+};
+
+struct __chm_table__ {
+	size_t nbuckets;
+	/* set while buckets are being moved to a bigger table */
+	struct __chm_table__ *next;
+	/* buckets handed out to/moved by threads helping with the move */
+	size_t migrate_claimed, migrate_done;
+	EBREntry retire;
+	struct __chm_entry__ *buckets[1];
+};
+
+struct __chm_stripe__ {
+	pthread_mutex_t lock;
+} __attribute__ ((aligned (CACHE_LINE_SIZE)));
+
+struct __concurrent_hashmap__ {
+	struct __chm_stripe__ stripes[CHM_NLOCKS];
+	/* oldest table still in use */
+	struct __chm_table__ *table;
+	size_t nmemb;
+	pthread_mutex_t resize_lock;
+	EBR ebr;
+	size_t (*hash)(const void *key);
+	int (*eq)(const void *k1, const void *k2);
+	void (*__del_key__)(void*);
+	void (*__del_value__)(void*);
+};
+
+/* bucket content after it was moved to the next table */
+static struct __chm_entry__ __chm_moved__;
+#define CHM_MOVED	(&__chm_moved__)
+
+static struct __chm_table__ *__chm_new_table(size_t nbuckets)
+{
+	struct __chm_table__ *t;
+	size_t size = offsetof(struct __chm_table__, buckets) + nbuckets * sizeof(struct __chm_entry__*);
+
+#ifdef INTERNAL_ERROR_HANDLING
+	t = (struct __chm_table__*) xcalloc(1, size);
+#else
+	t = (struct __chm_table__*) calloc(1, size);
+	if(unlikely(t == (struct __chm_table__*) NULL))
+		return (struct __chm_table__*) NULL;
+#endif /* #ifdef INTERNAL_ERROR_HANDLING */
+	t->nbuckets = nbuckets;
+	return t;
+}
+
+ConcurrentHashMap new_concurrent_hashmap(size_t (*hash)(const void *key), int (*eq)(const void *k1, const void *k2),
+		void (*__del_key__)(void*), void (*__del_value__)(void*))
+{
+	ConcurrentHashMap m;
+	int i;
+
+#ifdef INTERNAL_ERROR_HANDLING
+	m = (ConcurrentHashMap) xmemalign(CACHE_LINE_SIZE, sizeof(struct __concurrent_hashmap__));
+	m->table = __chm_new_table(CHM_NLOCKS);
+	m->ebr = new_ebr();
+	if(unlikely(m->ebr == (EBR) NULL)) {
+		log_message(LOG_FATAL, "Error creating thread-specific key: %s", strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+#else
+	if(unlikely(posix_memalign((void**) &m, CACHE_LINE_SIZE, sizeof(struct __concurrent_hashmap__)) != 0)) {
+		errno = ENOMEM;
+		return (ConcurrentHashMap) NULL;
+	}
+	m->table = __chm_new_table(CHM_NLOCKS);
+	if(unlikely(m->table == (struct __chm_table__*) NULL)) {
+		free(m);
+		return (ConcurrentHashMap) NULL;
+	}
+	m->ebr = new_ebr();
+	if(unlikely(m->ebr == (EBR) NULL)) {
+		free(m->table);
+		free(m);
+		return (ConcurrentHashMap) NULL;
+	}
+#endif /* #ifdef INTERNAL_ERROR_HANDLING */
+	for(i = 0; i < CHM_NLOCKS; i++)
+		pthread_mutex_init(&m->stripes[i].lock, (const pthread_mutexattr_t*) NULL);
+	pthread_mutex_init(&m->resize_lock, (const pthread_mutexattr_t*) NULL);
+	m->nmemb = 0;
+	m->hash = hash;
+	m->eq = eq;
+	m->__del_key__ = __del_key__;
+	m->__del_value__ = __del_value__;
+	return m;
+}
+
+static void __chm_free_entry(void *ptr, void *arg)
+{
+	struct __chm_entry__ *e = (struct __chm_entry__*) ptr;
+	ConcurrentHashMap m = (ConcurrentHashMap) arg;
+
+	if(m->__del_key__ != (void(*)(void*)) NULL)
+		m->__del_key__(e->key);
+	if(m->__del_value__ != (void(*)(void*)) NULL)
+		m->__del_value__(e->value);
+	free(e);
+}
+
+/* entry was replaced by a copy with a new value */
+static void __chm_free_replaced_entry(void *ptr, void *arg)
+{
+	struct __chm_entry__ *e = (struct __chm_entry__*) ptr;
+	ConcurrentHashMap m = (ConcurrentHashMap) arg;
+
+	if(m->__del_value__ != (void(*)(void*)) NULL)
+		m->__del_value__(e->value);
+	free(e);
+}
+
+/* entry was copied to the next table */
+static void __chm_free_moved_entry(void *ptr, void *arg)
+{
+	(void) arg;
+	free(ptr);
+}
+
+static void __chm_free_table(void *ptr, void *arg)
+{
+	(void) arg;
+	free(ptr);
+}
+
+void delete_concurrent_hashmap(ConcurrentHashMap m)
+{
+	struct __chm_table__ *t, *next;
+	struct __chm_entry__ *e, *enext;
+	size_t i;
+
+	for(t = m->table; t != (struct __chm_table__*) NULL; t = next) {
+		next = t->next;
+		for(i = 0; i < t->nbuckets; i++)
+			for(e = t->buckets[i]; e != (struct __chm_entry__*) NULL && e != CHM_MOVED; e = enext) {
+				enext = e->next;
+				__chm_free_entry(e, m);
+			}
+		free(t);
+	}
+	delete_ebr(m->ebr);
+	for(i = 0; i < CHM_NLOCKS; i++)
+		pthread_mutex_destroy(&m->stripes[i].lock);
+	pthread_mutex_destroy(&m->resize_lock);
+	free(m);
+}
+
+static size_t __chm_hash(ConcurrentHashMap m, const void *key)
+{
+	if(m->hash != (size_t(*)(const void*)) NULL)
+		return (size_t) __hash_mix(m->hash(key));
+	return (size_t) __hash_mix((uintptr_t) key);
+}
+
+static int __chm_eq(ConcurrentHashMap m, const void *k1, const void *k2)
+{
+	if(m->eq != (int(*)(const void*, const void*)) NULL)
+		return m->eq(k1, k2);
+	return k1 == k2;
+}
+
+static struct __chm_entry__ *__chm_new_entry(size_t hash, void *key, void *value, struct __chm_entry__ *next)
+{
+	struct __chm_entry__ *e;
+
+#ifdef INTERNAL_ERROR_HANDLING
+	e = (struct __chm_entry__*) xmalloc(sizeof(struct __chm_entry__));
+#else
+	e = (struct __chm_entry__*) malloc(sizeof(struct __chm_entry__));
+	if(unlikely(e == (struct __chm_entry__*) NULL))
+		return (struct __chm_entry__*) NULL;
+#endif /* #ifdef INTERNAL_ERROR_HANDLING */
+	e->hash = hash;
+	e->key = key;
+	e->value = value;
+	e->next = next;
+	return e;
+}
+
+/* copy bucket b of t to t->next. Stripe lock must be held.
+ * Return 0 on success, -1 if out of memory (t is left untouched) */
+static int __chm_migrate_bucket(ConcurrentHashMap m, struct __chm_table__ *t, size_t b)
+{
+	struct __chm_table__ *t2 = t->next;
+	struct __chm_entry__ *e, *copies = (struct __chm_entry__*) NULL, *next;
+	size_t b2;
+
+	/* copy first so that a failure leaves nothing half done */
+	for(e = t->buckets[b]; e != (struct __chm_entry__*) NULL; e = e->next) {
+		next = __chm_new_entry(e->hash, e->key, e->value, copies);
+		if(unlikely(next == (struct __chm_entry__*) NULL)) {
+			for(; copies != (struct __chm_entry__*) NULL; copies = next) {
+				next = copies->next;
+				free(copies);
+			}
+			return -1;
+		}
+		copies = next;
+	}
+	for(; copies != (struct __chm_entry__*) NULL; copies = next) {
+		next = copies->next;
+		b2 = copies->hash & (t2->nbuckets - 1);
+		copies->next = t2->buckets[b2];
+		__atomic_store_n(&t2->buckets[b2], copies, __ATOMIC_RELEASE);
+	}
+	e = t->buckets[b];
+	__atomic_store_n(&t->buckets[b], CHM_MOVED, __ATOMIC_RELEASE);
+	for(; e != (struct __chm_entry__*) NULL; e = next) {
+		next = e->next;
+		ebr_retire(m->ebr, &e->retire, e, &__chm_free_moved_entry, m);
+	}
+	return 0;
+}
+
+/* lock stripe of hash and return the table where it must be written, after
+ * moving its bucket if a resize is in progress. Must be pinned.
+ * Return NULL if out of memory, with the stripe unlocked */
+static struct __chm_table__ *__chm_lock(ConcurrentHashMap m, size_t hash)
+{
+	struct __chm_table__ *t = __atomic_load_n(&m->table, __ATOMIC_ACQUIRE), *next;
+	pthread_mutex_t *lock = &m->stripes[hash & (CHM_NLOCKS - 1)].lock;
+	size_t b;
+
+	pthread_mutex_lock(lock);
+	do {
+		b = hash & (t->nbuckets - 1);
+		next = __atomic_load_n(&t->next, __ATOMIC_ACQUIRE);
+		if(t->buckets[b] == CHM_MOVED) {
+			t = next;
+		} else if(next != (struct __chm_table__*) NULL) {
+			if(unlikely(__chm_migrate_bucket(m, t, b) != 0)) {
+				pthread_mutex_unlock(lock);
+				return (struct __chm_table__*) NULL;
+			}
+			t = next;
+		} else {
+			return t;
+		}
+	} while(BOOL_TRUE);
+}
+
+/* move a few buckets of the oldest table if a resize is in progress, and
+ * retire it once they are all moved. Must be pinned */
+static void __chm_help_migrate(ConcurrentHashMap m)
+{
+	struct __chm_table__ *t = __atomic_load_n(&m->table, __ATOMIC_ACQUIRE);
+	pthread_mutex_t *lock;
+	size_t b, start, end;
+
+	if(__atomic_load_n(&t->next, __ATOMIC_ACQUIRE) == (struct __chm_table__*) NULL)
+		return;
+	start = __atomic_fetch_add(&t->migrate_claimed, CHM_MIGRATE_STEP, __ATOMIC_RELAXED);
+	if(start >= t->nbuckets)
+		return;
+	end = start + CHM_MIGRATE_STEP < t->nbuckets ? start + CHM_MIGRATE_STEP : t->nbuckets;
+	for(b = start; b < end; b++) {
+		lock = &m->stripes[b & (CHM_NLOCKS - 1)].lock;
+		pthread_mutex_lock(lock);
+		/* claimed buckets must be moved for the resize to ever end */
+		while(t->buckets[b] != CHM_MOVED && __chm_migrate_bucket(m, t, b) != 0) {
+			pthread_mutex_unlock(lock);
+			sched_yield();
+			pthread_mutex_lock(lock);
+		}
+		pthread_mutex_unlock(lock);
+	}
+	if(__atomic_add_fetch(&t->migrate_done, end - start, __ATOMIC_ACQ_REL) == t->nbuckets) {
+		__atomic_store_n(&m->table, t->next, __ATOMIC_RELEASE);
+		ebr_retire(m->ebr, &t->retire, t, &__chm_free_table, m);
+	}
+}
+
+/* start moving to a table twice as big if t is too full and not already being moved */
+static void __chm_maybe_grow(ConcurrentHashMap m, size_t nmemb)
+{
+	struct __chm_table__ *t = __atomic_load_n(&m->table, __ATOMIC_ACQUIRE), *t2;
+
+	if(nmemb <= t->nbuckets || __atomic_load_n(&t->next, __ATOMIC_RELAXED) != (struct __chm_table__*) NULL)
+		return;
+	if(pthread_mutex_trylock(&m->resize_lock) != 0)
+		return;
+	if(t == __atomic_load_n(&m->table, __ATOMIC_ACQUIRE) && t->next == (struct __chm_table__*) NULL) {
+		t2 = __chm_new_table(t->nbuckets << 1);
+		if(likely(t2 != (struct __chm_table__*) NULL))
+			__atomic_store_n(&t->next, t2, __ATOMIC_RELEASE);
+	}
+	pthread_mutex_unlock(&m->resize_lock);
+}
+
+int chm_put(ConcurrentHashMap m, void *key, void *value)
+{
+	size_t hash = __chm_hash(m, key), nmemb = 0;
+	struct __chm_table__ *t;
+	struct __chm_entry__ **link, *e, *ne;
+	int ret = -1;
+
+	ebr_pin(m->ebr);
+	t = __chm_lock(m, hash);
+	if(unlikely(t == (struct __chm_table__*) NULL))
+		goto end;
+	for(link = &t->buckets[hash & (t->nbuckets - 1)]; (e = *link) != (struct __chm_entry__*) NULL; link = &e->next)
+		if(e->hash == hash && __chm_eq(m, key, e->key))
+			break;
+	if(e != (struct __chm_entry__*) NULL && e->value == value) {
+		/* nothing to swap, and retiring e would free value */
+		ret = 1;
+	} else if(e != (struct __chm_entry__*) NULL) {
+		/* entries are immutable for readers: swap in a copy */
+		ne = __chm_new_entry(hash, e->key, value, e->next);
+		if(likely(ne != (struct __chm_entry__*) NULL)) {
+			__atomic_store_n(link, ne, __ATOMIC_RELEASE);
+			ebr_retire(m->ebr, &e->retire, e, &__chm_free_replaced_entry, m);
+			ret = 1;
+		}
+	} else {
+		link = &t->buckets[hash & (t->nbuckets - 1)];
+		ne = __chm_new_entry(hash, key, value, *link);
+		if(likely(ne != (struct __chm_entry__*) NULL)) {
+			__atomic_store_n(link, ne, __ATOMIC_RELEASE);
+			nmemb = __atomic_add_fetch(&m->nmemb, 1, __ATOMIC_RELAXED);
+			ret = 0;
+		}
+	}
+	pthread_mutex_unlock(&m->stripes[hash & (CHM_NLOCKS - 1)].lock);
+	if(ret == 0)
+		__chm_maybe_grow(m, nmemb);
+	__chm_help_migrate(m);
+end:
+	ebr_unpin(m->ebr);
+	return ret;
+}
+
+void *chm_get(ConcurrentHashMap m, const void *key)
+{
+	size_t hash = __chm_hash(m, key);
+	struct __chm_table__ *t;
+	struct __chm_entry__ *e;
+	void *value = NULL;
+
+	ebr_pin(m->ebr);
+	t = __atomic_load_n(&m->table, __ATOMIC_ACQUIRE);
+	do {
+		e = __atomic_load_n(&t->buckets[hash & (t->nbuckets - 1)], __ATOMIC_ACQUIRE);
+		if(e != CHM_MOVED)
+			break;
+		t = __atomic_load_n(&t->next, __ATOMIC_ACQUIRE);
+	} while(BOOL_TRUE);
+	for(; e != (struct __chm_entry__*) NULL; e = __atomic_load_n(&e->next, __ATOMIC_ACQUIRE))
+		if(e->hash == hash && __chm_eq(m, key, e->key)) {
+			value = e->value;
+			break;
+		}
+	ebr_unpin(m->ebr);
+	return value;
+}
+
+int chm_remove(ConcurrentHashMap m, const void *key)
+{
+	size_t hash = __chm_hash(m, key);
+	struct __chm_table__ *t;
+	struct __chm_entry__ **link, *e;
+	int ret = -1;
+
+	ebr_pin(m->ebr);
+	t = __chm_lock(m, hash);
+	if(unlikely(t == (struct __chm_table__*) NULL))
+		goto end;
+	for(link = &t->buckets[hash & (t->nbuckets - 1)]; (e = *link) != (struct __chm_entry__*) NULL; link = &e->next)
+		if(e->hash == hash && __chm_eq(m, key, e->key))
+			break;
+	if(e != (struct __chm_entry__*) NULL) {
+		/* readers standing on e still see the rest of the chain through e->next */
+		__atomic_store_n(link, e->next, __ATOMIC_RELEASE);
+		__atomic_sub_fetch(&m->nmemb, 1, __ATOMIC_RELAXED);
+		ebr_retire(m->ebr, &e->retire, e, &__chm_free_entry, m);
+		ret = 0;
+	}
+	pthread_mutex_unlock(&m->stripes[hash & (CHM_NLOCKS - 1)].lock);
+	__chm_help_migrate(m);
+end:
+	ebr_unpin(m->ebr);
+	return ret;
+}
+
+size_t chm_size(ConcurrentHashMap m)
+{
+	return __atomic_load_n(&m->nmemb, __ATOMIC_RELAXED);
+}
+
+void chm_pin(ConcurrentHashMap m)
+{
+	ebr_pin(m->ebr);
+}
+
+void chm_unpin(ConcurrentHashMap m)
+{
+	ebr_unpin(m->ebr);
+}
+#undef CHM_MOVED
+#undef CHM_MIGRATE_STEP
+#undef CHM_NLOCKS
+
+/* ----- Concurrent skip list ----- */
+#define SKIPLIST_MAX_LEVEL	32
+/* low bit of a link: the node holding it is being deleted */
+#define SKIPLIST_MARK		((uintptr_t) 1)
+#define __sl_marked(link)	(((link) & SKIPLIST_MARK) != 0)
+#define __sl_node(link)		((struct __skiplist_node__*) ((link) & ~SKIPLIST_MARK))
+
+/* node states: set by the inserting thread until it is done linking the node,
+ * and by the thread that removed it. Whichever comes last unlinks it for good
+ * and retires it */
+#define SKIPLIST_INSERTING	1
+#define SKIPLIST_REMOVED	2
+
+/* links to the next nodes at each level are stored inline, so each node is a
+ * single allocation */
+struct __skiplist_node__ {
+	EBREntry retire;
+	uint64_t key;
+	void *value;
+	uint32_t height, state;
+	uintptr_t next[1];
+};
+
+struct __skiplist__ {
+	struct __skiplist_node__ *head;
+	size_t nmemb;
+	EBR ebr;
+	void (*__del__)(void*);
+};
+
+static struct __skiplist_node__ *__sl_new_node(uint64_t key, void *value, unsigned height)
+{
+	struct __skiplist_node__ *node;
+	size_t size = offsetof(struct __skiplist_node__, next) + height * sizeof(uintptr_t);
+
+#ifdef INTERNAL_ERROR_HANDLING
+	node = (struct __skiplist_node__*) xmalloc(size);
+#else
+	node = (struct __skiplist_node__*) malloc(size);
+	if(unlikely(node == (struct __skiplist_node__*) NULL))
+		return (struct __skiplist_node__*) NULL;
+#endif /* #ifdef INTERNAL_ERROR_HANDLING */
+	memset(node->next, 0, height * sizeof(uintptr_t));
+	node->key = key;
+	node->value = value;
+	node->height = height;
+	node->state = SKIPLIST_INSERTING;
+	return node;
+}
+
+SkipList new_skiplist(void (*__del__)(void*))
+{
+	SkipList l;
+
+#ifdef INTERNAL_ERROR_HANDLING
+	l = (SkipList) xmalloc(sizeof(struct __skiplist__));
+	l->head = __sl_new_node(0, NULL, SKIPLIST_MAX_LEVEL);
+	l->ebr = new_ebr();
+	if(unlikely(l->ebr == (EBR) NULL)) {
+		log_message(LOG_FATAL, "Error creating thread-specific key: %s", strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+#else
+	l = (SkipList) malloc(sizeof(struct __skiplist__));
+	if(unlikely(l == (SkipList) NULL))
+		return (SkipList) NULL;
+	l->head = __sl_new_node(0, NULL, SKIPLIST_MAX_LEVEL);
+	if(unlikely(l->head == (struct __skiplist_node__*) NULL)) {
+		free(l);
+		return (SkipList) NULL;
+	}
+	l->ebr = new_ebr();
+	if(unlikely(l->ebr == (EBR) NULL)) {
+		free(l->head);
+		free(l);
+		return (SkipList) NULL;
+	}
+#endif /* #ifdef INTERNAL_ERROR_HANDLING */
+	l->nmemb = 0;
+	l->__del__ = __del__;
+	return l;
+}
+
+static void __sl_free_node(void *ptr, void *arg)
+{
+	struct __skiplist_node__ *node = (struct __skiplist_node__*) ptr;
+	SkipList l = (SkipList) arg;
+
+	if(l->__del__ != (void(*)(void*)) NULL)
+		l->__del__(node->value);
+	free(node);
+}
+
+void delete_skiplist(SkipList l)
+{
+	struct __skiplist_node__ *node, *next;
+
+	delete_ebr(l->ebr);
+	for(node = __sl_node(l->head->next[0]); node != (struct __skiplist_node__*) NULL; node = next) {
+		next = __sl_node(node->next[0]);
+		__sl_free_node(node, l);
+	}
+	free(l->head);
+	free(l);
+}
+
+/* height of a new node: 1 + one more level with probability 1/4 each time */
+static unsigned __sl_random_height(void)
+{
+	static __thread uint64_t state = 0;
+	uint64_t r;
+	unsigned height;
+
+	if(unlikely(state == 0))
+		state = __hash_mix((uintptr_t) &state) | 1;
+	state ^= state << 13;
+	state ^= state >> 7;
+	state ^= state << 17;
+	r = state | (UINT64_C(1) << 62);
+	for(height = 1; (r & 3) == 0; r >>= 2)
+		height++;
+	return height;
+}
+
+/* set preds[i] and succs[i] to the nodes around the place of key at every level,
+ * unlinking marked nodes on the way. When target is not NULL, nodes with the
+ * same key other than target are walked past, so that target gets unlinked
+ * even if a newer node with the same key was inserted in front of it.
+ * Return whether a node with key was found at the bottom level. Must be pinned */
+static BOOL_TYPE __sl_find(SkipList l, uint64_t key, const struct __skiplist_node__ *target,
+		struct __skiplist_node__ **preds, struct __skiplist_node__ **succs)
+{
+	struct __skiplist_node__ *pred, *curr;
+	uintptr_t succ;
+	int level;
+
+retry:
+	pred = l->head;
+	for(level = SKIPLIST_MAX_LEVEL - 1; level >= 0; level--) {
+		curr = __sl_node(__atomic_load_n(&pred->next[level], __ATOMIC_ACQUIRE));
+		while(curr != (struct __skiplist_node__*) NULL) {
+			succ = __atomic_load_n(&curr->next[level], __ATOMIC_ACQUIRE);
+			if(__sl_marked(succ)) {
+				/* curr is being deleted: unlink it at this level */
+				uintptr_t expected = (uintptr_t) curr;
+
+				if( ! __atomic_compare_exchange_n(&pred->next[level], &expected, succ & ~SKIPLIST_MARK,
+							0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+					goto retry;
+				curr = __sl_node(succ);
+				continue;
+			}
+			if(curr->key < key || (target != (struct __skiplist_node__*) NULL
+						&& curr->key == key && curr != target)) {
+				pred = curr;
+				curr = __sl_node(succ);
+			} else {
+				break;
+			}
+		}
+		if(preds != (struct __skiplist_node__**) NULL) {
+			preds[level] = pred;
+			succs[level] = curr;
+		}
+	}
+	return curr != (struct __skiplist_node__*) NULL && curr->key == key;
+}
+
+/* node was removed, and its inserter is done linking it */
+static void __sl_unlink_and_retire(SkipList l, struct __skiplist_node__ *node)
+{
+	(void) __sl_find(l, node->key, node, (struct __skiplist_node__**) NULL, (struct __skiplist_node__**) NULL);
+	ebr_retire(l->ebr, &node->retire, node, &__sl_free_node, l);
+}
+
+int skiplist_insert(SkipList l, uint64_t key, void *value)
+{
+	struct __skiplist_node__ *preds[SKIPLIST_MAX_LEVEL], *succs[SKIPLIST_MAX_LEVEL];
+	struct __skiplist_node__ *node = (struct __skiplist_node__*) NULL;
+	unsigned height = __sl_random_height(), level;
+	uintptr_t expected, link;
+
+	ebr_pin(l->ebr);
+	for(;;) {
+		if(__sl_find(l, key, (struct __skiplist_node__*) NULL, preds, succs)) {
+			ebr_unpin(l->ebr);
+			free(node);
+			return 1;
+		}
+		if(node == (struct __skiplist_node__*) NULL) {
+			node = __sl_new_node(key, value, height);
+#ifndef INTERNAL_ERROR_HANDLING
+			if(unlikely(node == (struct __skiplist_node__*) NULL)) {
+				ebr_unpin(l->ebr);
+				return -1;
+			}
+#endif /* #ifndef INTERNAL_ERROR_HANDLING */
+		}
+		for(level = 0; level < height; level++)
+			node->next[level] = (uintptr_t) succs[level];
+		/* once linked at the bottom level, the node is in the list */
+		expected = (uintptr_t) succs[0];
+		if(__atomic_compare_exchange_n(&preds[0]->next[0], &expected, (uintptr_t) node,
+					0, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+			break;
+	}
+	__atomic_add_fetch(&l->nmemb, 1, __ATOMIC_RELAXED);
+
+	/* then link it at upper levels, unless it is removed meanwhile */
+	for(level = 1; level < height; level++) {
+		for(;;) {
+			link = __atomic_load_n(&node->next[level], __ATOMIC_ACQUIRE);
+			if(__sl_marked(link))
+				goto done;
+			if(link != (uintptr_t) succs[level] && ! __atomic_compare_exchange_n(&node->next[level],
+						&link, (uintptr_t) succs[level], 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+				goto done;
+			expected = (uintptr_t) succs[level];
+			if(__atomic_compare_exchange_n(&preds[level]->next[level], &expected, (uintptr_t) node,
+						0, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+				break;
+			/* the neighbourhood changed: look again. Stop if node is gone */
+			if(__sl_find(l, key, node, preds, succs) == BOOL_FALSE || succs[0] != node)
+				goto done;
+		}
+	}
+done:
+	if(__atomic_fetch_and(&node->state, ~(uint32_t) SKIPLIST_INSERTING, __ATOMIC_ACQ_REL) & SKIPLIST_REMOVED)
+		__sl_unlink_and_retire(l, node);
+	ebr_unpin(l->ebr);
+	return 0;
+}
+
+void *skiplist_get(SkipList l, uint64_t key)
+{
+	SkipListCursor c;
+	uint64_t k;
+	void *value = NULL;
+
+	ebr_pin(l->ebr);
+	skiplist_lower_bound(l, key, &c);
+	if( ! skiplist_iterate(&c, &k, &value) || k != key)
+		value = NULL;
+	ebr_unpin(l->ebr);
+	return value;
+}
+
+BOOL_TYPE skiplist_contains(SkipList l, uint64_t key)
+{
+	SkipListCursor c;
+	uint64_t k;
+	BOOL_TYPE found;
+
+	ebr_pin(l->ebr);
+	skiplist_lower_bound(l, key, &c);
+	found = skiplist_iterate(&c, &k, (void**) NULL) && k == key;
+	ebr_unpin(l->ebr);
+	return found;
+}
+
+int skiplist_remove(SkipList l, uint64_t key)
+{
+	struct __skiplist_node__ *preds[SKIPLIST_MAX_LEVEL], *succs[SKIPLIST_MAX_LEVEL], *node;
+	uintptr_t link;
+	int level;
+
+	ebr_pin(l->ebr);
+	if( ! __sl_find(l, key, (struct __skiplist_node__*) NULL, preds, succs)) {
+		ebr_unpin(l->ebr);
+		return -1;
+	}
+	node = succs[0];
+	/* mark upper levels first, so that the node is never reachable from above
+	 * once it is marked at the bottom */
+	for(level = (int) node->height - 1; level > 0; level--) {
+		link = __atomic_load_n(&node->next[level], __ATOMIC_ACQUIRE);
+		while( ! __sl_marked(link) && ! __atomic_compare_exchange_n(&node->next[level], &link,
+					link | SKIPLIST_MARK, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+			;
+	}
+	/* marking the bottom level is what removes the node. Only one thread can
+	 * succeed */
+	link = __atomic_load_n(&node->next[0], __ATOMIC_ACQUIRE);
+	for(;;) {
+		if(__sl_marked(link)) {
+			ebr_unpin(l->ebr);
+			return -1;
+		}
+		if(__atomic_compare_exchange_n(&node->next[0], &link, link | SKIPLIST_MARK,
+					0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+			break;
+	}
+	__atomic_sub_fetch(&l->nmemb, 1, __ATOMIC_RELAXED);
+	if( ! (__atomic_fetch_or(&node->state, SKIPLIST_REMOVED, __ATOMIC_ACQ_REL) & SKIPLIST_INSERTING))
+		__sl_unlink_and_retire(l, node);
+	ebr_unpin(l->ebr);
+	return 0;
+}
+
+size_t skiplist_size(SkipList l)
+{
+	return __atomic_load_n(&l->nmemb, __ATOMIC_RELAXED);
+}
+
+void skiplist_pin(SkipList l)
+{
+	ebr_pin(l->ebr);
+}
+
+void skiplist_unpin(SkipList l)
+{
+	ebr_unpin(l->ebr);
+}
 
-typedef struct {
-	Color c;
-	Color bgc;
-	Style s;
-} ColorEnv;
+void skiplist_rewind(SkipList l, SkipListCursor *c)
+{
+	c->node = __sl_node(__atomic_load_n(&l->head->next[0], __ATOMIC_ACQUIRE));
+}
 
-static ColorEnv __color_session__;
+/* read-only search: marked nodes are walked over, not unlinked */
+void skiplist_lower_bound(SkipList l, uint64_t key, SkipListCursor *c)
+{
+	struct __skiplist_node__ *pred = l->head, *curr = (struct __skiplist_node__*) NULL;
+	uintptr_t succ;
+	int level;
+
+	for(level = SKIPLIST_MAX_LEVEL - 1; level >= 0; level--) {
+		curr = __sl_node(__atomic_load_n(&pred->next[level], __ATOMIC_ACQUIRE));
+		while(curr != (struct __skiplist_node__*) NULL) {
+			succ = __atomic_load_n(&curr->next[level], __ATOMIC_ACQUIRE);
+			if( ! __sl_marked(succ) && curr->key >= key)
+				break;
+			if( ! __sl_marked(succ))
+				pred = curr;
+			curr = __sl_node(succ);
+		}
+	}
+	c->node = curr;
+}
 
-void set_style(Color c, Color bgc, Style s)
+BOOL_TYPE skiplist_iterate(SkipListCursor *c, uint64_t *key, void **value)
 {
-	printf("\x1B[%d;%dm", c + 30, s);
-	__color_session__.c = c;
-	__color_session__.s = s;
-	printf("\x1B[%dm", bgc + 40);
-	__color_session__.bgc = bgc;
+	struct __skiplist_node__ *node = (struct __skiplist_node__*) c->node;
+	uintptr_t next;
+
+	while(node != (struct __skiplist_node__*) NULL) {
+		next = __atomic_load_n(&node->next[0], __ATOMIC_ACQUIRE);
+		if( ! __sl_marked(next)) {
+			if(key != (uint64_t*) NULL)
+				*key = node->key;
+			if(value != (void**) NULL)
+				*value = node->value;
+			c->node = __sl_node(next);
+			return BOOL_TRUE;
+		}
+		node = __sl_node(next);
+	}
+	c->node = node;
+	return BOOL_FALSE;
 }
 
-void stylish_fprintf(FILE *stream, Color c, Color bgc, Style s, const char *fmt, ...)
+#undef SKIPLIST_REMOVED
+#undef SKIPLIST_INSERTING
+#undef __sl_node
+#undef __sl_marked
+#undef SKIPLIST_MARK
+#undef SKIPLIST_MAX_LEVEL
+
+#ifdef ENABLE_DATASTRUCTS
+/* ----- Sharded cache ----- */
+struct __cache_shard__ {
+	pthread_mutex_t lock;
+	Cache cache;
+} __attribute__ ((aligned (CACHE_LINE_SIZE)));
+
+struct __sharded_cache__ {
+	struct __cache_shard__ *shards;
+	size_t mask;
+};
+
+ShardedCache new_sharded_cache(size_t capacity, unsigned nshards, int policy, void (*__del__)(void*))
 {
-	va_list ap;
+	ShardedCache c;
+	size_t i, n = 1;
 
-	va_start(ap, fmt);
-	fprintf(stream, "\x1B[%d;%dm", c + 30, s);
-	fprintf(stream, "\x1B[%dm", bgc + 40);
-	vprintf(fmt, ap);
-	va_end(ap);
-	fprintf(stream, "\x1B[%dm", __color_session__.bgc);
-	fprintf(stream, "\x1B[%d;%dm", __color_session__.c + 30, __color_session__.s);
-	fflush(stream);
+	while(n < nshards)
+		n <<= 1;
+#ifdef INTERNAL_ERROR_HANDLING
+	c = (ShardedCache) xmalloc(sizeof(struct __sharded_cache__));
+	c->shards = (struct __cache_shard__*) xmemalign(CACHE_LINE_SIZE, n * sizeof(struct __cache_shard__));
+	for(i = 0; i < n; i++)
+		c->shards[i].cache = new_cache(capacity / n, policy, __del__);
+#else
+	c = (ShardedCache) malloc(sizeof(struct __sharded_cache__));
+	if(unlikely(c == (ShardedCache) NULL))
+		return (ShardedCache) NULL;
+	if(unlikely(posix_memalign((void**) &c->shards, CACHE_LINE_SIZE, n * sizeof(struct __cache_shard__)) != 0)) {
+		free(c);
+		errno = ENOMEM;
+		return (ShardedCache) NULL;
+	}
+	for(i = 0; i < n; i++) {
+		c->shards[i].cache = new_cache(capacity / n, policy, __del__);
+		if(unlikely(c->shards[i].cache == (Cache) NULL)) {
+			while(i-- > 0)
+				delete_cache(c->shards[i].cache);
+			free(c->shards);
+			free(c);
+			return (ShardedCache) NULL;
+		}
+	}
+#endif /* #ifdef INTERNAL_ERROR_HANDLING */
+	for(i = 0; i < n; i++)
+		pthread_mutex_init(&c->shards[i].lock, (const pthread_mutexattr_t*) NULL);
+	c->mask = n - 1;
+	return c;
 }
 
-int turn_echoing_off(void)
+void delete_sharded_cache(ShardedCache c)
 {
-	struct termios term;
+	size_t i;
 
-	if(tcgetattr(STDIN_FILENO, &term) != 0) {
+	for(i = 0; i <= c->mask; i++) {
+		delete_cache(c->shards[i].cache);
+		pthread_mutex_destroy(&c->shards[i].lock);
+	}
+	free(c->shards);
+	free(c);
+}
+
+/* the shard is picked from other bits than those the HashMap uses */
+#define __sharded_cache_shard(c, hash)	(&(c)->shards[(size_t) __hash_mix(hash) & (c)->mask])
+
+int sharded_cache_put(ShardedCache c, const void *key, size_t keylen, void *value, size_t size, unsigned long ttl_ms)
+{
+	size_t hash = hash_bytes(key, keylen);
+	struct __cache_shard__ *shard = __sharded_cache_shard(c, hash);
+	int ret;
+
+	pthread_mutex_lock(&shard->lock);
+	ret = __cache_put(shard->cache, key, keylen, hash, value, size, ttl_ms);
+	pthread_mutex_unlock(&shard->lock);
+	return ret;
+}
+
+int sharded_cache_remove(ShardedCache c, const void *key, size_t keylen)
+{
+	size_t hash = hash_bytes(key, keylen);
+	struct __cache_shard__ *shard = __sharded_cache_shard(c, hash);
+	int ret;
+
+	pthread_mutex_lock(&shard->lock);
+	ret = __cache_remove(shard->cache, key, keylen, hash);
+	pthread_mutex_unlock(&shard->lock);
+	return ret;
+}
+
+void *sharded_cache_get(ShardedCache c, const void *key, size_t keylen, void *(*__clone__)(void *value))
+{
+	size_t hash = hash_bytes(key, keylen);
+	struct __cache_shard__ *shard = __sharded_cache_shard(c, hash);
+	void *value;
+
+	pthread_mutex_lock(&shard->lock);
+	value = __cache_get(shard->cache, key, keylen, hash);
+	if(value != NULL && __clone__ != NULL)
+		value = __clone__(value);
+	pthread_mutex_unlock(&shard->lock);
+	return value;
+}
+
+size_t sharded_cache_size(ShardedCache c)
+{
+	size_t i, size = 0;
+
+	for(i = 0; i <= c->mask; i++) {
+		pthread_mutex_lock(&c->shards[i].lock);
+		size += cache_size(c->shards[i].cache);
+		pthread_mutex_unlock(&c->shards[i].lock);
+	}
+	return size;
+}
+
+void sharded_cache_stats(ShardedCache c, CacheStats *stats)
+{
+	size_t i;
+
+	memset(stats, 0, sizeof(CacheStats));
+	for(i = 0; i <= c->mask; i++) {
+		pthread_mutex_lock(&c->shards[i].lock);
+		stats->hits += c->shards[i].cache->stats.hits;
+		stats->misses += c->shards[i].cache->stats.misses;
+		stats->evictions += c->shards[i].cache->stats.evictions;
+		stats->expirations += c->shards[i].cache->stats.expirations;
+		pthread_mutex_unlock(&c->shards[i].lock);
+	}
+}
+#undef __sharded_cache_shard
+#endif /* #ifdef ENABLE_DATASTRUCTS */
+
+/* ----- Thread pool ----- */
+#define THREAD_POOL_QUEUE_SIZE		1024
+#define PARALLEL_CHUNKS_PER_THREAD	4
+
+/* tasks from thread_pool_submit have no batch and are freed once run */
+struct __pool_task__ {
+	void (*__task__)(void*);
+	void *arg;
+	uint32_t *batch;	/* number of unfinished tasks of the parallel call */
+};
+
+struct __thread_pool__ {
+	MPMCQueue tasks;
+	pthread_t *threads;
+	unsigned nthreads;
+	uint32_t pending;	/* submitted tasks not completed yet */
+};
+
+static void __pool_run(ThreadPool p, struct __pool_task__ *t)
+{
+	uint32_t *batch = t->batch;
+
+	t->__task__(t->arg);
+	if(batch != (uint32_t*) NULL) {
+		if(__atomic_sub_fetch(batch, 1, __ATOMIC_ACQ_REL) == 0)
+			__futex_wake(batch, INT_MAX);
+	} else {
+		free(t);
+		if(__atomic_sub_fetch(&p->pending, 1, __ATOMIC_ACQ_REL) == 0)
+			__futex_wake(&p->pending, INT_MAX);
+	}
+}
+
+static void *__pool_worker(void *arg)
+{
+	ThreadPool p = (ThreadPool) arg;
+	struct __pool_task__ *t;
+
+	/* NULL tells the worker to stop */
+	while((t = (struct __pool_task__*) mpmc_pop(p->tasks)) != (struct __pool_task__*) NULL)
+		__pool_run(p, t);
+	return NULL;
+}
+
+ThreadPool new_thread_pool(unsigned nthreads)
+{
+	ThreadPool p;
+
+	if(nthreads == 0) {
+#ifdef _SC_NPROCESSORS_ONLN
+		long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+		nthreads = ncpus > 0 ? (unsigned) ncpus : 1;
+#else
+		nthreads = 1;
+#endif /* #ifdef _SC_NPROCESSORS_ONLN */
+	}
 #ifdef INTERNAL_ERROR_HANDLING
-		log_message(LOG_FATAL, "Error manipulating terminal: %s", strerror(errno));
-		exit(EXIT_FAILURE);
+	p = (ThreadPool) xmalloc(sizeof(struct __thread_pool__));
+	p->threads = (pthread_t*) xmalloc(nthreads * sizeof(pthread_t));
+	p->tasks = new_mpmc_queue(THREAD_POOL_QUEUE_SIZE);
 #else
-		return -1;
+	p = (ThreadPool) malloc(sizeof(struct __thread_pool__));
+	if(unlikely(p == (ThreadPool) NULL))
+		return (ThreadPool) NULL;
+	p->threads = (pthread_t*) malloc(nthreads * sizeof(pthread_t));
+	p->tasks = new_mpmc_queue(THREAD_POOL_QUEUE_SIZE);
+	if(unlikely(p->threads == (pthread_t*) NULL || p->tasks == (MPMCQueue) NULL)) {
+		free(p->threads);
+		if(p->tasks != (MPMCQueue) NULL)
+			delete_mpmc_queue(p->tasks, NULL);
+		free(p);
+		return (ThreadPool) NULL;
+	}
+#endif /* #ifdef INTERNAL_ERROR_HANDLING */
+	p->pending = 0;
+	for(p->nthreads = 0; p->nthreads < nthreads; p->nthreads++) {
+#ifdef INTERNAL_ERROR_HANDLING
+		p->threads[p->nthreads] = xlaunch_thread(&__pool_worker, p, (pthread_attr_t*) NULL);
+#else
+		p->threads[p->nthreads] = launch_thread(&__pool_worker, p, (pthread_attr_t*) NULL);
+		if(unlikely(p->threads[p->nthreads] == 0))
+			break;
 #endif /* #ifdef INTERNAL_ERROR_HANDLING */
 	}
-	term.c_lflag &= ~ECHO;
-	if(tcsetattr(STDIN_FILENO, TCSAFLUSH, &term) != 0) {
+	/* make do with the threads we could start */
+	if(unlikely(p->nthreads == 0)) {
+		free(p->threads);
+		delete_mpmc_queue(p->tasks, NULL);
+		free(p);
+		return (ThreadPool) NULL;
+	}
+	return p;
+}
+
+void delete_thread_pool(ThreadPool p)
+{
+	unsigned i;
+
+	/* tasks are popped in order, so workers only see these once the queue
+	 * has been drained */
+	for(i = 0; i < p->nthreads; i++)
+		mpmc_push(p->tasks, NULL);
+	for(i = 0; i < p->nthreads; i++)
+		pthread_join(p->threads[i], (void**) NULL);
+	delete_mpmc_queue(p->tasks, NULL);
+	free(p->threads);
+	free(p);
+}
+
+int thread_pool_submit(ThreadPool p, void (*__task__)(void*), void *arg)
+{
+	struct __pool_task__ *t;
+
 #ifdef INTERNAL_ERROR_HANDLING
-		log_message(LOG_FATAL, "Error manipulating terminal: %s", strerror(errno));
-		exit(EXIT_FAILURE);
+	t = (struct __pool_task__*) xmalloc(sizeof(struct __pool_task__));
 #else
+	t = (struct __pool_task__*) malloc(sizeof(struct __pool_task__));
+	if(unlikely(t == (struct __pool_task__*) NULL))
 		return -1;
 #endif /* #ifdef INTERNAL_ERROR_HANDLING */
+	t->__task__ = __task__;
+	t->arg = arg;
+	t->batch = (uint32_t*) NULL;
+	__atomic_add_fetch(&p->pending, 1, __ATOMIC_ACQ_REL);
+	mpmc_push(p->tasks, t);
+	return 0;
+}
+
+void thread_pool_wait(ThreadPool p)
+{
+	uint32_t pending;
+
+	while((pending = __atomic_load_n(&p->pending, __ATOMIC_ACQUIRE)) != 0)
+		__futex_wait(&p->pending, pending);
+}
+
+unsigned thread_pool_size(const ThreadPool p)
+{
+	return p->nthreads;
+}
+
+/* what a parallel call does with each chunk */
+struct __parallel_job__ {
+	size_t size;	/* element size, 0 when walking DLinkedList nodes */
+	void (*__body__)(size_t from, size_t to, void *arg);
+	void (*__foreachfunc__)(void *data, void *arg);
+	void *(*__mapfunc__)(void *data, void *acc);
+	void *arg;	/* arg or identity */
+};
+
+struct __parallel_chunk__ {
+	struct __pool_task__ task;
+	const struct __parallel_job__ *job;
+	void *start;	/* first element or node */
+	size_t from, nmemb;
+	void *acc;
+};
+
+static void __parallel_run_chunk(void *arg)
+{
+	struct __parallel_chunk__ *c = (struct __parallel_chunk__*) arg;
+	const struct __parallel_job__ *job = c->job;
+	byte *elem = (byte*) c->start;
+	void *acc = job->arg;
+	size_t i;
+
+	if(job->__body__ != NULL) {
+		job->__body__(c->from, c->from + c->nmemb, job->arg);
+		c->acc = NULL;
+		return;
+	}
+	for(i = 0; i < c->nmemb; i++) {
+		void *data = elem;
+
+		if(job->size == 0) {
+			data = ((__datastruct_elem__*) (void*) elem)->data;
+			elem = (byte*) ((__datastruct_elem__*) (void*) elem)->next;
+		} else {
+			elem += job->size;
+		}
+		if(job->__foreachfunc__ != NULL)
+			job->__foreachfunc__(data, job->arg);
+		else
+			acc = job->__mapfunc__(data, acc);
+	}
+	c->acc = acc;
+}
+
+/* number of chunks to cut nmemb elements into, 1 for serial execution */
+static size_t __parallel_nchunks(ThreadPool p, size_t nmemb, size_t grain)
+{
+	size_t nchunks;
+
+	if(p == (ThreadPool) NULL)
+		return 1;
+	if(grain == 0)
+		grain = 1;
+	nchunks = (size_t) p->nthreads * PARALLEL_CHUNKS_PER_THREAD;
+	if(nmemb / grain < nchunks)
+		nchunks = nmemb / grain;
+	return nchunks > 1 ? nchunks : 1;
+}
+
+/* run all chunks and return once they are done */
+static void __parallel_dispatch(ThreadPool p, struct __parallel_chunk__ *chunks, size_t nchunks)
+{
+	struct __pool_task__ *t;
+	uint32_t remaining = (uint32_t) nchunks, r;
+	size_t i;
+
+	for(i = 0; i < nchunks; i++) {
+		chunks[i].task.__task__ = &__parallel_run_chunk;
+		chunks[i].task.arg = &chunks[i];
+		chunks[i].task.batch = &remaining;
+	}
+	/* never block on a full queue: we may be one of the workers */
+	for(i = 1; i < nchunks; i++)
+		if(mpmc_try_push(p->tasks, &chunks[i].task) != 0)
+			__pool_run(p, &chunks[i].task);
+	__pool_run(p, &chunks[0].task);
+	while((r = __atomic_load_n(&remaining, __ATOMIC_ACQUIRE)) != 0) {
+		if(mpmc_try_pop(p->tasks, (void**) (void*) &t) == 0) {
+			/* don't steal a worker's stop request */
+			if(t == (struct __pool_task__*) NULL) {
+				mpmc_push(p->tasks, NULL);
+				__futex_wait(&remaining, r);
+			} else {
+				__pool_run(p, t);
+			}
+		} else {
+			__futex_wait(&remaining, r);
+		}
+	}
+}
+
+/* cut the input of job into chunks, run them and return the combined result.
+ * first is the first element or node, nmemb the number of elements */
+static void *__parallel_do(ThreadPool p, const struct __parallel_job__ *job, void *first,
+		size_t nmemb, size_t grain, void *(*__combine__)(void*, void*))
+{
+	struct __parallel_chunk__ one, *chunks = (struct __parallel_chunk__*) NULL;
+	size_t nchunks = __parallel_nchunks(p, nmemb, grain), i, j, from;
+	void *elem = first, *acc;
+
+	if(nchunks > 1)
+		chunks = (struct __parallel_chunk__*) malloc(nchunks * sizeof(struct __parallel_chunk__));
+	/* too small, or no memory for chunks: run serially */
+	if(chunks == (struct __parallel_chunk__*) NULL) {
+		one.job = job;
+		one.start = first;
+		one.from = 0;
+		one.nmemb = nmemb;
+		__parallel_run_chunk(&one);
+		return one.acc;
+	}
+	for(i = 0, from = 0; i < nchunks; i++) {
+		chunks[i].job = job;
+		chunks[i].start = elem;
+		chunks[i].from = from;
+		chunks[i].nmemb = nmemb / nchunks + (i < nmemb % nchunks);
+		from += chunks[i].nmemb;
+		if(job->size != 0)
+			elem = (byte*) elem + chunks[i].nmemb * job->size;
+		else if(first != NULL)
+			for(j = 0; j < chunks[i].nmemb; j++)
+				elem = ((__datastruct_elem__*) elem)->next;
+	}
+	__parallel_dispatch(p, chunks, nchunks);
+	acc = chunks[0].acc;
+	if(__combine__ != NULL)
+		for(i = 1; i < nchunks; i++)
+			acc = __combine__(acc, chunks[i].acc);
+	free(chunks);
+	return acc;
+}
+
+void parallel_for(ThreadPool p, size_t nmemb, size_t grain,
+		void (*__body__)(size_t from, size_t to, void *arg), void *arg)
+{
+	struct __parallel_job__ job;
+
+	job.size = 1;
+	job.__body__ = __body__;
+	job.__foreachfunc__ = NULL;
+	job.__mapfunc__ = NULL;
+	job.arg = arg;
+	(void) __parallel_do(p, &job, NULL, nmemb, grain, NULL);
+}
+
+void parallel_foreach(ThreadPool p, void *base, size_t nmemb, size_t size,
+		void (*__foreachfunc__)(void *elem, void *arg), void *arg)
+{
+	struct __parallel_job__ job;
+
+	job.size = size;
+	job.__body__ = NULL;
+	job.__foreachfunc__ = __foreachfunc__;
+	job.__mapfunc__ = NULL;
+	job.arg = arg;
+	(void) __parallel_do(p, &job, base, nmemb, PARALLEL_MIN_GRAIN, NULL);
+}
+
+void *parallel_reduce(ThreadPool p, void *base, size_t nmemb, size_t size,
+		void *(*__mapfunc__)(void *elem, void *acc), void *identity,
+		void *(*__combine__)(void *acc1, void *acc2))
+{
+	struct __parallel_job__ job;
+
+	job.size = size;
+	job.__body__ = NULL;
+	job.__foreachfunc__ = NULL;
+	job.__mapfunc__ = __mapfunc__;
+	job.arg = identity;
+	return __parallel_do(p, &job, base, nmemb, PARALLEL_MIN_GRAIN, __combine__);
+}
+
+#ifdef ENABLE_DATASTRUCTS
+static size_t __dll_length(DLinkedList dl)
+{
+	__datastruct_elem__ *e;
+	size_t nmemb = 0;
+
+	for(e = dl->out; e != (__datastruct_elem__*) NULL; e = e->next)
+		nmemb++;
+	return nmemb;
+}
+
+void dll_parallel_foreach(ThreadPool p, DLinkedList dl,
+		void (*__foreachfunc__)(void *data, void *arg), void *arg)
+{
+	struct __parallel_job__ job;
+
+	job.size = 0;
+	job.__body__ = NULL;
+	job.__foreachfunc__ = __foreachfunc__;
+	job.__mapfunc__ = NULL;
+	job.arg = arg;
+	(void) __parallel_do(p, &job, dl->out, __dll_length(dl), PARALLEL_MIN_GRAIN, NULL);
+}
+
+void *dll_parallel_map(ThreadPool p, DLinkedList dl,
+		void *(*__mapfunc__)(void *data, void *acc), void *identity,
+		void *(*__combine__)(void *acc1, void *acc2))
+{
+	struct __parallel_job__ job;
+
+	job.size = 0;
+	job.__body__ = NULL;
+	job.__foreachfunc__ = NULL;
+	job.__mapfunc__ = __mapfunc__;
+	job.arg = identity;
+	return __parallel_do(p, &job, dl->out, __dll_length(dl), PARALLEL_MIN_GRAIN, __combine__);
+}
+#endif /* #ifdef ENABLE_DATASTRUCTS */
+
+#undef PARALLEL_CHUNKS_PER_THREAD
+#undef THREAD_POOL_QUEUE_SIZE
+
+/* ----- Parallel directory walk ----- */
+#if defined(ENABLE_FILESYSTEM) && defined(__unix__)
+#define WS_DEQUE_INIT_SIZE	64
+
+struct __ws_array__ {
+	size_t mask;
+	struct __ws_array__ *prev;	/* thieves may still be reading it */
+	void *buf[1];
+};
+
+/* Chase-Lev work-stealing deque: its owner pushes and takes at the bottom while
+ * other threads steal from the top */
+struct __ws_deque__ {
+	ssize_t top __attribute__ ((aligned (CACHE_LINE_SIZE)));
+	ssize_t bottom __attribute__ ((aligned (CACHE_LINE_SIZE)));
+	struct __ws_array__ *array;
+};
+
+static struct __ws_array__ *__ws_new_array(size_t size, struct __ws_array__ *prev)
+{
+	struct __ws_array__ *a;
+	size_t bytes = sizeof(struct __ws_array__) + (size - 1) * sizeof(void*);
+
+#ifdef INTERNAL_ERROR_HANDLING
+	a = (struct __ws_array__*) xmalloc(bytes);
+#else
+	a = (struct __ws_array__*) malloc(bytes);
+	if(unlikely(a == (struct __ws_array__*) NULL))
+		return (struct __ws_array__*) NULL;
+#endif /* #ifdef INTERNAL_ERROR_HANDLING */
+	a->mask = size - 1;
+	a->prev = prev;
+	return a;
+}
+
+static int __ws_init(struct __ws_deque__ *d)
+{
+	d->top = d->bottom = 0;
+	d->array = __ws_new_array(WS_DEQUE_INIT_SIZE, (struct __ws_array__*) NULL);
+	return d->array == (struct __ws_array__*) NULL ? -1 : 0;
+}
+
+static void __ws_free(struct __ws_deque__ *d)
+{
+	struct __ws_array__ *a, *prev;
+
+	for(a = d->array; a != (struct __ws_array__*) NULL; a = prev) {
+		prev = a->prev;
+		free(a);
+	}
+}
+
+/* owner only. Return 0 on success, -1 if out of memory */
+static int __ws_push(struct __ws_deque__ *d, void *x)
+{
+	ssize_t b = __atomic_load_n(&d->bottom, __ATOMIC_RELAXED);
+	ssize_t t = __atomic_load_n(&d->top, __ATOMIC_ACQUIRE);
+	struct __ws_array__ *a = d->array, *grown;
+
+	if(unlikely((size_t) (b - t) > a->mask)) {
+		grown = __ws_new_array((a->mask + 1) << 1, a);
+		if(unlikely(grown == (struct __ws_array__*) NULL))
+			return -1;
+		for(; t < b; t++)
+			__atomic_store_n(&grown->buf[t & grown->mask],
+					__atomic_load_n(&a->buf[t & a->mask], __ATOMIC_RELAXED), __ATOMIC_RELAXED);
+		__atomic_store_n(&d->array, grown, __ATOMIC_RELEASE);
+		a = grown;
 	}
+	__atomic_store_n(&a->buf[b & a->mask], x, __ATOMIC_RELAXED);
+	__atomic_store_n(&d->bottom, b + 1, __ATOMIC_RELEASE);
 	return 0;
 }
 
-int turn_echoing_on(void)
+/* owner only, LIFO */
+static void *__ws_take(struct __ws_deque__ *d)
 {
-	struct termios term;
+	ssize_t b = __atomic_load_n(&d->bottom, __ATOMIC_RELAXED) - 1, t;
+	struct __ws_array__ *a = d->array;
+	void *x;
+
+	__atomic_store_n(&d->bottom, b, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	t = __atomic_load_n(&d->top, __ATOMIC_RELAXED);
+	if(t > b) {
+		__atomic_store_n(&d->bottom, b + 1, __ATOMIC_RELAXED);
+		return NULL;
+	}
+	x = __atomic_load_n(&a->buf[b & a->mask], __ATOMIC_RELAXED);
+	/* last one: race against thieves */
+	if(t == b) {
+		if( ! __atomic_compare_exchange_n(&d->top, &t, t + 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+			x = NULL;
+		__atomic_store_n(&d->bottom, b + 1, __ATOMIC_RELAXED);
+	}
+	return x;
+}
 
-	if(tcgetattr(STDIN_FILENO, &term) != 0) {
+/* any thread, FIFO. Return NULL if empty or if another thread got there first */
+static void *__ws_steal(struct __ws_deque__ *d)
+{
+	ssize_t t = __atomic_load_n(&d->top, __ATOMIC_ACQUIRE), b;
+	struct __ws_array__ *a;
+	void *x;
+
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	b = __atomic_load_n(&d->bottom, __ATOMIC_ACQUIRE);
+	if(t >= b)
+		return NULL;
+	a = __atomic_load_n(&d->array, __ATOMIC_ACQUIRE);
+	x = __atomic_load_n(&a->buf[t & a->mask], __ATOMIC_RELAXED);
+	if( ! __atomic_compare_exchange_n(&d->top, &t, t + 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+		return NULL;
+	return x;
+}
+
+/* a directory to walk through, followed by its path */
+struct __pdw_task__ {
+	int fd;		/* already opened, or -1 */
+	unsigned depth;
+	size_t len;
+};
+
+/* an entry of a DIRWALK_ORDERED directory, waiting to be sorted */
+struct __pdw_entry__ {
+	DirRecord rec;
+	size_t off;	/* of rec.name in names, which moves while filling it */
+	size_t namelen;
+};
+
+struct __pdw_worker__ {
+	struct __ws_deque__ deque;
+	struct __dirwalk__ w;	/* path buffer, flags and callback */
+	struct __parallel_dirwalk__ *walk;
+	struct __pdw_entry__ *entries;
+	size_t entries_size;
+	char *names;
+	size_t names_size;
+	unsigned id;
+	pthread_t thread;
+};
+
+struct __parallel_dirwalk__ {
+	struct __pdw_worker__ *workers;
+	unsigned nthreads;
+	size_t pending;		/* directories pushed but not walked through yet */
+	uint32_t idle;		/* workers about to sleep on events */
+	uint32_t events;
+	int ret;		/* what stopped the walk, 0 if nothing did */
+	int error;		/* errno when ret is -1 */
+	pthread_mutex_t lock;	/* serializes DIRWALK_ORDERED callbacks */
+};
+
+static void __pdw_stop(struct __parallel_dirwalk__ *walk, int ret)
+{
+	int expected = 0;
+
+	if(__atomic_compare_exchange_n(&walk->ret, &expected, ret, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)
+			&& ret == -1)
+		walk->error = errno;
+}
+
+#define __pdw_stopped(walk)	(__atomic_load_n(&(walk)->ret, __ATOMIC_RELAXED) != 0)
+
+/* make room for nmemb elements of size bytes in *buf. Return 0 on success,
+ * -1 if out of memory */
+static int __pdw_reserve(void **buf, size_t *nmemb_max, size_t nmemb, size_t size)
+{
+	size_t n = *nmemb_max == 0 ? 64 : *nmemb_max;
+	void *grown;
+
+	if(likely(nmemb <= *nmemb_max))
+		return 0;
+	while(n < nmemb)
+		n <<= 1;
 #ifdef INTERNAL_ERROR_HANDLING
-		log_message(LOG_FATAL, "Error manipulating terminal: %s", strerror(errno));
-		exit(EXIT_FAILURE);
+	grown = xrealloc(*buf, n * size);
 #else
+	grown = realloc(*buf, n * size);
+	if(unlikely(grown == NULL)) {
+		errno = ENOMEM;
 		return -1;
-#endif /* #ifdef INTERNAL_ERROR_HANDLING */
 	}
-	term.c_lflag |= ECHO;
-	if(tcsetattr(STDIN_FILENO, TCSAFLUSH, &term) != 0) {
+#endif /* #ifdef INTERNAL_ERROR_HANDLING */
+	*buf = grown;
+	*nmemb_max = n;
+	return 0;
+}
+
+/* queue up directory path for any worker to walk through */
+static int __pdw_push(struct __pdw_worker__ *self, const char *path, size_t len, unsigned depth, int fd)
+{
+	struct __parallel_dirwalk__ *walk = self->walk;
+	struct __pdw_task__ *t;
+
 #ifdef INTERNAL_ERROR_HANDLING
-		log_message(LOG_FATAL, "Error manipulating terminal: %s", strerror(errno));
-		exit(EXIT_FAILURE);
+	t = (struct __pdw_task__*) xmalloc(sizeof(struct __pdw_task__) + len + 1);
 #else
+	t = (struct __pdw_task__*) malloc(sizeof(struct __pdw_task__) + len + 1);
+	if(unlikely(t == (struct __pdw_task__*) NULL))
 		return -1;
 #endif /* #ifdef INTERNAL_ERROR_HANDLING */
+	t->fd = fd;
+	t->depth = depth;
+	t->len = len;
+	memcpy(t + 1, path, len);
+	((char*) (t + 1))[len] = '\0';
+	__atomic_add_fetch(&walk->pending, 1, __ATOMIC_SEQ_CST);
+	if(unlikely(__ws_push(&self->deque, t) != 0)) {
+		__atomic_sub_fetch(&walk->pending, 1, __ATOMIC_SEQ_CST);
+		free(t);
+		return -1;
+	}
+	if(__atomic_load_n(&walk->idle, __ATOMIC_SEQ_CST) != 0) {
+		__atomic_add_fetch(&walk->events, 1, __ATOMIC_SEQ_CST);
+		__futex_wake(&walk->events, 1);
+	}
+	return 0;
+}
+
+/* report entry rec of directory fd, whose path is in self->w.path up to base,
+ * and queue it up if it is a directory to walk through. Return non zero to
+ * stop reading the directory */
+static int __pdw_entry(struct __pdw_worker__ *self, int fd, size_t base, unsigned depth,
+		const DirRecord *rec, size_t namelen)
+{
+	struct __dirwalk__ *w = &self->w;
+	struct stat st;
+	DirEntry e;
+	int ret;
+
+	if(unlikely(__dirwalk_reserve(w, base + namelen) != 0)) {
+		__pdw_stop(self->walk, -1);
+		return -1;
+	}
+	memcpy(&w->path[base], rec->name, namelen + 1);
+	e.path = w->path;
+	e.name = &w->path[base];
+	e.pathlen = base + namelen;
+	e.dirfd = fd;
+	e.depth = depth;
+	e.ino = rec->ino;
+	if(__dirwalk_classify(&e, rec->type, w->flags, &st) != 0)
+		return 0;
+	if(e.type != DIRWALK_DIR || (w->flags & DIRWALK_DIRS)) {
+		ret = w->func(&e, w->arg);
+		if(ret == DIRWALK_PRUNE)
+			return 0;
+		if(ret != 0) {
+			__pdw_stop(self->walk, ret);
+			return ret;
+		}
+	}
+	if(e.type == DIRWALK_DIR && (w->flags & DIRWALK_RECURSE)
+			&& unlikely(__pdw_push(self, w->path, e.pathlen, depth + 1, -1) != 0)) {
+		__pdw_stop(self->walk, -1);
+		return -1;
+	}
+	return 0;
+}
+
+static int __pdw_entry_cmp(const void *a, const void *b)
+{
+	return strcmp(((const struct __pdw_entry__*) a)->rec.name, ((const struct __pdw_entry__*) b)->rec.name);
+}
+
+/* walk through directory t, which is freed once done */
+static void __pdw_dir(struct __pdw_worker__ *self, struct __pdw_task__ *t)
+{
+	struct __parallel_dirwalk__ *walk = self->walk;
+	struct __dirwalk__ *w = &self->w;
+	char *buf = __dirwalk_buffer(w, 0);
+	DirReader r;
+	DirRecord rec;
+	size_t base, namelen, nentries = 0, namesoff = 0, i;
+	int fd = t->fd;
+
+	if(__pdw_stopped(walk))
+		goto out;
+	if(unlikely(buf == (char*) NULL || __dirwalk_reserve(w, t->len) != 0)) {
+		errno = ENOMEM;
+		__pdw_stop(walk, -1);
+		goto out;
+	}
+	memcpy(w->path, t + 1, t->len + 1);
+	/* this is the only directory this worker has open */
+	if(fd < 0 && (fd = open(w->path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC)) < 0)
+		goto out;
+	/* closes fd on failure */
+	if(dir_reader_init(&r, fd, buf, DIRWALK_BUFSIZE) != 0) {
+		fd = -1;
+		goto out;
+	}
+	fd = -1;
+	base = t->len + (w->path[t->len - 1] != '/');
+	w->path[t->len] = '/';
+	while( ! __pdw_stopped(walk) && dir_read(&r, &rec) == 1) {
+		namelen = strlen(rec.name);
+		if( ! (w->flags & DIRWALK_ORDERED)) {
+			if(__pdw_entry(self, r.fd, base, t->depth, &rec, namelen) != 0)
+				break;
+			continue;
+		}
+		if(unlikely(__pdw_reserve((void**) &self->entries, &self->entries_size, nentries + 1, sizeof(struct __pdw_entry__)) != 0
+				|| __pdw_reserve((void**) &self->names, &self->names_size, namesoff + namelen + 1, 1) != 0)) {
+			__pdw_stop(walk, -1);
+			break;
+		}
+		self->entries[nentries].rec = rec;
+		self->entries[nentries].off = namesoff;
+		self->entries[nentries++].namelen = namelen;
+		memcpy(&self->names[namesoff], rec.name, namelen + 1);
+		namesoff += namelen + 1;
+	}
+	if(nentries != 0 && ! __pdw_stopped(walk)) {
+		for(i = 0; i < nentries; i++)
+			self->entries[i].rec.name = &self->names[self->entries[i].off];
+		qsort(self->entries, nentries, sizeof(struct __pdw_entry__), &__pdw_entry_cmp);
+		pthread_mutex_lock(&walk->lock);
+		for(i = 0; i < nentries && ! __pdw_stopped(walk); i++)
+			if(__pdw_entry(self, r.fd, base, t->depth, &self->entries[i].rec, self->entries[i].namelen) != 0)
+				break;
+		pthread_mutex_unlock(&walk->lock);
+	}
+	dir_reader_close(&r);
+out:
+	if(fd >= 0)
+		close(fd);
+	free(t);
+}
+
+static struct __pdw_task__ *__pdw_steal(struct __pdw_worker__ *self)
+{
+	struct __parallel_dirwalk__ *walk = self->walk;
+	struct __pdw_task__ *t;
+	unsigned i;
+
+	for(i = 1; i < walk->nthreads; i++) {
+		t = (struct __pdw_task__*) __ws_steal(&walk->workers[(self->id + i) % walk->nthreads].deque);
+		if(t != (struct __pdw_task__*) NULL)
+			return t;
+	}
+	return (struct __pdw_task__*) NULL;
+}
+
+static void *__pdw_worker(void *arg)
+{
+	struct __pdw_worker__ *self = (struct __pdw_worker__*) arg;
+	struct __parallel_dirwalk__ *walk = self->walk;
+	struct __pdw_task__ *t;
+	uint32_t ev;
+
+	for(;;) {
+		t = (struct __pdw_task__*) __ws_take(&self->deque);
+		if(t == (struct __pdw_task__*) NULL)
+			t = __pdw_steal(self);
+		if(t == (struct __pdw_task__*) NULL) {
+			if(__atomic_load_n(&walk->pending, __ATOMIC_ACQUIRE) == 0)
+				break;
+			/* announce we are going to sleep before a last look, so that
+			 * __pdw_push either sees us or we see its task */
+			__atomic_add_fetch(&walk->idle, 1, __ATOMIC_SEQ_CST);
+			ev = __atomic_load_n(&walk->events, __ATOMIC_SEQ_CST);
+			t = __pdw_steal(self);
+			if(t == (struct __pdw_task__*) NULL && __atomic_load_n(&walk->pending, __ATOMIC_SEQ_CST) != 0)
+				__futex_wait(&walk->events, ev);
+			__atomic_sub_fetch(&walk->idle, 1, __ATOMIC_SEQ_CST);
+			if(t == (struct __pdw_task__*) NULL)
+				continue;
+		}
+		__pdw_dir(self, t);
+		if(__atomic_sub_fetch(&walk->pending, 1, __ATOMIC_ACQ_REL) == 0) {
+			__atomic_add_fetch(&walk->events, 1, __ATOMIC_SEQ_CST);
+			__futex_wake(&walk->events, INT_MAX);
+		}
 	}
-	return 0;
+	return NULL;
 }
 
-int instant_getchar(void)
+int parallel_dirwalk(const char *path, int flags, unsigned nthreads,
+		int (*func)(const DirEntry *entry, void *arg), void *arg)
 {
-	struct termios term;
+	struct __parallel_dirwalk__ walk;
+	size_t len = __dirwalk_pathlen(path);
+	unsigned i, n, started;
+	int fd;
 
-	if(tcgetattr(STDIN_FILENO, &term) != 0) {
-#ifdef INTERNAL_ERROR_HANDLING
-		log_message(LOG_FATAL, "Error manipulating terminal: %s", strerror(errno));
-		exit(EXIT_FAILURE);
-#else
+	if(unlikely(len == 0)) {
+		errno = ENOENT;
 		return -1;
-#endif /* #ifdef INTERNAL_ERROR_HANDLING */
 	}
-	term.c_lflag &= ~ICANON;
-	term.c_cc[VMIN] = 1;
-	term.c_cc[VTIME] = 0;
-
-	if(tcsetattr(STDIN_FILENO, TCSAFLUSH, &term) != 0) {
+	if(nthreads == 0) {
+#ifdef _SC_NPROCESSORS_ONLN
+		long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+		nthreads = ncpus > 0 ? (unsigned) ncpus : 1;
+#else
+		nthreads = 1;
+#endif /* #ifdef _SC_NPROCESSORS_ONLN */
+	}
 #ifdef INTERNAL_ERROR_HANDLING
-		log_message(LOG_FATAL, "Error manipulating terminal: %s", strerror(errno));
-		exit(EXIT_FAILURE);
+	walk.workers = (struct __pdw_worker__*) xmemalign(CACHE_LINE_SIZE, nthreads * sizeof(struct __pdw_worker__));
 #else
+	if(unlikely(posix_memalign((void**) &walk.workers, CACHE_LINE_SIZE, nthreads * sizeof(struct __pdw_worker__)) != 0)) {
+		errno = ENOMEM;
 		return -1;
+	}
 #endif /* #ifdef INTERNAL_ERROR_HANDLING */
+	walk.nthreads = nthreads;
+	walk.pending = 0;
+	walk.idle = walk.events = 0;
+	walk.ret = walk.error = 0;
+	pthread_mutex_init(&walk.lock, (pthread_mutexattr_t*) NULL);
+	for(n = 0; n < nthreads; n++) {
+		__dirwalk_init(&walk.workers[n].w, flags, func, arg);
+		walk.workers[n].walk = &walk;
+		walk.workers[n].entries = (struct __pdw_entry__*) NULL;
+		walk.workers[n].entries_size = 0;
+		walk.workers[n].names = (char*) NULL;
+		walk.workers[n].names_size = 0;
+		walk.workers[n].id = n;
+		if(unlikely(__ws_init(&walk.workers[n].deque) != 0)) {
+			errno = ENOMEM;
+			walk.ret = -1;
+			goto out;
+		}
 	}
-	return 0;
+
+	/* open the top directory here to report errors */
+	if(unlikely(__dirwalk_reserve(&walk.workers[0].w, len) != 0)) {
+		walk.ret = -1;
+		goto out;
+	}
+	memcpy(walk.workers[0].w.path, path, len);
+	walk.workers[0].w.path[len] = '\0';
+	if((fd = open(walk.workers[0].w.path, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0) {
+		walk.ret = -1;
+		goto out;
+	}
+	if(unlikely(__pdw_push(&walk.workers[0], walk.workers[0].w.path, len, 0, fd) != 0)) {
+		close(fd);
+		walk.ret = -1;
+		goto out;
+	}
+
+	/* the calling thread is worker 0. Make do with the threads we could
+	 * start: the deques of the others stay empty */
+	for(started = 1; started < nthreads; started++) {
+		walk.workers[started].thread = launch_thread(&__pdw_worker, &walk.workers[started], (pthread_attr_t*) NULL);
+		if(unlikely(walk.workers[started].thread == 0))
+			break;
+	}
+	(void) __pdw_worker(&walk.workers[0]);
+	for(i = 1; i < started; i++)
+		pthread_join(walk.workers[i].thread, (void**) NULL);
+	if(walk.ret == -1)
+		errno = walk.error;
+out:
+	for(i = 0; i < n; i++) {
+		__ws_free(&walk.workers[i].deque);
+		__dirwalk_free(&walk.workers[i].w);
+		free(walk.workers[i].entries);
+		free(walk.workers[i].names);
+	}
+	pthread_mutex_destroy(&walk.lock);
+	free(walk.workers);
+	return walk.ret;
 }
 
-int normal_getchar(void)
+#ifdef ENABLE_DATASTRUCTS
+/* ----- Duplicate files ----- */
+#define DUP_HEAD_SIZE	4096
+/* files are hashed block by block, so that mapped and read files hash the same */
+#define DUP_BLOCK_SIZE	(1024 * 1024)
+
+struct __dup_file__ {
+	uint64_t size;
+	uint64_t dev;
+	uint64_t ino;
+	uint64_t head;	/* hash of the first DUP_HEAD_SIZE bytes */
+	uint64_t full;	/* hash of the whole file */
+	size_t path;	/* offset in paths */
+	int error;
+};
+
+struct __dup_finder__ {
+	struct __dup_file__ *files;
+	size_t nfiles;
+	size_t files_size;
+	char *paths;
+	size_t pathslen;
+	size_t paths_size;
+	uint64_t min_size;
+	pthread_mutex_t lock;
+	BOOL_TYPE full;		/* hashing heads or whole files */
+};
+
+static int __dup_collect(const DirEntry *e, void *arg)
 {
-	struct termios term;
+	struct __dup_finder__ *d = (struct __dup_finder__*) arg;
+	struct __dup_file__ *f;
+	int ret = 0;
 
-	if(tcgetattr(STDIN_FILENO, &term) != 0) {
-#ifdef INTERNAL_ERROR_HANDLING
-		log_message(LOG_FATAL, "Error manipulating terminal: %s", strerror(errno));
-		exit(EXIT_FAILURE);
-#else
+	if(e->type != DIRWALK_FILE || (uint64_t) e->st->st_size < d->min_size)
+		return 0;
+	pthread_mutex_lock(&d->lock);
+	if(unlikely(__pdw_reserve((void**) &d->files, &d->files_size, d->nfiles + 1, sizeof(struct __dup_file__)) != 0
+			|| __pdw_reserve((void**) &d->paths, &d->paths_size, d->pathslen + e->pathlen + 1, 1) != 0)) {
+		ret = -1;
+	} else {
+		f = &d->files[d->nfiles++];
+		f->size = (uint64_t) e->st->st_size;
+		f->dev = (uint64_t) e->st->st_dev;
+		f->ino = (uint64_t) e->st->st_ino;
+		f->path = d->pathslen;
+		f->error = 0;
+		memcpy(&d->paths[d->pathslen], e->path, e->pathlen + 1);
+		d->pathslen += e->pathlen + 1;
+	}
+	pthread_mutex_unlock(&d->lock);
+	return ret;
+}
+
+/* hash the first len bytes of path into *hash. *buf is allocated if need be.
+ * Return 0 on success, -1 otherwise */
+static int __dup_hash(const char *path, uint64_t len, uint64_t *hash, char **buf)
+{
+	uint64_t h = len, pos, n;
+	const char *map;
+	struct stat st;
+	ssize_t nread;
+	size_t fill;
+	int fd = open(path, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+
+	if(fd < 0)
+		return -1;
+	/* the file may have shrunk since it was walked through, and touching
+	 * mapped pages past its end raises SIGBUS */
+	if(fstat(fd, &st) != 0 || (uint64_t) st.st_size < len) {
+		close(fd);
 		return -1;
-#endif /* #ifdef INTERNAL_ERROR_HANDLING */
 	}
-	term.c_lflag |= ICANON;
-	if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &term) != 0) {
+	if(len > DUP_HEAD_SIZE && len <= (uint64_t) SIZE_MAX) {
+		map = (const char*) mmap(NULL, (size_t) len, PROT_READ, MAP_PRIVATE, fd, 0);
+		if(map != (const char*) MAP_FAILED) {
+			/* pages are read once, in order */
+			madvise((void*) map, (size_t) len, MADV_SEQUENTIAL);
+			for(pos = 0; pos < len; pos += n) {
+				n = len - pos < DUP_BLOCK_SIZE ? len - pos : DUP_BLOCK_SIZE;
+				h = __hash_mix(h + (uint64_t) hash_bytes(&map[pos], (size_t) n));
+			}
+			munmap((void*) map, (size_t) len);
+			close(fd);
+			*hash = h;
+			return 0;
+		}
+	}
+	if(*buf == (char*) NULL) {
 #ifdef INTERNAL_ERROR_HANDLING
-		log_message(LOG_FATAL, "Error manipulating terminal: %s", strerror(errno));
-		exit(EXIT_FAILURE);
+		*buf = (char*) xmalloc(DUP_BLOCK_SIZE);
 #else
-		return -1;
+		if(unlikely((*buf = (char*) malloc(DUP_BLOCK_SIZE)) == (char*) NULL)) {
+			close(fd);
+			return -1;
+		}
 #endif /* #ifdef INTERNAL_ERROR_HANDLING */
 	}
+	for(pos = 0; pos < len; pos += n) {
+		n = len - pos < DUP_BLOCK_SIZE ? len - pos : DUP_BLOCK_SIZE;
+		for(fill = 0; fill < (size_t) n; fill += (size_t) nread) {
+			nread = read(fd, *buf + fill, (size_t) n - fill);
+			if(nread < 0 && errno == EINTR) {
+				nread = 0;
+				continue;
+			}
+			/* file shrunk or I/O error */
+			if(nread <= 0) {
+				close(fd);
+				return -1;
+			}
+		}
+		h = __hash_mix(h + (uint64_t) hash_bytes(*buf, (size_t) n));
+	}
+	close(fd);
+	*hash = h;
 	return 0;
 }
 
-#endif /* #if defined(ENABLE_TERMIOS_MANIPULATION) && defined(__unix__) */
+static void __dup_hash_range(size_t from, size_t to, void *arg)
+{
+	struct __dup_finder__ *d = (struct __dup_finder__*) arg;
+	struct __dup_file__ *f;
+	char *buf = (char*) NULL;
+
+	for(; from < to; from++) {
+		f = &d->files[from];
+		if( ! d->full)
+			f->error = __dup_hash(&d->paths[f->path], f->size < DUP_HEAD_SIZE ? f->size : DUP_HEAD_SIZE, &f->head, &buf);
+		else if(f->size > DUP_HEAD_SIZE)
+			f->error = __dup_hash(&d->paths[f->path], f->size, &f->full, &buf);
+		/* the head is the whole file */
+		if( ! d->full && f->size <= DUP_HEAD_SIZE)
+			f->full = f->head;
+	}
+	free(buf);
+}
 
+#define __dup_cmp(a, b)	((a) < (b) ? -1 : (a) > (b))
 
-/* -------------------- Threading -------------------- */
-#ifdef ENABLE_THREADING
+static int __dup_cmp_inode(const void *a, const void *b)
+{
+	const struct __dup_file__ *f1 = (const struct __dup_file__*) a, *f2 = (const struct __dup_file__*) b;
 
-pthread_t launch_thread(void *(*start_routine)(void*), void *arg, const pthread_attr_t *attr)
+	if(f1->size != f2->size)
+		return __dup_cmp(f1->size, f2->size);
+	if(f1->dev != f2->dev)
+		return __dup_cmp(f1->dev, f2->dev);
+	return __dup_cmp(f1->ino, f2->ino);
+}
+
+static int __dup_cmp_size(const void *a, const void *b)
 {
-	pthread_t th;
-	if(pthread_create(&th, attr, start_routine, arg) != 0) {
-		log_message(LOG_ERROR, "Error creating thread: %s", strerror(errno));
-		th = 0;
-	}
-	return th;
+	return __dup_cmp(((const struct __dup_file__*) a)->size, ((const struct __dup_file__*) b)->size);
 }
 
-#ifdef ENABLE_ERROR_HANDLING
+static int __dup_cmp_head(const void *a, const void *b)
+{
+	const struct __dup_file__ *f1 = (const struct __dup_file__*) a, *f2 = (const struct __dup_file__*) b;
 
-pthread_t xlaunch_thread(void *(*start_routine)(void*), void *arg, const pthread_attr_t *attr)
+	if(f1->size != f2->size)
+		return __dup_cmp(f1->size, f2->size);
+	return __dup_cmp(f1->head, f2->head);
+}
+
+static int __dup_cmp_full(const void *a, const void *b)
 {
-	pthread_t th = launch_thread(start_routine, arg, attr);
-	if(th == 0) {
-		log_message(LOG_FATAL, "Thread not created: %s", strerror(errno));
-		exit(EXIT_FAILURE);
-	}
-	return th;
+	const struct __dup_file__ *f1 = (const struct __dup_file__*) a, *f2 = (const struct __dup_file__*) b;
+
+	if(f1->size != f2->size)
+		return __dup_cmp(f1->size, f2->size);
+	if(f1->head != f2->head)
+		return __dup_cmp(f1->head, f2->head);
+	return __dup_cmp(f1->full, f2->full);
 }
 
-void *xpthread_join(pthread_t thread)
+/* drop files in error, then sort the others and only keep those which have
+ * at least one equal according to cmp. Return how many are left */
+static size_t __dup_keep_groups(struct __dup_file__ *files, size_t nfiles, int (*cmp)(const void*, const void*))
 {
-	void *retval;
+	size_t i, j, n = 0;
+
+	for(i = 0; i < nfiles; i++)
+		if(files[i].error == 0)
+			files[n++] = files[i];
+	qsort(files, n, sizeof(struct __dup_file__), cmp);
+	nfiles = n;
+	for(i = n = 0; i < nfiles; i = j) {
+		for(j = i + 1; j < nfiles && cmp(&files[i], &files[j]) == 0; j++)
+			;
+		if(j - i > 1) {
+			memmove(&files[n], &files[i], (j - i) * sizeof(struct __dup_file__));
+			n += j - i;
+		}
+	}
+	return n;
+}
 
-	if(pthread_join(thread, &retval) != 0) {
-		log_message(LOG_FATAL, "Error joining threads: %s", strerror(errno));
-		exit(EXIT_FAILURE);
+int find_duplicates(const char *path, uint64_t min_size, unsigned nthreads,
+		void (*func)(const char **paths, size_t npaths, uint64_t size, void *arg), void *arg)
+{
+	struct __dup_finder__ d;
+	ThreadPool p = (ThreadPool) NULL;
+	const char **group = (const char**) NULL;
+	size_t group_size = 0, i, j, n;
+	int ngroups = -1;
+
+	d.files = (struct __dup_file__*) NULL;
+	d.nfiles = d.files_size = 0;
+	d.paths = (char*) NULL;
+	d.pathslen = d.paths_size = 0;
+	d.min_size = min_size;
+	pthread_mutex_init(&d.lock, (pthread_mutexattr_t*) NULL);
+	if(parallel_dirwalk(path, DIRWALK_RECURSE | DIRWALK_STAT, nthreads, &__dup_collect, &d) != 0)
+		goto out;
+
+	/* same size, and not a hard link to a file already there */
+	qsort(d.files, d.nfiles, sizeof(struct __dup_file__), &__dup_cmp_inode);
+	for(i = 1; i < d.nfiles; i++)
+		if(d.files[i].dev == d.files[i - 1].dev && d.files[i].ino == d.files[i - 1].ino)
+			d.files[i].error = 1;
+	n = __dup_keep_groups(d.files, d.nfiles, &__dup_cmp_size);
+
+	/* with nthreads == 1, hash on the calling thread */
+	if(n > 1 && nthreads != 1)
+		p = new_thread_pool(nthreads);
+	d.full = BOOL_FALSE;
+	parallel_for(p, n, 1, &__dup_hash_range, &d);
+	n = __dup_keep_groups(d.files, n, &__dup_cmp_head);
+	d.full = BOOL_TRUE;
+	parallel_for(p, n, 1, &__dup_hash_range, &d);
+	n = __dup_keep_groups(d.files, n, &__dup_cmp_full);
+
+	for(i = ngroups = 0; i < n; i = j, ngroups++) {
+		for(j = i; j < n && __dup_cmp_full(&d.files[i], &d.files[j]) == 0; j++) {
+			if(unlikely(__pdw_reserve((void**) &group, &group_size, j - i + 1, sizeof(const char*)) != 0)) {
+				ngroups = -1;
+				goto out;
+			}
+			group[j - i] = &d.paths[d.files[j].path];
+		}
+		func(group, j - i, d.files[i].size, arg);
 	}
-	return retval;
+out:
+	if(p != (ThreadPool) NULL)
+		delete_thread_pool(p);
+	free(group);
+	free(d.files);
+	free(d.paths);
+	pthread_mutex_destroy(&d.lock);
+	return ngroups;
 }
-#endif /* #ifdef ENABLE_ERROR_HANDLING */
+
+#undef __dup_cmp
+#undef DUP_BLOCK_SIZE
+#undef DUP_HEAD_SIZE
+#endif /* #ifdef ENABLE_DATASTRUCTS */
+
+#undef __pdw_stopped
+#undef DIRWALK_BUFSIZE
+#undef WS_DEQUE_INIT_SIZE
+#endif /* #if defined(ENABLE_FILESYSTEM) && defined(__unix__) */
 
 #endif /* #ifdef ENABLE_THREADING */
 
@@ -2333,6 +9618,349 @@ int mclose(Mmap *f)
 
 #endif /* #if defined(ENABLE_MMAP) && defined(_POSIX_MAPPED_FILES) */
 
+
+/* -------------------- CSV/TSV reading -------------------- */
+#if defined(ENABLE_CSV) && defined(__unix__)
+
+#define CSV_BUFFER_SIZE		65536
+#define CSV_FIELDS_START_SIZE	16
+
+struct __csv_reader__ {
+	int fd;			/* -1 when parsing an Mmap */
+#ifdef ENABLE_MMAP
+	Mmap *map;
+#endif /* #ifdef ENABLE_MMAP */
+	byte separator, quote;
+	BOOL_TYPE eof, in_quote;
+	/* data not parsed yet is [start, end). scan is the offset from start up to
+	 * which we already looked for the end of the current record, and in_quote
+	 * the quoting state at that offset */
+	const byte *start, *end;
+	size_t scan;
+	byte *buf;
+	size_t bufsize;
+	/* holds the fields from which escaped quotes had to be removed */
+	byte *scratch;
+	size_t scratch_size;
+	CsvField *fields;
+	size_t fields_size;
+};
+
+/* make sure *ptr can hold at least nmemb elements of size size. Returns 0 on
+ * success, -1 on failure */
+static int __csv_reserve(void **ptr, size_t *cur_nmemb, size_t nmemb, size_t size)
+{
+	size_t new_nmemb = *cur_nmemb == 0 ? CSV_FIELDS_START_SIZE : *cur_nmemb;
+	void *new_ptr;
+
+	if(likely(nmemb <= *cur_nmemb))
+		return 0;
+	while(new_nmemb < nmemb)
+		new_nmemb <<= 1;
+#ifdef INTERNAL_ERROR_HANDLING
+	new_ptr = xrealloc(*ptr, new_nmemb * size);
+#else
+	new_ptr = realloc(*ptr, new_nmemb * size);
+	if(unlikely(new_ptr == (void*) NULL))
+		return -1;
+#endif /* #ifdef INTERNAL_ERROR_HANDLING */
+	*ptr = new_ptr;
+	*cur_nmemb = new_nmemb;
+	return 0;
+}
+
+static CsvReader __new_csv_reader(char separator, char quote)
+{
+#ifdef INTERNAL_ERROR_HANDLING
+	CsvReader r = (CsvReader) xmalloc(sizeof(struct __csv_reader__));
+#else
+	CsvReader r = (CsvReader) malloc(sizeof(struct __csv_reader__));
+	if(unlikely(r == (CsvReader) NULL))
+		return (CsvReader) NULL;
+#endif /* #ifdef INTERNAL_ERROR_HANDLING */
+	memset(r, 0, sizeof(struct __csv_reader__));
+	r->fd = -1;
+	r->separator = (byte) separator;
+	r->quote = (byte) quote;
+	if(unlikely(__csv_reserve((void**) &r->fields, &r->fields_size, 1, sizeof(CsvField)) != 0)) {
+		free(r);
+		return (CsvReader) NULL;
+	}
+	return r;
+}
+
+CsvReader new_csv_reader(int fd, char separator, char quote)
+{
+	CsvReader r = __new_csv_reader(separator, quote);
+
+#ifdef INTERNAL_ERROR_HANDLING
+	r->buf = (byte*) xmalloc(CSV_BUFFER_SIZE);
+#else
+	if(unlikely(r == (CsvReader) NULL))
+		return (CsvReader) NULL;
+	r->buf = (byte*) malloc(CSV_BUFFER_SIZE);
+	if(unlikely(r->buf == (byte*) NULL)) {
+		delete_csv_reader(r);
+		return (CsvReader) NULL;
+	}
+#endif /* #ifdef INTERNAL_ERROR_HANDLING */
+	r->bufsize = CSV_BUFFER_SIZE;
+	r->start = r->end = r->buf;
+	r->fd = fd;
+	return r;
+}
+
+#ifdef ENABLE_MMAP
+CsvReader new_csv_reader_mmap(Mmap *f, char separator, char quote)
+{
+	CsvReader r = __new_csv_reader(separator, quote);
+
+#ifndef INTERNAL_ERROR_HANDLING
+	if(unlikely(r == (CsvReader) NULL))
+		return (CsvReader) NULL;
+#endif /* #ifndef INTERNAL_ERROR_HANDLING */
+	r->map = f;
+	r->start = f->offset;
+	r->end = f->endptr;
+	r->eof = BOOL_TRUE;
+	return r;
+}
+#endif /* #ifdef ENABLE_MMAP */
+
+/* returns pointer to first occurence of c1 or c2 in [p, end), or end if there
+ * is none. Compares 32 or 16 bytes at a time when AVX2 or SSE2 are available */
+static const byte *__csv_find2(const byte *p, const byte *end, byte c1, byte c2)
+{
+#ifdef __AVX2__
+	__m256i y1 = _mm256_set1_epi8((char) c1), y2 = _mm256_set1_epi8((char) c2), ychunk;
+#endif /* #ifdef __AVX2__ */
+#ifdef __SSE2__
+	__m128i x1 = _mm_set1_epi8((char) c1), x2 = _mm_set1_epi8((char) c2), xchunk;
+#endif /* #ifdef __SSE2__ */
+#if defined(__AVX2__) || defined(__SSE2__)
+	unsigned mask;
+#endif /* #if defined(__AVX2__) || defined(__SSE2__) */
+
+#ifdef __AVX2__
+	for(; end - p >= 32; p += 32) {
+		ychunk = _mm256_loadu_si256((const __m256i*) p);
+		mask = (unsigned) _mm256_movemask_epi8(_mm256_or_si256(
+					_mm256_cmpeq_epi8(ychunk, y1), _mm256_cmpeq_epi8(ychunk, y2)));
+		if(mask != 0)
+			return p + __builtin_ctz(mask);
+	}
+#endif /* #ifdef __AVX2__ */
+#ifdef __SSE2__
+	for(; end - p >= 16; p += 16) {
+		xchunk = _mm_loadu_si128((const __m128i*) p);
+		mask = (unsigned) _mm_movemask_epi8(_mm_or_si128(
+					_mm_cmpeq_epi8(xchunk, x1), _mm_cmpeq_epi8(xchunk, x2)));
+		if(mask != 0)
+			return p + __builtin_ctz(mask);
+	}
+#endif /* #ifdef __SSE2__ */
+	for(; p < end; p++)
+		if(*p == c1 || *p == c2)
+			return p;
+	return end;
+}
+
+/* look for the newline ending the record starting at r->start. Quote chars
+ * toggle quoting, so an escaped quote ("") leaves the state unchanged.
+ * Returns NULL if the record isn't complete in [r->start, r->end) */
+static const byte *__csv_find_record_end(CsvReader r)
+{
+	const byte *p = r->start + r->scan, *q;
+
+	if(r->quote == (byte) CSV_NO_QUOTE) {
+		q = (const byte*) memchr(p, '\n', r->end - p);
+		r->scan = (q == (const byte*) NULL ? r->end : q) - r->start;
+		return q;
+	}
+	while(p < r->end) {
+		if(r->in_quote) {
+			q = (const byte*) memchr(p, r->quote, r->end - p);
+			if(q == (const byte*) NULL)
+				break;
+			r->in_quote = BOOL_FALSE;
+		} else {
+			q = __csv_find2(p, r->end, r->quote, '\n');
+			if(q == r->end)
+				break;
+			if(*q == '\n') {
+				r->scan = q - r->start;
+				return q;
+			}
+			r->in_quote = BOOL_TRUE;
+		}
+		p = q + 1;
+	}
+	r->scan = r->end - r->start;
+	return (const byte*) NULL;
+}
+
+/* move unparsed data to the start of the buffer, doubling its size if it is
+ * full, then read() as much as fits. Returns 0 on success, -1 on error */
+static int __csv_fill(CsvReader r)
+{
+	size_t len = r->end - r->start;
+	ssize_t ret;
+	byte *new_buf;
+
+	if(r->start != r->buf)
+		memmove(r->buf, r->start, len);
+	if(len == r->bufsize) {
+#ifdef INTERNAL_ERROR_HANDLING
+		new_buf = (byte*) xrealloc(r->buf, r->bufsize << 1);
+#else
+		new_buf = (byte*) realloc(r->buf, r->bufsize << 1);
+		if(unlikely(new_buf == (byte*) NULL))
+			return -1;
+#endif /* #ifdef INTERNAL_ERROR_HANDLING */
+		r->buf = new_buf;
+		r->bufsize <<= 1;
+	}
+	r->start = r->buf;
+	r->end = r->buf + len;
+
+	do
+		ret = read(r->fd, r->buf + len, r->bufsize - len);
+	while(ret == -1 && errno == EINTR);
+	if(unlikely(ret == -1))
+		return -1;
+	else if(ret == 0)
+		r->eof = BOOL_TRUE;
+	r->end += ret;
+	return 0;
+}
+
+/* parse a field containing quote chars. p is the start of the field and q its
+ * first quote char. Fields made of a single quoted string are returned in place,
+ * all others are unescaped into *out. Returns pointer to the separator ending
+ * the field, or rec_end */
+static const byte *__csv_parse_quoted(CsvReader r, const byte *p, const byte *q,
+		const byte *rec_end, byte **out, CsvField *field)
+{
+	const byte *close;
+	byte *start = *out;
+
+	if(q == p) {
+		close = (const byte*) memchr(q + 1, r->quote, rec_end - q - 1);
+		if(close != (const byte*) NULL && (close + 1 == rec_end || close[1] == r->separator)) {
+			field->data = (const char*) q + 1;
+			field->len = close - q - 1;
+			return close + 1;
+		}
+	}
+	memcpy(*out, p, q - p);
+	*out += q - p;
+	do {
+		/* q points to the quote char opening a quoted section */
+		close = (const byte*) memchr(q + 1, r->quote, rec_end - q - 1);
+		if(unlikely(close == (const byte*) NULL))
+			close = rec_end;	/* unterminated quote at end of input */
+		memcpy(*out, q + 1, close - q - 1);
+		*out += close - q - 1;
+		if(close == rec_end) {
+			p = rec_end;
+		} else if(close + 1 < rec_end && close[1] == r->quote) {
+			*(*out)++ = r->quote;
+			q = close + 1;
+			p = q;
+		} else {
+			p = close + 1;
+			q = __csv_find2(p, rec_end, r->separator, r->quote);
+			memcpy(*out, p, q - p);
+			*out += q - p;
+			p = q;
+		}
+	} while(p != rec_end && *p == r->quote);
+
+	field->data = (const char*) start;
+	field->len = *out - start;
+	return p;
+}
+
+/* split [p, rec_end) into fields. Returns number of fields or -1 on error */
+static ssize_t __csv_split_record(CsvReader r, const byte *p, const byte *rec_end)
+{
+	const byte *q;
+	byte *out = r->scratch;
+	size_t n = 0;
+
+	do {
+		if(unlikely(__csv_reserve((void**) &r->fields, &r->fields_size,
+						n + 1, sizeof(CsvField)) != 0))
+			return -1;
+		if(r->quote == (byte) CSV_NO_QUOTE) {
+			q = (const byte*) memchr(p, r->separator, rec_end - p);
+			if(q == (const byte*) NULL)
+				q = rec_end;
+		} else
+			q = __csv_find2(p, rec_end, r->separator, r->quote);
+
+		if(q == rec_end || *q == r->separator) {
+			r->fields[n].data = (const char*) p;
+			r->fields[n].len = q - p;
+		} else
+			q = __csv_parse_quoted(r, p, q, rec_end, &out, &r->fields[n]);
+		n++;
+		p = q + 1;
+	} while(q != rec_end);
+
+	return (ssize_t) n;
+}
+
+ssize_t csv_read_record(CsvReader r, CsvField **fields)
+{
+	const byte *rec_end, *next;
+	ssize_t n;
+
+	while((rec_end = __csv_find_record_end(r)) == (const byte*) NULL) {
+		if(r->eof) {
+			if(r->start == r->end)
+				return 0;
+			rec_end = r->end;
+			break;
+		}
+		if(unlikely(__csv_fill(r) != 0))
+			return -1;
+	}
+	next = rec_end < r->end ? rec_end + 1 : rec_end;
+	if(rec_end > r->start && rec_end[-1] == '\r')
+		rec_end--;
+
+	/* unescaped fields are never longer than the record they come from */
+	if(r->quote != (byte) CSV_NO_QUOTE && unlikely(__csv_reserve((void**) &r->scratch,
+					&r->scratch_size, rec_end - r->start, sizeof(byte)) != 0))
+		return -1;
+	n = __csv_split_record(r, r->start, rec_end);
+	if(unlikely(n == -1))
+		return -1;
+
+	r->start = next;
+	r->scan = 0;
+	r->in_quote = BOOL_FALSE;
+#ifdef ENABLE_MMAP
+	if(r->map != (Mmap*) NULL)
+		r->map->offset = (byte*) next;
+#endif /* #ifdef ENABLE_MMAP */
+	*fields = r->fields;
+	return n;
+}
+
+void delete_csv_reader(CsvReader r)
+{
+	free(r->buf);
+	free(r->scratch);
+	free(r->fields);
+	free(r);
+}
+
+#undef CSV_BUFFER_SIZE
+#undef CSV_FIELDS_START_SIZE
+#endif /* #if defined(ENABLE_CSV) && defined(__unix__) */
+
 /* -------------------- Misc functions -------------------- */
 #ifdef ENABLE_MISC
 
@@ -2449,6 +10077,329 @@ void *initialize_vector(void *dest, const void *src, size_t size, size_t nmemb)
 	return dest;
 }
 
+/* arrays shorter than this are insertion sorted */
+#define RADIX_SORT_MIN		64
+#define SORT_STRINGS_MIN	16
+
+/* radix sort for keys of type type. Defines int radix_sort_<suffix>() */
+#define __DEFINE_RADIX_SORT(suffix, type)						\
+int radix_sort_##suffix(type *keys, void **values, size_t nmemb)			\
+{											\
+	size_t counts[sizeof(type)][256], i, j, pos, sum;				\
+	type *src = keys, *dst, *tmp, key;						\
+	void **vsrc = values, **vdst = (void**) NULL, **vtmp = (void**) NULL, *value;	\
+	unsigned d, b;									\
+											\
+	if(nmemb < RADIX_SORT_MIN) {							\
+		for(i = 1; i < nmemb; i++) {						\
+			key = keys[i];							\
+			value = values != (void**) NULL ? values[i] : NULL;		\
+			for(j = i; j > 0 && keys[j - 1] > key; j--) {			\
+				keys[j] = keys[j - 1];					\
+				if(values != (void**) NULL)				\
+					values[j] = values[j - 1];			\
+			}								\
+			keys[j] = key;							\
+			if(values != (void**) NULL)					\
+				values[j] = value;					\
+		}									\
+		return 0;								\
+	}										\
+	__RADIX_SORT_ALLOC(tmp, type, nmemb, (void) 0);					\
+	if(values != (void**) NULL)							\
+		__RADIX_SORT_ALLOC(vtmp, void*, nmemb, free(tmp));			\
+	dst = tmp;									\
+	vdst = vtmp;									\
+											\
+	/* histograms of all digits at once */						\
+	memset(counts, 0, sizeof(counts));						\
+	for(i = 0; i < nmemb; i++)							\
+		for(d = 0; d < sizeof(type); d++)					\
+			counts[d][(keys[i] >> (d << 3)) & 0xFF]++;			\
+	for(d = 0; d < sizeof(type); d++) {						\
+		/* this byte is the same in all keys */					\
+		if(counts[d][(src[0] >> (d << 3)) & 0xFF] == nmemb)			\
+			continue;							\
+		for(b = 0, sum = 0; b < 256; b++) {					\
+			pos = counts[d][b];						\
+			counts[d][b] = sum;						\
+			sum += pos;							\
+		}									\
+		for(i = 0; i < nmemb; i++) {						\
+			pos = counts[d][(src[i] >> (d << 3)) & 0xFF]++;		\
+			dst[pos] = src[i];						\
+			if(vsrc != (void**) NULL)					\
+				vdst[pos] = vsrc[i];					\
+		}									\
+		tmp = src; src = dst; dst = tmp;					\
+		vtmp = vsrc; vsrc = vdst; vdst = vtmp;					\
+	}										\
+	if(src != keys) {								\
+		memcpy(keys, src, nmemb * sizeof(type));				\
+		if(values != (void**) NULL)						\
+			memcpy(values, vsrc, nmemb * sizeof(void*));			\
+		dst = src;								\
+		vdst = vsrc;								\
+	}										\
+	/* dst and vdst are the temporary buffers now */				\
+	free(dst);									\
+	free(vdst);									\
+	return 0;									\
+}
+
+#ifdef INTERNAL_ERROR_HANDLING
+# define __RADIX_SORT_ALLOC(p, type, nmemb, cleanup)	\
+	((void) (p = (type*) xmalloc((nmemb) * sizeof(type))))
+#else
+# define __RADIX_SORT_ALLOC(p, type, nmemb, cleanup)	\
+	do {							\
+		p = (type*) malloc((nmemb) * sizeof(type));	\
+		if(unlikely(p == (type*) NULL)) {		\
+			cleanup;				\
+			return -1;				\
+		}						\
+	} while(0)
+#endif /* #ifdef INTERNAL_ERROR_HANDLING */
+
+__DEFINE_RADIX_SORT(u32, uint32_t)
+__DEFINE_RADIX_SORT(u64, uint64_t)
+
+#undef __RADIX_SORT_ALLOC
+#undef __DEFINE_RADIX_SORT
+
+#define __sort_char(s, depth)	((unsigned char) (s)[depth])
+
+/* all strings share their first depth characters */
+static void __sort_strings(char **strs, size_t nmemb, size_t depth)
+{
+	size_t i, j, lt, gt;
+	unsigned char pivot, c, c0, c1, c2;
+	char *tmp;
+
+	while(nmemb >= SORT_STRINGS_MIN) {
+		/* median of 3 characters at depth */
+		c0 = __sort_char(strs[0], depth);
+		c1 = __sort_char(strs[nmemb >> 1], depth);
+		c2 = __sort_char(strs[nmemb - 1], depth);
+		pivot = c0 < c1 ? (c1 < c2 ? c1 : (c0 < c2 ? c2 : c0)) : (c0 < c2 ? c0 : (c1 < c2 ? c2 : c1));
+
+		/* partition into <, = and > pivot at depth */
+		for(lt = 0, i = 0, gt = nmemb; i < gt; ) {
+			c = __sort_char(strs[i], depth);
+			if(c < pivot) {
+				tmp = strs[lt]; strs[lt++] = strs[i]; strs[i++] = tmp;
+			} else if(c > pivot) {
+				tmp = strs[--gt]; strs[gt] = strs[i]; strs[i] = tmp;
+			} else {
+				i++;
+			}
+		}
+		__sort_strings(strs, lt, depth);
+		__sort_strings(&strs[gt], nmemb - gt, depth);
+		/* strings equal to pivot share one more character, unless they
+		 * all ended */
+		if(pivot == '\0')
+			return;
+		strs += lt;
+		nmemb = gt - lt;
+		depth++;
+	}
+	for(i = 1; i < nmemb; i++) {
+		tmp = strs[i];
+		for(j = i; j > 0 && strcmp(&strs[j - 1][depth], &tmp[depth]) > 0; j--)
+			strs[j] = strs[j - 1];
+		strs[j] = tmp;
+	}
+}
+
+void sort_strings(char **strs, size_t nmemb)
+{
+	__sort_strings(strs, nmemb, 0);
+}
+#undef __sort_char
+#undef SORT_STRINGS_MIN
+#undef RADIX_SORT_MIN
+
+#ifdef ENABLE_THREADING
+/* arrays shorter than this are sorted with qsort() */
+#define PARALLEL_SORT_MIN	16384
+
+/* one step of parallel_sort: sorting runs, or merging pairs of runs */
+struct __psort_step__ {
+	byte *src, *dst;
+	size_t size, nmemb, nruns;
+	const size_t *bounds;	/* run i is [bounds[i], bounds[i + 1][ */
+	int (*compar)(const void*, const void*);
+	unsigned nthreads;
+	BOOL_TYPE merge;
+};
+
+struct __psort_task__ {
+	const struct __psort_step__ *step;
+	unsigned t;
+};
+
+/* number of elements of a (na elements) among the first i of the merge of a
+ * and b, elements of a coming first among equal ones */
+static size_t __psort_corank(const struct __psort_step__ *st, const byte *a, size_t na,
+		const byte *b, size_t nb, size_t i)
+{
+	size_t lo = i > nb ? i - nb : 0, hi = i < na ? i : na, mid;
+
+	while(lo < hi) {
+		mid = lo + ((hi - lo) >> 1);
+		if(st->compar(a + mid * st->size, b + (i - mid - 1) * st->size) <= 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+/* merge outputs from to to of runs a and b into out */
+static void __psort_merge(const struct __psort_step__ *st, const byte *a, size_t na,
+		const byte *b, size_t nb, byte *out, size_t from, size_t to)
+{
+	size_t ia = __psort_corank(st, a, na, b, nb, from), ib = from - ia;
+	size_t ea = __psort_corank(st, a, na, b, nb, to), eb = to - ea;
+	size_t size = st->size;
+
+	out += from * size;
+	while(ia < ea && ib < eb) {
+		if(st->compar(a + ia * size, b + ib * size) <= 0)
+			memcpy(out, a + ia++ * size, size);
+		else
+			memcpy(out, b + ib++ * size, size);
+		out += size;
+	}
+	memcpy(out, a + ia * size, (ea - ia) * size);
+	out += (ea - ia) * size;
+	memcpy(out, b + ib * size, (eb - ib) * size);
+}
+
+static void *__psort_worker(void *arg)
+{
+	const struct __psort_task__ *task = (const struct __psort_task__*) arg;
+	const struct __psort_step__ *st = task->step;
+	size_t from, to, lo, mid, hi, r, s, e, size = st->size;
+
+	if( ! st->merge) {
+		for(r = task->t; r < st->nruns; r += st->nthreads)
+			qsort(st->src + st->bounds[r] * size, st->bounds[r + 1] - st->bounds[r], size, st->compar);
+		return NULL;
+	}
+	/* this thread writes output elements [from, to[, whichever pairs of
+	 * runs they come from */
+	from = (size_t) ((double) st->nmemb * task->t / st->nthreads);
+	to = (size_t) ((double) st->nmemb * (task->t + 1) / st->nthreads);
+	if(task->t == st->nthreads - 1)
+		to = st->nmemb;
+	for(r = 0; r < st->nruns; r += 2) {
+		lo = st->bounds[r];
+		mid = st->bounds[r + 1];
+		hi = r + 2 <= st->nruns ? st->bounds[r + 2] : mid;
+		s = from > lo ? from : lo;
+		e = to < hi ? to : hi;
+		if(s >= e)
+			continue;
+		if(r + 1 == st->nruns)
+			memcpy(st->dst + s * size, st->src + s * size, (e - s) * size);
+		else
+			__psort_merge(st, st->src + lo * size, mid - lo, st->src + mid * size, hi - mid,
+					st->dst + lo * size, s - lo, e - lo);
+	}
+	return NULL;
+}
+
+/* run step on nthreads threads, the calling one included */
+static void __psort_run(const struct __psort_step__ *st, struct __psort_task__ *tasks, pthread_t *threads)
+{
+	unsigned t;
+
+	for(t = 0; t < st->nthreads; t++) {
+		tasks[t].step = st;
+		tasks[t].t = t;
+		threads[t] = t == 0 ? 0 : launch_thread(&__psort_worker, &tasks[t], (pthread_attr_t*) NULL);
+		/* could not start a thread: do its share ourselves */
+		if(t > 0 && threads[t] == 0)
+			__psort_worker(&tasks[t]);
+	}
+	__psort_worker(&tasks[0]);
+	for(t = 1; t < st->nthreads; t++)
+		if(threads[t] != 0)
+			pthread_join(threads[t], (void**) NULL);
+}
+
+void parallel_sort(void *base, size_t nmemb, size_t size,
+		int (*compar)(const void*, const void*), unsigned nthreads)
+{
+	struct __psort_step__ st;
+	struct __psort_task__ *tasks;
+	pthread_t *threads;
+	size_t *bounds;
+	byte *tmp;
+	size_t i;
+
+	if(nthreads == 0) {
+#ifdef _SC_NPROCESSORS_ONLN
+		long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+		nthreads = ncpus > 0 ? (unsigned) ncpus : 1;
+#else
+		nthreads = 1;
+#endif /* #ifdef _SC_NPROCESSORS_ONLN */
+	}
+	if(nthreads < 2 || nmemb < PARALLEL_SORT_MIN) {
+		qsort(base, nmemb, size, compar);
+		return;
+	}
+	tmp = (byte*) malloc(nmemb * size);
+	bounds = (size_t*) malloc((nthreads + 1) * sizeof(size_t));
+	tasks = (struct __psort_task__*) malloc(nthreads * sizeof(struct __psort_task__));
+	threads = (pthread_t*) malloc(nthreads * sizeof(pthread_t));
+	if(unlikely(tmp == (byte*) NULL || bounds == (size_t*) NULL
+				|| tasks == (struct __psort_task__*) NULL || threads == (pthread_t*) NULL)) {
+		qsort(base, nmemb, size, compar);
+		goto end;
+	}
+	for(i = 0; i <= nthreads; i++)
+		bounds[i] = (size_t) ((double) nmemb * i / nthreads);
+	bounds[nthreads] = nmemb;
+
+	st.src = (byte*) base;
+	st.dst = tmp;
+	st.size = size;
+	st.nmemb = nmemb;
+	st.nruns = nthreads;
+	st.bounds = bounds;
+	st.compar = compar;
+	st.nthreads = nthreads;
+	st.merge = BOOL_FALSE;
+	__psort_run(&st, tasks, threads);
+
+	st.merge = BOOL_TRUE;
+	while(st.nruns > 1) {
+		__psort_run(&st, tasks, threads);
+		/* merged runs start at every other boundary */
+		for(i = 0; 2 * i < st.nruns; i++)
+			bounds[i] = bounds[2 * i];
+		bounds[i] = nmemb;
+		st.nruns = i;
+		tmp = st.src;
+		st.src = st.dst;
+		st.dst = tmp;
+	}
+	if(st.src != (byte*) base)
+		memcpy(base, st.src, nmemb * size);
+	tmp = st.src == (byte*) base ? st.dst : st.src;
+end:
+	free(tmp);
+	free(bounds);
+	free(tasks);
+	free(threads);
+}
+#undef PARALLEL_SORT_MIN
+#endif /* #ifdef ENABLE_THREADING */
+
 size_t human_readable(const char *str)
 {
 	size_t size = 0;
@@ -46,9 +46,17 @@
 /* Easily read data from streams/file descriptors */
 #define ENABLE_READ_DATA
 
-/* Data structures: double linked list, stack, queue, Bitset */
+/* Data structures: dynamic array, double linked list, stack, queue, deque,
+ * intrusive lists, Bitset, compressed bitmap, hash map, B+tree, heap, Bloom filter,
+ * LRU/CLOCK cache */
 #define ENABLE_DATASTRUCTS
 
+/* Stack and Queue stored in contiguous growable arrays instead of linked nodes:
+ * pushing and popping allocate nothing once they have grown to their working
+ * size, and elements are read sequentially. Memory is only given back when they
+ * are deleted */
+/* #define ARRAY_STACK_QUEUE */
+
 /* Directory navigation functions */
 #define ENABLE_FILESYSTEM
 
@@ -71,6 +79,9 @@
 /* High-level mmap. Still experimental */
 #define ENABLE_MMAP
 
+/* Streaming CSV/TSV parsing from file descriptors or Mmap'd files */
+#define ENABLE_CSV
+
 /* miscellaneous functions */
 #define ENABLE_MISC
 
@@ -161,6 +172,9 @@ extern int errno;
 # define BOOL_TYPE int
 #endif /* #ifdef ENABLE_BOOL_TYPE */
 
+/* used to keep data written by different threads on separate cache lines */
+#define CACHE_LINE_SIZE		64
+
 #if defined(MANAGE_MEM) || defined(ENABLE_ERROR_HANDLING)
 # define MAX_RETRIES_ALLOC	3
 #endif /* #if defined(MANAGE_MEM) || defined(ENABLE_ERROR_HANDLING) */
@@ -211,6 +225,11 @@ void *xmalloc(size_t size) __attribute__ ((malloc));
 void *xcalloc(size_t nmemb, size_t size) __attribute__ ((malloc));
 char *xstrdup(const char *str);
 void *xrealloc(void *ptr, size_t size);
+#ifdef __unix__
+/* same as xmalloc, returning memory aligned on an alignment-byte boundary.
+ * alignment must be a power of two multiple of sizeof(void*) */
+void *xmemalign(size_t alignment, size_t size) __attribute__ ((malloc));
+#endif /* #ifdef __unix__ */
 
 #define MAX_RETRIES_OPEN	3
 /* attempt to open the file with the corresponding mode. Calls exit() at failure */
@@ -466,6 +485,18 @@ void delete_mempool(struct mempool *mp) __attribute__ ((nonnull));
 /* -------------------- DATA STRUCTURES -------------------- */
 #ifdef ENABLE_DATASTRUCTS
 
+#include <stddef.h>
+#include <time.h>
+#ifdef __linux__
+# include <sys/mman.h>
+#endif /* #ifdef __linux__ */
+#ifdef __SSE2__
+# include <emmintrin.h>
+#endif /* #ifdef __SSE2__ */
+#ifdef __AVX2__
+# include <immintrin.h>
+#endif /* #ifdef __AVX2__ */
+
 /* ISO C forbids zero-size array ‘data’ */
 #define __ARRAY_SIZEOF_DATA_ELEM	1
 #ifdef C89
@@ -482,18 +513,89 @@ struct __array_data__ {
 	byte data[__ARRAY_SIZEOF_DATA_ELEM];
 };
 
+/* ----- Dynamic array ----- */
+/* Growable array used through an ordinary T* pointing to its first element, so
+ * that elements are read and written with a[i] at full speed and with the right
+ * type. Capacity (size) and element count (nmemb) live in a struct
+ * __array_data__ right before the first element. An empty array is NULL:
+ *	double *a = NULL;
+ *	array_push(a, 4.2);
+ *	for(i = 0; i < array_len(a); i++)
+ *		printf("%f\n", a[i]);
+ *	array_free(a);
+ * Capacity doubles when full. Arrays bigger than ARRAY_MREMAP_THRESHOLD bytes
+ * are mapped directly and grown with mremap() on Linux, which moves pages
+ * around instead of copying them.
+ * The macros below may evaluate a several times and may assign to it, so a
+ * must be a plain variable. Pointers to elements are invalidated whenever the
+ * array grows. Functions returning int return 0 on success and -1 if out of
+ * memory, in which case a is left untouched */
+#define ARRAY_MREMAP_THRESHOLD	(256 * 1024)
+
+#define __array_header(a)	((struct __array_data__*) (void*) ((byte*) (a) - __SIZEOF_ARRAY_STRUCT))
+#define array_len(a)		((a) == NULL ? (size_t) 0 : __array_header(a)->nmemb)
+#define array_capacity(a)	((a) == NULL ? (size_t) 0 : __array_header(a)->size)
+
+/* make room for n more elements */
+#define __array_make_room(a, n)	(array_len(a) + (n) <= array_capacity(a) ? 0 :\
+		((a) = __array_grow((a), sizeof(*(a)), array_len(a) + (n)),\
+		 array_len(a) + (n) <= array_capacity(a) ? 0 : -1))
+
+/* int array_push(T *a, T value) */
+#define array_push(a, v)	(__array_make_room(a, 1) != 0 ? -1 :\
+		((a)[__array_header(a)->nmemb++] = (v), 0))
+/* T array_pop(T *a). a must not be empty */
+#define array_pop(a)		((a)[--__array_header(a)->nmemb])
+/* T array_last(T *a). a must not be empty */
+#define array_last(a)		((a)[array_len(a) - 1])
+/* int array_insert(T *a, size_t i, T value). Shift elements from position i
+ * onwards one place to the right and store value at position i */
+#define array_insert(a, i, v)	(__array_make_room(a, 1) != 0 ? -1 :\
+		(memmove(&(a)[(i) + 1], &(a)[i], (array_len(a) - (i)) * sizeof(*(a))),\
+		 __array_header(a)->nmemb++, (a)[i] = (v), 0))
+/* void array_erase(T *a, size_t i). Remove element at position i, shifting
+ * the following elements one place to the left */
+#define array_erase(a, i)	((void) memmove(&(a)[i], &(a)[(i) + 1],\
+			(--__array_header(a)->nmemb - (i)) * sizeof(*(a))))
+/* void array_clear(T *a). Remove all elements, keeping memory allocated */
+#define array_clear(a)		((a) == NULL ? (void) 0 : (void) (__array_header(a)->nmemb = 0))
+
+/* int array_reserve(T *a, size_t n). Make room for n elements in total */
+#define array_reserve(a, n)	((n) <= array_capacity(a) ? 0 :\
+		((a) = __array_resize((a), sizeof(*(a)), (n)), (n) <= array_capacity(a) ? 0 : -1))
+/* void array_shrink(T *a). Release unused capacity. a becomes NULL if empty */
+#define array_shrink(a)		((void) ((a) = __array_resize((a), sizeof(*(a)), array_len(a))))
+/* void array_free(T *a). a becomes NULL */
+#define array_free(a)		(__array_free((a), sizeof(*(a))), (void) ((a) = NULL))
+
+/* implementation of the macros above. Return a unchanged if out of memory */
+void *__array_grow(void *a, size_t elem_size, size_t min_nmemb);
+void *__array_resize(void *a, size_t elem_size, size_t nmemb);
+void __array_free(void *a, size_t elem_size);
+
 typedef struct __datastruct_elem__ {
 	void *data;
 	struct __datastruct_elem__ *next;
 } __datastruct_elem__;
 
+/* see implementation for details */
+struct __datastruct_slab__;
+
 typedef struct __datastruct__ {
 	__datastruct_elem__ *in, *out;
+	__datastruct_elem__ *last;	/* last node of out. Unused by Queue */
+	struct __datastruct_slab__ *slab;
 } __datastruct__;
 
 /* ----- Double linked list ----- */
 typedef __datastruct__* DLinkedList;
 
+/* Nodes are allocated from chunks owned by the list and recycled through a
+ * free list. delete_dlinkedlist releases all of them at once, calling __del__
+ * on every element first unless it is NULL.
+ * Lists returned by dll_tail and dll_copy_interator share their nodes with dl:
+ * delete_dlinkedlist only frees the view itself and ignores __del__ for them,
+ * and they must not be used once dl has been deleted */
 DLinkedList new_dlinkedlist(void);
 void delete_dlinkedlist(DLinkedList dl, void (*__del__)(void*)) __attribute__ ((nonnull (1)));
 
@@ -506,64 +608,657 @@ void *dll_rev_iterate(DLinkedList dl) __attribute__ ((nonnull));
 void *dll_head(DLinkedList dl) __attribute__ ((nonnull));
 DLinkedList dll_tail(DLinkedList dl) __attribute__ ((nonnull));
 DLinkedList dll_copy_interator(DLinkedList dl) __attribute__ ((nonnull));
-/*
-DLinkedList dll_clone(DLinkedList dl, void *(*__clonefunc__)(void*));
-DLinkedList dll_join(DLinkedList dl1, DLinkedList dl2);
-DLinkedList dll_filter(DLinkedList dl, BOOL_TYPE (*__filterfunc__)(void*))
-void dll_sort(DLinkedList dl, int (*__cmp__)(void *d1, void *d2));
-*/
+
+/* return a new list holding __clonefunc__(data) for every element of dl, or
+ * the same data pointers if __clonefunc__ is NULL. The copy has its iterator at
+ * the same position as dl. Running out of memory returns NULL before
+ * __clonefunc__ is ever called */
+DLinkedList dll_clone(DLinkedList dl, void *(*__clonefunc__)(void*)) __attribute__ ((nonnull (1)));
+
+/* move all elements of dl2 to the end of dl1 and return dl1. Nodes are spliced,
+ * not copied: this takes O(1) time plus O(k) if dl2 was iterated over k elements.
+ * dl2 is left empty and must still be deleted. Returns NULL and sets errno to
+ * EINVAL if dl2 is a view from dll_tail/dll_copy_interator, or shares its nodes
+ * with dl1 */
+DLinkedList dll_join(DLinkedList dl1, DLinkedList dl2) __attribute__ ((nonnull));
+
+/* return a new list holding the elements of dl for which __filterfunc__
+ * returns true, in the same order */
+DLinkedList dll_filter(DLinkedList dl, BOOL_TYPE (*__filterfunc__)(void*)) __attribute__ ((nonnull));
+
+/* stable in-place sort. Nodes are relinked, no memory is allocated. The
+ * iterator is rewound */
+void dll_sort(DLinkedList dl, int (*__cmp__)(void *d1, void *d2)) __attribute__ ((nonnull));
+
 void *dll_map(DLinkedList dl, void *(*__mapfunc__)(void *data, void *arg), void *arg) __attribute__ ((nonnull (1)));
 
 
 /* ----- Stack ----- */
+#ifdef ARRAY_STACK_QUEUE
+/* dynamic array of elements, top of the stack last */
+typedef void** Stack;
+#else
 typedef __datastruct_elem__* Stack;
 
+/* Stack nodes come from a per-thread cache of up to STACK_NODE_CACHE_NMEMB
+ * nodes, refilled by stack_pop and delete_stack */
+#endif /* #ifdef ARRAY_STACK_QUEUE */
+
+/* an empty stack is NULL */
 #define new_stack()	(Stack) NULL
-void delete_stack(Stack s, void (*__del__)(void*)) __attribute__ ((nonnull (1)));
+void delete_stack(Stack s, void (*__del__)(void*));
 
+/* return data, or NULL if internal error handling is disabled and growing an
+ * array stack failed */
 void *stack_push(Stack *s, void *data);
+/* return NULL if s is empty */
 void *stack_pop(Stack *s);
 void *stack_peek(Stack s);
+/* make room for nmemb elements in total. Return 0 on success, -1 if out of
+ * memory. Does nothing for linked stacks */
+int stack_reserve(Stack *s, size_t nmemb);
+/* remove all elements, calling __del__ on each unless it is NULL. Array stacks
+ * keep their memory */
+void stack_clear(Stack *s, void (*__del__)(void*));
 
 /* for a consistent interface */
 #define stack_push(s, data)	stack_push(&(s), (data))
 #define stack_pop(s)		stack_pop(&(s))
+#define stack_reserve(s, n)	stack_reserve(&(s), (n))
+#define stack_clear(s, del)	stack_clear(&(s), (del))
 
 /* ----- Queue ----- */
+#ifdef ARRAY_STACK_QUEUE
+/* ring buffer of elements, which doubles in size when full */
+typedef struct __array_queue__ {
+	void **data;
+	size_t size, head, nmemb;
+} *Queue;
+#else
 typedef __datastruct__* Queue;
 
+/* Same node allocation scheme as DLinkedList */
+#endif /* #ifdef ARRAY_STACK_QUEUE */
+
 Queue new_queue(void);
-void delete_queue(Queue q, void (*__del__)(void*)); __attribute__ ((nonnull (1)))
+void delete_queue(Queue q, void (*__del__)(void*)) __attribute__ ((nonnull (1)));
 
 void queue_push(Queue q, void *data) __attribute__ ((nonnull (1)));
 void *queue_pop(Queue q) __attribute__ ((nonnull));
 void *queue_peek(Queue q) __attribute__ ((nonnull));
+/* make room for nmemb elements in total. Return 0 on success, -1 if out of
+ * memory */
+int queue_reserve(Queue q, size_t nmemb) __attribute__ ((nonnull));
+/* same as stack_clear */
+void queue_clear(Queue q, void (*__del__)(void*)) __attribute__ ((nonnull (1)));
+
+/* ----- Deque ----- */
+/* Elements are stored DEQUE_BLOCK_NMEMB at a time in contiguous blocks whose
+ * addresses are kept in a central map, so pushing and popping at both ends is
+ * O(1) amortized, access by index is O(1) and no allocation happens per element.
+ * Must be a power of 2 */
+#define DEQUE_BLOCK_NMEMB	64
+
+typedef struct __deque__ {
+	void ***map;
+	size_t map_size, start, nmemb;
+	void **spare;	/* last emptied block, kept for the next push */
+} *Deque;
+
+/* position between two elements of a Deque. Cursors are invalidated by pushing
+ * or popping at the front of the deque */
+typedef struct {
+	Deque d;
+	size_t pos;
+} DequeCursor;
+
+Deque new_deque(void);
+void delete_deque(Deque d, void (*__del__)(void*)) __attribute__ ((nonnull (1)));
+
+/* return data, or NULL if internal error handling is disabled and allocating
+ * a new block failed */
+void *deque_push_back(Deque d, void *data) __attribute__ ((nonnull (1)));
+void *deque_push_front(Deque d, void *data) __attribute__ ((nonnull (1)));
+
+/* return NULL if d is empty */
+void *deque_pop_back(Deque d) __attribute__ ((nonnull));
+void *deque_pop_front(Deque d) __attribute__ ((nonnull));
+void *deque_peek_back(Deque d) __attribute__ ((nonnull));
+void *deque_peek_front(Deque d) __attribute__ ((nonnull));
+
+/* return element at index i from the front, or NULL if i is out of range */
+void *deque_at(Deque d, size_t i) __attribute__ ((nonnull)) __attribute__ ((pure));
+
+#define deque_size(d)	((d)->nmemb)
+
+/* set cursor c before the first (deque_rewind) or after the last
+ * (deque_rewind_end) element of d */
+void deque_rewind(Deque d, DequeCursor *c) __attribute__ ((nonnull));
+void deque_rewind_end(Deque d, DequeCursor *c) __attribute__ ((nonnull));
+
+/* return element following (deque_iterate) or preceding (deque_rev_iterate) c
+ * and move c past it. Return NULL when there are no more elements */
+void *deque_iterate(DequeCursor *c) __attribute__ ((nonnull));
+void *deque_rev_iterate(DequeCursor *c) __attribute__ ((nonnull));
+
+/* same as dll_map */
+void *deque_map(Deque d, void *(*__mapfunc__)(void *data, void *arg), void *arg) __attribute__ ((nonnull (1, 2)));
+
+/* ----- Intrusive lists ----- */
+/* The link fields are embedded in the user's own struct, so adding an object
+ * to a list allocates nothing and the object is reached without an extra
+ * pointer hop. container_of() gets back to the object from its link:
+ *	struct conn {
+ *		int fd;
+ *		IListNode link;
+ *	};
+ *	IList l;
+ *	IListNode *n;
+ *	ilist_init(&l);
+ *	ilist_push_back(&l, &c->link);
+ *	ilist_foreach(&l, n)
+ *		printf("%d\n", container_of(n, struct conn, link)->fd);
+ * An object may be in several lists at once through several link fields */
+#ifndef container_of
+# define container_of(ptr, type, member)	((type*) (void*) ((char*) (ptr) - offsetof(type, member)))
+#endif /* #ifndef container_of */
+
+/* doubly linked, circular around the IList head: any node can be unlinked in
+ * O(1) without knowing which list it is in */
+typedef struct __ilist_node__ {
+	struct __ilist_node__ *next, *prev;
+} IListNode;
+
+typedef struct {
+	IListNode head;
+} IList;
+
+void ilist_init(IList *l) __attribute__ ((nonnull));
+#define ilist_empty(l)		((l)->head.next == &(l)->head)
+/* return NULL if l is empty */
+#define ilist_front(l)		(ilist_empty(l) ? (IListNode*) NULL : (l)->head.next)
+#define ilist_back(l)		(ilist_empty(l) ? (IListNode*) NULL : (l)->head.prev)
+
+void ilist_push_front(IList *l, IListNode *node) __attribute__ ((nonnull));
+void ilist_push_back(IList *l, IListNode *node) __attribute__ ((nonnull));
+/* insert node right after / before pos, which is already in a list */
+void ilist_insert_after(IListNode *pos, IListNode *node) __attribute__ ((nonnull));
+void ilist_insert_before(IListNode *pos, IListNode *node) __attribute__ ((nonnull));
+/* unlink node from whatever list it is in */
+void ilist_remove(IListNode *node) __attribute__ ((nonnull));
+/* return NULL if l is empty */
+IListNode *ilist_pop_front(IList *l) __attribute__ ((nonnull));
+IListNode *ilist_pop_back(IList *l) __attribute__ ((nonnull));
+/* unlink node and push it at the front / back of l, e.g. for LRU ordering */
+void ilist_move_front(IList *l, IListNode *node) __attribute__ ((nonnull));
+void ilist_move_back(IList *l, IListNode *node) __attribute__ ((nonnull));
+/* move all nodes of src to the end of dst in O(1). src is left empty */
+void ilist_splice(IList *dst, IList *src) __attribute__ ((nonnull));
+/* O(n) */
+size_t ilist_size(const IList *l) __attribute__ ((pure, nonnull));
+
+/* n must not be removed from the list inside ilist_foreach; use
+ * ilist_foreach_safe, which keeps the next node in tmp, for that */
+#define ilist_foreach(l, n)	for((n) = (l)->head.next; (n) != &(l)->head; (n) = (n)->next)
+#define ilist_rev_foreach(l, n)	for((n) = (l)->head.prev; (n) != &(l)->head; (n) = (n)->prev)
+#define ilist_foreach_safe(l, n, tmp)	for((n) = (l)->head.next, (tmp) = (n)->next;\
+		(n) != &(l)->head; (n) = (tmp), (tmp) = (n)->next)
+
+/* singly linked node for IStack and IQueue */
+typedef struct __islist_node__ {
+	struct __islist_node__ *next;
+} ISListNode;
+
+/* LIFO. An empty stack is NULL, like Stack */
+typedef ISListNode* IStack;
+
+#define new_istack()		(IStack) NULL
+#define istack_empty(s)		((s) == (IStack) NULL)
+#define istack_peek(s)		(s)
+void istack_push(IStack *s, ISListNode *node) __attribute__ ((nonnull));
+/* return NULL if s is empty */
+ISListNode *istack_pop(IStack *s) __attribute__ ((nonnull));
+
+/* for a consistent interface */
+#define istack_push(s, node)	istack_push(&(s), (node))
+#define istack_pop(s)		istack_pop(&(s))
+
+/* FIFO */
+typedef struct {
+	ISListNode *head, *tail;
+} IQueue;
+
+void iqueue_init(IQueue *q) __attribute__ ((nonnull));
+#define iqueue_empty(q)		((q)->head == (ISListNode*) NULL)
+#define iqueue_peek(q)		((q)->head)
+void iqueue_push(IQueue *q, ISListNode *node) __attribute__ ((nonnull));
+/* return NULL if q is empty */
+ISListNode *iqueue_pop(IQueue *q) __attribute__ ((nonnull));
 
 /* ----- Bitset ----- */
+/* Bits are stored in 64-bit words starting on a cache line boundary. Bits past
+ * size in the last word are always kept at 0.
+ * Functions taking a position return -1 and set errno to ERANGE if it is out
+ * of bounds */
 typedef struct {
-	size_t size;
-	byte data[1];
+	size_t size;		/* number of bits */
+	size_t nwords;
+	uint64_t data[1] __attribute__ ((aligned (CACHE_LINE_SIZE)));
 } __bitset_struct__;
 
 typedef __bitset_struct__ *Bitset;
 
+/* returned by the bitset_find_* functions when no bit matches */
+#define BITSET_NPOS	((size_t) -1)
+
 Bitset new_bitset(size_t size);
 
 #define free_bitset	free
 
-Bitset clone_bitset(const Bitset set);
+Bitset clone_bitset(const Bitset set) __attribute__ ((nonnull));
 
-/* obtain bit at position pos from set array */
-int getbit(const Bitset set, int pos) __attribute__ ((pure));
+/* obtain bit at position pos from set array. Return -1 and set errno to ERANGE
+ * if pos is out of range */
+int getbit(const Bitset set, size_t pos) __attribute__ ((nonnull));
 
 /* set bit at position pos to 1 */
-void setbit(Bitset set, int pos);
+int setbit(Bitset set, size_t pos) __attribute__ ((nonnull));
 
 /* set bit at position pos to 0 */
-void unsetbit(Bitset set, int pos);
+int unsetbit(Bitset set, size_t pos) __attribute__ ((nonnull));
+
+/* flip bit at position pos. Return new value of the bit */
+int togglebit(Bitset set, size_t pos) __attribute__ ((nonnull));
+
+/* set/unset bits in [from, to) */
+int bitset_set_range(Bitset set, size_t from, size_t to) __attribute__ ((nonnull));
+int bitset_clear_range(Bitset set, size_t from, size_t to) __attribute__ ((nonnull));
+/* unset all bits */
+void bitset_clear(Bitset set) __attribute__ ((nonnull));
+
+/* number of bits set to 1 */
+size_t bitset_count(const Bitset set) __attribute__ ((pure, nonnull));
+
+/* position of first bit set to 1 (resp. 0) at or after pos, or BITSET_NPOS */
+size_t bitset_find_next_set(const Bitset set, size_t pos) __attribute__ ((pure, nonnull));
+size_t bitset_find_next_clear(const Bitset set, size_t pos) __attribute__ ((pure, nonnull));
+#define bitset_find_first_set(set)	bitset_find_next_set(set, 0)
+#define bitset_find_first_clear(set)	bitset_find_next_clear(set, 0)
+
+/* iterate over positions of all bits set to 1, in increasing order. pos must be
+ * a size_t lvalue. Bits may be unset while iterating
+ * e.g. size_t pos;
+ *	bitset_foreach(set, pos)
+ *		printf("%lu\n", (unsigned long) pos); */
+#define bitset_foreach(set, pos)	\
+	for(pos = bitset_find_next_set(set, 0); pos != BITSET_NPOS; pos = bitset_find_next_set(set, pos + 1))
+
+/* dst = dst OP src. Both sets must have the same size, otherwise return -1 and
+ * set errno to EINVAL */
+int bitset_and(Bitset dst, const Bitset src) __attribute__ ((nonnull));
+int bitset_or(Bitset dst, const Bitset src) __attribute__ ((nonnull));
+int bitset_xor(Bitset dst, const Bitset src) __attribute__ ((nonnull));
+/* dst = dst AND NOT src */
+int bitset_andnot(Bitset dst, const Bitset src) __attribute__ ((nonnull));
+
+/* ----- Compressed bitmap ----- */
+/* Set of uint32_t in the spirit of Roaring bitmaps: values are grouped by their
+ * upper 16 bits into chunks of 65536, and each non-empty chunk is stored as
+ * whichever is smallest of a sorted array (up to 4096 values), a plain 8KB
+ * bitmap, or a list of runs of consecutive values. Empty chunks take no space.
+ * Run containers are only created by roaring_run_optimize() and by
+ * roaring_from_bitset(); modifying one turns it back into an array or bitmap */
+typedef struct __roaring_bitmap__ *RoaringBitmap;
+
+typedef struct {
+	RoaringBitmap r;
+	size_t container;
+	/* position within current container */
+	uint32_t index, next;
+} RoaringCursor;
+
+RoaringBitmap new_roaring_bitmap(void);
+RoaringBitmap roaring_clone(const RoaringBitmap r) __attribute__ ((nonnull));
+void delete_roaring_bitmap(RoaringBitmap r) __attribute__ ((nonnull));
+
+/* return 1 if x was added (resp. removed), 0 if it was already present (resp.
+ * absent), -1 if out of memory */
+int roaring_add(RoaringBitmap r, uint32_t x) __attribute__ ((nonnull));
+int roaring_remove(RoaringBitmap r, uint32_t x) __attribute__ ((nonnull));
+BOOL_TYPE roaring_contains(const RoaringBitmap r, uint32_t x) __attribute__ ((pure, nonnull));
+
+/* number of values in r */
+uint64_t roaring_cardinality(const RoaringBitmap r) __attribute__ ((pure, nonnull));
+/* number of values in r smaller than or equal to x */
+uint64_t roaring_rank(const RoaringBitmap r, uint32_t x) __attribute__ ((pure, nonnull));
+/* set *x to the value with rank i + 1, i.e. the i-th smallest value counting
+ * from 0. Return -1 if r has no more than i values */
+int roaring_select(const RoaringBitmap r, uint64_t i, uint32_t *x) __attribute__ ((nonnull));
+
+/* iterate over values in increasing order. r must not be modified meanwhile
+ * e.g. RoaringCursor c;
+ *	uint32_t x;
+ *	roaring_rewind(r, &c);
+ *	while(roaring_iterate(&c, &x))
+ *		... */
+void roaring_rewind(RoaringBitmap r, RoaringCursor *c) __attribute__ ((nonnull));
+BOOL_TYPE roaring_iterate(RoaringCursor *c, uint32_t *x) __attribute__ ((nonnull));
+
+/* return a new bitmap holding a OP b, NULL if out of memory */
+RoaringBitmap roaring_and(const RoaringBitmap a, const RoaringBitmap b) __attribute__ ((nonnull));
+RoaringBitmap roaring_or(const RoaringBitmap a, const RoaringBitmap b) __attribute__ ((nonnull));
+RoaringBitmap roaring_xor(const RoaringBitmap a, const RoaringBitmap b) __attribute__ ((nonnull));
+/* a AND NOT b */
+RoaringBitmap roaring_andnot(const RoaringBitmap a, const RoaringBitmap b) __attribute__ ((nonnull));
+
+/* convert containers to runs wherever that saves memory. Return -1 if out of memory */
+int roaring_run_optimize(RoaringBitmap r) __attribute__ ((nonnull));
+
+/* positions of bits set in b. Return NULL and set errno to EINVAL if b has bits
+ * set past UINT32_MAX */
+RoaringBitmap roaring_from_bitset(const Bitset b) __attribute__ ((nonnull));
+/* Bitset of size highest value + 1 */
+Bitset roaring_to_bitset(const RoaringBitmap r) __attribute__ ((nonnull));
+
+/* ----- HashMap ----- */
+/* Open addressing hash map. Each slot has a control byte holding 7 bits of the
+ * key's hash, and lookups compare 16 control bytes at a time (with SSE2 when
+ * available) before looking at any key. Slots are probed linearly and removal
+ * shifts following entries back instead of leaving tombstones, so lookups stay
+ * fast after many deletions.
+ * Keys and values are either void* (key_size/value_size 0) stored as is, or
+ * fixed-size blobs of key_size/value_size bytes copied into the map.
+ * In the functions below, a key or value argument is the pointer itself in the
+ * first case and a pointer to the bytes to copy in the second.
+ * hash and eq callbacks receive keys the same way. eq returns nonzero if both
+ * keys are equal. If NULL, pointer keys are hashed and compared by address and
+ * inline keys bytewise (make sure padding bytes are zeroed) */
+typedef struct __hashmap__ *HashMap;
+
+HashMap new_hashmap(size_t key_size, size_t value_size,
+		size_t (*hash)(const void *key), int (*eq)(const void *k1, const void *k2));
+/* call __del_key__ and __del_value__ on every key and value unless they are NULL.
+ * They receive pointers to the inline key/value storage for inline keys/values */
+void delete_hashmap(HashMap m, void (*__del_key__)(void*), void (*__del_value__)(void*)) __attribute__ ((nonnull (1)));
+
+/* insert or replace key. Return 0 if key was added, 1 if its value was replaced,
+ * -1 if out of memory */
+int hashmap_put(HashMap m, const void *key, const void *value) __attribute__ ((nonnull (1)));
+/* return value associated with key (pointer values) or pointer to it (inline
+ * values), NULL if not found. Inline value pointers are only valid until the
+ * next insertion or removal */
+void *hashmap_get(const HashMap m, const void *key) __attribute__ ((nonnull (1)));
+BOOL_TYPE hashmap_contains(const HashMap m, const void *key) __attribute__ ((nonnull (1)));
+/* remove key from m, calling __del_key__ and __del_value__ on it like
+ * delete_hashmap does. Return 0 on success, -1 if key was not found */
+int hashmap_remove(HashMap m, const void *key, void (*__del_key__)(void*), void (*__del_value__)(void*)) __attribute__ ((nonnull (1)));
+
+/* make room for nmemb elements without further rehashing.
+ * Return 0 on success, -1 if out of memory */
+int hashmap_reserve(HashMap m, size_t nmemb) __attribute__ ((nonnull));
+size_t hashmap_size(const HashMap m) __attribute__ ((pure, nonnull));
+
+/* walk through all elements in no particular order. *pos must be set to 0
+ * before the first call. Sets *key and *value (either of which may be NULL) the
+ * same way hashmap_get returns values. Return BOOL_FALSE when done.
+ * m must not be modified while iterating
+ * e.g. size_t pos = 0;
+ *	while(hashmap_iterate(m, &pos, &key, &value))
+ *		... */
+BOOL_TYPE hashmap_iterate(const HashMap m, size_t *pos, void **key, void **value) __attribute__ ((nonnull (1, 2)));
+
+/* fast non-cryptographic hash of len bytes */
+size_t hash_bytes(const void *data, size_t len) __attribute__ ((pure));
+/* hash and eq callbacks for '\0'-terminated string keys */
+size_t hash_string(const void *str) __attribute__ ((pure, nonnull));
+int string_equal(const void *s1, const void *s2) __attribute__ ((pure, nonnull));
+
+/* ----- B+tree ----- */
+/* Ordered map of uint64_t keys to void* values. Nodes are 256 bytes (4 cache
+ * lines) and aligned on cache lines; all values are stored in the leaves, which
+ * are linked together so that range scans walk from leaf to leaf without going
+ * back up the tree */
+typedef struct __btree__ *BTree;
+
+/* position between 2 elements of a BTree. Invalidated by any modification of
+ * the tree */
+typedef struct {
+	void *leaf;
+	unsigned pos;
+} BTreeCursor;
+
+BTree new_btree(void);
+/* build a tree from nmemb key/value pairs in O(nmemb). keys must be strictly
+ * increasing, otherwise return NULL and set errno to EINVAL */
+BTree new_btree_from_sorted(const uint64_t *keys, void **values, size_t nmemb);
+/* calls __del__ on every value unless it is NULL */
+void delete_btree(BTree t, void (*__del__)(void*)) __attribute__ ((nonnull (1)));
+
+/* insert or replace key. Return 0 if key was added, 1 if its value was
+ * replaced, -1 if out of memory */
+int btree_insert(BTree t, uint64_t key, void *value) __attribute__ ((nonnull (1)));
+/* return value associated with key, NULL if not found */
+void *btree_get(const BTree t, uint64_t key) __attribute__ ((pure, nonnull));
+BOOL_TYPE btree_contains(const BTree t, uint64_t key) __attribute__ ((pure, nonnull));
+/* remove key, calling __del__ on its value unless it is NULL. Return 0 on
+ * success, -1 if key was not found */
+int btree_remove(BTree t, uint64_t key, void (*__del__)(void*)) __attribute__ ((nonnull (1)));
+size_t btree_size(const BTree t) __attribute__ ((pure, nonnull));
+
+/* set c before the first element whose key is >= key (btree_lower_bound) or
+ * > key (btree_upper_bound) */
+void btree_lower_bound(const BTree t, uint64_t key, BTreeCursor *c) __attribute__ ((nonnull));
+void btree_upper_bound(const BTree t, uint64_t key, BTreeCursor *c) __attribute__ ((nonnull));
+/* set c before the first or after the last element of t */
+void btree_rewind(const BTree t, BTreeCursor *c) __attribute__ ((nonnull));
+void btree_rewind_end(const BTree t, BTreeCursor *c) __attribute__ ((nonnull));
+/* set *key and *value (either may be NULL) to the element following
+ * (btree_iterate) or preceding (btree_rev_iterate) c and move c past it.
+ * Return BOOL_FALSE when there are no more elements
+ * e.g. all elements with keys in [from, to[:
+ *	btree_lower_bound(t, from, &c);
+ *	while(btree_iterate(&c, &key, &value) && key < to)
+ *		... */
+BOOL_TYPE btree_iterate(BTreeCursor *c, uint64_t *key, void **value) __attribute__ ((nonnull (1)));
+BOOL_TYPE btree_rev_iterate(BTreeCursor *c, uint64_t *key, void **value) __attribute__ ((nonnull (1)));
+
+/* ----- Heap ----- */
+/* Priority queue kept as a 4-ary heap in a contiguous array: half as deep as a
+ * binary heap, and the 4 children of a node sit next to each other in memory.
+ * The element for which __cmp__ returns a negative value against all others
+ * comes out first (min-heap; reverse __cmp__ for a max-heap).
+ * heap_push returns a handle identifying the element until it leaves the heap,
+ * used to change its priority or remove it */
+typedef struct __heap__ *Heap;
+typedef size_t HeapHandle;
+
+#define HEAP_NO_HANDLE	((HeapHandle) -1)
+
+Heap new_heap(int (*__cmp__)(const void*, const void*));
+/* build a heap out of nmemb elements in O(nmemb). Handle of data[i] is i */
+Heap new_heap_from_array(void **data, size_t nmemb, int (*__cmp__)(const void*, const void*));
+/* calls __del__ on every element left unless it is NULL */
+void delete_heap(Heap h, void (*__del__)(void*)) __attribute__ ((nonnull (1)));
+
+/* return HEAP_NO_HANDLE if out of memory */
+HeapHandle heap_push(Heap h, void *data) __attribute__ ((nonnull (1)));
+/* remove and return first element, NULL if h is empty */
+void *heap_pop(Heap h) __attribute__ ((nonnull));
+/* first element without removing it, NULL if h is empty */
+void *heap_peek(const Heap h) __attribute__ ((pure, nonnull));
+size_t heap_size(const Heap h) __attribute__ ((pure, nonnull));
+
+/* element identified by handle */
+void *heap_get(const Heap h, HeapHandle handle) __attribute__ ((pure, nonnull));
+/* restore heap order after the priority of the element identified by handle
+ * changed (e.g. decrease-key), or set a new element for it */
+void heap_update(Heap h, HeapHandle handle) __attribute__ ((nonnull));
+void heap_replace(Heap h, HeapHandle handle, void *data) __attribute__ ((nonnull (1)));
+/* remove element identified by handle from h and return it */
+void *heap_remove(Heap h, HeapHandle handle) __attribute__ ((nonnull));
+
+/* DEFINE_HEAP(name, type, less) generates a 4-ary min-heap of inline values of
+ * type type kept in a dynamic array (see array_push), where less(a, b) is an
+ * expression or macro true if a must come out before b. Comparisons are then
+ * plain code instead of function calls through a pointer:
+ *	#define timer_less(a, b)	((a).deadline < (b).deadline)
+ *	DEFINE_HEAP(timer_heap, struct timer, timer_less)
+ *	struct timer *timers = NULL;
+ *	timer_heap_push(&timers, t);
+ *	next = timer_heap_pop(timers);
+ * It defines the following static functions:
+ *	int name_push(type **heap, type value);	-> 0 on success, -1 if out of memory
+ *	type name_pop(type *heap);		-> heap must not be empty
+ *	void name_heapify(type *heap);		-> turn a whole array into a heap
+ *	void name_update(type *heap, size_t i);	-> heap[i] was modified
+ * and the first element is heap[0] */
+#define DEFINE_HEAP(name, type, less)\
+static void name##_sift_up(type *heap, size_t i)\
+{\
+	type value = heap[i];\
+	size_t parent;\
+\
+	while(i > 0) {\
+		parent = (i - 1) >> 2;\
+		if( ! (less(value, heap[parent])))\
+			break;\
+		heap[i] = heap[parent];\
+		i = parent;\
+	}\
+	heap[i] = value;\
+}\
+\
+static void name##_sift_down(type *heap, size_t i)\
+{\
+	type value = heap[i];\
+	size_t n = array_len(heap), child, best, last;\
+\
+	while((child = (i << 2) + 1) < n) {\
+		last = child + 4 < n ? child + 4 : n;\
+		for(best = child++; child < last; child++)\
+			if(less(heap[child], heap[best]))\
+				best = child;\
+		if( ! (less(heap[best], value)))\
+			break;\
+		heap[i] = heap[best];\
+		i = best;\
+	}\
+	heap[i] = value;\
+}\
+\
+static int name##_push(type **heap, type value) __attribute__ ((unused));\
+static int name##_push(type **heap, type value)\
+{\
+	if(array_push(*heap, value) != 0)\
+		return -1;\
+	name##_sift_up(*heap, array_len(*heap) - 1);\
+	return 0;\
+}\
+\
+static type name##_pop(type *heap) __attribute__ ((unused));\
+static type name##_pop(type *heap)\
+{\
+	type first = heap[0];\
+\
+	heap[0] = array_pop(heap);\
+	if(array_len(heap) > 0)\
+		name##_sift_down(heap, 0);\
+	return first;\
+}\
+\
+static void name##_heapify(type *heap) __attribute__ ((unused));\
+static void name##_heapify(type *heap)\
+{\
+	size_t i = array_len(heap);\
+\
+	if(i < 2)\
+		return;\
+	for(i = (i - 2) >> 2; i > 0; i--)\
+		name##_sift_down(heap, i);\
+	name##_sift_down(heap, 0);\
+}\
+\
+static void name##_update(type *heap, size_t i) __attribute__ ((unused));\
+static void name##_update(type *heap, size_t i)\
+{\
+	name##_sift_up(heap, i);\
+	name##_sift_down(heap, i);\
+}
+
+/* ----- Bloom filter ----- */
+/* Probabilistic set answering "maybe present" or "definitely absent", stored in
+ * a Bitset. Options:
+ * BLOOM_COUNTING: every slot is a 4-bit counter instead of a bit, so that
+ *	elements can be removed. Takes 4 times as much memory. Counters stop at
+ *	15 and are never decremented past that point
+ * BLOOM_BLOCKED: all slots of an element are picked within the same 64-byte
+ *	block, so each operation touches a single cache line. False positive
+ *	rate is slightly higher than requested */
+typedef struct __bloom_filter__ *BloomFilter;
+
+#define BLOOM_COUNTING	0x1
+#define BLOOM_BLOCKED	0x2
+
+/* size filter for nmemb elements with a false positive rate of fp_rate, in ]0, 1[.
+ * Return NULL and set errno to EINVAL if parameters are out of range */
+BloomFilter new_bloom_filter(size_t nmemb, double fp_rate, int flags);
+void delete_bloom_filter(BloomFilter b) __attribute__ ((nonnull));
+
+void bloom_add(BloomFilter b, const void *data, size_t len) __attribute__ ((nonnull (1)));
+BOOL_TYPE bloom_contains(const BloomFilter b, const void *data, size_t len) __attribute__ ((pure, nonnull (1)));
+/* BLOOM_COUNTING filters only. Return -1 and set errno to EINVAL if b is not a
+ * counting filter, or ENOENT if data is definitely absent from b */
+int bloom_remove(BloomFilter b, const void *data, size_t len) __attribute__ ((nonnull (1)));
+void bloom_clear(BloomFilter b) __attribute__ ((nonnull));
+
+/* add all elements of src to dst. Both filters must have been created with the
+ * same parameters, otherwise return -1 and set errno to EINVAL */
+int bloom_union(BloomFilter dst, const BloomFilter src) __attribute__ ((nonnull));
+
+/* portable (little-endian) representation of b, for storing on disk or sending
+ * over the network. buf must hold bloom_serialized_size(b) bytes */
+size_t bloom_serialized_size(const BloomFilter b) __attribute__ ((pure, nonnull));
+void bloom_serialize(const BloomFilter b, void *buf) __attribute__ ((nonnull));
+/* Return NULL and set errno to EINVAL if buf does not contain a filter */
+BloomFilter new_bloom_filter_from_buffer(const void *buf, size_t len) __attribute__ ((nonnull));
+
+/* ----- Cache ----- */
+/* Bounded cache of values keyed by byte strings, with O(1) lookups through a
+ * HashMap and an intrusive list of entries for eviction.
+ * CACHE_LRU evicts the least recently used entry. CACHE_CLOCK approximates it:
+ * a hit only sets a flag on the entry, and a hand sweeping around the entries
+ * evicts the first one whose flag is clear, clearing flags on its way.
+ * Each entry is charged the size given to cache_put() plus its key length and
+ * bookkeeping, and entries are evicted until the total fits in capacity bytes.
+ * __del__ is called on values which are evicted, replaced, removed or expired */
+#define CACHE_LRU	0
+#define CACHE_CLOCK	1
+
+typedef struct __cache__ *Cache;
 
-/* flip bit at position pos */
-int togglebit(Bitset set, int pos) __attribute__ ((pure));
+typedef struct {
+	uint64_t hits, misses, evictions, expirations;
+} CacheStats;
+
+Cache new_cache(size_t capacity, int policy, void (*__del__)(void*));
+void delete_cache(Cache c) __attribute__ ((nonnull));
+
+/* insert or replace key. size is what value costs in bytes. Entries expire
+ * ttl_ms milliseconds later, or never if ttl_ms is 0. Putting the value key
+ * already has only updates its size and expiry.
+ * Return 0 if key was added, 1 if it was replaced, -1 on error (value is not
+ * stored): errno is E2BIG if the entry can never fit, ENOMEM if out of memory */
+int cache_put(Cache c, const void *key, size_t keylen, void *value, size_t size, unsigned long ttl_ms) __attribute__ ((nonnull (1, 2)));
+/* return value associated with key, NULL if not found or expired. The value is
+ * only valid until the next call modifying c */
+void *cache_get(Cache c, const void *key, size_t keylen) __attribute__ ((nonnull));
+/* return 0 if key was removed, -1 if not found */
+int cache_remove(Cache c, const void *key, size_t keylen) __attribute__ ((nonnull));
+
+size_t cache_size(const Cache c) __attribute__ ((pure, nonnull));
+/* bytes charged for all entries */
+size_t cache_usage(const Cache c) __attribute__ ((pure, nonnull));
+void cache_stats(const Cache c, CacheStats *stats) __attribute__ ((nonnull));
 
 #endif /* #ifdef ENABLE_DATASTRUCTS */
 
@@ -574,7 +1269,13 @@ int togglebit(Bitset set, int pos) __attribute__ ((pure));
 
 #ifdef __unix__
 #include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
 #endif /* #ifdef __unix__ */
+#ifdef __linux__
+# include <sys/syscall.h>
+# include <sys/inotify.h>
+#endif /* #ifdef __linux__ */
 
 /* get modern readdir_r function prototype on solaris */
 #if defined(__sun) && defined(__SVR4)
@@ -610,6 +1311,132 @@ char *make_path(const char *path, ...) __attribute__ ((nonnull (1)));
  * errno to determine if an error occured */
 void *dirwalk(const char *path, BOOL_TYPE recurse, void *(*func)(char *path, void *arg), void *arg) __attribute__ ((nonnull (1,3)));
 
+#ifdef __unix__
+typedef enum {
+	DIRWALK_FILE,
+	DIRWALK_DIR,
+	DIRWALK_SYMLINK,
+	DIRWALK_OTHER
+} DirEntryType;
+
+/* what dirwalk_at() callbacks receive. Everything in it is only valid during
+ * the callback */
+typedef struct {
+	const char *path;	/* path as given to dirwalk_at, followed by "/name" */
+	const char *name;	/* last component of path */
+	size_t pathlen;
+	int dirfd;		/* parent directory, for use with openat() and co */
+	unsigned depth;		/* 0 for entries of the top directory */
+	uint64_t ino;
+	DirEntryType type;
+	const struct stat *st;	/* lstat() of the entry with DIRWALK_STAT, NULL otherwise */
+} DirEntry;
+
+/* dirwalk_at() flags */
+#define DIRWALK_RECURSE	1
+/* fill in DirEntry.st. Costs one syscall per entry */
+#define DIRWALK_STAT	2
+/* also call func on directories, before walking through them */
+#define DIRWALK_DIRS	4
+
+/* func return value telling dirwalk_at() not to walk through the directory it
+ * was just called on */
+#define DIRWALK_PRUNE	1
+
+/* call func on every entry of directory path, relative to dirfd (AT_FDCWD for
+ * the current directory) like openat(). Subdirectories are opened relative to
+ * their parent's descriptor and paths are built in a single buffer, so there is
+ * no allocation nor path lookup per entry. Entry types come from readdir() and
+ * entries are only stat'ed if the filesystem doesn't provide them, or with
+ * DIRWALK_STAT. Symbolic links are never followed. Subdirectories which cannot
+ * be opened are skipped.
+ * func returns 0 to carry on, DIRWALK_PRUNE or any other value to stop the walk.
+ * Return 0 once done, what func returned if it stopped the walk, -1 if path
+ * cannot be opened or out of memory, with errno set */
+int dirwalk_at(int dirfd, const char *path, int flags, int (*func)(const DirEntry *entry, void *arg), void *arg) __attribute__ ((nonnull (2, 4)));
+
+/* Low level directory reading. On Linux, entries are read straight from the
+ * kernel into the caller's buffer with getdents64, as many as fit per system
+ * call, where readdir() makes do with 32KiB. Elsewhere, this wraps readdir()
+ * and the buffer is not used */
+typedef struct {
+	int fd;
+#ifdef __linux__
+	char *buf;
+	size_t size;
+	size_t pos;
+	size_t len;
+#else
+	DIR *dir;
+#endif /* #ifdef __linux__ */
+} DirReader;
+
+/* name points into the reader's buffer, and is only valid until the next
+ * dir_read() */
+typedef struct {
+	const char *name;
+	uint64_t ino;
+	int type;	/* a DirEntryType, -1 if the filesystem doesn't tell */
+} DirRecord;
+
+/* buffer size used by dirwalk_at() and parallel_dirwalk() */
+#define DIR_READER_BUFSIZE	(128 * 1024)
+
+/* read directory fd, which belongs to r until dir_reader_close() from then on.
+ * buf must be suitably aligned for a uint64_t, which malloc() ensures, and at
+ * least a few hundred bytes long. Return 0 on success, -1 and close fd
+ * otherwise */
+int dir_reader_init(DirReader *r, int fd, void *buf, size_t size) __attribute__ ((nonnull (1)));
+void dir_reader_close(DirReader *r) __attribute__ ((nonnull));
+/* skips "." and "..". Return 1 with *rec filled in, 0 at the end of the
+ * directory, -1 on error */
+int dir_read(DirReader *r, DirRecord *rec) __attribute__ ((nonnull));
+
+#if defined(__linux__) && defined(ENABLE_DATASTRUCTS)
+/* Index of everything under a directory, walked once then kept up to date from
+ * inotify events. If the kernel's event queue overflows, the whole tree is
+ * walked again and compared against the index. Directories created or moved in
+ * are walked when their event comes in. Entries are linked to their directory,
+ * so removing or moving a directory only costs what it holds. Directories
+ * which cannot be read are indexed without their contents.
+ * Paths are built like dirwalk_at() does, starting from the path given to
+ * new_dir_index() without its trailing '/' */
+typedef struct __dir_index__ *DirIndex;
+
+typedef struct {
+	const char *path;
+	uint64_t ino;
+	uint64_t size;
+	struct timespec mtime;
+	DirEntryType type;
+} DirIndexEntry;
+
+typedef enum {
+	DIR_INDEX_ADDED,
+	DIR_INDEX_MODIFIED,
+	DIR_INDEX_REMOVED
+} DirIndexChange;
+
+/* Return NULL and set errno if path cannot be walked, or if there are too many
+ * directories to watch (see /proc/sys/fs/inotify/max_user_watches) */
+DirIndex new_dir_index(const char *path) __attribute__ ((nonnull));
+void delete_dir_index(DirIndex ix) __attribute__ ((nonnull));
+/* readable when dir_index_update() has something to do, for poll() and co */
+int dir_index_fd(const DirIndex ix) __attribute__ ((pure, nonnull));
+/* apply pending events without blocking, calling func (unless NULL) on every
+ * entry added, modified or removed, right before removed entries are freed.
+ * Return the number of changes, -1 if out of memory or inotify fails, after
+ * which the index may be incomplete */
+int dir_index_update(DirIndex ix, void (*func)(DirIndexChange change, const DirIndexEntry *entry, void *arg), void *arg) __attribute__ ((nonnull (1)));
+
+/* queries. Entries are only valid until the next dir_index_update() */
+const DirIndexEntry *dir_index_get(const DirIndex ix, const char *path) __attribute__ ((nonnull));
+size_t dir_index_size(const DirIndex ix) __attribute__ ((pure, nonnull));
+/* walk through all entries in no particular order, like hashmap_iterate() */
+BOOL_TYPE dir_index_iterate(const DirIndex ix, size_t *pos, const DirIndexEntry **entry) __attribute__ ((nonnull));
+#endif /* #if defined(__linux__) && defined(ENABLE_DATASTRUCTS) */
+#endif /* #ifdef __unix__ */
+
 #endif /* #ifdef ENABLE_FILESYSTEM */
 
 
@@ -693,6 +1520,17 @@ int normal_getchar(void);
 #ifdef ENABLE_THREADING
 
 #include <pthread.h>
+#include <sched.h>
+#include <stddef.h>
+#include <limits.h>
+#ifdef __linux__
+# include <unistd.h>
+# include <sys/syscall.h>
+# include <linux/futex.h>
+#endif /* #ifdef __linux__ */
+#if defined(ENABLE_FILESYSTEM) && defined(__unix__)
+# include <sys/mman.h>
+#endif /* #if defined(ENABLE_FILESYSTEM) && defined(__unix__) */
 
 #define DETACH_THREAD		1
 #define NO_DETACH_THREAD	0
@@ -708,6 +1546,304 @@ pthread_t xlaunch_thread(void *(*start_routine)(void*), void *arg, const pthread
 void *xpthread_join(pthread_t thread);
 #endif /* #ifdef ENABLE_ERROR_HANDLING */
 
+#if defined(__x86_64__) || defined(__i386__)
+# define cpu_relax()	__builtin_ia32_pause()
+#else
+# define cpu_relax()	__asm__ __volatile__("" ::: "memory")
+#endif /* #if defined(__x86_64__) || defined(__i386__) */
+
+/* ----- Bounded MPMC queue ----- */
+/* Lock-free ring of void* which any number of threads can push to and pop from
+ * concurrently, without allocating. Each slot carries a sequence number telling
+ * whether it is ready to be written or read for a given lap around the ring, so
+ * producers and consumers only contend on the head and tail counters, which
+ * live on separate cache lines.
+ * Typical use is handing work over to threads started with launch_thread():
+ *	MPMCQueue q = new_mpmc_queue(1024);
+ *	launch_thread(&worker, q, NULL);	-> worker loops on mpmc_pop(q)
+ *	mpmc_push(q, job);
+ * Blocking calls spin for a short while, then sleep on a futex on Linux or
+ * yield the CPU elsewhere */
+typedef struct __mpmc_queue__ *MPMCQueue;
+
+/* capacity is rounded up to a power of 2 */
+MPMCQueue new_mpmc_queue(size_t capacity);
+/* must not be called while other threads still use q. Calls __del__ on every
+ * element left in q unless it is NULL */
+void delete_mpmc_queue(MPMCQueue q, void (*__del__)(void*)) __attribute__ ((nonnull (1)));
+
+/* return 0 on success, -1 if q is full (push) or empty (pop) */
+int mpmc_try_push(MPMCQueue q, void *data) __attribute__ ((nonnull (1)));
+int mpmc_try_pop(MPMCQueue q, void **data) __attribute__ ((nonnull));
+
+/* wait until there is room in q / an element to pop */
+void mpmc_push(MPMCQueue q, void *data) __attribute__ ((nonnull (1)));
+void *mpmc_pop(MPMCQueue q) __attribute__ ((nonnull));
+
+/* push/pop up to nmemb elements from/to array data, claiming all slots at once.
+ * Never blocks. Returns number of elements pushed/popped */
+size_t mpmc_push_batch(MPMCQueue q, void **data, size_t nmemb) __attribute__ ((nonnull));
+size_t mpmc_pop_batch(MPMCQueue q, void **data, size_t nmemb) __attribute__ ((nonnull));
+
+/* ----- SPSC ring buffer ----- */
+/* Ring of void* shared by exactly one producer thread and one consumer thread.
+ * Neither side ever waits on the other: each keeps a private copy of the other
+ * side's index and only rereads the shared one when the copy says the ring is
+ * full/empty, so cache lines only bounce when they have to.
+ * Slots can be filled and drained in batches, straight in the ring:
+ *	n = spsc_reserve(r, &slots, 32);	(producer)
+ *	... fill slots[0] to slots[n - 1] ...
+ *	spsc_commit(r, n);
+ *	n = spsc_peek(r, &slots, 32);		(consumer)
+ *	... use slots[0] to slots[n - 1] ...
+ *	spsc_release(r, n);
+ * Create with SPSC_BLOCKING for the waiting functions to sleep on a futex once
+ * spinning fails; without it they spin and yield, and commit/release skip the
+ * memory fence needed to wake up sleepers */
+typedef struct __spsc_ring__ *SPSCRing;
+
+#define SPSC_BLOCKING	0x1
+
+/* capacity is rounded up to a power of 2 */
+SPSCRing new_spsc_ring(size_t capacity, int flags);
+/* calls __del__ on every element left in r unless it is NULL */
+void delete_spsc_ring(SPSCRing r, void (*__del__)(void*)) __attribute__ ((nonnull (1)));
+
+/* Producer side. spsc_reserve() sets *slots to a run of at most nmemb free
+ * contiguous slots and returns its length, 0 if r is full. Runs stop at the
+ * end of the ring, so a second call may return more slots. Nothing is visible
+ * to the consumer until spsc_commit() publishes the first n reserved slots */
+size_t spsc_reserve(SPSCRing r, void ***slots, size_t nmemb) __attribute__ ((nonnull));
+void spsc_commit(SPSCRing r, size_t n) __attribute__ ((nonnull));
+/* Consumer side, same as above: spsc_peek() exposes a run of at most nmemb
+ * elements, spsc_release() hands the first n back to the producer */
+size_t spsc_peek(SPSCRing r, void ***slots, size_t nmemb) __attribute__ ((nonnull));
+void spsc_release(SPSCRing r, size_t n) __attribute__ ((nonnull));
+
+/* return 0 on success, -1 if r is full (push) or empty (pop) */
+int spsc_try_push(SPSCRing r, void *data) __attribute__ ((nonnull (1)));
+int spsc_try_pop(SPSCRing r, void **data) __attribute__ ((nonnull));
+
+/* wait until at least one slot is free / one element is available */
+void spsc_wait_writable(SPSCRing r) __attribute__ ((nonnull));
+void spsc_wait_readable(SPSCRing r) __attribute__ ((nonnull));
+void spsc_push(SPSCRing r, void *data) __attribute__ ((nonnull (1)));
+void *spsc_pop(SPSCRing r) __attribute__ ((nonnull));
+
+/* ----- Epoch-based reclamation ----- */
+/* Defers freeing memory that was unlinked from a shared structure until no
+ * thread can still be reading it, so readers never need locks.
+ * Readers wrap every access to shared nodes between ebr_pin() and ebr_unpin()
+ * (pins nest). Writers unlink a node, then hand it to ebr_retire() instead of
+ * freeing it: the callback runs once every thread that was pinned at that time
+ * has unpinned. Pinned sections should be kept short, since a thread staying
+ * pinned delays all reclamation */
+typedef struct __ebr__ *EBR;
+
+/* embed one of these in every object which may be retired */
+typedef struct __ebr_entry__ {
+	struct __ebr_entry__ *next;
+	void *ptr, *arg;
+	void (*__free__)(void *ptr, void *arg);
+} EBREntry;
+
+EBR new_ebr(void);
+/* run all pending callbacks. No thread may use e anymore */
+void delete_ebr(EBR e) __attribute__ ((nonnull));
+
+void ebr_pin(EBR e) __attribute__ ((nonnull));
+void ebr_unpin(EBR e) __attribute__ ((nonnull));
+/* call __free__(ptr, arg) once no reader can reference ptr anymore. entry must
+ * stay valid until then, and is typically a member of *ptr */
+void ebr_retire(EBR e, EBREntry *entry, void *ptr, void (*__free__)(void *ptr, void *arg), void *arg) __attribute__ ((nonnull (1, 2, 4)));
+
+/* ----- Concurrent hash map ----- */
+/* Hash map of void* keys and values shared between threads. Lookups take no
+ * lock. Writers lock one of a fixed set of stripes picked from the key's hash,
+ * so writes to different stripes proceed in parallel.
+ * Growing the table does not block: a new table is allocated and each write
+ * afterwards moves a few buckets over, while readers follow moved buckets to
+ * the new table.
+ * Removed and replaced entries are reclaimed through EBR: __del_key__ and
+ * __del_value__ are called once no reader can access them anymore. Value
+ * pointers returned by chm_get() are only guaranteed to stay valid while the
+ * calling thread holds chm_pin() if other threads may remove or replace them:
+ *	chm_pin(m);
+ *	session = chm_get(m, id);
+ *	... use session ...
+ *	chm_unpin(m);
+ * hash and eq are the same as for new_hashmap() (NULL for address) */
+typedef struct __concurrent_hashmap__ *ConcurrentHashMap;
+
+ConcurrentHashMap new_concurrent_hashmap(size_t (*hash)(const void *key), int (*eq)(const void *k1, const void *k2),
+		void (*__del_key__)(void*), void (*__del_value__)(void*));
+/* no thread may use m anymore. Calls __del_key__ and __del_value__ on every
+ * element left */
+void delete_concurrent_hashmap(ConcurrentHashMap m) __attribute__ ((nonnull));
+
+/* insert or replace key. Return 0 if key was added, 1 if its value was replaced
+ * (key is not stored then, the map keeps its own copy) or already was value,
+ * -1 if out of memory */
+int chm_put(ConcurrentHashMap m, void *key, void *value) __attribute__ ((nonnull (1)));
+/* return value associated with key, NULL if not found */
+void *chm_get(ConcurrentHashMap m, const void *key) __attribute__ ((nonnull (1)));
+/* return 0 if key was removed, -1 if not found or out of memory */
+int chm_remove(ConcurrentHashMap m, const void *key) __attribute__ ((nonnull (1)));
+size_t chm_size(ConcurrentHashMap m) __attribute__ ((nonnull));
+
+void chm_pin(ConcurrentHashMap m) __attribute__ ((nonnull));
+void chm_unpin(ConcurrentHashMap m) __attribute__ ((nonnull));
+
+/* ----- Concurrent skip list ----- */
+/* Lock-free ordered map of uint64_t keys to void* values. Any number of threads
+ * may insert, remove, look up and scan concurrently. A node is deleted by
+ * marking its links, then unlinked by whichever thread walks past it next, and
+ * reclaimed through EBR: __del__ is called on its value once no reader can
+ * access it anymore. Values returned by skiplist_get() and cursors are only
+ * guaranteed to stay valid while the calling thread holds skiplist_pin():
+ *	skiplist_pin(l);
+ *	skiplist_lower_bound(l, from, &c);
+ *	while(skiplist_iterate(&c, &key, &value) && key < to)
+ *		...
+ *	skiplist_unpin(l);
+ * Scans see every element present for their whole duration, and may or may not
+ * see those inserted or removed meanwhile */
+typedef struct __skiplist__ *SkipList;
+
+typedef struct {
+	void *node;
+} SkipListCursor;
+
+SkipList new_skiplist(void (*__del__)(void*));
+/* no thread may use l anymore. Calls __del__ on every value left */
+void delete_skiplist(SkipList l) __attribute__ ((nonnull));
+
+/* return 0 if key was added, 1 if it was already present (the value is left
+ * unchanged), -1 if out of memory */
+int skiplist_insert(SkipList l, uint64_t key, void *value) __attribute__ ((nonnull (1)));
+/* return value associated with key, NULL if not found */
+void *skiplist_get(SkipList l, uint64_t key) __attribute__ ((nonnull));
+BOOL_TYPE skiplist_contains(SkipList l, uint64_t key) __attribute__ ((nonnull));
+/* return 0 if key was removed, -1 if not found */
+int skiplist_remove(SkipList l, uint64_t key) __attribute__ ((nonnull));
+/* exact when no other thread modifies l */
+size_t skiplist_size(SkipList l) __attribute__ ((nonnull));
+
+void skiplist_pin(SkipList l) __attribute__ ((nonnull));
+void skiplist_unpin(SkipList l) __attribute__ ((nonnull));
+
+/* set c before the first element, or the first element whose key is >= key */
+void skiplist_rewind(SkipList l, SkipListCursor *c) __attribute__ ((nonnull));
+void skiplist_lower_bound(SkipList l, uint64_t key, SkipListCursor *c) __attribute__ ((nonnull));
+/* set *key and *value (either may be NULL) to the element following c and
+ * move c past it. Return BOOL_FALSE when there are no more elements */
+BOOL_TYPE skiplist_iterate(SkipListCursor *c, uint64_t *key, void **value) __attribute__ ((nonnull (1)));
+
+#ifdef ENABLE_DATASTRUCTS
+/* ----- Sharded cache ----- */
+/* Cache split into independently locked shards picked from the key's hash, so
+ * that threads working on different keys rarely contend. Each shard gets an
+ * equal part of capacity */
+typedef struct __sharded_cache__ *ShardedCache;
+
+/* nshards is rounded up to a power of 2 */
+ShardedCache new_sharded_cache(size_t capacity, unsigned nshards, int policy, void (*__del__)(void*));
+void delete_sharded_cache(ShardedCache c) __attribute__ ((nonnull));
+
+/* same as cache_put/cache_remove */
+int sharded_cache_put(ShardedCache c, const void *key, size_t keylen, void *value, size_t size, unsigned long ttl_ms) __attribute__ ((nonnull (1, 2)));
+int sharded_cache_remove(ShardedCache c, const void *key, size_t keylen) __attribute__ ((nonnull));
+/* return __clone__(value), called with the shard locked, or NULL if key is not
+ * found. The value itself may be evicted by another thread as soon as the lock
+ * is released. If __clone__ is NULL, the value is returned as is, which is only
+ * safe if it outlives the cache */
+void *sharded_cache_get(ShardedCache c, const void *key, size_t keylen, void *(*__clone__)(void *value)) __attribute__ ((nonnull (1, 2)));
+/* sums over all shards */
+size_t sharded_cache_size(ShardedCache c) __attribute__ ((nonnull));
+void sharded_cache_stats(ShardedCache c, CacheStats *stats) __attribute__ ((nonnull));
+#endif /* #ifdef ENABLE_DATASTRUCTS */
+
+/* ----- Thread pool ----- */
+/* Fixed set of worker threads taking tasks from an MPMCQueue */
+typedef struct __thread_pool__ *ThreadPool;
+
+/* start nthreads workers, or one per online CPU if nthreads is 0 */
+ThreadPool new_thread_pool(unsigned nthreads);
+/* run all tasks still queued, then stop and join the workers */
+void delete_thread_pool(ThreadPool p) __attribute__ ((nonnull));
+
+/* queue __task__(arg), waiting for room in the queue if it is full. Return 0
+ * on success, -1 if out of memory */
+int thread_pool_submit(ThreadPool p, void (*__task__)(void*), void *arg) __attribute__ ((nonnull (1, 2)));
+/* wait until every task submitted so far has completed */
+void thread_pool_wait(ThreadPool p) __attribute__ ((nonnull));
+unsigned thread_pool_size(const ThreadPool p) __attribute__ ((pure, nonnull));
+
+/* Data-parallel operations. The input is cut into at most a few chunks per
+ * worker, and no smaller than grain elements (PARALLEL_MIN_GRAIN where there
+ * is no grain argument); chunks run on the pool while the calling thread runs
+ * the first one, then helps with whatever is left in the queue until all are
+ * done. This makes them safe to call from within a task.
+ * They run serially on the calling thread when p is NULL or the input is too
+ * small to be worth splitting */
+#define PARALLEL_MIN_GRAIN	256
+
+/* call __body__(from, to, arg) on disjoint ranges covering [0, nmemb[ */
+void parallel_for(ThreadPool p, size_t nmemb, size_t grain,
+		void (*__body__)(size_t from, size_t to, void *arg), void *arg) __attribute__ ((nonnull (4)));
+/* call __foreachfunc__(elem, arg) on every element of array base, whose elements are
+ * size bytes long */
+void parallel_foreach(ThreadPool p, void *base, size_t nmemb, size_t size,
+		void (*__foreachfunc__)(void *elem, void *arg), void *arg) __attribute__ ((nonnull (5)));
+/* every chunk folds its elements with acc = __mapfunc__(elem, acc), starting
+ * from identity. Chunk results are then merged in element order with
+ * __combine__, which must be associative, and the final result is returned */
+void *parallel_reduce(ThreadPool p, void *base, size_t nmemb, size_t size,
+		void *(*__mapfunc__)(void *elem, void *acc), void *identity,
+		void *(*__combine__)(void *acc1, void *acc2)) __attribute__ ((nonnull (5, 7)));
+
+#ifdef ENABLE_DATASTRUCTS
+/* same as above on the data of every element of dl. The list is not modified
+ * and must not be modified until they return. With the same identity as arg,
+ * dll_parallel_map returns what dll_map would */
+void dll_parallel_foreach(ThreadPool p, DLinkedList dl,
+		void (*__foreachfunc__)(void *data, void *arg), void *arg) __attribute__ ((nonnull (2, 3)));
+void *dll_parallel_map(ThreadPool p, DLinkedList dl,
+		void *(*__mapfunc__)(void *data, void *acc), void *identity,
+		void *(*__combine__)(void *acc1, void *acc2)) __attribute__ ((nonnull (2, 3, 5)));
+#endif /* #ifdef ENABLE_DATASTRUCTS */
+
+#if defined(ENABLE_FILESYSTEM) && defined(__unix__)
+/* parallel_dirwalk() flag on top of dirwalk_at()'s: func calls never overlap,
+ * and every directory's entries are reported together, sorted by name */
+#define DIRWALK_ORDERED	8
+
+/* dirwalk_at(AT_FDCWD, path, flags, func, arg) on nthreads threads (0 for one
+ * per CPU), the calling thread being one of them. Subdirectories are queued up
+ * in per-thread work-stealing deques, and every thread only has one directory
+ * open at a time, so it is opened by path. Unless flags has DIRWALK_ORDERED,
+ * func is called concurrently from all threads, in no particular order.
+ * The first value other than 0 and DIRWALK_PRUNE returned by func cancels the
+ * walk: threads stop at the next entry and it is returned */
+int parallel_dirwalk(const char *path, int flags, unsigned nthreads,
+		int (*func)(const DirEntry *entry, void *arg), void *arg) __attribute__ ((nonnull (1, 4)));
+
+#ifdef ENABLE_DATASTRUCTS
+/* call func on every group of identical regular files under path which are at
+ * least min_size bytes long (1 skips empty files). The tree is walked with
+ * parallel_dirwalk(), and files are only read if another file has the same
+ * size: first their head, then the whole of them if heads match, hashed with
+ * hash_bytes() on nthreads threads (0 for one per CPU). Files are mapped in
+ * memory, or read if they cannot be. Hard links to a file only count once, and
+ * unreadable files are left out.
+ * Files are deemed identical when their 64 bit hashes match, they are not
+ * compared byte by byte. paths is only valid during the call.
+ * Return the number of groups found, -1 on error with errno set */
+int find_duplicates(const char *path, uint64_t min_size, unsigned nthreads,
+		void (*func)(const char **paths, size_t npaths, uint64_t size, void *arg), void *arg) __attribute__ ((nonnull (1, 4)));
+#endif /* #ifdef ENABLE_DATASTRUCTS */
+#endif /* #if defined(ENABLE_FILESYSTEM) && defined(__unix__) */
+
 #endif /* #ifdef ENABLE_THREADING */
 
 
@@ -746,6 +1882,56 @@ int mclose(Mmap *f);
 
 
 
+/* -------------------- CSV/TSV reading -------------------- */
+#if defined(ENABLE_CSV) && defined(__unix__)
+
+#include <unistd.h>
+
+#ifdef __SSE2__
+# include <emmintrin.h>
+#endif /* #ifdef __SSE2__ */
+#ifdef __AVX2__
+# include <immintrin.h>
+#endif /* #ifdef __AVX2__ */
+
+/* View on one field of the current record. data is NOT '\0'-terminated and is
+ * only valid until the next call to csv_read_record() or delete_csv_reader() */
+typedef struct {
+	const char *data;
+	size_t len;
+} CsvField;
+
+typedef struct __csv_reader__ *CsvReader;
+
+/* pass as quote parameter to disable quoting, e.g. for plain TSV */
+#define CSV_NO_QUOTE	'\0'
+
+/* Create a reader parsing RFC4180 records from file descriptor fd. separator is
+ * ',' for CSV or '\t' for TSV, quote is '"' for RFC4180 or CSV_NO_QUOTE. Quoted
+ * fields may contain separators, newlines and doubled quote chars. Records are
+ * terminated by "\n" or "\r\n" and may span any number of read() calls.
+ * fd is not closed by delete_csv_reader() */
+CsvReader new_csv_reader(int fd, char separator, char quote);
+
+#ifdef ENABLE_MMAP
+/* Same as new_csv_reader, parsing f from its current offset. f->offset is moved
+ * past each record returned. Fields point straight into the mapping unless they
+ * contain escaped quotes */
+CsvReader new_csv_reader_mmap(Mmap *f, char separator, char quote) __attribute__ ((nonnull));
+#endif /* #ifdef ENABLE_MMAP */
+
+/* Parse the next record. *fields is set to an array holding one view per field,
+ * owned by the reader. Empty fields are preserved: "a,,b" yields 3 fields.
+ * Returns the number of fields, 0 at end of input or -1 in case of error, in
+ * which case errno is set appropriately */
+ssize_t csv_read_record(CsvReader r, CsvField **fields) __attribute__ ((nonnull));
+
+void delete_csv_reader(CsvReader r) __attribute__ ((nonnull));
+
+#endif /* #if defined(ENABLE_CSV) && defined(__unix__) */
+
+
+
 /* -------------------- Misc functions -------------------- */
 #ifdef ENABLE_MISC
 
@@ -793,6 +1979,29 @@ int32_t int_min(int32_t a, int32_t b) __attribute__ ((pure));
  * value 42 */
 void *initialize_vector(void *dest, const void *src, size_t size, size_t nmemb) __attribute__ ((nonnull));
 
+/* Sorting without a comparison callback.
+ * LSD radix sort of keys in ascending order, 8 bits at a time, skipping bytes
+ * which are the same in all keys. If values is not NULL, values[i] is moved
+ * along with keys[i]. The sort is stable. Signed keys sort correctly once their
+ * sign bit is flipped. Return 0 on success, -1 if out of memory (only if
+ * internal error handling is disabled) */
+int radix_sort_u32(uint32_t *keys, void **values, size_t nmemb) __attribute__ ((nonnull (1)));
+int radix_sort_u64(uint64_t *keys, void **values, size_t nmemb) __attribute__ ((nonnull (1)));
+
+/* sort '\0'-terminated strings in strcmp() order with multikey quicksort, which
+ * looks at each character of a common prefix once instead of once per
+ * comparison. Works on the output of split_str() */
+void sort_strings(char **strs, size_t nmemb) __attribute__ ((nonnull));
+
+#ifdef ENABLE_THREADING
+/* same as qsort(), using nthreads threads (one per online CPU if 0): equal
+ * parts of base are sorted in parallel with qsort(), then merged pairwise with
+ * every thread merging an equal share of the output. Falls back to qsort() for
+ * small arrays or if out of memory. Not stable */
+void parallel_sort(void *base, size_t nmemb, size_t size,
+		int (*compar)(const void*, const void*), unsigned nthreads) __attribute__ ((nonnull (1, 4)));
+#endif /* #ifdef ENABLE_THREADING */
+
 #ifdef __unix__
 #include <signal.h>
 /* register sighandler as the signal handler function to be called when program receives